@@ -0,0 +1,163 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "types.h"
+#include "acrn_common.h"
+#include "ioeventfd.h"
+
+struct ioeventfd {
+	uint32_t	type;
+	int		len;
+	uint64_t	addr;
+	int64_t		datamatch;
+	int		fd;		/* -1 if the slot is free */
+};
+
+static struct ioeventfd ioeventfds[IOEVENTFD_MAX] = {
+	[0 ... IOEVENTFD_MAX - 1] = { .fd = -1 }
+};
+static int ioeventfd_count;	/* highest used slot + 1 */
+static pthread_rwlock_t ioeventfd_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+int
+ioeventfd_register(uint32_t type, uint64_t addr, int len, int64_t datamatch,
+		   int fd)
+{
+	struct ioeventfd *iofd;
+	int i, error = -ENOSPC;
+
+	if (fd < 0 || (type != REQ_PORTIO && type != REQ_MMIO))
+		return -EINVAL;
+
+	pthread_rwlock_wrlock(&ioeventfd_lock);
+	for (i = 0; i < IOEVENTFD_MAX; i++) {
+		iofd = &ioeventfds[i];
+		if (iofd->fd >= 0) {
+			if (iofd->type == type && iofd->addr == addr &&
+			    iofd->datamatch == datamatch) {
+				error = -EEXIST;
+				break;
+			}
+			continue;
+		}
+		if (error == -ENOSPC) {
+			iofd->type = type;
+			iofd->addr = addr;
+			iofd->len = len;
+			iofd->datamatch = datamatch;
+			iofd->fd = fd;
+			if (i >= ioeventfd_count)
+				ioeventfd_count = i + 1;
+			error = 0;
+		}
+	}
+	pthread_rwlock_unlock(&ioeventfd_lock);
+
+	return error;
+}
+
+static void
+ioeventfd_free(struct ioeventfd *iofd)
+{
+	iofd->fd = -1;
+	while (ioeventfd_count > 0 && ioeventfds[ioeventfd_count - 1].fd < 0)
+		ioeventfd_count--;
+}
+
+void
+ioeventfd_unregister(int fd)
+{
+	int i;
+
+	pthread_rwlock_wrlock(&ioeventfd_lock);
+	for (i = 0; i < ioeventfd_count; i++) {
+		if (ioeventfds[i].fd == fd)
+			ioeventfd_free(&ioeventfds[i]);
+	}
+	pthread_rwlock_unlock(&ioeventfd_lock);
+}
+
+/*
+ * Called when a BAR moves or is disabled, so a stale posted range can not
+ * steal writes meant for whatever is mapped there next. The owner keeps
+ * its eventfd; writes simply go through the regular emulation again.
+ */
+void
+ioeventfd_unregister_range(uint32_t type, uint64_t base, uint64_t size)
+{
+	struct ioeventfd *iofd;
+	int i;
+
+	pthread_rwlock_wrlock(&ioeventfd_lock);
+	for (i = 0; i < ioeventfd_count; i++) {
+		iofd = &ioeventfds[i];
+		if (iofd->fd >= 0 && iofd->type == type &&
+		    iofd->addr >= base && iofd->addr < base + size)
+			ioeventfd_free(iofd);
+	}
+	pthread_rwlock_unlock(&ioeventfd_lock);
+}
+
+/*
+ * Return 0 if the write was posted, -ENOENT if it hit no posted range and
+ * has to be emulated as usual.
+ */
+int
+ioeventfd_signal(uint32_t type, uint64_t addr, int size, uint64_t value)
+{
+	struct ioeventfd *iofd;
+	int i, error = -ENOENT;
+
+	if (ioeventfd_count == 0)
+		return error;
+
+	pthread_rwlock_rdlock(&ioeventfd_lock);
+	for (i = 0; i < ioeventfd_count; i++) {
+		iofd = &ioeventfds[i];
+		if (iofd->fd < 0 || iofd->type != type || iofd->addr != addr)
+			continue;
+		if (iofd->len != 0 && iofd->len != size)
+			continue;
+		if (iofd->datamatch != IOEVENTFD_NOMATCH &&
+		    (uint64_t)iofd->datamatch != value)
+			continue;
+
+		if (eventfd_write(iofd->fd, 1) == 0)
+			error = 0;
+		break;
+	}
+	pthread_rwlock_unlock(&ioeventfd_lock);
+
+	return error;
+}
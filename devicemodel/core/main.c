@@ -38,6 +38,7 @@
 #include <sysexits.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <time.h>
 
 #include "vmmapi.h"
 #include "sw_load.h"
@@ -46,6 +47,7 @@
 #include "acpi.h"
 #include "atkbdc.h"
 #include "inout.h"
+#include "ioeventfd.h"
 #include "ioapic.h"
 #include "mem.h"
 #include "mevent.h"
@@ -71,10 +73,12 @@ int guest_ncpus;
 char *guest_uuid_str;
 char *vsbl_file_name;
 uint8_t trusty_enabled;
+uint8_t rt_pinned;
+uint8_t guest_vmexit_on_hlt;
 bool stdio_in_use;
 bool hugetlb;
 
-static int guest_vmexit_on_hlt, guest_vmexit_on_pause;
+static int guest_vmexit_on_pause;
 static int virtio_msix = 1;
 static int x2apic_mode;	/* default is xAPIC */
 
@@ -83,6 +87,15 @@ static int strictmsr = 1;
 
 static int acpi;
 
+/* number of vCPUs served by each ioreq worker thread, 0 means none */
+static int ioreq_group;
+
+/*
+ * max time in us vm_loop spins on the shared page before it blocks, and
+ * vCPUs spin on a forwarded request before they are paused
+ */
+int ioreq_poll_max;
+
 static char *progname;
 static const int BSP;
 
@@ -97,6 +110,7 @@ static char vhm_request_page[4096] __attribute__ ((aligned(4096)));
 static struct vhm_request *vhm_req_buf =
 				(struct vhm_request *)&vhm_request_page;
 
+/* bumped from the ioreq workers too, update atomically */
 struct dmstats {
 	uint64_t	vmexit_bogus;
 	uint64_t	vmexit_reqidle;
@@ -116,6 +130,65 @@ struct mt_vmm_info {
 
 static cpuset_t *vcpumap[VM_MAXCPU] = { NULL };
 
+/*
+ * vm_loop waits for the ioreq client and hands each pending vhm_request
+ * to the worker owning that vCPU, so a slow emulation on one vCPU does
+ * not hold off the completion of requests from the other vCPUs.
+ */
+#define IOREQ_DISPATCH_SPIN_US	100
+
+struct ioreq_worker {
+	pthread_t	thr;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cond;
+	uint32_t	pending;	/* bitmap of vCPUs to handle */
+	int		quit;
+	struct vmctx	*ctx;
+};
+
+static struct ioreq_worker ioreq_workers[VM_MAXCPU];
+static int ioreq_nworkers;
+
+/*
+ * Port I/O (CF8/CFC, LPC, uart, rtc, pm ...), PCI config space and most
+ * device BARs keep their state without locking, so the workers take turns
+ * emulating them. Only memory ranges flagged MEM_F_MT_SAFE, whose handlers
+ * lock themselves, are emulated in parallel, see emulate_mem().
+ *
+ * The lock is recursive: an emulated config write may unregister a range
+ * and replay the coalesced writes still buffered for it.
+ */
+static pthread_mutex_t ioreq_emul_mtx = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+void
+ioreq_emul_lock(bool serialize)
+{
+	if (serialize && ioreq_nworkers > 0)
+		pthread_mutex_lock(&ioreq_emul_mtx);
+}
+
+void
+ioreq_emul_unlock(bool serialize)
+{
+	if (serialize && ioreq_nworkers > 0)
+		pthread_mutex_unlock(&ioreq_emul_mtx);
+}
+
+/* bitmap of vCPU slots currently owned by a worker */
+static volatile uint32_t ioreq_inflight;
+
+/* signaled by the workers whenever they complete a request */
+static pthread_mutex_t ioreq_done_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioreq_done_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Adaptive poll budget, in the manner of halt-polling: grown when the
+ * blocking wait turned out shorter than ioreq_poll_max, shrunk otherwise.
+ */
+#define IOREQ_POLL_START_US	10
+
+static int ioreq_poll_us;
+
 static struct vmctx *_ctx;
 
 static void
@@ -125,7 +198,7 @@ usage(int code)
 		"Usage: %s [-abehuwxACHPSTWY] [-c vcpus] [-g <gdb port>] [-l <lpc>]\n"
 		"       %*s [-m mem] [-p vcpu:hostcpu] [-s <pci>] [-U uuid] \n"
 		"       %*s [--vsbl vsbl_file_name] [--part_info part_info_name]\n"
-		"	%*s [--enable_trusty] <vm>\n"
+		"	%*s [--enable_trusty] [--rt_pinned] <vm>\n"
 		"       -a: local apic is in xAPIC mode (deprecated)\n"
 		"       -A: create ACPI tables\n"
 		"       -c: # cpus (default 1)\n"
@@ -154,9 +227,13 @@ usage(int code)
 		"       -G: GVT args: low_gm_size, high_gm_size, fence_sz\n"
 		"       -v: version\n"
 		"       -i: ioc boot parameters\n"
+		"       --ioreq_group: vCPUs per ioreq worker thread (0: none)\n"
+		"       --ioreq_poll_us: max us to poll for requests and their\n"
+		"                        completion (0: none)\n"
 		"       --vsbl: vsbl file path\n"
 		"       --part_info: guest partition info file path\n"
 		"	--enable_trusty: enable trusty for guest\n"
+		"	--rt_pinned: give each vCPU a physical CPU of its own\n"
 		"	--ptdev_no_reset: disable reset check for ptdev\n",
 		progname, (int)strlen(progname), "", (int)strlen(progname), "",
 		(int)strlen(progname), "");
@@ -301,7 +378,13 @@ vmexit_inout(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 	bytes = vhm_req->reqs.pio_request.size;
 	in = (vhm_req->reqs.pio_request.direction == REQUEST_READ);
 
+	if (!in && ioeventfd_signal(REQ_PORTIO, port, bytes,
+			vhm_req->reqs.pio_request.value) == 0)
+		return VMEXIT_CONTINUE;
+
+	ioreq_emul_lock(true);
 	error = emulate_inout(ctx, pvcpu, &vhm_req->reqs.pio_request, strictio);
+	ioreq_emul_unlock(true);
 	if (error) {
 		fprintf(stderr, "Unhandled %s%c 0x%04x\n",
 				in ? "in" : "out",
@@ -318,7 +401,16 @@ vmexit_mmio_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
 	int err;
 
-	stats.vmexit_mmio_emul++;
+	__sync_fetch_and_add(&stats.vmexit_mmio_emul, 1);
+	if (vhm_req->reqs.mmio_request.direction == REQUEST_WRITE &&
+		ioeventfd_signal(REQ_MMIO, vhm_req->reqs.mmio_request.address,
+			vhm_req->reqs.mmio_request.size,
+			vhm_req->reqs.mmio_request.value) == 0) {
+		vhm_req->processed = REQ_STATE_SUCCESS;
+		return VMEXIT_CONTINUE;
+	}
+
+	/* serializes itself unless the range is MEM_F_MT_SAFE */
 	err = emulate_mem(ctx, &vhm_req->reqs.mmio_request);
 
 	if (err) {
@@ -342,6 +434,7 @@ vmexit_pci_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
 	int err, in = (vhm_req->reqs.pci_request.direction == REQUEST_READ);
 
+	ioreq_emul_lock(true);
 	err = emulate_pci_cfgrw(ctx, *pvcpu, in,
 			vhm_req->reqs.pci_request.bus,
 			vhm_req->reqs.pci_request.dev,
@@ -349,6 +442,7 @@ vmexit_pci_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 			vhm_req->reqs.pci_request.reg,
 			vhm_req->reqs.pci_request.size,
 			&vhm_req->reqs.pci_request.value);
+	ioreq_emul_unlock(true);
 	if (err) {
 		fprintf(stderr, "Unhandled pci cfg rw at %x:%x.%x reg 0x%x\n",
 			vhm_req->reqs.pci_request.bus,
@@ -375,7 +469,7 @@ vmexit_pci_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_bogus(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_bogus++;
+	__sync_fetch_and_add(&stats.vmexit_bogus, 1);
 
 	return VMEXIT_CONTINUE;
 }
@@ -383,7 +477,7 @@ vmexit_bogus(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_reqidle(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_reqidle++;
+	__sync_fetch_and_add(&stats.vmexit_reqidle, 1);
 
 	return VMEXIT_CONTINUE;
 }
@@ -391,7 +485,7 @@ vmexit_reqidle(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_hlt(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_hlt++;
+	__sync_fetch_and_add(&stats.vmexit_hlt, 1);
 
 	/*
 	 * Just continue execution with the next instruction. We use
@@ -404,7 +498,7 @@ vmexit_hlt(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_pause(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_pause++;
+	__sync_fetch_and_add(&stats.vmexit_pause, 1);
 
 	return VMEXIT_CONTINUE;
 }
@@ -412,7 +506,7 @@ vmexit_pause(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_mtrap(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_mtrap++;
+	__sync_fetch_and_add(&stats.vmexit_mtrap, 1);
 
 	return VMEXIT_CONTINUE;
 }
@@ -514,6 +608,247 @@ vm_deinit_vdevs(struct vmctx *ctx)
 	ioapic_deinit();
 }
 
+static inline bool
+ioreq_is_pending(struct vmctx *ctx, struct vhm_request *vhm_req)
+{
+	return vhm_req->valid
+		&& (vhm_req->processed == REQ_STATE_PROCESSING)
+		&& (vhm_req->client == ctx->ioreq_client);
+}
+
+static void *
+ioreq_worker_thread(void *param)
+{
+	struct ioreq_worker *worker = param;
+	uint32_t pending;
+	int vcpu;
+
+	pthread_mutex_lock(&worker->mtx);
+	for (;;) {
+		while (worker->pending == 0 && !worker->quit)
+			pthread_cond_wait(&worker->cond, &worker->mtx);
+		if (worker->quit)
+			break;
+
+		pending = worker->pending;
+		worker->pending = 0;
+		pthread_mutex_unlock(&worker->mtx);
+
+		while (pending) {
+			vcpu = ffs(pending) - 1;
+			pending &= ~(1U << vcpu);
+
+			handle_vmexit(worker->ctx, &vhm_req_buf[vcpu], vcpu);
+			__sync_fetch_and_and(&ioreq_inflight, ~(1U << vcpu));
+
+			pthread_mutex_lock(&ioreq_done_mtx);
+			pthread_cond_signal(&ioreq_done_cond);
+			pthread_mutex_unlock(&ioreq_done_mtx);
+		}
+		pthread_mutex_lock(&worker->mtx);
+	}
+	pthread_mutex_unlock(&worker->mtx);
+
+	return NULL;
+}
+
+static void
+ioreq_workers_deinit(void)
+{
+	struct ioreq_worker *worker;
+	int i;
+
+	for (i = 0; i < ioreq_nworkers; i++) {
+		worker = &ioreq_workers[i];
+		pthread_mutex_lock(&worker->mtx);
+		worker->quit = 1;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->mtx);
+
+		pthread_join(worker->thr, NULL);
+		pthread_mutex_destroy(&worker->mtx);
+		pthread_cond_destroy(&worker->cond);
+	}
+	ioreq_nworkers = 0;
+}
+
+static int
+ioreq_workers_init(struct vmctx *ctx)
+{
+	char tname[MAXCOMLEN + 1];
+	struct ioreq_worker *worker;
+	int i, error;
+
+	ioreq_inflight = 0;
+	ioreq_nworkers = 0;
+	if (ioreq_group <= 0)
+		return 0;
+
+	for (i = 0; i < (guest_ncpus + ioreq_group - 1) / ioreq_group; i++) {
+		worker = &ioreq_workers[i];
+		worker->ctx = ctx;
+		worker->pending = 0;
+		worker->quit = 0;
+		pthread_mutex_init(&worker->mtx, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+
+		error = pthread_create(&worker->thr, NULL,
+				ioreq_worker_thread, worker);
+		if (error) {
+			fprintf(stderr, "failed to create ioreq worker %d\n",
+				i);
+			pthread_mutex_destroy(&worker->mtx);
+			pthread_cond_destroy(&worker->cond);
+			/* stop the workers already running */
+			ioreq_workers_deinit();
+			return -1;
+		}
+		snprintf(tname, sizeof(tname), "ioreq %d", i);
+		pthread_setname_np(worker->thr, tname);
+		ioreq_nworkers++;
+	}
+
+	return 0;
+}
+
+/*
+ * Hand every new pending request to its worker. Return the number of
+ * requests dispatched.
+ */
+static int
+ioreq_dispatch(struct vmctx *ctx)
+{
+	struct ioreq_worker *worker;
+	int vcpu, dispatched = 0;
+
+	for (vcpu = 0; vcpu < guest_ncpus; vcpu++) {
+		if ((ioreq_inflight & (1U << vcpu))
+			|| !ioreq_is_pending(ctx, &vhm_req_buf[vcpu]))
+			continue;
+
+		__sync_fetch_and_or(&ioreq_inflight, 1U << vcpu);
+
+		worker = &ioreq_workers[vcpu / ioreq_group];
+		pthread_mutex_lock(&worker->mtx);
+		worker->pending |= 1U << vcpu;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->mtx);
+		dispatched++;
+	}
+
+	return dispatched;
+}
+
+static uint64_t
+ioreq_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static bool
+ioreq_any_pending(struct vmctx *ctx)
+{
+	int vcpu;
+
+	for (vcpu = 0; vcpu < guest_ncpus; vcpu++) {
+		if (!(ioreq_inflight & (1U << vcpu))
+			&& ioreq_is_pending(ctx, &vhm_req_buf[vcpu]))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * The ioreq client stays attachable as long as any request is not yet
+ * notified as done, so the attach ioctl can't sleep until the next
+ * request while a worker is busy. Watch the request page instead, and
+ * return as soon as a request shows up on another vCPU or the last
+ * request in flight is done and the attach can block again.
+ *
+ * Most requests complete within IOREQ_DISPATCH_SPIN_US, so spin for that
+ * long first. Past it, sleep until a worker completes a request. Nothing
+ * signals a request showing up on another vCPU meanwhile, it is
+ * dispatched once the sleep ends.
+ */
+static void
+ioreq_wait_done(struct vmctx *ctx)
+{
+	uint64_t deadline = ioreq_now_us() + IOREQ_DISPATCH_SPIN_US;
+
+	while (ioreq_inflight != 0 && !quit_vm_loop
+			&& !ioreq_any_pending(ctx)) {
+		if (ioreq_now_us() >= deadline)
+			break;
+		asm volatile("pause" ::: "memory");
+	}
+
+	pthread_mutex_lock(&ioreq_done_mtx);
+	while (ioreq_inflight != 0 && !quit_vm_loop
+			&& !ioreq_any_pending(ctx))
+		pthread_cond_wait(&ioreq_done_cond, &ioreq_done_mtx);
+	pthread_mutex_unlock(&ioreq_done_mtx);
+}
+
+/*
+ * Spin on the shared page for up to ioreq_poll_us before falling back to
+ * the blocking attach, saving the wakeup latency for back-to-back
+ * requests. Return true when a request showed up.
+ */
+static bool
+ioreq_poll(struct vmctx *ctx)
+{
+	uint64_t deadline;
+
+	if (ioreq_poll_us == 0)
+		return false;
+
+	deadline = ioreq_now_us() + ioreq_poll_us;
+	do {
+		if (ioreq_any_pending(ctx))
+			return true;
+		asm volatile("pause" ::: "memory");
+	} while (ioreq_now_us() < deadline);
+
+	return false;
+}
+
+static void
+ioreq_poll_adjust(uint64_t blocked_us)
+{
+	if (blocked_us <= ioreq_poll_max) {
+		if (ioreq_poll_us == 0)
+			ioreq_poll_us = MIN(IOREQ_POLL_START_US,
+					ioreq_poll_max);
+		else
+			ioreq_poll_us = MIN(ioreq_poll_us * 2,
+					ioreq_poll_max);
+	} else
+		ioreq_poll_us /= 2;
+}
+
+static int
+ioreq_wait(struct vmctx *ctx)
+{
+	uint64_t start;
+	int error;
+
+	if (ioreq_poll_max == 0)
+		return vm_attach_ioreq_client(ctx);
+
+	if (ioreq_poll(ctx))
+		return 0;
+
+	start = ioreq_now_us();
+	error = vm_attach_ioreq_client(ctx);
+	ioreq_poll_adjust(ioreq_now_us() - start);
+
+	return error;
+}
+
 static void
 vm_loop(struct vmctx *ctx)
 {
@@ -522,6 +857,11 @@ vm_loop(struct vmctx *ctx)
 	ctx->ioreq_client = vm_create_ioreq_client(ctx);
 	assert(ctx->ioreq_client > 0);
 
+	if (ioreq_workers_init(ctx) != 0)
+		fprintf(stderr, "handling ioreqs without worker threads\n");
+
+	ioreq_poll_us = ioreq_poll_max;
+
 	error = vm_run(ctx);
 	assert(error == 0);
 
@@ -529,18 +869,31 @@ vm_loop(struct vmctx *ctx)
 		int vcpu;
 		struct vhm_request *vhm_req;
 
-		error = vm_attach_ioreq_client(ctx);
+		error = ioreq_wait(ctx);
 		if (error)
 			break;
 
-		for (vcpu = 0; vcpu < 4; vcpu++) {
+		/*
+		 * Buffered writes happened before any pending request, replay
+		 * them before a worker may pick one up.
+		 */
+		ioreq_emul_lock(true);
+		coalesced_mmio_drain(ctx);
+		ioreq_emul_unlock(true);
+
+		if (ioreq_nworkers > 0) {
+			ioreq_dispatch(ctx);
+			ioreq_wait_done(ctx);
+			continue;
+		}
+
+		for (vcpu = 0; vcpu < guest_ncpus; vcpu++) {
 			vhm_req = &vhm_req_buf[vcpu];
-			if (vhm_req->valid
-				&& (vhm_req->processed == REQ_STATE_PROCESSING)
-				&& (vhm_req->client == ctx->ioreq_client))
+			if (ioreq_is_pending(ctx, vhm_req))
 				handle_vmexit(ctx, vhm_req, vcpu);
 		}
 	}
+	ioreq_workers_deinit();
 	quit_vm_loop = 0;
 	printf("VM loop exit\n");
 }
@@ -584,11 +937,20 @@ sig_handler_term(int signo)
 	mevent_notify();
 }
 
+static void
+sig_handler_stats(int signo)
+{
+	mevent_request_stats();
+}
+
 enum {
 	CMD_OPT_VSBL = 1000,
 	CMD_OPT_PART_INFO,
 	CMD_OPT_TRUSTY_ENABLE,
 	CMD_OPT_PTDEV_NO_RESET,
+	CMD_OPT_IOREQ_GROUP,
+	CMD_OPT_IOREQ_POLL_US,
+	CMD_OPT_RT_PINNED,
 };
 
 static struct option long_options[] = {
@@ -627,6 +989,12 @@ static struct option long_options[] = {
 					CMD_OPT_TRUSTY_ENABLE},
 	{"ptdev_no_reset",	no_argument,		0,
 		CMD_OPT_PTDEV_NO_RESET},
+	{"ioreq_group",		required_argument,	0,
+		CMD_OPT_IOREQ_GROUP},
+	{"ioreq_poll_us",	required_argument,	0,
+		CMD_OPT_IOREQ_POLL_US},
+	{"rt_pinned",		no_argument,		0,
+		CMD_OPT_RT_PINNED},
 	{0,			0,			0,  0  },
 };
 
@@ -653,6 +1021,8 @@ main(int argc, char *argv[])
 		fprintf(stderr, "cannot register handler for SIGHUP\n");
 	if (signal(SIGINT, sig_handler_term) == SIG_ERR)
 		fprintf(stderr, "cannot register handler for SIGINT\n");
+	if (signal(SIGUSR1, sig_handler_stats) == SIG_ERR)
+		fprintf(stderr, "cannot register handler for SIGUSR1\n");
 
 	optstr = "abehuwxACHIMPSTWYvk:r:B:p:g:c:s:m:l:U:G:i:";
 	while ((c = getopt_long(argc, argv, optstr, long_options,
@@ -796,6 +1166,21 @@ main(int argc, char *argv[])
 		case CMD_OPT_PTDEV_NO_RESET:
 			ptdev_no_reset(true);
 			break;
+		case CMD_OPT_RT_PINNED:
+			rt_pinned = 1;
+			break;
+		case CMD_OPT_IOREQ_GROUP:
+			ioreq_group = atoi(optarg);
+			if (ioreq_group < 0 || ioreq_group > VM_MAXCPU)
+				errx(EX_USAGE, "invalid ioreq group %s",
+					optarg);
+			break;
+		case CMD_OPT_IOREQ_POLL_US:
+			ioreq_poll_max = atoi(optarg);
+			if (ioreq_poll_max < 0)
+				errx(EX_USAGE, "invalid ioreq poll time %s",
+					optarg);
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -818,6 +1203,13 @@ main(int argc, char *argv[])
 		if (error)
 			goto fail;
 
+		/* optional, MEM_F_COALESCED ranges stay synchronous without */
+		if (coalesced_mmio_init(ctx) != 0) {
+#ifdef COALESCED_MMIO_DEBUG
+			fprintf(stderr, "coalesced MMIO not supported\n");
+#endif
+		}
+
 		if (guest_ncpus < 1) {
 			fprintf(stderr, "Invalid guest vCPUs (%d)\n",
 				guest_ncpus);
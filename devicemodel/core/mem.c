@@ -34,11 +34,15 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
+#include "dm.h"
 #include "vmm.h"
+#include "vmmapi.h"
 #include "mem.h"
 #include "tree.h"
 
@@ -63,6 +67,16 @@ static struct mmio_rb_range	*mmio_hint;
 
 static pthread_rwlock_t mmio_rwlock;
 
+/*
+ * Ring the hypervisor appends writes to MEM_F_COALESCED ranges to. It is
+ * only used once the hypervisor accepted it; until then such ranges are
+ * emulated synchronously like any other. The page is mapped once and
+ * kept for the life of the process, VHM pins it while a VM uses it.
+ */
+static struct coalesced_mmio_ring *coalesced_ring;
+static struct vmctx *coalesced_ctx;
+static pthread_mutex_t coalesced_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 static int
 mmio_rb_range_compare(struct mmio_rb_range *a, struct mmio_rb_range *b)
 {
@@ -159,8 +173,10 @@ emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req)
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
 	struct mmio_rb_range *entry = NULL;
+	bool serialized = false;
 	int err;
 
+again:
 	pthread_rwlock_rdlock(&mmio_rwlock);
 	/*
 	 * First check the per-VM cache
@@ -175,12 +191,26 @@ emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req)
 			mmio_hint = entry;
 		else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
 			pthread_rwlock_unlock(&mmio_rwlock);
+			ioreq_emul_unlock(serialized);
 			return -ESRCH;
 		}
 	}
 
 	assert(entry != NULL);
 
+	/*
+	 * Handlers that don't lock themselves run under the ioreq emulation
+	 * lock. It is taken before mmio_rwlock, the range may be unregistered
+	 * by a config write holding it, so look the range up again.
+	 */
+	if (!serialized && (entry->mr_param.flags & MEM_F_MT_SAFE) == 0) {
+		pthread_rwlock_unlock(&mmio_rwlock);
+		ioreq_emul_lock(true);
+		serialized = true;
+		entry = NULL;
+		goto again;
+	}
+
 	if (mmio_req->direction == REQUEST_READ)
 		err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
 				size, &entry->mr_param);
@@ -189,10 +219,99 @@ emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req)
 				size, &entry->mr_param);
 
 	pthread_rwlock_unlock(&mmio_rwlock);
+	ioreq_emul_unlock(serialized);
 
 	return err;
 }
 
+int
+coalesced_mmio_init(struct vmctx *ctx)
+{
+	struct coalesced_mmio_ring *ring;
+
+	coalesced_ctx = NULL;
+	if (coalesced_ring == NULL) {
+		ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (ring == MAP_FAILED)
+			return -1;
+		coalesced_ring = ring;
+	}
+
+	ring = coalesced_ring;
+	ring->first = ring->last = 0;
+	if (vm_set_coalesced_ring(ctx, (uint64_t)ring) != 0)
+		return -1;
+	coalesced_ctx = ctx;
+	return 0;
+}
+
+/*
+ * Replay the writes the hypervisor buffered since the last call. Must run
+ * before any synchronous request is handled so that the device sees the
+ * writes in guest order, and with the device emulation serialized like
+ * for a synchronous request: under ioreq_emul_lock in vm_loop, or from
+ * within an emulated config access when a range is unregistered.
+ */
+void
+coalesced_mmio_drain(struct vmctx *ctx)
+{
+	struct coalesced_mmio_ring *ring = coalesced_ring;
+	struct coalesced_mmio_entry *ent;
+	struct mmio_request req;
+	uint32_t first, last;
+
+	if (coalesced_ctx == NULL ||
+	    ring->first == *(volatile uint32_t *)&ring->last)
+		return;
+
+	pthread_mutex_lock(&coalesced_mtx);
+	first = ring->first;
+	last = *(volatile uint32_t *)&ring->last;
+	if (first >= COALESCED_MMIO_MAX || last >= COALESCED_MMIO_MAX) {
+		pthread_mutex_unlock(&coalesced_mtx);
+		return;
+	}
+	/* pairs with the barrier before the hypervisor advances last */
+	mb();
+
+	req.direction = REQUEST_WRITE;
+	while (first != last) {
+		ent = &ring->entries[first];
+		req.address = ent->addr;
+		req.size = ent->size;
+		req.value = ent->value;
+		if (emulate_mem(ctx, &req) != 0)
+			fprintf(stderr, "coalesced write 0x%lx lost\n",
+				ent->addr);
+		first = (first + 1) % COALESCED_MMIO_MAX;
+	}
+
+	/* hand the whole batch back at once */
+	mb();
+	ring->first = first;
+	pthread_mutex_unlock(&coalesced_mtx);
+}
+
+static void
+coalesced_mmio_zone(struct mem_range *memp, uint32_t op)
+{
+	if (coalesced_ctx == NULL || (memp->flags & MEM_F_COALESCED) == 0)
+		return;
+
+	if (vm_set_coalesced_zone(coalesced_ctx, memp->base, memp->size,
+			op) != 0)
+		fprintf(stderr, "%s: coalescing not available for %s\n",
+			__func__, memp->name);
+
+	/*
+	 * Only drain once the hypervisor stopped buffering for the range,
+	 * while it is still registered, so no write is left behind.
+	 */
+	if (op == COALESCED_MMIO_ZONE_DEL)
+		coalesced_mmio_drain(coalesced_ctx);
+}
+
 static int
 register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 {
@@ -222,7 +341,13 @@ register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 int
 register_mem(struct mem_range *memp)
 {
-	return register_mem_int(&mmio_rb_root, memp);
+	int err;
+
+	err = register_mem_int(&mmio_rb_root, memp);
+	if (err == 0)
+		coalesced_mmio_zone(memp, COALESCED_MMIO_ZONE_ADD);
+
+	return err;
 }
 
 int
@@ -266,6 +391,18 @@ unregister_mem(struct mem_range *memp)
 	struct mmio_rb_range *entry = NULL;
 	int err;
 
+	/*
+	 * Stop buffering and flush what was buffered for the range. The
+	 * caller need not pass the flags it registered the range with.
+	 */
+	pthread_rwlock_rdlock(&mmio_rwlock);
+	err = mmio_rb_lookup(&mmio_rb_root, memp->base, &entry);
+	pthread_rwlock_unlock(&mmio_rwlock);
+	if (err == 0)
+		coalesced_mmio_zone(&entry->mr_param,
+			COALESCED_MMIO_ZONE_DEL);
+
+	entry = NULL;
 	pthread_rwlock_wrlock(&mmio_rwlock);
 	err = mmio_rb_lookup(&mmio_rb_root, memp->base, &entry);
 	if (err == 0) {
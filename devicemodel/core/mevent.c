@@ -27,17 +27,29 @@
  */
 
 /*
- * Micro event library for FreeBSD, designed for a single i/o thread
- * using EPOLL, and having events be persistent by default.
+ * Micro event library for FreeBSD, using EPOLL, and having events be
+ * persistent by default.
+ *
+ * Events live on event loops. The shared loop is run by mevent_dispatch()
+ * on the main thread; a device with a noisy or latency sensitive fd can
+ * ask for a named loop, which gets its own epoll set and thread and may
+ * be shared by every device asking for the same name. Events may be
+ * added to and deleted from any loop by any thread; an event deleted
+ * while its loop is handling a batch is only freed, and its fd closed,
+ * once that batch ends.
  */
 
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/queue.h>
 #include <pthread.h>
 
@@ -45,17 +57,16 @@
 #include "vmmapi.h"
 
 #define	MEVENT_MAX	64
+#define	MEVENT_LOOP_MAX	16
+
+/* log2 buckets in us, the last one collects everything >= 16ms */
+#define	MEVENT_HIST_BUCKETS	16
 
 #define	MEV_ADD		1
 #define	MEV_ENABLE	2
 #define	MEV_DISABLE	3
 #define	MEV_DEL_PENDING	4
 
-static int epoll_fd;
-static pthread_t mevent_tid;
-static int mevent_pipefd[2];
-static pthread_mutex_t mevent_lmutex = PTHREAD_MUTEX_INITIALIZER;
-
 struct mevent {
 	void	(*me_func)(int, enum ev_type, void *);
 	int	me_fd;
@@ -64,55 +75,85 @@ struct mevent {
 	int	me_cq;
 	int	me_state;
 	int	me_closefd;
+	struct mevent_loop *me_loop;
 
 	LIST_ENTRY(mevent) me_list;
 };
 
-static LIST_HEAD(listhead, mevent) global_head;
+LIST_HEAD(listhead, mevent);
+
+struct mevent_loop {
+	char		name[16];
+	int		epfd;
+	int		wakefd;		/* eventfd, polled with a NULL data.ptr */
+	volatile int	wake_pending;
+	volatile int	quit;
+	pthread_t	tid;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	idle;		/* signalled when a handler returns */
+	struct mevent	*running;
+	struct listhead	head;
+	struct listhead	dead;		/* deleted, freed when the batch ends */
+
+	uint64_t	nevents;
+	uint64_t	run_max_us;
+	/* wakeup to handler start, and handler run time */
+	uint64_t	delay_hist[MEVENT_HIST_BUCKETS];
+	uint64_t	run_hist[MEVENT_HIST_BUCKETS];
+};
 
-static void
-mevent_qlock(void)
-{
-	pthread_mutex_lock(&mevent_lmutex);
-}
+/* mevent_loops[0] is the shared loop run by mevent_dispatch */
+static struct mevent_loop mevent_loops[MEVENT_LOOP_MAX];
+static int mevent_nloops;
+static pthread_mutex_t mevent_pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static volatile int mevent_stats_pending;
 
-static void
-mevent_qunlock(void)
+static int
+mevent_loop_wakeup(struct mevent_loop *loop)
 {
-	pthread_mutex_unlock(&mevent_lmutex);
+	/*
+	 * One outstanding wakeup is enough, the loop clears wake_pending
+	 * only after it drained the eventfd and before it looks at why it
+	 * was woken.
+	 */
+	if (__sync_lock_test_and_set(&loop->wake_pending, 1) == 0)
+		if (eventfd_write(loop->wakefd, 1) < 0)
+			return -1;
+	return 0;
 }
 
 static void
-mevent_pipe_read(int fd, enum ev_type type, void *param)
+mevent_loop_drain(struct mevent_loop *loop)
 {
-	char buf[MEVENT_MAX];
-	int status;
+	eventfd_t val;
 
-	/*
-	 * Drain the pipe read side. The fd is non-blocking so this is
-	 * safe to do.
-	 */
-	do {
-		status = read(fd, buf, sizeof(buf));
-	} while (status == MEVENT_MAX);
+	eventfd_read(loop->wakefd, &val);
+	__sync_lock_release(&loop->wake_pending);
 }
 
 /*On error, -1 is returned, else return zero*/
 int
 mevent_notify(void)
 {
-	char c;
+	struct mevent_loop *loop = &mevent_loops[0];
 
 	/*
-	 * If calling from outside the i/o thread, write a byte on the
-	 * pipe to force the i/o thread to exit the blocking epoll call.
+	 * If calling from outside the i/o thread, kick the eventfd to
+	 * force the i/o thread to exit the blocking epoll call.
 	 */
-	if (mevent_pipefd[1] != 0 && pthread_self() != mevent_tid)
-		if (write(mevent_pipefd[1], &c, 1) <= 0)
-			return -1;
+	if (mevent_nloops > 0 && !pthread_equal(pthread_self(), loop->tid))
+		return mevent_loop_wakeup(loop);
 	return 0;
 }
 
+/* Safe to call from a signal handler */
+void
+mevent_request_stats(void)
+{
+	mevent_stats_pending = 1;
+	mevent_notify();
+}
+
 static int
 mevent_kq_filter(struct mevent *mevp)
 {
@@ -128,19 +169,196 @@ mevent_kq_filter(struct mevent *mevp)
 	return retval;
 }
 
+static int
+mevent_hist_bucket(uint64_t us)
+{
+	int b = 0;
+
+	while (us != 0 && b < MEVENT_HIST_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static uint64_t
+mevent_elapsed_us(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000UL +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
 static void
-mevent_destroy()
+mevent_loop_reap(struct mevent_loop *loop)
 {
 	struct mevent *mevp, *tmpp;
+
+	pthread_mutex_lock(&loop->mtx);
+	list_foreach_safe(mevp, &loop->dead, me_list, tmpp) {
+		LIST_REMOVE(mevp, me_list);
+		if (mevp->me_closefd)
+			close(mevp->me_fd);
+		free(mevp);
+	}
+	pthread_mutex_unlock(&loop->mtx);
+}
+
+static void
+mevent_handle(struct mevent_loop *loop, struct epoll_event *kev, int numev)
+{
+	struct timespec woke, start, end;
+	struct mevent *mevp;
+	uint64_t run;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &woke);
+
+	for (i = 0; i < numev; i++) {
+		mevp = kev[i].data.ptr;
+		if (mevp == NULL) {
+			mevent_loop_drain(loop);
+			continue;
+		}
+		/* XXX check for EV_ERROR ? */
+
+		pthread_mutex_lock(&loop->mtx);
+		if (mevp->me_state == MEV_DEL_PENDING) {
+			pthread_mutex_unlock(&loop->mtx);
+			continue;
+		}
+		loop->running = mevp;
+		pthread_mutex_unlock(&loop->mtx);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		(*mevp->me_func)(mevp->me_fd, mevp->me_type, mevp->me_param);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		run = mevent_elapsed_us(&start, &end);
+		pthread_mutex_lock(&loop->mtx);
+		loop->running = NULL;
+		loop->nevents++;
+		loop->delay_hist[mevent_hist_bucket(
+			mevent_elapsed_us(&woke, &start))]++;
+		loop->run_hist[mevent_hist_bucket(run)]++;
+		if (run > loop->run_max_us)
+			loop->run_max_us = run;
+		pthread_cond_broadcast(&loop->idle);
+		pthread_mutex_unlock(&loop->mtx);
+	}
+
+	mevent_loop_reap(loop);
+}
+
+static void
+mevent_loop_poll(struct mevent_loop *loop)
+{
+	struct epoll_event eventlist[MEVENT_MAX];
+	int ret;
+
+	/*
+	 * Block awaiting events
+	 */
+	ret = epoll_wait(loop->epfd, eventlist, MEVENT_MAX, -1);
+	if (ret == -1 && errno != EINTR)
+		perror("Error return from epoll_wait");
+
+	/*
+	 * Handle reported events
+	 */
+	mevent_handle(loop, eventlist, ret);
+}
+
+static void *
+mevent_loop_thread(void *param)
+{
+	struct mevent_loop *loop = param;
+
+	while (!loop->quit)
+		mevent_loop_poll(loop);
+
+	return NULL;
+}
+
+static void
+mevent_print_stats(void)
+{
+	struct mevent_loop *loop;
+	uint64_t delay[MEVENT_HIST_BUCKETS], run[MEVENT_HIST_BUCKETS];
+	uint64_t nevents, run_max;
+	int i, b;
+
+	for (i = 0; i < mevent_nloops; i++) {
+		loop = &mevent_loops[i];
+		pthread_mutex_lock(&loop->mtx);
+		nevents = loop->nevents;
+		run_max = loop->run_max_us;
+		memcpy(delay, loop->delay_hist, sizeof(delay));
+		memcpy(run, loop->run_hist, sizeof(run));
+		pthread_mutex_unlock(&loop->mtx);
+
+		fprintf(stderr, "mevent loop %s: %lu events, max run %luus\n",
+			loop->name, nevents, run_max);
+		if (nevents == 0)
+			continue;
+		fprintf(stderr, "  %10s %12s %12s\n", "us", "delay", "run");
+		for (b = 0; b < MEVENT_HIST_BUCKETS; b++) {
+			if (!delay[b] && !run[b])
+				continue;
+			fprintf(stderr, "  %s%-8lu %12lu %12lu\n",
+				b == MEVENT_HIST_BUCKETS - 1 ? ">=" : " <",
+				b == MEVENT_HIST_BUCKETS - 1 ?
+				1UL << (b - 1) : 1UL << b,
+				delay[b], run[b]);
+		}
+	}
+}
+
+static int
+mevent_loop_setup(struct mevent_loop *loop, const char *name)
+{
 	struct epoll_event ee;
 
-	mevent_qlock();
+	memset(loop, 0, sizeof(*loop));
+	snprintf(loop->name, sizeof(loop->name), "%s", name);
+	LIST_INIT(&loop->head);
+	LIST_INIT(&loop->dead);
+	pthread_mutex_init(&loop->mtx, NULL);
+	pthread_cond_init(&loop->idle, NULL);
+
+	loop->epfd = epoll_create1(0);
+	if (loop->epfd < 0)
+		return -1;
 
-	list_foreach_safe(mevp, &global_head, me_list, tmpp) {
+	loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wakefd < 0) {
+		close(loop->epfd);
+		return -1;
+	}
+
+	ee.events = EPOLLIN;
+	ee.data.ptr = NULL;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ee) < 0) {
+		close(loop->wakefd);
+		close(loop->epfd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+mevent_loop_destroy(struct mevent_loop *loop)
+{
+	struct mevent *mevp, *tmpp;
+	struct epoll_event ee;
+
+	pthread_mutex_lock(&loop->mtx);
+
+	list_foreach_safe(mevp, &loop->head, me_list, tmpp) {
 		LIST_REMOVE(mevp, me_list);
 		ee.events = mevent_kq_filter(mevp);
 		ee.data.ptr = mevp;
-		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, mevp->me_fd, &ee);
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, mevp->me_fd, &ee);
 
 		if ((mevp->me_type == EVF_READ ||
 			mevp->me_type == EVF_WRITE)
@@ -150,26 +368,74 @@ mevent_destroy()
 		free(mevp);
 	}
 
-	mevent_qunlock();
+	list_foreach_safe(mevp, &loop->dead, me_list, tmpp) {
+		LIST_REMOVE(mevp, me_list);
+		if (mevp->me_closefd)
+			close(mevp->me_fd);
+		free(mevp);
+	}
+
+	pthread_mutex_unlock(&loop->mtx);
+
+	close(loop->wakefd);
+	close(loop->epfd);
+	pthread_cond_destroy(&loop->idle);
+	pthread_mutex_destroy(&loop->mtx);
 }
 
-static void
-mevent_handle(struct epoll_event *kev, int numev)
+/*
+ * Return the loop called name, starting its thread on first use. A NULL
+ * name, or running out of loops, yields the shared loop.
+ */
+struct mevent_loop *
+mevent_loop_get(const char *name)
 {
+	struct mevent_loop *loop = NULL;
+	char tname[16];
 	int i;
-	struct mevent *mevp;
 
-	for (i = 0; i < numev; i++) {
-		mevp = kev[i].data.ptr;
-		/* XXX check for EV_ERROR ? */
+	if (name == NULL)
+		return &mevent_loops[0];
 
-		(*mevp->me_func)(mevp->me_fd, mevp->me_type, mevp->me_param);
+	pthread_mutex_lock(&mevent_pool_mtx);
+	for (i = 1; i < mevent_nloops; i++) {
+		if (strncmp(mevent_loops[i].name, name,
+			    sizeof(mevent_loops[i].name)) == 0) {
+			loop = &mevent_loops[i];
+			goto out;
+		}
+	}
+
+	loop = &mevent_loops[0];
+	if (mevent_nloops == MEVENT_LOOP_MAX) {
+		fprintf(stderr, "mevent: no loop left for %s, sharing\n",
+			name);
+		goto out;
+	}
+
+	if (mevent_loop_setup(&mevent_loops[mevent_nloops], name) < 0) {
+		fprintf(stderr, "mevent: failed to set up loop %s\n", name);
+		goto out;
 	}
+	if (pthread_create(&mevent_loops[mevent_nloops].tid, NULL,
+			   mevent_loop_thread,
+			   &mevent_loops[mevent_nloops]) != 0) {
+		fprintf(stderr, "mevent: failed to start loop %s\n", name);
+		mevent_loop_destroy(&mevent_loops[mevent_nloops]);
+		goto out;
+	}
+
+	loop = &mevent_loops[mevent_nloops++];
+	snprintf(tname, sizeof(tname), "mev-%s", name);
+	pthread_setname_np(loop->tid, tname);
+out:
+	pthread_mutex_unlock(&mevent_pool_mtx);
+	return loop;
 }
 
 struct mevent *
-mevent_add(int tfd, enum ev_type type,
-	   void (*func)(int, enum ev_type, void *), void *param)
+mevent_add_loop(struct mevent_loop *loop, int tfd, enum ev_type type,
+		void (*func)(int, enum ev_type, void *), void *param)
 {
 	int ret;
 	struct epoll_event ee;
@@ -181,15 +447,8 @@ mevent_add(int tfd, enum ev_type type,
 	if (type == EVF_TIMER)
 		return NULL;
 
-	mevent_qlock();
-	/* Verify that the fd/type tuple is not present in the list */
-	LIST_FOREACH(lp, &global_head, me_list) {
-		if (lp->me_fd == tfd && lp->me_type == type) {
-			mevent_qunlock();
-			return lp;
-		}
-	}
-	mevent_qunlock();
+	if (loop == NULL)
+		loop = &mevent_loops[0];
 
 	/*
 	 * Allocate an entry, populate it, and add it to the list.
@@ -202,131 +461,202 @@ mevent_add(int tfd, enum ev_type type,
 	mevp->me_type = type;
 	mevp->me_func = func;
 	mevp->me_param = param;
+	mevp->me_state = MEV_ENABLE;
+	mevp->me_loop = loop;
 
+	pthread_mutex_lock(&loop->mtx);
+	/* Verify that the fd/type tuple is not present in the list */
+	LIST_FOREACH(lp, &loop->head, me_list) {
+		if (lp->me_fd == tfd && lp->me_type == type) {
+			pthread_mutex_unlock(&loop->mtx);
+			free(mevp);
+			return lp;
+		}
+	}
+
+	/*
+	 * The loop lock is held until the entry is on the list, so the
+	 * handler can not run, and delete it, before that.
+	 */
 	ee.events = mevent_kq_filter(mevp);
 	ee.data.ptr = mevp;
-	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
-	if (ret == 0) {
-		mevent_qlock();
-		LIST_INSERT_HEAD(&global_head, mevp, me_list);
-		mevent_qunlock();
+	ret = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
+	if (ret == 0)
+		LIST_INSERT_HEAD(&loop->head, mevp, me_list);
+	pthread_mutex_unlock(&loop->mtx);
 
-		return mevp;
-	} else {
+	if (ret != 0) {
 		free(mevp);
 		return NULL;
 	}
+	return mevp;
+}
+
+struct mevent *
+mevent_add(int tfd, enum ev_type type,
+	   void (*func)(int, enum ev_type, void *), void *param)
+{
+	return mevent_add_loop(NULL, tfd, type, func, param);
+}
+
+static int
+mevent_update(struct mevent *evp, int newstate)
+{
+	struct mevent_loop *loop;
+	struct epoll_event ee;
+	int ret = 0;
+
+	/* e.g. the uart on a stdin which is not a tty never adds one */
+	if (evp == NULL)
+		return 0;
+
+	loop = evp->me_loop;
+	pthread_mutex_lock(&loop->mtx);
+	if (evp->me_state != newstate && evp->me_state != MEV_DEL_PENDING) {
+		ee.events = (newstate == MEV_ENABLE) ?
+			mevent_kq_filter(evp) : 0;
+		ee.data.ptr = evp;
+		ret = epoll_ctl(loop->epfd, EPOLL_CTL_MOD, evp->me_fd, &ee);
+		if (ret == 0)
+			evp->me_state = newstate;
+	}
+	pthread_mutex_unlock(&loop->mtx);
+
+	return ret;
 }
 
 int
 mevent_enable(struct mevent *evp)
 {
-	return 0;
+	return mevent_update(evp, MEV_ENABLE);
 }
 
 int
 mevent_disable(struct mevent *evp)
 {
-	return 0;
+	return mevent_update(evp, MEV_DISABLE);
 }
 
 static int
-mevent_delete_event(struct mevent *evp, int closefd)
+mevent_delete_event(struct mevent *evp, int closefd, bool wait)
 {
+	struct mevent_loop *loop;
 	struct epoll_event ee;
+	bool remote;
+
+	if (evp == NULL)
+		return 0;
 
-	mevent_qlock();
+	loop = evp->me_loop;
+	pthread_mutex_lock(&loop->mtx);
 	LIST_REMOVE(evp, me_list);
-	mevent_qunlock();
+	evp->me_state = MEV_DEL_PENDING;
 
 	ee.events = mevent_kq_filter(evp);
 	ee.data.ptr = evp;
-	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, evp->me_fd, &ee);
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, evp->me_fd, &ee);
 
-	if (closefd)
+	remote = !pthread_equal(pthread_self(), loop->tid);
+	if (remote && wait) {
+		while (loop->running == evp)
+			pthread_cond_wait(&loop->idle, &loop->mtx);
+	}
+
+	/*
+	 * A handler still running on the loop thread may use the fd, let
+	 * the loop close it together with freeing the entry.
+	 */
+	if (closefd && (!remote || wait))
 		close(evp->me_fd);
+	else if (closefd)
+		evp->me_closefd = 1;
+
+	/* the loop may still hold it in the batch it is handling */
+	LIST_INSERT_HEAD(&loop->dead, evp, me_list);
+	pthread_mutex_unlock(&loop->mtx);
 
-	free(evp);
+	if (remote)
+		mevent_loop_wakeup(loop);
 	return 0;
 }
 
 int
 mevent_delete(struct mevent *evp)
 {
-	return mevent_delete_event(evp, 0);
+	return mevent_delete_event(evp, 0, false);
 }
 
 int
 mevent_delete_close(struct mevent *evp)
 {
-	return mevent_delete_event(evp, 1);
+	return mevent_delete_event(evp, 1, false);
+}
+
+/*
+ * Like mevent_delete, but also wait for the handler if it is running on
+ * another loop right now, so the caller may free what it uses. Must not
+ * be called with a lock held that the handler takes.
+ */
+int
+mevent_delete_wait(struct mevent *evp)
+{
+	return mevent_delete_event(evp, 0, true);
 }
 
 static void
 mevent_set_name(void)
 {
-	pthread_setname_np(mevent_tid, "mevent");
+	pthread_setname_np(mevent_loops[0].tid, "mevent");
 }
 
 int
 mevent_init(void)
 {
-	epoll_fd = epoll_create1(0);
-	assert(epoll_fd >= 0);
+	int ret;
+
+	ret = mevent_loop_setup(&mevent_loops[0], "mevent");
+	assert(ret == 0);
 
-	if (epoll_fd >= 0)
+	if (ret == 0) {
+		mevent_nloops = 1;
 		return 0;
-	else
+	} else
 		return -1;
 }
 
 void
 mevent_deinit(void)
 {
-	mevent_destroy();
-	close(epoll_fd);
+	struct mevent_loop *loop;
+	int i;
+
+	for (i = 1; i < mevent_nloops; i++) {
+		loop = &mevent_loops[i];
+		loop->quit = 1;
+		mevent_loop_wakeup(loop);
+		pthread_join(loop->tid, NULL);
+	}
+
+	for (i = 0; i < mevent_nloops; i++)
+		mevent_loop_destroy(&mevent_loops[i]);
+	mevent_nloops = 0;
 }
 
 void
 mevent_dispatch(void)
 {
-	struct epoll_event eventlist[MEVENT_MAX];
+	struct mevent_loop *loop = &mevent_loops[0];
 
-	struct mevent *pipev;
-	int ret;
-
-	mevent_tid = pthread_self();
+	loop->tid = pthread_self();
 	mevent_set_name();
 
-	/*
-	 * Open the pipe that will be used for other threads to force
-	 * the blocking kqueue call to exit by writing to it. Set the
-	 * descriptor to non-blocking.
-	 */
-	ret = pipe(mevent_pipefd);
-	if (ret < 0) {
-		perror("pipe");
-		exit(0);
-	}
-
-	/*
-	 * Add internal event handler for the pipe write fd
-	 */
-	pipev = mevent_add(mevent_pipefd[0], EVF_READ, mevent_pipe_read, NULL);
-	assert(pipev != NULL);
-
 	for (;;) {
-		/*
-		 * Block awaiting events
-		 */
-		ret = epoll_wait(epoll_fd, eventlist, MEVENT_MAX, -1);
-		if (ret == -1 && errno != EINTR)
-			perror("Error return from epoll_wait");
-
-		/*
-		 * Handle reported events
-		 */
-		mevent_handle(eventlist, ret);
+		mevent_loop_poll(loop);
+
+		if (mevent_stats_pending) {
+			mevent_stats_pending = 0;
+			mevent_print_stats();
+		}
 
 		if (vm_get_suspend_mode() != VM_SUSPEND_NONE)
 			break;
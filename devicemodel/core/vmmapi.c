@@ -138,6 +138,17 @@ vm_open(const char *name)
 	else
 		create_vm.vm_flag &= (~SECURE_WORLD_ENABLED);
 
+	/* vCPUs must not time-share physical CPUs */
+	if (rt_pinned)
+		create_vm.vm_flag |= RT_PINNED_ENABLED;
+
+	/* halted vCPUs give their physical CPU back */
+	if (guest_vmexit_on_hlt)
+		create_vm.vm_flag |= HLT_EXIT_ENABLED;
+
+	/* vCPUs spin on requests as long as vm_loop spins for them */
+	create_vm.ioreq_poll_us = ioreq_poll_max;
+
 	while (retry > 0) {
 		error = ioctl(ctx->fd, IC_CREATE_VM, &create_vm);
 		if (error == 0)
@@ -187,6 +198,47 @@ vm_set_shared_io_page(struct vmctx *ctx, uint64_t page_vma)
 	return 0;
 }
 
+int
+vm_set_coalesced_ring(struct vmctx *ctx, uint64_t ring_vma)
+{
+	return ioctl(ctx->fd, IC_SET_COALESCED_RING, ring_vma);
+}
+
+int
+vm_set_coalesced_zone(struct vmctx *ctx, uint64_t addr, uint64_t size,
+		uint32_t op)
+{
+	struct acrn_coalesced_mmio_zone zone;
+
+	bzero(&zone, sizeof(zone));
+	zone.addr = addr;
+	zone.size = size;
+	zone.op = op;
+
+	return ioctl(ctx->fd, IC_SET_COALESCED_ZONE, &zone);
+}
+
+int
+vm_setup_vuart(struct vmctx *ctx, int base, int irq, uint64_t ring_vma,
+		int notify_fd)
+{
+	struct acrn_vuart_setup setup;
+
+	bzero(&setup, sizeof(setup));
+	setup.ring_buf = ring_vma;
+	setup.base = base;
+	setup.irq = irq;
+	setup.notify_fd = notify_fd;
+
+	return ioctl(ctx->fd, IC_SETUP_VUART, &setup);
+}
+
+int
+vm_notify_vuart(struct vmctx *ctx)
+{
+	return ioctl(ctx->fd, IC_NOTIFY_VUART, 0);
+}
+
 int
 vm_create_ioreq_client(struct vmctx *ctx)
 {
@@ -30,7 +30,10 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 #include <linux/fs.h>
+#include <linux/aio_abi.h>
 #include <errno.h>
 #include <assert.h>
 #include <err.h>
@@ -45,6 +48,7 @@
 #include "dm.h"
 #include "block_if.h"
 #include "ahci.h"
+#include "mevent.h"
 
 /*
  * Notes:
@@ -63,6 +67,29 @@
 #define BLOCKIF_NUMTHR	8
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
 
+/*
+ * With "aio=native", reads and writes are submitted through the Linux
+ * native aio interface and completed from the mevent thread. Flush,
+ * discard and any request the kernel refuses to queue are still handled
+ * synchronously by a single worker thread.
+ */
+#define BLOCKIF_AIO_NUMTHR	1
+#define BLOCKIF_AIO_BATCH	32
+
+/* max segments passed to a single preadv/pwritev */
+#define BLOCKIF_SEG_MAX		MIN(BLOCKIF_IOV_MAX, IOV_MAX)
+
+/*
+ * Contiguous pending reads or writes are merged into one vectored I/O
+ * of up to BLOCKIF_MERGE_MAX bytes and BLOCKIF_MERGE_IOV segments.
+ */
+#define BLOCKIF_MERGE_MAX	(128 * 1024)
+#define BLOCKIF_MERGE_IOV	64
+
+/* buckets of the offset indexes used for dependency tracking */
+#define BLOCKIF_HASH_BITS	6
+#define BLOCKIF_HASH_SIZE	(1 << BLOCKIF_HASH_BITS)
+
 /*
  * Debug printf
  */
@@ -92,6 +119,15 @@ struct blockif_elem {
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	int		     aio;	/* handled by the aio engine */
+	struct iocb	     iocb;
+	LIST_ENTRY(blockif_elem) start_link;	/* pending, by req->offset */
+	LIST_ENTRY(blockif_elem) end_link;	/* pending or busy, by block */
+
+	/* requests merged into this one, and the combined segments */
+	struct blockif_elem  *next_merged;
+	int		     miovcnt;
+	struct iovec	     miov[BLOCKIF_MERGE_IOV];
 };
 
 struct blockif_ctxt {
@@ -101,6 +137,7 @@ struct blockif_ctxt {
 	int			isgeom;
 	int			candelete;
 	int			rdonly;
+	int			align;		/* O_DIRECT buffer alignment */
 	off_t			size;
 	int			sub_file_assign;
 	off_t			sub_file_start_lba;
@@ -109,7 +146,10 @@ struct blockif_ctxt {
 	int			psectsz;
 	int			psectoff;
 	int			closing;
+	int			nthr;
 	pthread_t		btid[BLOCKIF_NUMTHR];
+	uint8_t			*bounce;	/* MAXPHYS per i/o thread */
+	int			bounce_next;
 	pthread_mutex_t		mtx;
 	pthread_cond_t		cond;
 
@@ -118,6 +158,22 @@ struct blockif_ctxt {
 	TAILQ_HEAD(, blockif_elem) pendq;
 	TAILQ_HEAD(, blockif_elem) busyq;
 	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+
+	/*
+	 * A request must wait for any pending or busy request ending where
+	 * it starts. Index pending requests by start and pending and busy
+	 * ones by end offset so neither check has to walk the queues.
+	 */
+	LIST_HEAD(, blockif_elem) start_hash[BLOCKIF_HASH_SIZE];
+	LIST_HEAD(, blockif_elem) end_hash[BLOCKIF_HASH_SIZE];
+
+	/* native aio engine, protected by mtx */
+	int			aio;
+	aio_context_t		aio_ctx;
+	int			aio_efd;
+	struct mevent		*aio_evp;
+	int			aio_inflight;
+	int			plugged;
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
@@ -131,11 +187,88 @@ struct blockif_sig_elem {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+static inline int
+io_setup(unsigned int nr, aio_context_t *ctxp)
+{
+	return syscall(__NR_io_setup, nr, ctxp);
+}
+
+static inline int
+io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int
+io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int
+io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+	     struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events,
+		       timeout);
+}
+
+/*
+ * O_DIRECT requires the guest buffers to be aligned to the logical block
+ * size. Requests that are not have to go through the bounce buffer.
+ */
+static int
+blockif_aligned(struct blockif_ctxt *bc, struct blockif_req *br)
+{
+	int i;
+
+	if (bc->align <= 1)
+		return 1;
+
+	for (i = 0; i < br->iovcnt; i++) {
+		if (((uintptr_t)br->iov[i].iov_base | br->iov[i].iov_len) &
+		    (bc->align - 1))
+			return 0;
+	}
+	return 1;
+}
+
+static int
+blockif_aio_op(struct blockif_ctxt *bc, struct blockif_req *breq,
+	       enum blockop op)
+{
+	if (!bc->aio)
+		return 0;
+	if (op != BOP_READ && (op != BOP_WRITE || bc->rdonly))
+		return 0;
+	return blockif_aligned(bc, breq);
+}
+
+static inline unsigned int
+blockif_hash(off_t off)
+{
+	return ((uint64_t)off * 0x9E3779B97F4A7C15ULL) >>
+		(64 - BLOCKIF_HASH_BITS);
+}
+
+/* Return a pending or busy request other than skip ending at off */
+static struct blockif_elem *
+blockif_find_end(struct blockif_ctxt *bc, off_t off, struct blockif_elem *skip)
+{
+	struct blockif_elem *tbe;
+
+	LIST_FOREACH(tbe, &bc->end_hash[blockif_hash(off)], end_link) {
+		if (tbe->block == off && tbe != skip)
+			return tbe;
+	}
+	return NULL;
+}
+
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
-	struct blockif_elem *be, *tbe;
+	struct blockif_elem *be;
 	off_t off;
 	int i;
 
@@ -145,6 +278,7 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	TAILQ_REMOVE(&bc->freeq, be, link);
 	be->req = breq;
 	be->op = op;
+	be->aio = blockif_aio_op(bc, breq, op);
 	switch (op) {
 	case BOP_READ:
 	case BOP_WRITE:
@@ -158,40 +292,132 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		off = 1 << (sizeof(off_t) - 1);
 	}
 	be->block = off;
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
-		if (tbe->block == breq->offset)
-			break;
-	}
-	if (tbe == NULL) {
-		TAILQ_FOREACH(tbe, &bc->busyq, link) {
-			if (tbe->block == breq->offset)
-				break;
-		}
-	}
-	if (tbe == NULL)
+	be->next_merged = NULL;
+	be->miovcnt = 0;
+	if (blockif_find_end(bc, breq->offset, NULL) == NULL)
 		be->status = BST_PEND;
 	else
 		be->status = BST_BLOCK;
 	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	LIST_INSERT_HEAD(&bc->start_hash[blockif_hash(breq->offset)], be,
+			 start_link);
+	LIST_INSERT_HEAD(&bc->end_hash[blockif_hash(off)], be, end_link);
 	return (be->status == BST_PEND);
 }
 
+/* Move a pending request to the busy queue. Called with mtx held */
+static void
+blockif_busy(struct blockif_ctxt *bc, struct blockif_elem *be, pthread_t t)
+{
+	TAILQ_REMOVE(&bc->pendq, be, link);
+	LIST_REMOVE(be, start_link);
+	be->status = BST_BUSY;
+	be->tid = t;
+	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+}
+
+static int
+blockif_mergeable(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_req *br = be->req;
+
+	if (be->op != BOP_READ && be->op != BOP_WRITE)
+		return 0;
+	/* requests through the bounce buffer are done one at a time */
+	if (!be->aio && !blockif_aligned(bc, br))
+		return 0;
+	return br->resid == be->block - br->offset;
+}
+
+/*
+ * Pull pending requests that continue where be ends into be, so that the
+ * whole run is issued as one vectored I/O. A request only qualifies if
+ * nothing outside the run has to complete before it. Called with mtx
+ * held, after be went busy.
+ */
+static void
+blockif_merge(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_elem *tail, *tbe;
+	struct blockif_req *br;
+	ssize_t len;
+	int cnt;
+
+	be->next_merged = NULL;
+	be->miovcnt = 0;
+	if (!blockif_mergeable(bc, be))
+		return;
+
+	tail = be;
+	len = be->req->resid;
+	cnt = be->req->iovcnt;
+	for (;;) {
+		LIST_FOREACH(tbe, &bc->start_hash[blockif_hash(tail->block)],
+			     start_link) {
+			if (tbe->req->offset == tail->block &&
+			    tbe->op == be->op && tbe->aio == be->aio)
+				break;
+		}
+		if (tbe == NULL || !blockif_mergeable(bc, tbe))
+			break;
+		br = tbe->req;
+		if (cnt + br->iovcnt > BLOCKIF_MERGE_IOV ||
+		    len + br->resid > BLOCKIF_MERGE_MAX)
+			break;
+		if (blockif_find_end(bc, br->offset, tail) != NULL)
+			break;
+
+		blockif_busy(bc, tbe, be->tid);
+		tail->next_merged = tbe;
+		tail = tbe;
+		cnt += br->iovcnt;
+		len += br->resid;
+	}
+	if (tail == be)
+		return;
+
+	cnt = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->next_merged) {
+		br = tbe->req;
+		memcpy(&be->miov[cnt], br->iov, br->iovcnt * sizeof(br->iov[0]));
+		cnt += br->iovcnt;
+	}
+	be->miovcnt = cnt;
+}
+
+/* Hand out the bytes a merged I/O transferred to its requests in order */
+static void
+blockif_merge_done(struct blockif_elem *be, ssize_t done, int err)
+{
+	struct blockif_elem *tbe, *next;
+	struct blockif_req *br;
+	ssize_t len;
+
+	for (tbe = be; tbe != NULL; tbe = next) {
+		next = tbe->next_merged;
+		br = tbe->req;
+		len = MIN(br->resid, done);
+		br->resid -= len;
+		done -= len;
+		tbe->status = BST_DONE;
+		(*br->callback)(br, err);
+	}
+}
+
 static int
 blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
 
 	TAILQ_FOREACH(be, &bc->pendq, link) {
-		if (be->status == BST_PEND)
+		if (be->status == BST_PEND && !be->aio)
 			break;
-		assert(be->status == BST_BLOCK);
+		assert(be->status == BST_BLOCK || be->aio);
 	}
 	if (be == NULL)
 		return 0;
-	TAILQ_REMOVE(&bc->pendq, be, link);
-	be->status = BST_BUSY;
-	be->tid = t;
-	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+	blockif_busy(bc, be, t);
+	blockif_merge(bc, be);
 	*bep = be;
 	return 1;
 }
@@ -203,18 +429,323 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 
 	if (be->status == BST_DONE || be->status == BST_BUSY)
 		TAILQ_REMOVE(&bc->busyq, be, link);
-	else
+	else {
 		TAILQ_REMOVE(&bc->pendq, be, link);
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
+		LIST_REMOVE(be, start_link);
+	}
+	LIST_REMOVE(be, end_link);
+	LIST_FOREACH(tbe, &bc->start_hash[blockif_hash(be->block)],
+		     start_link) {
 		if (tbe->req->offset == be->block)
 			tbe->status = BST_PEND;
 	}
+	be->next_merged = NULL;
+	be->miovcnt = 0;
 	be->tid = 0;
 	be->status = BST_FREE;
 	be->req = NULL;
 	TAILQ_INSERT_TAIL(&bc->freeq, be, link);
 }
 
+/* Complete be and the requests merged into it. Called with mtx held */
+static void
+blockif_complete_merged(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_elem *next;
+
+	for (; be != NULL; be = next) {
+		next = be->next_merged;
+		blockif_complete(bc, be);
+	}
+}
+
+/*
+ * Put a busy request that could not be submitted back at the head of
+ * the pending queue for the worker thread, splitting up what was merged
+ * into it. Called with mtx held.
+ */
+static void
+blockif_requeue(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_elem *prev, *next;
+
+	for (prev = NULL; be != NULL; prev = be, be = next) {
+		next = be->next_merged;
+		be->next_merged = NULL;
+		be->miovcnt = 0;
+		be->aio = 0;
+		TAILQ_REMOVE(&bc->busyq, be, link);
+		if (prev == NULL) {
+			be->status = BST_PEND;
+			TAILQ_INSERT_HEAD(&bc->pendq, be, link);
+		} else {
+			/* still ordered behind the previous one */
+			be->status = BST_BLOCK;
+			TAILQ_INSERT_AFTER(&bc->pendq, prev, be, link);
+		}
+		LIST_INSERT_HEAD(&bc->start_hash[blockif_hash(be->req->offset)],
+				 be, start_link);
+	}
+}
+
+/*
+ * Submit iocbs in one io_submit call. Whatever the kernel doesn't accept
+ * is handed back to the worker thread, since invoking the callback here
+ * could deadlock with the device lock held by the caller.
+ */
+static void
+blockif_aio_flush(struct blockif_ctxt *bc, struct iocb **iocbs, int n)
+{
+	struct blockif_elem *be;
+	int i, ret;
+
+	ret = io_submit(bc->aio_ctx, n, iocbs);
+	if (ret < 0) {
+		DPRINTF(("blockif: io_submit failed %d\n", errno));
+		ret = 0;
+	}
+	bc->aio_inflight += ret;
+
+	for (i = ret; i < n; i++) {
+		be = (struct blockif_elem *)(uintptr_t)iocbs[i]->aio_data;
+		blockif_requeue(bc, be);
+	}
+	if (ret < n)
+		pthread_cond_signal(&bc->cond);
+}
+
+/* Submit all unblocked aio requests. Called with mtx held */
+static void
+blockif_aio_submit(struct blockif_ctxt *bc)
+{
+	struct iocb *iocbs[BLOCKIF_AIO_BATCH];
+	struct blockif_elem *be, *next;
+	struct blockif_req *br;
+	struct iocb *iocb;
+	int n;
+
+	n = 0;
+	for (be = TAILQ_FIRST(&bc->pendq); be != NULL; be = next) {
+		next = TAILQ_NEXT(be, link);
+		if (be->status != BST_PEND || !be->aio)
+			continue;
+
+		blockif_busy(bc, be, 0);
+		blockif_merge(bc, be);
+		/* merged requests left the pending queue, next may be one */
+		if (be->next_merged != NULL)
+			next = TAILQ_FIRST(&bc->pendq);
+
+		br = be->req;
+		iocb = &be->iocb;
+		memset(iocb, 0, sizeof(*iocb));
+		iocb->aio_data = (uintptr_t)be;
+		iocb->aio_lio_opcode = (be->op == BOP_READ) ?
+			IOCB_CMD_PREADV : IOCB_CMD_PWRITEV;
+		iocb->aio_fildes = bc->fd;
+		if (be->miovcnt != 0) {
+			iocb->aio_buf = (uintptr_t)be->miov;
+			iocb->aio_nbytes = be->miovcnt;
+		} else {
+			iocb->aio_buf = (uintptr_t)br->iov;
+			iocb->aio_nbytes = br->iovcnt;
+		}
+		iocb->aio_offset = br->offset + bc->sub_file_start_lba;
+		iocb->aio_flags = IOCB_FLAG_RESFD;
+		iocb->aio_resfd = bc->aio_efd;
+
+		iocbs[n++] = iocb;
+		if (n == BLOCKIF_AIO_BATCH) {
+			blockif_aio_flush(bc, iocbs, n);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		blockif_aio_flush(bc, iocbs, n);
+}
+
+/* Reap completed aio requests, return the number reaped */
+static int
+blockif_aio_reap(struct blockif_ctxt *bc, long min_nr, struct timespec *ts)
+{
+	struct io_event events[BLOCKIF_AIO_BATCH];
+	struct blockif_elem *be;
+	struct blockif_req *br;
+	int i, n, err;
+
+	n = io_getevents(bc->aio_ctx, min_nr, BLOCKIF_AIO_BATCH, events, ts);
+	if (n <= 0)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		be = (struct blockif_elem *)(uintptr_t)events[i].data;
+		br = be->req;
+		err = 0;
+		if ((int64_t)events[i].res < 0)
+			err = -(int64_t)events[i].res;
+		if (be->miovcnt != 0) {
+			blockif_merge_done(be, err ? 0 : events[i].res, err);
+			continue;
+		}
+		if (err == 0)
+			br->resid -= events[i].res;
+		be->status = BST_DONE;
+		(*br->callback)(br, err);
+	}
+
+	pthread_mutex_lock(&bc->mtx);
+	for (i = 0; i < n; i++) {
+		be = (struct blockif_elem *)(uintptr_t)events[i].data;
+		blockif_complete_merged(bc, be);
+	}
+	bc->aio_inflight -= n;
+	/* requests blocked behind the completed ones may go now */
+	blockif_aio_submit(bc);
+	pthread_cond_signal(&bc->cond);
+	pthread_mutex_unlock(&bc->mtx);
+
+	return n;
+}
+
+static void
+blockif_aio_handler(int fd, enum ev_type type, void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct timespec ts = { 0, 0 };
+	eventfd_t val;
+
+	eventfd_read(fd, &val);
+	while (blockif_aio_reap(bc, 0, &ts) == BLOCKIF_AIO_BATCH)
+		;
+}
+
+static int
+blockif_aio_init(struct blockif_ctxt *bc)
+{
+	bc->aio_ctx = 0;
+	if (io_setup(BLOCKIF_MAXREQ, &bc->aio_ctx) < 0) {
+		WPRINTF(("blockif: io_setup failed %d\n", errno));
+		return -1;
+	}
+
+	bc->aio_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (bc->aio_efd < 0) {
+		WPRINTF(("blockif: eventfd failed %d\n", errno));
+		io_destroy(bc->aio_ctx);
+		return -1;
+	}
+
+	/* completions of all disks share a loop, away from the tty and timers */
+	bc->aio_evp = mevent_add_loop(mevent_loop_get("blockif"),
+				      bc->aio_efd, EVF_READ,
+				      blockif_aio_handler, bc);
+	if (bc->aio_evp == NULL) {
+		WPRINTF(("blockif: failed to add aio event\n"));
+		close(bc->aio_efd);
+		io_destroy(bc->aio_ctx);
+		return -1;
+	}
+
+	bc->aio = 1;
+	return 0;
+}
+
+static void
+blockif_aio_deinit(struct blockif_ctxt *bc)
+{
+	struct timespec ts = { 0, 10000000 };
+	int inflight;
+
+	mevent_delete_wait(bc->aio_evp);
+
+	/* complete whatever is still owned by the kernel */
+	for (;;) {
+		pthread_mutex_lock(&bc->mtx);
+		inflight = bc->aio_inflight;
+		pthread_mutex_unlock(&bc->mtx);
+		if (inflight == 0)
+			break;
+		blockif_aio_reap(bc, 1, &ts);
+	}
+
+	close(bc->aio_efd);
+	io_destroy(bc->aio_ctx);
+	bc->aio = 0;
+}
+
+/*
+ * Issue vectored I/O directly on the request iovecs, without copying.
+ * Each call covers at most MAXPHYS bytes and BLOCKIF_SEG_MAX segments,
+ * splitting a segment that crosses the MAXPHYS boundary.
+ */
+static int
+blockif_rw_iov(struct blockif_ctxt *bc, const struct iovec *biov, int iovcnt,
+	       off_t offset, ssize_t *resid, int write)
+{
+	struct iovec iov[BLOCKIF_SEG_MAX];
+	ssize_t clen, len, ret;
+	size_t voff;
+	off_t off;
+	int i, n;
+
+	i = 0;
+	voff = 0;
+	off = offset + bc->sub_file_start_lba;
+	while (*resid > 0 && i < iovcnt) {
+		n = 0;
+		len = 0;
+		while (i < iovcnt && n < BLOCKIF_SEG_MAX && len < MAXPHYS) {
+			clen = MIN(biov[i].iov_len - voff, MAXPHYS - len);
+			iov[n].iov_base = biov[i].iov_base + voff;
+			iov[n].iov_len = clen;
+			n++;
+			len += clen;
+			if (clen < biov[i].iov_len - voff)
+				voff += clen;
+			else {
+				i++;
+				voff = 0;
+			}
+		}
+
+		if (write)
+			ret = pwritev(bc->fd, iov, n, off);
+		else
+			ret = preadv(bc->fd, iov, n, off);
+		if (ret < 0)
+			return errno;
+
+		*resid -= ret;
+		off += ret;
+		/* short transfer, e.g. end of file */
+		if (ret < len)
+			break;
+	}
+	return 0;
+}
+
+static void
+blockif_proc_merged(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_elem *tbe;
+	ssize_t len, resid;
+	int err;
+
+	len = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->next_merged)
+		len += tbe->req->resid;
+
+	resid = len;
+	if (be->op == BOP_WRITE && bc->rdonly)
+		err = EROFS;
+	else
+		err = blockif_rw_iov(bc, be->miov, be->miovcnt,
+				     be->req->offset, &resid,
+				     be->op == BOP_WRITE);
+
+	blockif_merge_done(be, len - resid, err);
+}
+
 static void
 blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 {
@@ -223,19 +754,20 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 	ssize_t clen, len, off, boff, voff;
 	int i, err;
 
+	if (be->miovcnt != 0) {
+		blockif_proc_merged(bc, be);
+		return;
+	}
+
 	br = be->req;
-	if (br->iovcnt <= 1)
+	if (blockif_aligned(bc, br))
 		buf = NULL;
 	err = 0;
 	switch (be->op) {
 	case BOP_READ:
 		if (buf == NULL) {
-			len = preadv(bc->fd, br->iov, br->iovcnt,
-				     br->offset + bc->sub_file_start_lba);
-			if (len < 0)
-				err = errno;
-			else
-				br->resid -= len;
+			err = blockif_rw_iov(bc, br->iov, br->iovcnt,
+					     br->offset, &br->resid, 0);
 			break;
 		}
 		i = 0;
@@ -271,12 +803,8 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 			break;
 		}
 		if (buf == NULL) {
-			len = pwritev(bc->fd, br->iov, br->iovcnt,
-				      br->offset + bc->sub_file_start_lba);
-			if (len < 0)
-				err = errno;
-			else
-				br->resid -= len;
+			err = blockif_rw_iov(bc, br->iov, br->iovcnt,
+					     br->offset, &br->resid, 1);
 			break;
 		}
 		i = 0;
@@ -346,10 +874,12 @@ blockif_thr(void *arg)
 	uint8_t *buf;
 
 	bc = arg;
-	if (bc->isgeom)
-		buf = malloc(MAXPHYS);
-	else
-		buf = NULL;
+	/* bounce buffer for requests not meeting O_DIRECT alignment */
+	buf = NULL;
+	if (bc->bounce)
+		buf = bc->bounce +
+			(size_t)__sync_fetch_and_add(&bc->bounce_next, 1) *
+			MAXPHYS;
 	t = pthread_self();
 
 	pthread_mutex_lock(&bc->mtx);
@@ -358,7 +888,10 @@ blockif_thr(void *arg)
 			pthread_mutex_unlock(&bc->mtx);
 			blockif_proc(bc, be, buf);
 			pthread_mutex_lock(&bc->mtx);
-			blockif_complete(bc, be);
+			blockif_complete_merged(bc, be);
+			/* while plugged, blockif_unplug() submits the batch */
+			if (bc->aio && !bc->plugged)
+				blockif_aio_submit(bc);
 		}
 		/* Check ctxt status here to see if exit requested */
 		if (bc->closing)
@@ -367,8 +900,6 @@ blockif_thr(void *arg)
 	}
 	pthread_mutex_unlock(&bc->mtx);
 
-	if (buf)
-		free(buf);
 	pthread_exit(NULL);
 	return NULL;
 }
@@ -453,19 +984,72 @@ sub_file_unlock(struct blockif_ctxt *bc)
 	}
 }
 
+/*
+ * Set up the request queues and start the i/o threads of a context.
+ * Without the bounce buffers unaligned requests would reach the O_DIRECT
+ * fd as they are and fail, so the context fails without them.
+ */
+static int
+blockif_start(struct blockif_ctxt *bc, const char *ident, int aio)
+{
+	char tname[MAXCOMLEN + 1];
+	int i;
+
+	pthread_mutex_init(&bc->mtx, NULL);
+	pthread_cond_init(&bc->cond, NULL);
+	TAILQ_INIT(&bc->freeq);
+	TAILQ_INIT(&bc->pendq);
+	TAILQ_INIT(&bc->busyq);
+	for (i = 0; i < BLOCKIF_HASH_SIZE; i++) {
+		LIST_INIT(&bc->start_hash[i]);
+		LIST_INIT(&bc->end_hash[i]);
+	}
+	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+		bc->reqs[i].status = BST_FREE;
+		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
+	}
+
+	bc->nthr = BLOCKIF_NUMTHR;
+	if (aio) {
+		if (blockif_aio_init(bc) == 0)
+			bc->nthr = BLOCKIF_AIO_NUMTHR;
+		else
+			WPRINTF(("blockif: fall back to aio=threads\n"));
+	}
+
+	bc->bounce = NULL;
+	bc->bounce_next = 0;
+	if (bc->align > 1 && posix_memalign((void **)&bc->bounce,
+			getpagesize(), (size_t)bc->nthr * MAXPHYS) != 0) {
+		WPRINTF(("blockif: failed to allocate bounce buffers\n"));
+		bc->bounce = NULL;
+		if (bc->aio)
+			blockif_aio_deinit(bc);
+		pthread_cond_destroy(&bc->cond);
+		pthread_mutex_destroy(&bc->mtx);
+		return -1;
+	}
+
+	for (i = 0; i < bc->nthr; i++) {
+		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
+		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
+		pthread_setname_np(bc->btid[i], tname);
+	}
+
+	return 0;
+}
 
 struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident)
 {
-	char tname[MAXCOMLEN + 1];
 	/* char name[MAXPATHLEN]; */
 	char *nopt, *xopts, *cp;
 	struct blockif_ctxt *bc;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
-	int extra, fd, i, sectsz;
-	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
+	int extra, fd, sectsz, lsectsz;
+	int nocache, sync, ro, candelete, geom, ssopt, pssopt, aio;
 	long sz;
 	long long b;
 	int err_code = -1;
@@ -479,6 +1063,7 @@ blockif_open(const char *optstr, const char *ident)
 	nocache = 0;
 	sync = 0;
 	ro = 0;
+	aio = 0;
 	sub_file_assign = 0;
 
 	/*
@@ -500,6 +1085,10 @@ blockif_open(const char *optstr, const char *ident)
 			sync = 1;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strcmp(cp, "aio=native"))
+			aio = 1;
+		else if (!strcmp(cp, "aio=threads"))
+			aio = 0;
 		else if (sscanf(cp, "sectorsize=%d/%d", &ssopt, &pssopt) == 2)
 			;
 		else if (sscanf(cp, "sectorsize=%d", &ssopt) == 1)
@@ -513,7 +1102,11 @@ blockif_open(const char *optstr, const char *ident)
 		}
 	}
 
-	/* enforce a write-through policy by default */
+	/*
+	 * enforce a write-through policy by default, aio=native relies on
+	 * the O_DIRECT this implies to keep io_submit from completing the
+	 * request inline, on the notify path with bc->mtx held
+	 */
 	nocache = 1;
 	sync = 1;
 
@@ -544,7 +1137,7 @@ blockif_open(const char *optstr, const char *ident)
 	 * Deal with raw devices
 	 */
 	size = sbuf.st_size;
-	sectsz = DEV_BSIZE;
+	sectsz = lsectsz = DEV_BSIZE;
 	psectsz = psectoff = 0;
 	candelete = geom = 0;
 
@@ -567,8 +1160,11 @@ blockif_open(const char *optstr, const char *ident)
 		}
 		DPRINTF(("block partition size is 0x%lx\n", size));
 
-		/* get sector size, 512 on Linux */
-		sectsz = DEV_BSIZE;
+		/* get logical sector size, 4K on 4K native devices */
+		err_code = ioctl(fd, BLKSSZGET, &sectsz);
+		if (err_code || sectsz < DEV_BSIZE)
+			sectsz = DEV_BSIZE;
+		lsectsz = sectsz;
 		DPRINTF(("block partition sector size is 0x%x\n", sectsz));
 
 		/* get physical sector size */
@@ -644,24 +1240,16 @@ blockif_open(const char *optstr, const char *ident)
 	bc->isgeom = geom;
 	bc->candelete = candelete;
 	bc->rdonly = ro;
+	/* O_DIRECT needs at least the logical block size of the device */
+	bc->align = (extra & O_DIRECT) ? MAX(sectsz, lsectsz) : 1;
 	bc->size = size;
 	bc->sectsz = sectsz;
 	bc->psectsz = psectsz;
 	bc->psectoff = psectoff;
-	pthread_mutex_init(&bc->mtx, NULL);
-	pthread_cond_init(&bc->cond, NULL);
-	TAILQ_INIT(&bc->freeq);
-	TAILQ_INIT(&bc->pendq);
-	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
-		bc->reqs[i].status = BST_FREE;
-		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
-	}
-
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
-		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
-		pthread_setname_np(bc->btid[i], tname);
+	if (blockif_start(bc, ident, aio) < 0) {
+		sub_file_unlock(bc);
+		free(bc);
+		goto err;
 	}
 
 	return bc;
@@ -671,6 +1259,53 @@ err:
 	return NULL;
 }
 
+/*
+ * Create another submission context on the backing file of bc, with its
+ * own request queues, i/o threads and aio context. Used by emulations
+ * with multiple request queues. The clone must be closed before bc.
+ */
+struct blockif_ctxt *
+blockif_clone(struct blockif_ctxt *bc, const char *ident)
+{
+	struct blockif_ctxt *nbc;
+
+	assert(bc->magic == BLOCKIF_SIG);
+
+	nbc = calloc(1, sizeof(struct blockif_ctxt));
+	if (nbc == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	/* the dup'ed fd shares the open file description and its lock */
+	nbc->fd = dup(bc->fd);
+	if (nbc->fd < 0) {
+		warn("Could not dup backing file");
+		free(nbc);
+		return NULL;
+	}
+
+	nbc->magic = BLOCKIF_SIG;
+	nbc->isblk = bc->isblk;
+	nbc->isgeom = bc->isgeom;
+	nbc->candelete = bc->candelete;
+	nbc->rdonly = bc->rdonly;
+	nbc->align = bc->align;
+	nbc->size = bc->size;
+	nbc->sub_file_assign = 0;	/* lock is released by the parent */
+	nbc->sub_file_start_lba = bc->sub_file_start_lba;
+	nbc->sectsz = bc->sectsz;
+	nbc->psectsz = bc->psectsz;
+	nbc->psectoff = bc->psectoff;
+	if (blockif_start(nbc, ident, bc->aio) < 0) {
+		close(nbc->fd);
+		free(nbc);
+		return NULL;
+	}
+
+	return nbc;
+}
+
 static int
 blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
@@ -685,8 +1320,12 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 * Enqueue and inform the block i/o thread
 		 * that there is work available
 		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->cond);
+		if (blockif_enqueue(bc, breq, op)) {
+			if (!blockif_aio_op(bc, breq, op))
+				pthread_cond_signal(&bc->cond);
+			else if (!bc->plugged)
+				blockif_aio_submit(bc);
+		}
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -729,6 +1368,32 @@ blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DELETE);
 }
 
+/*
+ * While plugged, aio requests are only queued; they are submitted in
+ * one batch on the final unplug.
+ */
+void
+blockif_plug(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+
+	pthread_mutex_lock(&bc->mtx);
+	bc->plugged++;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+
+	pthread_mutex_lock(&bc->mtx);
+	assert(bc->plugged > 0);
+	if (--bc->plugged == 0 && bc->aio)
+		blockif_aio_submit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
@@ -769,6 +1434,15 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		return -1;
 	}
 
+	/*
+	 * Requests owned by the kernel aio context can't be interrupted;
+	 * they complete through the normal callback path.
+	 */
+	if (be->aio) {
+		pthread_mutex_unlock(&bc->mtx);
+		return -EBUSY;
+	}
+
 	/*
 	 * Interrupt the processing thread to force it return
 	 * prematurely via it's normal callback path.
@@ -822,9 +1496,13 @@ blockif_close(struct blockif_ctxt *bc)
 	bc->closing = 1;
 	pthread_mutex_unlock(&bc->mtx);
 	pthread_cond_broadcast(&bc->cond);
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
+	for (i = 0; i < bc->nthr; i++)
 		pthread_join(bc->btid[i], &jval);
 
+	if (bc->aio)
+		blockif_aio_deinit(bc);
+	free(bc->bounce);
+
 	/* XXX Cancel queued i/o's ??? */
 
 	/*
@@ -38,6 +38,7 @@
 
 #include "dm.h"
 #include "pci_core.h"
+#include "mem.h"
 #include "ahci.h"
 #include "block_if.h"
 #include "ata.h"
@@ -1842,6 +1843,9 @@ ahci_handle_port(struct ahci_port *p)
 	if (!(p->cmd & AHCI_P_CMD_ST))
 		return;
 
+	if (p->bctx)
+		blockif_plug(p->bctx);
+
 	/*
 	 * Search for any new commands to issue ignoring those that
 	 * are already in-flight.  Stop if device is busy or in error.
@@ -1857,6 +1861,9 @@ ahci_handle_port(struct ahci_port *p)
 			ahci_handle_slot(p, p->ccs);
 		}
 	}
+
+	if (p->bctx)
+		blockif_unplug(p->bctx);
 }
 
 /*
@@ -2417,6 +2424,8 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 	p = MIN(ahci_dev->ports, 16);
 	p = flsl(p) - ((p & (p - 1)) ? 0 : 1);
 	pci_emul_add_msicap(dev, 1 << p);
+	/* the register handlers take ahci_dev->mtx */
+	dev->bar[5].mem_flags = MEM_F_MT_SAFE;
 	pci_emul_alloc_bar(dev, 5, PCIBAR_MEM32,
 	    AHCI_OFFSET + ahci_dev->ports * AHCI_STEP);
 
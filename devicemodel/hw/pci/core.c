@@ -38,6 +38,7 @@
 #include "vmmapi.h"
 #include "acpi.h"
 #include "inout.h"
+#include "ioeventfd.h"
 #include "ioapic.h"
 #include "mem.h"
 #include "pci_core.h"
@@ -471,8 +472,11 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 			iop.handler = pci_emul_io_handler;
 			iop.arg = dev;
 			error = register_inout(&iop);
-		} else
+		} else {
+			ioeventfd_unregister_range(REQ_PORTIO, iop.port,
+				iop.size);
 			error = unregister_inout(&iop);
+		}
 		break;
 	case PCIBAR_MEM32:
 	case PCIBAR_MEM64:
@@ -481,13 +485,15 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 		mr.base = dev->bar[idx].addr;
 		mr.size = dev->bar[idx].size;
 		if (registration) {
-			mr.flags = MEM_F_RW;
+			mr.flags = MEM_F_RW | dev->bar[idx].mem_flags;
 			mr.handler = pci_emul_mem_handler;
 			mr.arg1 = dev;
 			mr.arg2 = idx;
 			error = register_mem(&mr);
-		} else
+		} else {
+			ioeventfd_unregister_range(REQ_MMIO, mr.base, mr.size);
 			error = unregister_mem(&mr);
+		}
 		break;
 	default:
 		error = EINVAL;
@@ -31,6 +31,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 
 #include "vmmapi.h"
 #include "acpi.h"
@@ -63,20 +66,24 @@ static struct lpc_uart_vdev {
 	int	iobase;
 	int	irq;
 	int	enabled;
+	bool	hv;		/* let the hypervisor emulate the registers */
+	struct vuart_ring_page *ring;	/* set once the hypervisor does */
 } lpc_uart_vdev[LPC_UART_NUM];
 
 static const char *lpc_uart_names[LPC_UART_NUM] = { "COM1", "COM2" };
 
 /*
  * LPC device configuration is in the following form:
- * <lpc_device_name>[,<options>]
+ * <lpc_device_name>[,<options>][,hv]
  * For e.g. "com1,stdio"
+ * A trailing "hv" lets the hypervisor emulate the COM port registers and
+ * only pass the data through, e.g. "com1,stdio,hv"
  */
 int
 lpc_device_parse(const char *opts)
 {
 	int unit, error;
-	char *str, *cpy, *lpcdev;
+	char *str, *cpy, *lpcdev, *hv;
 
 	error = -1;
 	str = cpy = strdup(opts);
@@ -84,6 +91,14 @@ lpc_device_parse(const char *opts)
 	if (lpcdev != NULL) {
 		for (unit = 0; unit < LPC_UART_NUM; unit++) {
 			if (strcasecmp(lpcdev, lpc_uart_names[unit]) == 0) {
+				hv = str ? strrchr(str, ',') : NULL;
+				if (hv != NULL && strcmp(hv + 1, "hv") == 0) {
+					*hv = '\0';
+					lpc_uart_vdev[unit].hv = true;
+				} else if (str && strcmp(str, "hv") == 0) {
+					str = NULL;
+					lpc_uart_vdev[unit].hv = true;
+				}
 				lpc_uart_vdev[unit].opts = str;
 				error = 0;
 				goto done;
@@ -152,6 +167,66 @@ lpc_uart_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 	return 0;
 }
 
+static void
+lpc_uart_ring_notify(void *arg)
+{
+	vm_notify_vuart((struct vmctx *)arg);
+}
+
+/*
+ * Hand the COM port to the hypervisor. Returns 0 if it took over, the
+ * port is emulated here otherwise.
+ */
+static int
+lpc_uart_hv_init(struct vmctx *ctx, int unit)
+{
+	struct lpc_uart_vdev *lpc_uart = &lpc_uart_vdev[unit];
+	struct vuart_ring_page *ring;
+	int fd;
+
+	if (!lpc_uart->hv)
+		return -1;
+
+	/*
+	 * A page of its own, which VHM pins for as long as the hypervisor
+	 * may write it, see IC_SETUP_VUART. Unmapping it here is safe once
+	 * VHM has it.
+	 */
+	ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ring == MAP_FAILED)
+		return -1;
+
+	/* signaled by VHM when the hypervisor wants the ring looked at */
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0) {
+		munmap(ring, sizeof(*ring));
+		return -1;
+	}
+
+	if (vm_setup_vuart(ctx, lpc_uart->iobase, lpc_uart->irq,
+			(uint64_t)ring, fd) != 0) {
+		fprintf(stderr, "hypervisor vuart not available for %s\n",
+			lpc_uart_names[unit]);
+		close(fd);
+		munmap(ring, sizeof(*ring));
+		return -1;
+	}
+
+	if (uart_set_hv_ring(lpc_uart->uart, ring, fd, lpc_uart_ring_notify,
+			ctx) != 0) {
+		/* the hypervisor owns the ports now, no way back */
+		fprintf(stderr, "failed to connect vuart ring of %s\n",
+			lpc_uart_names[unit]);
+		close(fd);
+		munmap(ring, sizeof(*ring));
+		return -2;
+	}
+
+	lpc_uart->ring = ring;
+	return 0;
+}
+
 static void
 lpc_deinit(struct vmctx *ctx)
 {
@@ -168,17 +243,22 @@ lpc_deinit(struct vmctx *ctx)
 		if (lpc_uart->enabled == 0)
 			continue;
 
-		bzero(&iop, sizeof(struct inout_port));
-		iop.name = name;
-		iop.port = lpc_uart->iobase;
-		iop.size = UART_IO_BAR_SIZE;
-		iop.flags = IOPORT_F_INOUT;
-		unregister_inout(&iop);
+		if (lpc_uart->ring == NULL) {
+			bzero(&iop, sizeof(struct inout_port));
+			iop.name = name;
+			iop.port = lpc_uart->iobase;
+			iop.size = UART_IO_BAR_SIZE;
+			iop.flags = IOPORT_F_INOUT;
+			unregister_inout(&iop);
+		}
 
 		uart_release_backend(lpc_uart->uart, lpc_uart->opts);
 		uart_deinit(lpc_uart->uart);
 		uart_legacy_dealloc(unit);
 		lpc_uart->uart = NULL;
+		if (lpc_uart->ring != NULL)
+			munmap(lpc_uart->ring, sizeof(*lpc_uart->ring));
+		lpc_uart->ring = NULL;
 		lpc_uart->enabled = 0;
 	}
 }
@@ -222,6 +302,18 @@ lpc_init(struct vmctx *ctx)
 			goto init_failed;
 		}
 
+		error = lpc_uart_hv_init(ctx, unit);
+		if (error == 0) {
+			/* no inout handler, the accesses never reach us */
+			lpc_uart->enabled = 1;
+			continue;
+		} else if (error == -2) {
+			uart_release_backend(lpc_uart->uart, lpc_uart->opts);
+			uart_deinit(lpc_uart->uart);
+			uart_legacy_dealloc(unit);
+			goto init_failed;
+		}
+
 		bzero(&iop, sizeof(struct inout_port));
 		iop.name = name;
 		iop.port = lpc_uart->iobase;
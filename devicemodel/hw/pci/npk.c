@@ -92,6 +92,7 @@
 
 #include "dm.h"
 #include "vmmapi.h"
+#include "mem.h"
 #include "pci_core.h"
 #include "npk.h"
 
@@ -262,7 +263,11 @@ static int pci_npk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	sw_bar_base = *(uint32_t *)&h_cfg[PCIR_BAR(2)] & PCIM_BAR_MEM_BASE;
 	sw_bar_base += NPK_MSTR_TO_MEM_SZ(m_off);
 
-	/* allocate the bar#0 (CSR)*/
+	/*
+	 * allocate the bar#0 (CSR), writes to it only update npk_csr and can
+	 * wait in the coalesced MMIO ring until the next synchronous exit
+	 */
+	dev->bar[0].mem_flags = MEM_F_COALESCED;
 	error = pci_emul_alloc_bar(dev, 0, PCIBAR_MEM64, NPK_CSR_MTB_BAR_SZ);
 	if (error) {
 		WPRINTF(("Cannot alloc bar#0 for the guest\n"));
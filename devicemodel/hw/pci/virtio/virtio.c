@@ -25,13 +25,18 @@
  */
 
 #include <sys/uio.h>
+#include <sys/eventfd.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
 #include <pthread.h>
 
 #include "dm.h"
 #include "pci_core.h"
 #include "virtio.h"
+#include "mevent.h"
+#include "ioeventfd.h"
 
 /*
  * Functions for dealing with generalized "virtual devices" as
@@ -66,9 +71,134 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	for (i = 0; i < vops->nvq; i++) {
 		queues[i].base = base;
 		queues[i].num = i;
+		queues[i].posted_fd = -1;
 	}
 }
 
+static void
+virtio_posted_notify_handler(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vq_info *vq = arg;
+	struct virtio_base *base = vq->base;
+	eventfd_t cnt;
+
+	if (eventfd_read(fd, &cnt) < 0)
+		return;
+
+	/* no base lock, the device locks its queues itself */
+	if (vq->notify)
+		(*vq->notify)(DEV_STRUCT(base), vq);
+	else if (base->vops->qnotify)
+		(*base->vops->qnotify)(DEV_STRUCT(base), vq);
+}
+
+/* Post the notifies of queue i at the current address of its BAR */
+static int
+virtio_posted_notify_register(struct virtio_base *base, int i, int fd)
+{
+	struct pci_vdev *dev = base->dev;
+	struct pcibar *bar;
+
+	if (base->negotiated_caps & VIRTIO_F_VERSION_1) {
+		bar = &dev->bar[base->modern_mmio_bar_idx];
+		return bar->type != PCIBAR_MEM64 ? -ENODEV :
+			ioeventfd_register(REQ_MMIO, bar->addr +
+			VIRTIO_CAP_NOTIFY_OFFSET +
+			i * VIRTIO_MODERN_NOTIFY_OFF_MULT, 0,
+			IOEVENTFD_NOMATCH, fd);
+	}
+
+	bar = &dev->bar[base->legacy_pio_bar_idx];
+	return bar->type != PCIBAR_IO ? -ENODEV :
+		ioeventfd_register(REQ_PORTIO, bar->addr +
+		VIRTIO_CR_QNOTIFY, 2, i, fd);
+}
+
+/*
+ * A notify of a posting queue reached the emulation: the BAR moved, or
+ * its decoding was toggled, and the posted range went with the old
+ * mapping. Post again at the current address.
+ */
+static void
+virtio_posted_notify_rebind(struct virtio_base *base,
+			    struct virtio_vq_info *vq)
+{
+	if (vq->posted_fd >= 0)
+		virtio_posted_notify_register(base, vq->num, vq->posted_fd);
+}
+
+/*
+ * Register the notify address of every queue as a posted write. The BARs
+ * are only known to be programmed once the driver is up, so this is done
+ * on DRIVER_OK and undone on reset. Each device gets a loop of its own,
+ * so a busy device does not hold off the notifies of the others.
+ */
+static void
+virtio_posted_notify_start(struct virtio_base *base)
+{
+	struct pci_vdev *dev = base->dev;
+	struct virtio_vq_info *vq;
+	struct mevent_loop *loop;
+	char name[16];
+	int i, fd;
+
+	snprintf(name, sizeof(name), "vq-%d:%d.%d", dev->bus, dev->slot,
+		 dev->func);
+	loop = mevent_loop_get(name);
+
+	for (vq = base->queues, i = 0; i < base->vops->nvq; vq++, i++) {
+		if (vq->posted_fd >= 0)
+			continue;
+
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		if (virtio_posted_notify_register(base, i, fd) != 0) {
+			close(fd);
+			return;
+		}
+
+		vq->posted_mev = mevent_add_loop(loop, fd, EVF_READ,
+				virtio_posted_notify_handler, vq);
+		if (vq->posted_mev == NULL) {
+			ioeventfd_unregister(fd);
+			close(fd);
+			return;
+		}
+		vq->posted_fd = fd;
+	}
+}
+
+void
+virtio_posted_notify_stop(struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	for (vq = base->queues, i = 0; i < base->vops->nvq; vq++, i++) {
+		if (vq->posted_fd < 0)
+			continue;
+		ioeventfd_unregister(vq->posted_fd);
+		/* the handler takes the base lock, never wait with it held */
+		mevent_delete_wait(vq->posted_mev);
+		close(vq->posted_fd);
+		vq->posted_mev = NULL;
+		vq->posted_fd = -1;
+	}
+}
+
+/*
+ * A reset by the guest drops the posted notifies. This runs after the
+ * register write, once the base lock is released again.
+ */
+static void
+virtio_posted_notify_reset(struct virtio_base *base)
+{
+	if ((base->flags & VIRTIO_POSTED_NOTIFY) && base->status == 0)
+		virtio_posted_notify_stop(base);
+}
+
 /*
  * Reset device (device-wide).  This erases all queues, i.e.,
  * all the queues become invalid (though we don't wipe out the
@@ -92,6 +222,7 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->flags = 0;
 		vq->last_avail = 0;
 		vq->save_used = 0;
+		vq->used_pending = 0;
 		vq->pfn = 0;
 		vq->msix_idx = VIRTIO_MSI_NO_VECTOR;
 		vq->gpa_desc[0] = 0;
@@ -214,6 +345,7 @@ virtio_vq_init(struct virtio_base *base, uint32_t pfn)
 	vq->flags = VQ_ALLOC;
 	vq->last_avail = 0;
 	vq->save_used = 0;
+	vq->used_pending = 0;
 }
 
 /*
@@ -256,6 +388,7 @@ virtio_vq_enable(struct virtio_base *base)
 	vq->flags = VQ_ALLOC;
 	vq->last_avail = 0;
 	vq->save_used = 0;
+	vq->used_pending = 0;
 
 	/* Mark queue as enabled. */
 	vq->enabled = true;
@@ -487,6 +620,55 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	vuh->idx = uidx;
 }
 
+/*
+ * Same as vq_relchain() but leave used->idx alone, so that a batch of
+ * chains becomes visible to the guest at once in vq_relchain_publish().
+ */
+void
+vq_relchain_prepare(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
+{
+	uint16_t uidx, mask;
+	volatile struct vring_used *vuh;
+	volatile struct virtio_used *vue;
+
+	mask = vq->qsize - 1;
+	vuh = vq->used;
+
+	uidx = vuh->idx + vq->used_pending++;
+	vue = &vuh->ring[uidx & mask];
+	vue->idx = idx;
+	vue->tlen = iolen;
+}
+
+void
+vq_relchain_publish(struct virtio_vq_info *vq)
+{
+	if (vq->used_pending == 0)
+		return;
+
+	/* ring entries must be visible before the index update */
+	wmb();
+	vq->used->idx += vq->used_pending;
+	vq->used_pending = 0;
+}
+
+void
+vq_set_notify(struct virtio_vq_info *vq, int enable)
+{
+	if (vq->base->negotiated_caps & VIRTIO_RING_F_EVENT_IDX) {
+		/*
+		 * The guest kicks when avail->idx moves past avail_event.
+		 * Leaving a stale value in place while disabled means it
+		 * won't kick again until we catch up.
+		 */
+		if (enable)
+			VQ_AVAIL_EVENT_IDX(vq) = vq->last_avail;
+	} else if (enable)
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	else
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
 /*
  * Driver has finished processing "available" chains and calling
  * vq_relchain on each one.  If driver used all the available
@@ -838,6 +1020,7 @@ bad:
 			goto done;
 		}
 		vq = &base->queues[value];
+		virtio_posted_notify_rebind(base, vq);
 		if (vq->notify)
 			(*vq->notify)(DEV_STRUCT(base), vq);
 		else if (vops->qnotify)
@@ -851,6 +1034,9 @@ bad:
 		base->status = value;
 		if (vops->set_status)
 			(*vops->set_status)(DEV_STRUCT(base), value);
+		if ((base->flags & VIRTIO_POSTED_NOTIFY) &&
+		    (value & VIRTIO_CR_STATUS_DRIVER_OK))
+			virtio_posted_notify_start(base);
 		if (value == 0)
 			(*vops->reset)(DEV_STRUCT(base));
 		break;
@@ -1253,6 +1439,9 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 		base->status = value & 0xff;
 		if (vops->set_status)
 			(*vops->set_status)(DEV_STRUCT(base), value);
+		if ((base->flags & VIRTIO_POSTED_NOTIFY) &&
+		    (base->status & VIRTIO_CR_STATUS_DRIVER_OK))
+			virtio_posted_notify_start(base);
 		if (base->status == 0)
 			(*vops->reset)(DEV_STRUCT(base));
 		break;
@@ -1428,6 +1617,7 @@ virtio_notify_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 	}
 
 	vq = &base->queues[idx];
+	virtio_posted_notify_rebind(base, vq);
 	if (vq->notify)
 		(*vq->notify)(DEV_STRUCT(base), vq);
 	else if (vops->qnotify)
@@ -1657,18 +1847,21 @@ virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 	if (baridx == base->legacy_pio_bar_idx) {
 		virtio_pci_legacy_write(ctx, vcpu, dev, baridx,
 			offset, size, value);
+		virtio_posted_notify_reset(base);
 		return;
 	}
 
 	if (baridx == base->modern_mmio_bar_idx) {
 		virtio_pci_modern_mmio_write(ctx, vcpu, dev, baridx,
 			offset, size, value);
+		virtio_posted_notify_reset(base);
 		return;
 	}
 
 	if (baridx == base->modern_pio_bar_idx) {
 		virtio_pci_modern_pio_write(ctx, vcpu, dev, baridx,
 			offset, size, value);
+		virtio_posted_notify_reset(base);
 		return;
 	}
 
@@ -1762,6 +1955,7 @@ virtio_pci_modern_cfgwrite(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		else
 			fprintf(stderr, "%s: cfgwrite unexpected baridx %d\r\n",
 				base->vops->name, cfg->cap.bar);
+		virtio_posted_notify_reset(base);
 
 		return 0;
 	}
@@ -41,6 +41,7 @@
 #include "block_if.h"
 
 #define VIRTIO_BLK_RINGSZ	64
+#define VIRTIO_BLK_MAX_QUEUES	16
 
 #define VIRTIO_BLK_S_OK	0
 #define VIRTIO_BLK_S_IOERR	1
@@ -53,6 +54,7 @@
 #define	VIRTIO_BLK_F_BLK_SIZE	(1 << 6)	/* cfg block size valid */
 #define	VIRTIO_BLK_F_FLUSH	(1 << 9)	/* Cache flush support */
 #define	VIRTIO_BLK_F_TOPOLOGY	(1 << 10)	/* Optimal I/O alignment */
+#define	VIRTIO_BLK_F_MQ		(1 << 12)	/* Multiple request queues */
 
 /*
  * Host capabilities
@@ -84,6 +86,8 @@ struct virtio_blk_config {
 		uint32_t opt_io_size;
 	} topology;
 	uint8_t	writeback;
+	uint8_t	unused;
+	uint16_t num_queues;
 } __attribute__((packed));
 
 /*
@@ -111,21 +115,34 @@ static int virtio_blk_debug;
 struct virtio_blk_ioreq {
 	struct blockif_req req;
 	struct virtio_blk *blk;
+	struct virtio_blk_queue *q;
 	uint8_t *status;
 	uint16_t idx;
 };
 
+/*
+ * Per-request-queue struct. Each queue has its own lock and blockif
+ * context, so queues don't contend with each other.
+ */
+struct virtio_blk_queue {
+	pthread_mutex_t mtx;
+	struct virtio_vq_info *vq;
+	struct blockif_ctxt *bc;
+	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+};
+
 /*
  * Per-device struct
  */
 struct virtio_blk {
 	struct virtio_base base;
 	pthread_mutex_t mtx;
-	struct virtio_vq_info vq;
+	struct virtio_ops ops;
+	struct virtio_vq_info vqs[VIRTIO_BLK_MAX_QUEUES];
+	struct virtio_blk_queue *queues;
+	int num_queues;
 	struct virtio_blk_config cfg;
-	struct blockif_ctxt *bc;
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
 };
 
 static void virtio_blk_reset(void *);
@@ -135,7 +152,7 @@ static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
 
 static struct virtio_ops virtio_blk_ops = {
 	"virtio_blk",		/* our name */
-	1,			/* we support 1 virtqueue */
+	1,			/* 1 virtqueue, more with num_queues= */
 	sizeof(struct virtio_blk_config), /* config reg size */
 	virtio_blk_reset,	/* reset */
 	virtio_blk_notify,	/* device-wide qnotify */
@@ -150,16 +167,21 @@ static void
 virtio_blk_reset(void *vdev)
 {
 	struct virtio_blk *blk = vdev;
+	int i;
 
 	DPRINTF(("virtio_blk: device reset requested !\n"));
+	for (i = 0; i < blk->num_queues; i++)
+		pthread_mutex_lock(&blk->queues[i].mtx);
 	virtio_reset_dev(&blk->base);
+	for (i = blk->num_queues - 1; i >= 0; i--)
+		pthread_mutex_unlock(&blk->queues[i].mtx);
 }
 
 static void
 virtio_blk_done(struct blockif_req *br, int err)
 {
 	struct virtio_blk_ioreq *io = br->param;
-	struct virtio_blk *blk = io->blk;
+	struct virtio_blk_queue *q = io->q;
 
 	/* convert errno into a virtio block error return */
 	if (err == EOPNOTSUPP || err == ENOSYS)
@@ -173,15 +195,16 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	vq_relchain(&blk->vq, io->idx, 1);
-	vq_endchains(&blk->vq, 0);
-	pthread_mutex_unlock(&blk->mtx);
+	pthread_mutex_lock(&q->mtx);
+	vq_relchain(q->vq, io->idx, 1);
+	vq_endchains(q->vq, 0);
+	pthread_mutex_unlock(&q->mtx);
 }
 
 static void
-virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
+virtio_blk_proc(struct virtio_blk *blk, struct virtio_blk_queue *q)
 {
+	struct virtio_vq_info *vq = q->vq;
 	struct virtio_blk_hdr *vbh;
 	struct virtio_blk_ioreq *io;
 	int i, n;
@@ -203,7 +226,7 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 */
 	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
 
-	io = &blk->ios[idx];
+	io = &q->ios[idx];
 	assert((flags[0] & VRING_DESC_F_WRITE) == 0);
 	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
 	vbh = iov[0].iov_base;
@@ -241,14 +264,14 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 
 	switch (type) {
 	case VBH_OP_READ:
-		err = blockif_read(blk->bc, &io->req);
+		err = blockif_read(q->bc, &io->req);
 		break;
 	case VBH_OP_WRITE:
-		err = blockif_write(blk->bc, &io->req);
+		err = blockif_write(q->bc, &io->req);
 		break;
 	case VBH_OP_FLUSH:
 	case VBH_OP_FLUSH_OUT:
-		err = blockif_flush(blk->bc, &io->req);
+		err = blockif_flush(q->bc, &io->req);
 		break;
 	case VBH_OP_IDENT:
 		/* Assume a single buffer */
@@ -269,9 +292,52 @@ static void
 virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_blk *blk = vdev;
+	struct virtio_blk_queue *q = &blk->queues[vq->num];
 
+	pthread_mutex_lock(&q->mtx);
+	blockif_plug(q->bc);
 	while (vq_has_descs(vq))
-		virtio_blk_proc(blk, vq);
+		virtio_blk_proc(blk, q);
+	blockif_unplug(q->bc);
+	pthread_mutex_unlock(&q->mtx);
+}
+
+/*
+ * Parse and strip the "num_queues=<n>" option, which is consumed here
+ * rather than by blockif. Return the number of queues, or -1 if invalid.
+ */
+static int
+virtio_blk_get_num_queues(char *opts)
+{
+	char *cp, *end;
+	long n;
+
+	cp = strstr(opts, ",num_queues=");
+	if (cp == NULL)
+		return 1;
+
+	n = strtol(cp + strlen(",num_queues="), &end, 10);
+	if (n < 1 || n > VIRTIO_BLK_MAX_QUEUES ||
+	    (*end != '\0' && *end != ','))
+		return -1;
+
+	memmove(cp, end, strlen(end) + 1);
+	return n;
+}
+
+static void
+virtio_blk_close_queues(struct virtio_blk *blk)
+{
+	int i;
+
+	/* clones must be closed before the context they were made from */
+	for (i = blk->num_queues - 1; i >= 0; i--) {
+		if (blk->queues[i].bc)
+			blockif_close(blk->queues[i].bc);
+		pthread_mutex_destroy(&blk->queues[i].mtx);
+	}
+	free(blk->queues);
+	blk->queues = NULL;
 }
 
 static int
@@ -282,8 +348,9 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	MD5_CTX mdctx;
 	u_char digest[16];
 	struct virtio_blk *blk;
+	struct virtio_blk_queue *q;
 	off_t size;
-	int i, sectsz, sts, sto;
+	int i, j, sectsz, sts, sto, num_queues;
 	pthread_mutexattr_t attr;
 	int rc;
 
@@ -292,6 +359,13 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return -1;
 	}
 
+	num_queues = virtio_blk_get_num_queues(opts);
+	if (num_queues < 0) {
+		printf("virtio-block: invalid num_queues, max %d\n",
+		       VIRTIO_BLK_MAX_QUEUES);
+		return -1;
+	}
+
 	/*
 	 * The supplied backing file has to exist
 	 */
@@ -309,18 +383,18 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk = calloc(1, sizeof(struct virtio_blk));
 	if (!blk) {
 		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		blockif_close(bctxt);
 		return -1;
 	}
 
-	blk->bc = bctxt;
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
-		struct virtio_blk_ioreq *io = &blk->ios[i];
-
-		io->req.callback = virtio_blk_done;
-		io->req.param = io;
-		io->blk = blk;
-		io->idx = i;
+	blk->queues = calloc(num_queues, sizeof(struct virtio_blk_queue));
+	if (!blk->queues) {
+		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		blockif_close(bctxt);
+		free(blk);
+		return -1;
 	}
+	blk->num_queues = num_queues;
 
 	/* init mutex attribute properly to avoid deadlock */
 	rc = pthread_mutexattr_init(&attr);
@@ -336,12 +410,50 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_blk: pthread_mutex_init failed with "
 					"error %d!\n", rc));
 
+	/*
+	 * Each queue gets its own blockif context, the first one is the
+	 * context opened above and the others are cloned from it.
+	 */
+	for (i = 0; i < num_queues; i++) {
+		q = &blk->queues[i];
+		pthread_mutex_init(&q->mtx, &attr);
+		q->vq = &blk->vqs[i];
+		if (i == 0)
+			q->bc = bctxt;
+		else {
+			snprintf(bident, sizeof(bident), "%d:%d.%d",
+				 dev->slot, dev->func, i);
+			q->bc = blockif_clone(bctxt, bident);
+			if (q->bc == NULL) {
+				virtio_blk_close_queues(blk);
+				free(blk);
+				return -1;
+			}
+		}
+
+		for (j = 0; j < VIRTIO_BLK_RINGSZ; j++) {
+			struct virtio_blk_ioreq *io = &q->ios[j];
+
+			io->req.callback = virtio_blk_done;
+			io->req.param = io;
+			io->blk = blk;
+			io->q = q;
+			io->idx = j;
+		}
+	}
+
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq);
+	blk->ops = virtio_blk_ops;
+	blk->ops.nvq = num_queues;
+	if (num_queues > 1)
+		blk->ops.hv_caps |= VIRTIO_BLK_F_MQ;
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs);
 	blk->base.mtx = &blk->mtx;
+	blk->base.flags |= VIRTIO_POSTED_NOTIFY;
 
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
-	/* blk->vq.vq_notify = we have no per-queue notify */
+	for (i = 0; i < num_queues; i++)
+		blk->vqs[i].qsize = VIRTIO_BLK_RINGSZ;
+	/* blk->vqs[i].vq_notify = we have no per-queue notify */
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -368,6 +480,7 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk->cfg.topology.min_io_size = 0;
 	blk->cfg.topology.opt_io_size = 0;
 	blk->cfg.writeback = 0;
+	blk->cfg.num_queues = num_queues;
 
 	/*
 	 * Should we move some of this into virtio.c?  Could
@@ -380,8 +493,9 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BLOCK);
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
+	/* MSI-X gets one vector per queue plus one for config changes */
 	if (virtio_interrupt_init(&blk->base, virtio_uses_msix())) {
-		blockif_close(blk->bc);
+		virtio_blk_close_queues(blk);
 		free(blk);
 		return -1;
 	}
@@ -392,14 +506,13 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 static void
 virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
-	struct blockif_ctxt *bctxt;
 	struct virtio_blk *blk;
 
 	if (dev->arg) {
 		DPRINTF(("virtio_blk: deinit\n"));
 		blk = (struct virtio_blk *) dev->arg;
-		bctxt = blk->bc;
-		blockif_close(bctxt);
+		virtio_posted_notify_stop(&blk->base);
+		virtio_blk_close_queues(blk);
 		free(blk);
 	}
 }
@@ -37,6 +37,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <openssl/md5.h>
 #include <pthread.h>
 
@@ -50,6 +52,13 @@
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
 
+/*
+ * Max packets handled per wakeup in each direction. Used ring entries
+ * are published to the guest once per batch.
+ */
+#define VIRTIO_NET_RX_BATCH	64
+#define VIRTIO_NET_TX_BATCH	64
+
 /*
  * Host capabilities.  Note that we only offer a few of these.
  */
@@ -72,10 +81,12 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* multiple rx/tx queue pairs */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
-	VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_RING_F_INDIRECT_DESC)
+	VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_RING_F_INDIRECT_DESC | \
+	VIRTIO_RING_F_EVENT_IDX)
 
 /* is address mcast/bcast? */
 #define ETHER_IS_MULTICAST(addr) (*(addr) & 0x01)
@@ -86,16 +97,32 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions. Queue pair i uses rx queue 2 * i and tx queue
+ * 2 * i + 1, the control queue follows the last pair.
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_MAX_QPAIRS	8
+#define VIRTIO_NET_MAXQ		(VIRTIO_NET_MAX_QPAIRS * 2 + 1)
+
+/*
+ * Control queue definitions
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
+
+#define VIRTIO_NET_CTRL_MQ			4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET		0
 
 /*
  * Fixed network header size
@@ -117,43 +144,56 @@ static int virtio_net_debug;
 #define DPRINTF(params) do { if (virtio_net_debug) printf params; } while (0)
 #define WPRINTF(params) (printf params)
 
+/*
+ * Per-queue-pair struct. Each pair has its own backend fd and an i/o
+ * thread which handles both rx from the backend and tx kicks.
+ */
+struct virtio_net_qpair {
+	struct virtio_net *net;
+	int		idx;
+	struct virtio_vq_info *rxq;
+	struct virtio_vq_info *txq;
+
+	int		fd;		/* tap queue fd or netmap fd */
+	int		kickfd;		/* eventfd for tx/exit kicks */
+	pthread_t	tid;
+	pthread_mutex_t	mtx;		/* held while processing */
+	int		rx_ready;
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
+	struct virtio_vq_info queues[VIRTIO_NET_MAXQ];
+	struct virtio_ops ops;
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
 
-	int		tapfd;
-	struct nm_desc	*nmd;
+	struct virtio_net_qpair qpairs[VIRTIO_NET_MAX_QPAIRS];
+	int		max_qpairs;
+	int		curr_qpairs;	/* set by VIRTIO_NET_CTRL_MQ */
 
-	int		rx_ready;
+	int		tapfd;		/* fd of the first tap queue */
+	struct nm_desc	*nmd;
 
 	volatile int	resetting;	/* set and checked outside lock */
-	volatile int	closing;	/* stop the tx i/o thread */
+	volatile int	closing;	/* stop the i/o threads */
 
 	uint64_t	features;	/* negotiated features */
 
 	struct virtio_net_config config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	void (*virtio_net_rx)(struct virtio_net_qpair *qp);
+	void (*virtio_net_tx)(struct virtio_net_qpair *qp, struct iovec *iov,
 			     int iovcnt, int len);
 };
 
 static void virtio_net_reset(void *);
-static void virtio_net_tx_stop(struct virtio_net *);
+static void virtio_net_qpairs_stop(struct virtio_net *);
 /* static void virtio_net_notify(void *, struct virtio_vq_info *); */
 static int virtio_net_cfgread(void *, int, int, uint32_t *);
 static int virtio_net_cfgwrite(void *, int, int, uint32_t);
@@ -161,7 +201,7 @@ static void virtio_net_neg_features(void *, uint64_t);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	2,				/* 2 virtqueues, more with mq= */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -191,55 +231,53 @@ ether_aton(const char *a, struct ether_addr *e)
 }
 
 /*
- * If the transmit thread is active then stall until it is done.
+ * Attach the tap queues of the active queue pairs and detach the rest,
+ * so the host only steers packets to queues the guest is using.
  */
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_tap_set_qpairs(struct virtio_net *net, int n)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
-		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
-	}
-	pthread_mutex_unlock(&net->tx_mtx);
-}
+	struct ifreq ifr;
+	int i;
 
-/*
- * If the receive thread is active then stall until it is done.
- */
-static void
-virtio_net_rxwait(struct virtio_net *net)
-{
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
-		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+	if (net->max_qpairs == 1 || net->tapfd == -1)
+		return;
+
+	for (i = 1; i < net->max_qpairs; i++) {
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = (i < n) ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		if (ioctl(net->qpairs[i].fd, TUNSETQUEUE, (void *)&ifr) < 0)
+			WPRINTF(("vtnet: failed to %s tap queue %d\n",
+				 (i < n) ? "attach" : "detach", i));
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
 	net->resetting = 1;
 
 	/*
-	 * Wait for the transmit and receive threads to finish their
-	 * processing.
+	 * Wait for the queue pair threads to finish their processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->max_qpairs; i++) {
+		pthread_mutex_lock(&net->qpairs[i].mtx);
+		net->qpairs[i].rx_ready = 0;
+		pthread_mutex_unlock(&net->qpairs[i].mtx);
+	}
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
 
+	/* back to a single queue pair until the driver enables more */
+	net->curr_qpairs = 1;
+	virtio_net_tap_set_qpairs(net, 1);
+
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
 
@@ -248,31 +286,39 @@ virtio_net_reset(void *vdev)
 }
 
 /*
- * Send signal to tx I/O thread and wait till it exits
+ * Kick the queue pair i/o threads to exit and wait till they do
  */
 static void
-virtio_net_tx_stop(struct virtio_net *net)
+virtio_net_qpairs_stop(struct virtio_net *net)
 {
+	struct virtio_net_qpair *qp;
 	void *jval;
+	int i;
 
 	net->closing = 1;
 
-	pthread_cond_broadcast(&net->tx_cond);
-
-	pthread_join(net->tx_tid, &jval);
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		if (qp->kickfd < 0)
+			continue;
+		eventfd_write(qp->kickfd, 1);
+		pthread_join(qp->tid, &jval);
+		close(qp->kickfd);
+		qp->kickfd = -1;
+	}
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
+virtio_net_tap_tx(struct virtio_net_qpair *qp, struct iovec *iov, int iovcnt,
 		  int len)
 {
 	static char pad[60]; /* all zero bytes */
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	if (qp->fd == -1)
 		return;
 
 	/*
@@ -285,7 +331,7 @@ virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
+	ret = writev(qp->fd, iov, iovcnt);
 	(void)ret; /*avoid compiler warning*/
 }
 
@@ -320,29 +366,30 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 }
 
 static void
-virtio_net_tap_rx(struct virtio_net *net)
+virtio_net_tap_rx(struct virtio_net_qpair *qp)
 {
 	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_net *net = qp->net;
 	struct virtio_vq_info *vq;
 	void *vrx;
-	int len, n;
+	int len, n, npkts;
 	uint16_t idx;
 	ssize_t ret;
 
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	assert(net->tapfd != -1);
+	assert(qp->fd != -1);
 
 	/*
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->fd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		return;
@@ -351,19 +398,20 @@ virtio_net_tap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = qp->rxq;
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
 		 * empty, if that's negotiated.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->fd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		vq_endchains(vq, 1);
 		return;
 	}
 
+	npkts = 0;
 	do {
 		/*
 		 * Get descriptor chain.
@@ -378,7 +426,7 @@ virtio_net_tap_rx(struct virtio_net *net)
 		vrx = iov[0].iov_base;
 		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
 
-		len = readv(net->tapfd, riov, n);
+		len = readv(qp->fd, riov, n);
 
 		if (len < 0 && errno == EWOULDBLOCK) {
 			/*
@@ -386,6 +434,7 @@ virtio_net_tap_rx(struct virtio_net *net)
 			 * entries.  Interrupt if needed/appropriate.
 			 */
 			vq_retchain(vq);
+			vq_relchain_publish(vq);
 			vq_endchains(vq, 0);
 			return;
 		}
@@ -406,11 +455,13 @@ virtio_net_tap_rx(struct virtio_net *net)
 		/*
 		 * Release this chain and handle more chains.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
-	} while (vq_has_descs(vq));
+		vq_relchain_prepare(vq, idx, len + net->rx_vhdrlen);
+	} while (++npkts < VIRTIO_NET_RX_BATCH && vq_has_descs(vq));
+
+	vq_relchain_publish(vq);
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
-	vq_endchains(vq, 1);
+	vq_endchains(vq, !vq_has_descs(vq));
 }
 
 static inline int
@@ -500,10 +551,11 @@ virtio_net_netmap_readv(struct nm_desc *nmd, struct iovec *iov, int iovcnt)
  * Called to send a buffer chain out to the vale port
  */
 static void
-virtio_net_netmap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
-		    int len)
+virtio_net_netmap_tx(struct virtio_net_qpair *qp, struct iovec *iov,
+		     int iovcnt, int len)
 {
 	static char pad[60]; /* all zero bytes */
+	struct virtio_net *net = qp->net;
 
 	if (net->nmd == NULL)
 		return;
@@ -522,12 +574,13 @@ virtio_net_netmap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 }
 
 static void
-virtio_net_netmap_rx(struct virtio_net *net)
+virtio_net_netmap_rx(struct virtio_net_qpair *qp)
 {
 	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_net *net = qp->net;
 	struct virtio_vq_info *vq;
 	void *vrx;
-	int len, n;
+	int len, n, npkts;
 	uint16_t idx;
 
 	/*
@@ -539,7 +592,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
@@ -550,7 +603,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = qp->rxq;
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
@@ -561,6 +614,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 		return;
 	}
 
+	npkts = 0;
 	do {
 		/*
 		 * Get descriptor chain.
@@ -583,6 +637,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 			 * entries.  Interrupt if needed/appropriate.
 			 */
 			vq_retchain(vq);
+			vq_relchain_publish(vq);
 			vq_endchains(vq, 0);
 			return;
 		}
@@ -603,42 +658,38 @@ virtio_net_netmap_rx(struct virtio_net *net)
 		/*
 		 * Release this chain and handle more chains.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
-	} while (vq_has_descs(vq));
+		vq_relchain_prepare(vq, idx, len + net->rx_vhdrlen);
+	} while (++npkts < VIRTIO_NET_RX_BATCH && vq_has_descs(vq));
+
+	vq_relchain_publish(vq);
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
-	vq_endchains(vq, 1);
+	vq_endchains(vq, !vq_has_descs(vq));
 }
 
-static void
-virtio_net_rx_callback(int fd, enum ev_type type, void *param)
+static struct virtio_net_qpair *
+virtio_net_vq_to_qpair(struct virtio_net *net, struct virtio_vq_info *vq)
 {
-	struct virtio_net *net = param;
-
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
-
+	return &net->qpairs[vq->num / 2];
 }
 
 static void
 virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = virtio_net_vq_to_qpair(net, vq);
 
 	/*
 	 * A qnotify means that the rx process can now begin
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	if (qp->rx_ready == 0) {
+		qp->rx_ready = 1;
+		vq_set_notify(vq, 0);
 	}
 }
 
 static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+virtio_net_proctx(struct virtio_net_qpair *qp, struct virtio_vq_info *vq)
 {
 	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
 	int i, n;
@@ -660,16 +711,17 @@ virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
 	}
 
 	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+	qp->net->virtio_net_tx(qp, &iov[1], n - 1, plen);
 
 	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, tlen);
+	vq_relchain_prepare(vq, idx, tlen);
 }
 
 static void
 virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = virtio_net_vq_to_qpair(net, vq);
 
 	/*
 	 * Any ring entries to process?
@@ -677,86 +729,158 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 	if (!vq_has_descs(vq))
 		return;
 
-	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	/* Kick the queue pair thread for processing */
+	vq_set_notify(vq, 0);
+	eventfd_write(qp->kickfd, 1);
 }
 
 /*
- * Thread which will handle processing of TX desc
+ * Process tx descs until the ring is empty with notifications
+ * re-enabled. Called with the queue pair mutex held.
  */
-static void *
-virtio_net_tx_thread(void *param)
+static void
+virtio_net_qpair_tx(struct virtio_net_qpair *qp)
 {
-	struct virtio_net *net = param;
-	struct virtio_vq_info *vq;
-	int error;
+	struct virtio_vq_info *vq = qp->txq;
+	int npkts;
 
-	vq = &net->queues[VIRTIO_NET_TXQ];
-
-	/*
-	 * Let us wait till the tx queue pointers get initialised &
-	 * first tx signaled
-	 */
-	pthread_mutex_lock(&net->tx_mtx);
-	error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
-	assert(error == 0);
-	if (net->closing) {
-		WPRINTF(("vtnet tx thread closing...\n"));
-		pthread_mutex_unlock(&net->tx_mtx);
-		return NULL;
-	}
+	if (!vq_ring_ready(vq))
+		return;
 
 	for (;;) {
-		/* note - tx mutex is locked here */
-		while (net->resetting || !vq_has_descs(vq)) {
-			vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
-			/* memory barrier */
-			mb();
-			if (!net->resetting && vq_has_descs(vq))
-				break;
-
-			net->tx_in_progress = 0;
-			error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
-			assert(error == 0);
-			if (net->closing) {
-				WPRINTF(("vtnet tx thread closing...\n"));
-				pthread_mutex_unlock(&net->tx_mtx);
-				return NULL;
-			}
-		}
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
-
-		do {
+		vq_set_notify(vq, 0);
+		while (!qp->net->resetting && vq_has_descs(vq)) {
 			/*
 			 * Run through entries, placing them into
 			 * iovecs and sending when an end-of-packet
 			 * is found
 			 */
-			virtio_net_proctx(net, vq);
-		} while (vq_has_descs(vq));
+			npkts = 0;
+			do {
+				virtio_net_proctx(qp, vq);
+			} while (++npkts < VIRTIO_NET_TX_BATCH &&
+				 vq_has_descs(vq));
 
-		/*
-		 * Generate an interrupt if needed.
-		 */
-		vq_endchains(vq, 1);
+			/*
+			 * Hand the batch back, generate an interrupt
+			 * if needed.
+			 */
+			vq_relchain_publish(vq);
+			vq_endchains(vq, !vq_has_descs(vq));
+		}
+
+		vq_set_notify(vq, 1);
+		/* memory barrier */
+		mb();
+		if (qp->net->resetting || !vq_has_descs(vq))
+			break;
+	}
+}
+
+/*
+ * Thread which serves one queue pair: rx from the backend fd and tx
+ * descs kicked through the eventfd.
+ */
+static void *
+virtio_net_qpair_thread(void *param)
+{
+	struct virtio_net_qpair *qp = param;
+	struct virtio_net *net = qp->net;
+	struct pollfd pfd[2];
+	eventfd_t val;
+	int n;
+
+	pfd[0].fd = qp->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = qp->kickfd;
+	pfd[1].events = POLLIN;
 
-		pthread_mutex_lock(&net->tx_mtx);
+	for (;;) {
+		pfd[0].revents = 0;
+		pfd[1].revents = 0;
+		/* a negative fd, i.e. no backend, is ignored by poll */
+		n = poll(pfd, 2, -1);
+		if (net->closing) {
+			WPRINTF(("vtnet qpair %d thread closing...\n",
+				 qp->idx));
+			break;
+		}
+		if (n < 0)
+			continue;
+
+		pthread_mutex_lock(&qp->mtx);
+		if (pfd[1].revents & POLLIN) {
+			eventfd_read(qp->kickfd, &val);
+			if (!net->resetting)
+				virtio_net_qpair_tx(qp);
+		}
+		if (pfd[0].revents & POLLIN)
+			net->virtio_net_rx(qp);
+		pthread_mutex_unlock(&qp->mtx);
 	}
+
+	return NULL;
+}
+
+static uint8_t
+virtio_net_ctrl_mq(struct virtio_net *net, uint8_t cmd, struct iovec *data)
+{
+	uint16_t pairs;
+
+	if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+	    data->iov_len < sizeof(pairs))
+		return VIRTIO_NET_ERR;
+
+	memcpy(&pairs, data->iov_base, sizeof(pairs));
+	if (!(net->features & VIRTIO_NET_F_MQ) ||
+	    pairs < 1 || pairs > net->max_qpairs)
+		return VIRTIO_NET_ERR;
+
+	DPRINTF(("vtnet: %d queue pairs enabled\n\r", pairs));
+	net->curr_qpairs = pairs;
+	virtio_net_tap_set_qpairs(net, pairs);
+	return VIRTIO_NET_OK;
 }
 
-#ifdef notyet
 static void
 virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
 {
+	struct virtio_net *net = vdev;
+	struct virtio_net_ctrl_hdr *hdr;
+	struct iovec iov[4];
+	uint16_t idx, flags[4];
+	uint8_t *ack, status;
+	int n;
+
 	DPRINTF(("vtnet: control qnotify!\n\r"));
+
+	/* posted notifies come without the (recursive) device lock */
+	pthread_mutex_lock(&net->mtx);
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, 4, flags);
+		if (n < 2 || iov[0].iov_len < sizeof(*hdr) ||
+		    iov[n - 1].iov_len < 1 ||
+		    !(flags[n - 1] & VRING_DESC_F_WRITE)) {
+			WPRINTF(("vtnet: bad control chain\n"));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		hdr = iov[0].iov_base;
+		ack = iov[n - 1].iov_base;
+		status = VIRTIO_NET_ERR;
+		if (hdr->class == VIRTIO_NET_CTRL_MQ && n == 3)
+			status = virtio_net_ctrl_mq(net, hdr->cmd, &iov[1]);
+		else
+			DPRINTF(("vtnet: unsupported ctrl class %d cmd %d\n\r",
+				 hdr->class, hdr->cmd));
+
+		*ack = status;
+		vq_relchain(vq, idx, 1);
+	}
+	vq_endchains(vq, 1);
+	pthread_mutex_unlock(&net->mtx);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -783,8 +907,23 @@ virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
 	return 0;
 }
 
+static void
+virtio_net_tap_close(struct virtio_net *net)
+{
+	int i;
+
+	if (net->tapfd < 0)
+		return;
+	for (i = 0; i < net->max_qpairs; i++) {
+		if (net->qpairs[i].fd >= 0)
+			close(net->qpairs[i].fd);
+		net->qpairs[i].fd = -1;
+	}
+	net->tapfd = -1;
+}
+
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, int multi_queue)
 {
 	int tunfd, rc;
 	struct ifreq ifr;
@@ -798,6 +937,8 @@ virtio_net_tap_open(char *devname)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	if (multi_queue)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
 
 	if (*devname)
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -830,32 +971,34 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
-		return;
-	}
-	DPRINTF(("open of tap device %s success!\n", tbuf));
-
 	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
+	 * Open one tap queue per queue pair, each polled by the i/o
+	 * thread of its pair. Set them non-blocking.
 	 */
-	int opt = 1;
-
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+	int i, fd, opt = 1;
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		fd = virtio_net_tap_open(tbuf, net->max_qpairs > 1);
+		if (fd != -1 && ioctl(fd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			close(fd);
+			fd = -1;
+		}
+		if (fd == -1) {
+			WPRINTF(("open of tap device %s queue %d failed\n",
+				 tbuf, i));
+			while (--i >= 0) {
+				close(net->qpairs[i].fd);
+				net->qpairs[i].fd = -1;
+			}
+			return;
+		}
+		net->qpairs[i].fd = fd;
 	}
+	net->tapfd = net->qpairs[0].fd;
+	DPRINTF(("open of tap device %s success!\n", tbuf));
 
-	net->mevp = mevent_add(net->tapfd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
-		WPRINTF(("Could not register event\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
-	}
+	virtio_net_tap_set_qpairs(net, 1);
 }
 
 static void
@@ -870,13 +1013,8 @@ virtio_net_netmap_setup(struct virtio_net *net, char *ifname)
 		return;
 	}
 
-	net->mevp = mevent_add(net->nmd->fd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
-		WPRINTF(("Could not register event\n"));
-		nm_close(net->nmd);
-		net->nmd = NULL;
-	}
+	/* netmap ports have a single queue pair */
+	net->qpairs[0].fd = net->nmd->fd;
 }
 
 static int
@@ -888,10 +1026,11 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char tname[MAXCOMLEN + 1];
 	struct virtio_net *net;
 	char *devname;
-	char *vtopts;
+	char *vtopts, *cp;
+	struct virtio_net_qpair *qp;
 	int mac_provided;
 	pthread_mutexattr_t attr;
-	int rc;
+	int i, rc;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -913,45 +1052,58 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_net: pthread_mutex_init failed with "
 			"error %d!\n", rc));
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues);
-	net->base.mtx = &net->mtx;
-
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
-
 	/*
 	 * Attempt to open the tap device and read the MAC address
-	 * if specified
+	 * and number of queue pairs if specified
 	 */
 	mac_provided = 0;
+	net->max_qpairs = 1;
 	net->tapfd = -1;
 	net->nmd = NULL;
+	for (i = 0; i < VIRTIO_NET_MAX_QPAIRS; i++) {
+		net->qpairs[i].fd = -1;
+		net->qpairs[i].kickfd = -1;
+	}
 	if (opts != NULL) {
 		int err;
 
 		devname = vtopts = strdup(opts);
 		if (!devname) {
 			WPRINTF(("virtio_net: strdup returns NULL\n"));
+			free(net);
 			return -1;
 		}
 
 		(void) strsep(&vtopts, ",");
 
-		if (vtopts != NULL) {
-			err = virtio_net_parsemac(vtopts, net->config.mac);
+		while ((cp = strsep(&vtopts, ",")) != NULL) {
+			if (!strncmp(cp, "mq=", 3)) {
+				net->max_qpairs = atoi(cp + 3);
+				if (net->max_qpairs < 1 ||
+				    net->max_qpairs > VIRTIO_NET_MAX_QPAIRS) {
+					fprintf(stderr, "Invalid mq=%s, max %d\n",
+						cp + 3, VIRTIO_NET_MAX_QPAIRS);
+					free(devname);
+					free(net);
+					return -1;
+				}
+				continue;
+			}
+			/* parsemac splits cp at the '=', check it first */
+			if (!strncmp(cp, "mac=", 4))
+				mac_provided = 1;
+			err = virtio_net_parsemac(cp, net->config.mac);
 			if (err != 0) {
 				free(devname);
+				free(net);
 				return err;
 			}
-			mac_provided = 1;
 		}
 
+		/* netmap ports have a single queue pair */
+		if (strncmp(devname, "vale", 4) == 0)
+			net->max_qpairs = 1;
+
 		if (strncmp(devname, "vale", 4) == 0)
 			virtio_net_netmap_setup(net, devname);
 		if (strncmp(devname, "tap", 3) == 0 ||
@@ -991,11 +1143,43 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	/* Link is up if we managed to open tap device or vale port. */
 	net->config.status = (opts == NULL || net->tapfd >= 0 ||
 			      net->nmd != NULL);
+	net->config.max_virtqueue_pairs = net->max_qpairs;
+	net->curr_qpairs = 1;
+
+	/*
+	 * Queue pairs come first, with the control queue after them,
+	 * which is only offered together with VIRTIO_NET_F_MQ.
+	 */
+	net->ops = virtio_net_ops;
+	if (net->max_qpairs > 1) {
+		net->ops.nvq = net->max_qpairs * 2 + 1;
+		net->ops.hv_caps |= VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ;
+	}
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues);
+	net->base.mtx = &net->mtx;
+	net->base.flags |= VIRTIO_POSTED_NOTIFY;
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		qp->net = net;
+		qp->idx = i;
+		qp->rxq = &net->queues[VIRTIO_NET_RXQ + i * 2];
+		qp->txq = &net->queues[VIRTIO_NET_TXQ + i * 2];
+		qp->rxq->qsize = VIRTIO_NET_RINGSZ;
+		qp->rxq->notify = virtio_net_ping_rxq;
+		qp->txq->qsize = VIRTIO_NET_RINGSZ;
+		qp->txq->notify = virtio_net_ping_txq;
+	}
+	if (net->max_qpairs > 1) {
+		net->queues[net->max_qpairs * 2].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[net->max_qpairs * 2].notify = virtio_net_ping_ctlq;
+	}
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
-		if (net)
-			free(net);
+		virtio_net_tap_close(net);
+		dev->arg = NULL;
+		free(net);
 		return -1;
 	}
 
@@ -1007,22 +1191,28 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
 
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Spawn one i/o thread per queue pair, handling both rx from
+	 * the backend and tx desc processing.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		pthread_mutex_init(&qp->mtx, NULL);
+		qp->kickfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (qp->kickfd < 0) {
+			WPRINTF(("vtnet: eventfd failed %d\n", errno));
+			virtio_net_qpairs_stop(net);
+			virtio_net_tap_close(net);
+			dev->arg = NULL;
+			free(net);
+			return -1;
+		}
+		pthread_create(&qp->tid, NULL, virtio_net_qpair_thread, qp);
+		snprintf(tname, sizeof(tname), "vtnet-%d:%d q%d", dev->slot,
+			 dev->func, i);
+		pthread_setname_np(qp->tid, tname);
+	}
 
 	return 0;
 }
@@ -1081,17 +1271,14 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
-		virtio_net_tx_stop(net);
+		virtio_posted_notify_stop(&net->base);
+		virtio_net_qpairs_stop(net);
 
-		if (net->tapfd >= 0) {
-			close(net->tapfd);
-			net->tapfd = -1;
-		} else
+		if (net->tapfd >= 0)
+			virtio_net_tap_close(net);
+		else
 			fprintf(stderr, "net->tapfd is -1!\n");
 
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
-
 		free(net);
 
 		DPRINTF(("%s: done\n", __func__));
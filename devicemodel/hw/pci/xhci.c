@@ -89,6 +89,7 @@
 #include "xhcireg.h"
 #include "dm.h"
 #include "pci_core.h"
+#include "mem.h"
 #include "xhci.h"
 #include "usb_pmapper.h"
 
@@ -3648,7 +3649,8 @@ pci_xhci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	pci_emul_add_msicap(dev, 1);
 
-	/* regsend registers */
+	/* regsend registers, the handlers take xdev->mtx */
+	dev->bar[0].mem_flags = MEM_F_MT_SAFE;
 	pci_emul_alloc_bar(dev, 0, PCIBAR_MEM32, xdev->regsend);
 	UPRINTF(LDBG, "pci_emu_alloc: %d\r\n", xdev->regsend);
 
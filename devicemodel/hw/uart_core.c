@@ -38,6 +38,7 @@
 #include <pthread.h>
 
 #include "types.h"
+#include "acrn_common.h"
 #include "mevent.h"
 #include "uart_core.h"
 #include "ns16550.h"
@@ -114,6 +115,16 @@ struct uart_vdev {
 	void	*arg;
 	uart_intr_func_t intr_assert;
 	uart_intr_func_t intr_deassert;
+
+	/*
+	 * Set when the hypervisor emulates the registers and only the data
+	 * goes through the ring; the fields above are unused then.
+	 */
+	struct vuart_ring_page *ring;
+	struct mevent *ring_mev;
+	bool	rx_stalled;	/* tty polling paused, rx ring full */
+	uart_notify_func_t ring_notify;
+	void	*ring_arg;
 };
 
 static void uart_drain(int fd, enum ev_type ev, void *arg);
@@ -368,6 +379,120 @@ uart_toggle_intr(struct uart_vdev *uart)
 		(*uart->intr_assert)(uart->arg);
 }
 
+/*
+ * Move tty input into the rx ring of the hypervisor vUART. Called with
+ * the uart lock held.
+ */
+static void
+uart_ring_rx(struct uart_vdev *uart)
+{
+	struct vuart_ring *ring = &uart->ring->rx;
+	uint32_t head, next, tail;
+	int ch, n = 0;
+
+	head = ring->head;
+	tail = *(volatile uint32_t *)&ring->tail;
+	while ((next = (head + 1) % VUART_RING_SIZE) != tail) {
+		ch = ttyread(&uart->tty);
+		if (ch == -1)
+			break;
+		ring->buf[head] = ch;
+		head = next;
+		n++;
+	}
+
+	/* stop polling the tty until the hypervisor made room */
+	if (next == tail && uart->mev != NULL && !uart->rx_stalled) {
+		mevent_disable(uart->mev);
+		uart->rx_stalled = true;
+	}
+
+	if (n == 0)
+		return;
+
+	/* bytes must be visible before the new index */
+	mb();
+	ring->head = head;
+	(*uart->ring_notify)(uart->ring_arg);
+}
+
+/*
+ * Write guest output from the tx ring of the hypervisor vUART to the tty.
+ * Called with the uart lock held, returns the number of bytes consumed.
+ */
+static int
+uart_ring_tx(struct uart_vdev *uart)
+{
+	struct vuart_ring *ring = &uart->ring->tx;
+	uint32_t head, tail, len;
+	ssize_t written;
+	int n = 0;
+
+	tail = ring->tail;
+	head = *(volatile uint32_t *)&ring->head;
+	if (head >= VUART_RING_SIZE)
+		return 0;
+	/* pairs with the barrier before the hypervisor advances head */
+	mb();
+
+	while (tail != head) {
+		len = (head > tail ? head : VUART_RING_SIZE) - tail;
+		if (uart->tty.opened) {
+			/*
+			 * Nothing retries a short write, drop what the tty
+			 * does not take like ttywrite does.
+			 */
+			written = write(uart->tty.fd, &ring->buf[tail], len);
+			if (written > 0)
+				len = written;
+		} /* else drop on floor */
+		tail = (tail + len) % VUART_RING_SIZE;
+		n += len;
+	}
+
+	mb();
+	ring->tail = tail;
+	return n;
+}
+
+/*
+ * The hypervisor put guest output into the tx ring or made room in a
+ * full rx ring, and VHM signaled the eventfd.
+ */
+static void
+uart_ring_event(int fd, enum ev_type ev, void *arg)
+{
+	struct uart_vdev *uart = arg;
+	struct vuart_ring *rx;
+	uint64_t count;
+	bool notify;
+
+	if (read(fd, &count, sizeof(count)) < 0)
+		return;
+
+	pthread_mutex_lock(&uart->mtx);
+
+	/* anything the hypervisor adds from now on raises a new event */
+	__sync_lock_test_and_set(&uart->ring->notify, 0);
+	mb();
+
+	/* the hypervisor waits for room to raise THRE again */
+	notify = uart_ring_tx(uart) > 0;
+
+	rx = &uart->ring->rx;
+	if (uart->rx_stalled &&
+	    (rx->head + 1) % VUART_RING_SIZE !=
+	    *(volatile uint32_t *)&rx->tail) {
+		uart->rx_stalled = false;
+		mevent_enable(uart->mev);
+	}
+
+	if (notify)
+		(*uart->ring_notify)(uart->ring_arg);
+
+	pthread_mutex_unlock(&uart->mtx);
+}
+
 static void
 uart_drain(int fd, enum ev_type ev, void *arg)
 {
@@ -386,7 +511,9 @@ uart_drain(int fd, enum ev_type ev, void *arg)
 	 */
 	pthread_mutex_lock(&uart->mtx);
 
-	if ((uart->mcr & MCR_LOOPBACK) != 0) {
+	if (uart->ring != NULL) {
+		uart_ring_rx(uart);
+	} else if ((uart->mcr & MCR_LOOPBACK) != 0) {
 		(void) ttyread(&uart->tty);
 	} else {
 		while ((ch = ttyread(&uart->tty)) != -1)
@@ -645,6 +772,8 @@ void
 uart_deinit(struct uart_vdev *uart)
 {
 	if (uart) {
+		if (uart->ring_mev != NULL)
+			mevent_delete_close(uart->ring_mev);
 		if (uart->tty.opened && uart->tty.fd == STDIN_FILENO) {
 			ttyclose();
 			stdio_in_use = false;
@@ -717,3 +846,30 @@ uart_release_backend(struct uart_vdev *uart, const char *opts)
 	uart->tty.fd = 0;
 	uart->tty.opened = false;
 }
+
+/*
+ * Switch the uart to a hypervisor emulated one: the hypervisor handles
+ * all register accesses and exchanges the data bytes through the ring,
+ * the uart only connects the ring to the backend. The ring must have
+ * been handed to the hypervisor already, together with notify_fd, the
+ * eventfd signaled when the ring needs attention. The uart owns notify_fd
+ * once this succeeded. notify is called after new input was produced or
+ * output was consumed.
+ */
+int
+uart_set_hv_ring(struct uart_vdev *uart, struct vuart_ring_page *ring,
+		 int notify_fd, uart_notify_func_t notify, void *arg)
+{
+	pthread_mutex_lock(&uart->mtx);
+	uart->ring = ring;
+	uart->ring_notify = notify;
+	uart->ring_arg = arg;
+	pthread_mutex_unlock(&uart->mtx);
+
+	uart->ring_mev = mevent_add(notify_fd, EVF_READ, uart_ring_event,
+			uart);
+	if (uart->ring_mev == NULL)
+		return -1;
+
+	return 0;
+}
@@ -39,6 +39,9 @@ struct vmctx;
 extern int guest_ncpus;
 extern char *guest_uuid_str;
 extern uint8_t trusty_enabled;
+extern uint8_t rt_pinned;
+extern uint8_t guest_vmexit_on_hlt;
+extern int ioreq_poll_max;
 extern char *vsbl_file_name;
 extern char *vmname;
 extern bool stdio_in_use;
@@ -50,4 +53,6 @@ void *dm_gpa2hva(uint64_t gpa, size_t size);
 int  virtio_uses_msix(void);
 void ptdev_prefer_msi(bool enable);
 void ptdev_no_reset(bool enable);
+void ioreq_emul_lock(bool serialize);
+void ioreq_emul_unlock(bool serialize);
 #endif
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _IOEVENTFD_H_
+#define _IOEVENTFD_H_
+
+#include "types.h"
+
+/*
+ * Posted writes: a guest write to a registered PIO/MMIO range only
+ * signals an eventfd, and the request is completed right away so the
+ * vCPU does not wait for the device to do the actual work.
+ *
+ * The table is matched here rather than in VHM. VHM can signal an
+ * eventfd outside of a vhm_request, as the vUART notify_fd does, but it
+ * does not match requests against addresses. A posted write therefore
+ * still costs the upcall round trip, and saves the vCPU from waiting on
+ * the device.
+ */
+#define IOEVENTFD_MAX		64
+#define IOEVENTFD_NOMATCH	(-1LL)
+
+/* type is REQ_PORTIO or REQ_MMIO, len 0 matches any access size */
+int	ioeventfd_register(uint32_t type, uint64_t addr, int len,
+			   int64_t datamatch, int fd);
+void	ioeventfd_unregister(int fd);
+void	ioeventfd_unregister_range(uint32_t type, uint64_t base,
+				   uint64_t size);
+int	ioeventfd_signal(uint32_t type, uint64_t addr, int size,
+			 uint64_t value);
+
+#endif /* _IOEVENTFD_H_ */
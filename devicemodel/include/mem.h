@@ -47,6 +47,8 @@ struct mem_range {
 #define	MEM_F_WRITE		0x2
 #define	MEM_F_RW		0x3
 #define	MEM_F_IMMUTABLE		0x4	/* mem_range cannot be unregistered */
+#define	MEM_F_COALESCED		0x8	/* writes may be buffered by the HV */
+#define	MEM_F_MT_SAFE		0x10	/* handler locks itself */
 
 void	init_mem(void);
 int	emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req);
@@ -54,5 +56,7 @@ int	register_mem(struct mem_range *memp);
 int	register_mem_fallback(struct mem_range *memp);
 int	unregister_mem(struct mem_range *memp);
 int	unregister_mem_fallback(struct mem_range *memp);
+int	coalesced_mmio_init(struct vmctx *ctx);
+void	coalesced_mmio_drain(struct vmctx *ctx);
 
 #endif	/* _MEM_H_ */
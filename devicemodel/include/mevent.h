@@ -38,15 +38,23 @@ enum ev_type {
 
 char *vmname;
 struct mevent;
+struct mevent_loop;
 
+struct mevent_loop *mevent_loop_get(const char *name);
 struct mevent *mevent_add(int fd, enum ev_type type,
 			  void (*func)(int, enum ev_type, void *),
 			  void *param);
+struct mevent *mevent_add_loop(struct mevent_loop *loop, int fd,
+			       enum ev_type type,
+			       void (*func)(int, enum ev_type, void *),
+			       void *param);
 int	mevent_enable(struct mevent *evp);
 int	mevent_disable(struct mevent *evp);
 int	mevent_delete(struct mevent *evp);
 int	mevent_delete_close(struct mevent *evp);
+int	mevent_delete_wait(struct mevent *evp);
 int	mevent_notify(void);
+void	mevent_request_stats(void);
 
 void	mevent_dispatch(void);
 int	mevent_init(void);
@@ -93,6 +93,7 @@ struct pcibar {
 	enum pcibar_type	type;		/* io or memory */
 	uint64_t		size;
 	uint64_t		addr;
+	int			mem_flags;	/* extra MEM_F_* of a mem bar */
 };
 
 #define PI_NAMESZ	40
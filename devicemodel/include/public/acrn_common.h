@@ -67,6 +67,8 @@
 
 /* Generic VM flags from guest OS */
 #define SECURE_WORLD_ENABLED    (1UL<<0)  /* Whether secure world is enabled */
+#define RT_PINNED_ENABLED       (1UL<<1)  /* Whether vcpus get pcpus of their own */
+#define HLT_EXIT_ENABLED        (1UL<<2)  /* Whether vcpus exit on HLT */
 
 /**
  * @brief Hypercall
@@ -153,11 +155,19 @@ struct acrn_create_vm {
 
 	/* VM flag bits from Guest OS, now used
 	 *  SECURE_WORLD_ENABLED          (1UL<<0)
+	 *  RT_PINNED_ENABLED             (1UL<<1)
+	 *  HLT_EXIT_ENABLED              (1UL<<2)
 	 */
 	uint64_t vm_flag;
 
+	/**
+	 * time in us a vcpu spins on a forwarded I/O request before it is
+	 * paused, capped by the hypervisor, 0 for no polling
+	 */
+	uint32_t ioreq_poll_us;
+
 	/** Reserved for future use*/
-	uint8_t  reserved[24];
+	uint8_t  reserved[20];
 } __aligned(8);
 
 /**
@@ -183,6 +193,143 @@ struct acrn_set_ioreq_buffer {
 	uint64_t req_buf;
 } __aligned(8);
 
+/**
+ * @brief Info to set the coalesced MMIO ring for a created VM
+ *
+ * the parameter for HC_SET_COALESCED_RING hypercall
+ */
+struct acrn_set_coalesced_ring {
+	/** guest physical address of the coalesced MMIO ring page */
+	uint64_t ring_buf;
+} __aligned(8);
+
+/** Operation for acrn_coalesced_mmio_zone: start coalescing a range */
+#define COALESCED_MMIO_ZONE_ADD		0U
+/** Operation for acrn_coalesced_mmio_zone: stop coalescing a range */
+#define COALESCED_MMIO_ZONE_DEL		1U
+
+/**
+ * @brief Info to add or remove a coalesced MMIO zone
+ *
+ * the parameter for HC_SET_COALESCED_ZONE hypercall
+ */
+struct acrn_coalesced_mmio_zone {
+	/** guest physical start address of the zone */
+	uint64_t addr;
+
+	/** size of the zone in bytes */
+	uint32_t size;
+
+	/** COALESCED_MMIO_ZONE_ADD or COALESCED_MMIO_ZONE_DEL */
+	uint32_t op;
+} __aligned(8);
+
+/**
+ * @brief One buffered MMIO write
+ *
+ * Recorded by the hypervisor for a write that hits a coalesced zone.
+ */
+struct coalesced_mmio_entry {
+	/** guest physical address written */
+	uint64_t addr;
+
+	/** value written */
+	uint64_t value;
+
+	/** access size in bytes */
+	uint32_t size;
+
+	uint32_t reserved;
+} __aligned(8);
+
+#define COALESCED_MMIO_MAX	\
+	((4096U - 8U) / sizeof(struct coalesced_mmio_entry))
+
+/**
+ * @brief Coalesced MMIO ring shared between hypervisor and SOS
+ *
+ * The hypervisor is the only producer and advances last; the device
+ * model is the only consumer and advances first. The ring is empty when
+ * first == last and full when last is one slot behind first.
+ */
+struct coalesced_mmio_ring {
+	/** index of the oldest entry not yet consumed */
+	uint32_t first;
+
+	/** index of the next free entry */
+	uint32_t last;
+
+	struct coalesced_mmio_entry entries[COALESCED_MMIO_MAX];
+} __aligned(4096);
+
+/**
+ * @brief Info to attach a hypervisor emulated 16550 UART to a VM
+ *
+ * the parameter for HC_SETUP_VUART hypercall
+ */
+struct acrn_vuart_setup {
+	/**
+	 * SOS guest physical address of the struct vuart_ring_page. The
+	 * page must stay pinned until the VM is destroyed or set up again.
+	 */
+	uint64_t ring_buf;
+
+	/** I/O port base of the UART, e.g. 0x3F8 for COM1 */
+	uint16_t base;
+
+	/** reserved for alignment padding */
+	uint16_t reserved;
+
+	/** ISA IRQ of the UART, e.g. 4 for COM1 */
+	uint32_t irq;
+
+	/**
+	 * eventfd VHM signals when an upcall finds notify set in the ring
+	 * page, not used by the hypervisor
+	 */
+	int32_t notify_fd;
+
+	/** reserved for alignment padding */
+	uint32_t reserved1;
+} __aligned(8);
+
+#define VUART_RING_SIZE		2032U
+
+/**
+ * @brief Byte ring with a single producer and a single consumer
+ *
+ * The ring is empty when head == tail and full when head is one byte
+ * behind tail. Both indexes stay below VUART_RING_SIZE.
+ */
+struct vuart_ring {
+	/** index the producer writes next */
+	uint32_t head;
+
+	/** index the consumer reads next */
+	uint32_t tail;
+
+	uint8_t buf[VUART_RING_SIZE];
+};
+
+/**
+ * @brief vUART data shared between hypervisor and SOS
+ *
+ * The hypervisor produces guest output into tx and consumes guest input
+ * from rx. The device model does the opposite and kicks the hypervisor
+ * with HC_NOTIFY_VUART after it moved data.
+ *
+ * The hypervisor sets notify when tx gained data or a full rx gained
+ * room, and raises the VHM upcall if notify was clear. The device model
+ * clears notify before it looks at the rings again.
+ */
+struct vuart_ring_page {
+	struct vuart_ring tx;
+	struct vuart_ring rx;
+
+	/** the device model has work, see above */
+	uint32_t notify;
+} __aligned(4096);
+
 /** Interrupt type for acrn_irqline: inject interrupt to IOAPIC */
 #define	ACRN_INTR_TYPE_ISA	0
 
@@ -87,6 +87,26 @@
 #define IC_CREATE_IOREQ_CLIENT          _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x02)
 #define IC_ATTACH_IOREQ_CLIENT          _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x03)
 #define IC_DESTROY_IOREQ_CLIENT         _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x04)
+/*
+ * IC_SET_COALESCED_RING passes the ring page as a DM virtual address, VHM
+ * translates and pins it like the IC_SETUP_VUART ring below. The DM only
+ * reads the ring when it handles a request, VHM signals nothing for it.
+ */
+#define IC_SET_COALESCED_RING           _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x05)
+#define IC_SET_COALESCED_ZONE           _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x06)
+/*
+ * IC_SETUP_VUART passes the ring page as a DM virtual address. VHM must
+ * translate it to the SOS physical address HC_SETUP_VUART expects and
+ * pin the page: the hypervisor writes it until the VM is destroyed, or
+ * until the next IC_SETUP_VUART of the VM replaces it. VHM releases the
+ * pin only then, not when the DM unmaps the page or exits.
+ *
+ * On every upcall VHM also signals the notify_fd eventfd of each vUART
+ * whose ring page has notify set, the DM has no other way to learn about
+ * guest output.
+ */
+#define IC_SETUP_VUART                  _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x07)
+#define IC_NOTIFY_VUART                 _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x08)
 
 /* Guest memory management */
 #define IC_ID_MEM_BASE                  0x40UL
@@ -84,6 +84,8 @@ flsl(uint64_t mask)
 
 /* memory barrier */
 #define mb()    ({ asm volatile("mfence" ::: "memory"); (void)0; })
+/* x86 doesn't reorder stores with other stores, a compiler barrier is enough */
+#define wmb()   ({ asm volatile("" ::: "memory"); (void)0; })
 
 static inline void
 do_cpuid(u_int ax, u_int *p)
@@ -33,8 +33,10 @@
 #define	UART_IO_BAR_SIZE	8
 
 struct uart_vdev;
+struct vuart_ring_page;
 
 typedef void (*uart_intr_func_t)(void *arg);
+typedef void (*uart_notify_func_t)(void *arg);
 struct uart_vdev *uart_init(uart_intr_func_t intr_assert,
 			    uart_intr_func_t intr_deassert, void *arg);
 void uart_deinit(struct uart_vdev *uart);
@@ -45,4 +47,6 @@ uint8_t	uart_read(struct uart_vdev *uart, int offset);
 void	uart_write(struct uart_vdev *uart, int offset, uint8_t value);
 int	uart_set_backend(struct uart_vdev *uart, const char *opt);
 void	uart_release_backend(struct uart_vdev *uart, const char *opts);
+int	uart_set_hv_ring(struct uart_vdev *uart, struct vuart_ring_page *ring,
+			 int notify_fd, uart_notify_func_t notify, void *arg);
 #endif
@@ -345,6 +345,7 @@ vring_size(u_int qsz)
 struct vmctx;
 struct pci_vdev;
 struct virtio_vq_info;
+struct mevent;
 
 /*
  * A virtual device, with some number (possibly 0) of virtual
@@ -373,11 +374,18 @@ struct virtio_vq_info;
  * However, the driver must verify the read or write size and offset
  * and that no one is writing a readonly register.)
  *
+ * The POSTED_NOTIFY flag, set by the driver, makes queue notifies
+ * posted writes once the guest driver is up: the vCPU resumes as soon
+ * as the write is recorded and the notify callback runs later, from an
+ * mevent loop of the device, without the base lock. The driver's notify
+ * callbacks must then lock whatever they touch themselves.
+ *
  * The BROKED flag ("this thing done gone and broked") is for future
  * use.
  */
 #define	VIRTIO_USE_MSIX		0x01
 #define	VIRTIO_EVENT_IDX	0x02	/* use the event-index values */
+#define	VIRTIO_POSTED_NOTIFY	0x04	/* queue notify w/o vCPU wait */
 #define	VIRTIO_BROKED		0x08	/* ??? */
 
 /*
@@ -588,6 +596,7 @@ struct virtio_vq_info {
 	uint16_t flags;		/**< flags (see above) */
 	uint16_t last_avail;	/**< a recent value of avail->idx */
 	uint16_t save_used;	/**< saved used->idx; see vq_endchains */
+	uint16_t used_pending;	/**< entries added by vq_relchain_prepare */
 	uint16_t msix_idx;	/**< MSI-X index, or VIRTIO_MSI_NO_VECTOR */
 
 	uint32_t pfn;		/**< PFN of virt queue (not shifted!) */
@@ -603,6 +612,10 @@ struct virtio_vq_info {
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
+
+	int posted_fd;		/**< eventfd of posted notify, or -1 */
+	struct mevent *posted_mev;
+				/**< mevent watching posted_fd */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -749,6 +762,20 @@ int virtio_intr_init(struct virtio_base *vb, int barnum, int use_msix);
  */
 void virtio_reset_dev(struct virtio_base *vb);
 
+/**
+ * @brief Stop posting queue notifications of the device.
+ *
+ * Unregisters and closes the per-queue eventfds set up for a device with
+ * VIRTIO_POSTED_NOTIFY, waiting for a notification being handled. Done
+ * when the guest resets the device; drivers also need to call it before
+ * freeing the device. Must not be called with the base lock held.
+ *
+ * @param vb Pointer to struct virtio_base.
+ *
+ * @return N/A
+ */
+void virtio_posted_notify_stop(struct virtio_base *vb);
+
 /**
  * @brief Set I/O BAR (usually 0) to map PCI config registers.
  *
@@ -797,6 +824,45 @@ void vq_retchain(struct virtio_vq_info *vq);
  */
 void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
 
+/**
+ * @brief Fill a used ring entry for the specified request chain without
+ * making it visible to the guest yet.
+ *
+ * Used by drivers that complete chains in batches; the entries are
+ * published with one update of the used index by vq_relchain_publish().
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param idx Pointer to available ring position, returned by vq_getchain().
+ * @param iolen Number of data bytes to be returned to frontend.
+ *
+ * @return N/A
+ */
+void vq_relchain_prepare(struct virtio_vq_info *vq, uint16_t idx,
+			 uint32_t iolen);
+
+/**
+ * @brief Publish the used ring entries filled by vq_relchain_prepare().
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return N/A
+ */
+void vq_relchain_publish(struct virtio_vq_info *vq);
+
+/**
+ * @brief Enable or disable guest notifications for the virtqueue.
+ *
+ * With VIRTIO_RING_F_EVENT_IDX negotiated, enabling publishes the
+ * current avail position as avail_event, otherwise the
+ * VRING_USED_F_NO_NOTIFY flag is used.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param enable Whether the guest should notify on new descriptors.
+ *
+ * @return N/A
+ */
+void vq_set_notify(struct virtio_vq_info *vq, int enable);
+
 /**
  * @brief Driver has finished processing "available" chains and calling
  * vq_relchain on each one.
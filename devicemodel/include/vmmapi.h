@@ -112,6 +112,12 @@ struct	vmctx *vm_open(const char *name);
 void	vm_close(struct vmctx *ctx);
 void	vm_pause(struct vmctx *ctx);
 int	vm_set_shared_io_page(struct vmctx *ctx, uint64_t page_vma);
+int	vm_set_coalesced_ring(struct vmctx *ctx, uint64_t ring_vma);
+int	vm_set_coalesced_zone(struct vmctx *ctx, uint64_t addr, uint64_t size,
+		uint32_t op);
+int	vm_setup_vuart(struct vmctx *ctx, int base, int irq, uint64_t ring_vma,
+		int notify_fd);
+int	vm_notify_vuart(struct vmctx *ctx);
 int	vm_create_ioreq_client(struct vmctx *ctx);
 int	vm_destroy_ioreq_client(struct vmctx *ctx);
 int	vm_attach_ioreq_client(struct vmctx *ctx);
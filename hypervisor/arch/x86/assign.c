@@ -14,6 +14,16 @@ static struct list_head softirq_dev_entry_list;
 static struct list_head ptdev_list;
 static spinlock_t ptdev_lock;
 
+/*
+ * Hash tables for entry lookup, protected by ptdev_lock:
+ * - ptdev_phys_hash is keyed by entry_id (phys_bdf + msix index or phys_pin)
+ * - ptdev_virt_hash is keyed by vm + (virt_bdf + msix index or virt_pin)
+ */
+#define PTDEV_HASH_BITS		6
+#define PTDEV_HASH_SIZE		(1 << PTDEV_HASH_BITS)
+static struct list_head ptdev_phys_hash[PTDEV_HASH_SIZE];
+static struct list_head ptdev_virt_hash[PTDEV_HASH_SIZE];
+
 /* invalid_entry for error return */
 static struct ptdev_remapping_info invalid_entry = {
 	.type = PTDEV_INTR_INV,
@@ -61,6 +71,66 @@ entry_id(struct ptdev_remapping_info *entry)
 	return id;
 }
 
+static inline uint32_t
+entry_vkey_from_msix(struct vm *vm, uint16_t vbdf, int32_t index)
+{
+	return ((uint32_t)vm->attr.id << 24) ^ ((uint32_t)index << 16) ^ vbdf;
+}
+
+static inline uint32_t
+entry_vkey_from_intx(struct vm *vm, uint8_t vpin,
+		enum ptdev_vpin_source vpin_src)
+{
+	return ((uint32_t)vm->attr.id << 24) ^ (PTDEV_INTR_INTX << 20) ^
+		((uint32_t)vpin_src << 8) ^ vpin;
+}
+
+/* vkey is used to find a ptdev entry based on its vm and virt info */
+static inline uint32_t
+entry_vkey(struct ptdev_remapping_info *entry)
+{
+	uint32_t key;
+
+	if (entry->type == PTDEV_INTR_INTX)
+		key = entry_vkey_from_intx(entry->vm,
+				entry->ptdev_intr_info.intx.virt_pin,
+				entry->ptdev_intr_info.intx.vpin_src);
+	else
+		key = entry_vkey_from_msix(entry->vm, entry->virt_bdf,
+				entry->ptdev_intr_info.msi.msix_entry_index);
+
+	return key;
+}
+
+static inline uint32_t
+ptdev_hash(uint32_t key)
+{
+	return (key * 0x9E3779B1U) >> (32 - PTDEV_HASH_BITS);
+}
+
+/* require ptdev_lock protect */
+static void
+hash_entry_phys(struct ptdev_remapping_info *entry)
+{
+	list_add(&entry->phys_hash_node,
+		&ptdev_phys_hash[ptdev_hash(entry_id(entry))]);
+}
+
+/*
+ * require ptdev_lock protect
+ * (re)hash entry after its vm or virt info is set or changed
+ */
+static void
+hash_entry_virt(struct ptdev_remapping_info *entry)
+{
+	list_del_init(&entry->virt_hash_node);
+	list_add(&entry->virt_hash_node,
+		&ptdev_virt_hash[ptdev_hash(entry_vkey(entry))]);
+
+	list_del_init(&entry->vm_node);
+	list_add(&entry->vm_node, &entry->vm->ptdev_list);
+}
+
 static inline bool
 is_entry_invalid(struct ptdev_remapping_info *entry)
 {
@@ -80,9 +150,9 @@ _lookup_entry_by_id(uint32_t id)
 	struct ptdev_remapping_info *entry;
 	struct list_head *pos;
 
-	list_for_each(pos, &ptdev_list) {
+	list_for_each(pos, &ptdev_phys_hash[ptdev_hash(id)]) {
 		entry = list_entry(pos, struct ptdev_remapping_info,
-				entry_node);
+				phys_hash_node);
 		if (entry_id(entry) == id)
 			return entry;
 	}
@@ -107,10 +177,11 @@ _lookup_entry_by_vmsi(struct vm *vm, uint16_t vbdf, int32_t index)
 {
 	struct ptdev_remapping_info *entry;
 	struct list_head *pos;
+	uint32_t key = entry_vkey_from_msix(vm, vbdf, index);
 
-	list_for_each(pos, &ptdev_list) {
+	list_for_each(pos, &ptdev_virt_hash[ptdev_hash(key)]) {
 		entry = list_entry(pos, struct ptdev_remapping_info,
-				entry_node);
+				virt_hash_node);
 		if ((entry->type == PTDEV_INTR_MSI)
 			&& (entry->vm == vm)
 			&& (entry->virt_bdf == vbdf)
@@ -140,10 +211,11 @@ _lookup_entry_by_vintx(struct vm *vm, uint8_t vpin,
 {
 	struct ptdev_remapping_info *entry;
 	struct list_head *pos;
+	uint32_t key = entry_vkey_from_intx(vm, vpin, vpin_src);
 
-	list_for_each(pos, &ptdev_list) {
+	list_for_each(pos, &ptdev_virt_hash[ptdev_hash(key)]) {
 		entry = list_entry(pos, struct ptdev_remapping_info,
-				entry_node);
+				virt_hash_node);
 		if ((entry->type == PTDEV_INTR_INTX)
 			&& (entry->vm == vm)
 			&& (entry->ptdev_intr_info.intx.virt_pin == vpin)
@@ -213,6 +285,10 @@ alloc_entry(struct vm *vm, enum ptdev_intr_type type)
 
 	INIT_LIST_HEAD(&entry->softirq_node);
 	INIT_LIST_HEAD(&entry->entry_node);
+	INIT_LIST_HEAD(&entry->phys_hash_node);
+	INIT_LIST_HEAD(&entry->virt_hash_node);
+	INIT_LIST_HEAD(&entry->vm_node);
+	entry->irte_index = -1;
 
 	atomic_clear_int(&entry->active, ACTIVE_FLAG);
 	list_add(&entry->entry_node, &ptdev_list);
@@ -226,8 +302,11 @@ release_entry(struct ptdev_remapping_info *entry)
 {
 	spinlock_rflags;
 
-	/* remove entry from ptdev_list */
+	/* remove entry from ptdev_list and the lookup tables */
 	list_del_init(&entry->entry_node);
+	list_del_init(&entry->phys_hash_node);
+	list_del_init(&entry->virt_hash_node);
+	list_del_init(&entry->vm_node);
 
 	/*
 	 * remove entry from softirq list.the ptdev_lock
@@ -237,6 +316,10 @@ release_entry(struct ptdev_remapping_info *entry)
 	list_del_init(&entry->softirq_node);
 	spinlock_irqrestore_release(&softirq_dev_lock);
 
+	if (entry->irte_index >= 0)
+		iommu_free_irte(entry->phys_bdf >> 8, entry->phys_bdf & 0xFF,
+				entry->irte_index);
+
 	free(entry);
 }
 
@@ -247,11 +330,10 @@ release_all_entries(struct vm *vm)
 	struct ptdev_remapping_info *entry;
 	struct list_head *pos, *tmp;
 
-	list_for_each_safe(pos, tmp, &ptdev_list) {
+	list_for_each_safe(pos, tmp, &vm->ptdev_list) {
 		entry = list_entry(pos, struct ptdev_remapping_info,
-				entry_node);
-		if (entry->vm == vm)
-			release_entry(entry);
+				vm_node);
+		release_entry(entry);
 	}
 }
 
@@ -334,6 +416,12 @@ ptdev_deactivate_entry(struct ptdev_remapping_info *entry)
 	unregister_handler_common(entry->node);
 	entry->node = NULL;
 
+	if (entry->irte_index >= 0) {
+		iommu_free_irte(entry->phys_bdf >> 8, entry->phys_bdf & 0xFF,
+				entry->irte_index);
+		entry->irte_index = -1;
+	}
+
 	/* remove from softirq list if added */
 	spinlock_irqsave_obtain(&softirq_dev_lock);
 	list_del_init(&entry->softirq_node);
@@ -385,6 +473,66 @@ static void ptdev_build_physical_msi(struct vm *vm, struct ptdev_msi_info *info,
 		info->pmsi_addr, info->pmsi_data);
 }
 
+/*
+ * A fixed or lowest priority MSI for a vcpu with APICv is posted by
+ * VT-d into the PIR descriptor of the vcpu, the hypervisor is not on
+ * the path of the interrupt any more. Otherwise, or if VT-d can't post
+ * it, the MSI keeps the host vector built by ptdev_build_physical_msi().
+ */
+static void ptdev_build_posted_msi(struct vm *vm,
+		struct ptdev_remapping_info *entry, struct ptdev_msi_info *info)
+{
+	uint64_t vdmask;
+	uint32_t dest, delmode, vector;
+	bool phys;
+	struct vcpu *vcpu;
+
+	dest = (info->vmsi_addr >> 12) & 0xff;
+	phys = ((info->vmsi_addr &
+			(MSI_ADDR_RH | MSI_ADDR_LOG)) !=
+			(MSI_ADDR_RH | MSI_ADDR_LOG));
+	calcvdest(vm, &vdmask, dest, phys);
+
+	delmode = info->vmsi_data & APIC_DELMODE_MASK;
+	vector = info->vmsi_data & 0xFF;
+
+	/* a fixed MSI for several vcpus can't be posted, any single
+	 * target is fine for lowest priority
+	 */
+	if (!is_vapic_posted_intr_supported() || vdmask == 0 ||
+		vector < 16 ||
+		(delmode != APIC_DELMODE_FIXED &&
+			delmode != APIC_DELMODE_LOWPRIO) ||
+		(delmode == APIC_DELMODE_FIXED && (vdmask & (vdmask - 1))))
+		goto fallback;
+
+	vcpu = vcpu_from_vid(vm, ffs64(vdmask));
+	if (vcpu == NULL)
+		goto fallback;
+
+	if (iommu_set_posted_irte(entry->phys_bdf >> 8,
+			entry->phys_bdf & 0xFF, &entry->irte_index,
+			apicv_get_pir_desc_addr(vcpu->arch_vcpu.vlapic),
+			vector) != 0)
+		goto fallback;
+
+	/* remappable format, the IRTE holds vector and destination */
+	info->pmsi_addr = MSI_ADDR_BASE | MSI_ADDR_IR_FORMAT |
+		MSI_ADDR_IR_HANDLE(entry->irte_index);
+	info->pmsi_data = 0;
+
+	dev_dbg(ACRN_DBG_IRQ, "MSI addr:data = 0x%x:%x(V) posted to vcpu%d",
+		info->vmsi_addr, info->vmsi_data, vcpu->vcpu_id);
+	return;
+
+fallback:
+	if (entry->irte_index >= 0) {
+		iommu_free_irte(entry->phys_bdf >> 8, entry->phys_bdf & 0xFF,
+				entry->irte_index);
+		entry->irte_index = -1;
+	}
+}
+
 static uint64_t ptdev_build_physical_rte(struct vm *vm,
 		struct ptdev_remapping_info *entry)
 {
@@ -473,9 +621,12 @@ add_msix_remapping(struct vm *vm, uint16_t virt_bdf, uint16_t phys_bdf,
 		entry->virt_bdf = virt_bdf;
 		entry->phys_bdf = phys_bdf;
 		entry->ptdev_intr_info.msi.msix_entry_index = msix_entry_index;
+		hash_entry_phys(entry);
+		hash_entry_virt(entry);
 	} else if ((entry->vm != vm) && is_vm0(entry->vm)) {
 		entry->vm = vm;
 		entry->virt_bdf = virt_bdf;
+		hash_entry_virt(entry);
 	} else if ((entry->vm != vm) && !is_vm0(entry->vm)) {
 		pr_err("MSIX pbdf%x idx=%d already in vm%d with vbdf%x, not "
 			"able to add into vm%d with vbdf%x", entry->phys_bdf,
@@ -549,10 +700,13 @@ add_intx_remapping(struct vm *vm, uint8_t virt_pin,
 		entry->ptdev_intr_info.intx.phys_pin = phys_pin;
 		entry->ptdev_intr_info.intx.virt_pin = virt_pin;
 		entry->ptdev_intr_info.intx.vpin_src = vpin_src;
+		hash_entry_phys(entry);
+		hash_entry_virt(entry);
 	} else if ((entry->vm != vm) && is_vm0(entry->vm)) {
 		entry->vm = vm;
 		entry->ptdev_intr_info.intx.virt_pin = virt_pin;
 		entry->ptdev_intr_info.intx.vpin_src = vpin_src;
+		hash_entry_virt(entry);
 	} else if ((entry->vm != vm) && !is_vm0(entry->vm)) {
 		pr_err("INTX pin%d already in vm%d with vpin%d, not able to "
 			"add into vm%d with vpin%d",
@@ -790,6 +944,7 @@ int ptdev_msix_remap(struct vm *vm, uint16_t virt_bdf,
 
 	/* build physical config MSI, update to info->pmsi_xxx */
 	ptdev_build_physical_msi(vm, info, dev_to_vector(entry->node));
+	ptdev_build_posted_msi(vm, entry, info);
 	entry->ptdev_intr_info.msi = *info;
 	entry->ptdev_intr_info.msi.virt_vector = info->vmsi_data & 0xFF;
 	entry->ptdev_intr_info.msi.phys_vector = dev_to_vector(entry->node);
@@ -953,8 +1108,11 @@ int ptdev_intx_pin_remap(struct vm *vm, struct ptdev_intx_info *info)
 				"vIOPIC" : "vPIC",
 			info->virt_pin,
 			entry->vm->attr.id);
+		spinlock_obtain(&ptdev_lock);
 		entry->ptdev_intr_info.intx.vpin_src = info->vpin_src;
 		entry->ptdev_intr_info.intx.virt_pin = info->virt_pin;
+		hash_entry_virt(entry);
+		spinlock_release(&ptdev_lock);
 	}
 
 	if (is_entry_active(entry)
@@ -1070,10 +1228,16 @@ void ptdev_remove_msix_remapping(struct vm *vm, uint16_t virt_bdf,
 
 void ptdev_init(void)
 {
+	int i;
+
 	if (get_cpu_id() > 0)
 		return;
 
 	INIT_LIST_HEAD(&ptdev_list);
+	for (i = 0; i < PTDEV_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&ptdev_phys_hash[i]);
+		INIT_LIST_HEAD(&ptdev_virt_hash[i]);
+	}
 	spinlock_init(&ptdev_lock);
 	INIT_LIST_HEAD(&softirq_dev_entry_list);
 	spinlock_init(&softirq_dev_lock);
@@ -1093,7 +1257,8 @@ static void get_entry_info(struct ptdev_remapping_info *entry, char *type,
 {
 	if (is_entry_active(entry)) {
 		if (entry->type == PTDEV_INTR_MSI) {
-			strcpy_s(type, 16, "MSI");
+			strcpy_s(type, 16, entry->irte_index >= 0 ?
+					"MSI-PI" : "MSI");
 			*dest = (entry->ptdev_intr_info.msi.pmsi_addr & 0xFF000)
 				>> 12;
 			if (entry->ptdev_intr_info.msi.pmsi_data &
@@ -61,7 +61,7 @@ inline bool cpu_has_cap(uint32_t bit)
 	return !!(boot_cpu_data.cpuid_leaves[feat_idx] & (1 << feat_bit));
 }
 
-static inline bool get_monitor_cap(void)
+bool get_monitor_cap(void)
 {
 	if (cpu_has_cap(X86_FEATURE_MONITOR)) {
 		/* don't use monitor for CPU (family: 0x6 model: 0x5c)
@@ -850,6 +850,11 @@ bool is_vapic_virt_reg_supported(void)
 	return ((cpu_caps.vapic_features & VAPIC_FEATURE_VIRT_REG) != 0);
 }
 
+bool is_vapic_posted_intr_supported(void)
+{
+	return ((cpu_caps.vapic_features & VAPIC_FEATURE_POST_INTR) != 0);
+}
+
 static void cpu_xsave_init(void)
 {
 	uint64_t val64;
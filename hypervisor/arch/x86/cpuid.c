@@ -6,51 +6,100 @@
 
 #include <hypervisor.h>
 
-static inline struct vcpuid_entry *find_vcpuid_entry(struct vcpu *vcpu,
+static inline struct vcpuid_index *vcpuid_index_of(struct vm *vm,
+					uint32_t leaf)
+{
+	if (leaf < VCPUID_BASIC_LEAVES)
+		return &vm->vcpuid_basic[leaf];
+	if (leaf - VCPUID_HV_BASE < VCPUID_HV_LEAVES)
+		return &vm->vcpuid_hv[leaf - VCPUID_HV_BASE];
+	if (leaf - VCPUID_EXT_BASE < VCPUID_EXT_LEAVES)
+		return &vm->vcpuid_ext[leaf - VCPUID_EXT_BASE];
+	return NULL;
+}
+
+/* slot of a leaf in vcpu->cpuid_exits */
+static inline uint32_t vcpuid_stat_slot(uint32_t leaf)
+{
+	if (leaf < VCPUID_BASIC_LEAVES)
+		return leaf;
+	if (leaf - VCPUID_HV_BASE < VCPUID_HV_LEAVES)
+		return VCPUID_BASIC_LEAVES + (leaf - VCPUID_HV_BASE);
+	if (leaf - VCPUID_EXT_BASE < VCPUID_EXT_LEAVES)
+		return VCPUID_BASIC_LEAVES + VCPUID_HV_LEAVES +
+			(leaf - VCPUID_EXT_BASE);
+	return VCPUID_STAT_SLOTS - 1U;
+}
+
+static inline uint32_t vcpuid_stat_leaf(uint32_t slot)
+{
+	if (slot < VCPUID_BASIC_LEAVES)
+		return slot;
+	slot -= VCPUID_BASIC_LEAVES;
+	if (slot < VCPUID_HV_LEAVES)
+		return VCPUID_HV_BASE + slot;
+	return VCPUID_EXT_BASE + (slot - VCPUID_HV_LEAVES);
+}
+
+static struct vcpuid_entry *lookup_vcpuid_entry(struct vm *vm,
 					uint32_t leaf, uint32_t subleaf)
 {
-	int i = 0, nr, half;
-	struct vcpuid_entry *entry = NULL;
-	struct vm *vm = vcpu->vm;
+	struct vcpuid_index *idx = vcpuid_index_of(vm, leaf);
+	struct vcpuid_entry *entry;
+	uint32_t i;
+
+	/* leaves out of the direct ranges are rare, scan for them */
+	if (idx == NULL) {
+		for (i = 0; i < vm->vcpuid_entry_nr; i++) {
+			entry = &vm->vcpuid_entries[i];
+			if (entry->leaf == leaf)
+				return entry;
+		}
+		return NULL;
+	}
 
-	nr = vm->vcpuid_entry_nr;
-	half = nr / 2;
-	if (vm->vcpuid_entries[half].leaf < leaf)
-		i = half;
+	if (idx->nr == 0)
+		return NULL;
 
-	for (; i < nr; i++) {
-		struct vcpuid_entry *tmp = &vm->vcpuid_entries[i];
+	entry = &vm->vcpuid_entries[idx->first];
+	if (!(entry->flags & CPUID_CHECK_SUBLEAF))
+		return entry;
 
-		if (tmp->leaf < leaf)
-			continue;
-		if (tmp->leaf == leaf) {
-			if ((tmp->flags & CPUID_CHECK_SUBLEAF) &&
-				(tmp->subleaf != subleaf))
-				continue;
-			entry = tmp;
-			break;
-		} else if (tmp->leaf > leaf)
-			break;
+	/* subleaves are usually stored densely from 0 */
+	if (subleaf < idx->nr && entry[subleaf].subleaf == subleaf)
+		return &entry[subleaf];
+
+	for (i = 0; i < idx->nr; i++) {
+		if (entry[i].subleaf == subleaf)
+			return &entry[i];
 	}
 
-	if (entry == NULL) {
-		uint32_t limit;
+	return NULL;
+}
 
-		if (leaf & 0x80000000)
-			limit = vm->vcpuid_xlevel;
-		else
-			limit = vm->vcpuid_level;
-
-		if (leaf > limit) {
-			/* Intel documentation states that invalid EAX input
-			 * will return the same information as EAX=cpuid_level
-			 * (Intel SDM Vol. 2A - Instruction Set Reference -
-			 * CPUID)
-			 */
-			leaf = vm->vcpuid_level;
-			return find_vcpuid_entry(vcpu, leaf, subleaf);
-		}
+static inline struct vcpuid_entry *find_vcpuid_entry(struct vcpu *vcpu,
+					uint32_t leaf, uint32_t subleaf)
+{
+	struct vcpuid_entry *entry;
+	struct vm *vm = vcpu->vm;
+	uint32_t limit;
 
+	entry = lookup_vcpuid_entry(vm, leaf, subleaf);
+	if (entry != NULL)
+		return entry;
+
+	if (leaf & 0x80000000)
+		limit = vm->vcpuid_xlevel;
+	else
+		limit = vm->vcpuid_level;
+
+	if (leaf > limit) {
+		/* Intel documentation states that invalid EAX input
+		 * will return the same information as EAX=cpuid_level
+		 * (Intel SDM Vol. 2A - Instruction Set Reference -
+		 * CPUID)
+		 */
+		entry = lookup_vcpuid_entry(vm, vm->vcpuid_level, subleaf);
 	}
 
 	return entry;
@@ -85,6 +134,39 @@ static void init_vcpuid_entry(__unused struct vm *vm,
 	entry->flags = flags;
 
 	switch (leaf) {
+	/*
+	 * Leaf 0x01
+	 * Only the initial APIC ID and OSXSAVE differ between vcpus,
+	 * guest_cpuid() patches them on each exit.
+	 */
+	case 0x01:
+		cpuid(leaf, &entry->eax, &entry->ebx,
+			&entry->ecx, &entry->edx);
+
+#ifndef CONFIG_MTRR_ENABLED
+		/* mask mtrr */
+		entry->edx &= ~CPUID_EDX_MTRR;
+#endif
+
+		/* Patching X2APIC, X2APIC mode is disabled by default. */
+		if (x2apic_enabled)
+			entry->ecx |= CPUID_ECX_x2APIC;
+		else
+			entry->ecx &= ~CPUID_ECX_x2APIC;
+
+		/* mask pcid */
+		entry->ecx &= ~CPUID_ECX_PCID;
+
+		/*mask vmx to guest os */
+		entry->ecx &= ~CPUID_ECX_VMX;
+
+		/*no xsave support for guest if it is not enabled on host*/
+		if (!(entry->ecx & CPUID_ECX_OSXSAVE))
+			entry->ecx &= ~CPUID_ECX_XSAVE;
+
+		entry->ecx &= ~CPUID_ECX_OSXSAVE;
+		break;
+
 	case 0x07:
 		if (!subleaf) {
 			cpuid(leaf,
@@ -167,8 +249,8 @@ int set_vcpuid_entries(struct vm *vm)
 	vm->vcpuid_level = limit = entry.eax;
 
 	for (i = 1; i <= limit; i++) {
-		/* cpuid 1/0xb is percpu related */
-		if (i == 1 || i == 0xb)
+		/* cpuid 0xb is percpu related */
+		if (i == 0xb)
 			continue;
 
 		switch (i) {
@@ -243,6 +325,18 @@ int set_vcpuid_entries(struct vm *vm)
 			return result;
 	}
 
+	/* entries of one leaf are contiguous, index the first of them */
+	for (i = 0; i < vm->vcpuid_entry_nr; i++) {
+		struct vcpuid_index *idx =
+			vcpuid_index_of(vm, vm->vcpuid_entries[i].leaf);
+
+		if (idx == NULL)
+			continue;
+		if (idx->nr == 0)
+			idx->first = i;
+		idx->nr++;
+	}
+
 	return 0;
 }
 
@@ -253,8 +347,10 @@ void guest_cpuid(struct vcpu *vcpu,
 	uint32_t leaf = *eax;
 	uint32_t subleaf = *ecx;
 
+	vcpu->cpuid_exits[vcpuid_stat_slot(leaf)]++;
+
 	/* vm related */
-	if (leaf != 0x1 && leaf != 0xb && leaf != 0xd) {
+	if (leaf != 0xb && leaf != 0xd) {
 		struct vcpuid_entry *entry =
 			find_vcpuid_entry(vcpu, leaf, subleaf);
 
@@ -270,51 +366,25 @@ void guest_cpuid(struct vcpu *vcpu,
 			*edx = 0;
 		}
 
-		return;
-	}
-
-	/* percpu related */
-	switch (leaf) {
-	case 0x01:
-	{
-		cpuid(leaf, eax, ebx, ecx, edx);
-		uint32_t apicid = vlapic_get_id(vcpu->arch_vcpu.vlapic);
-		/* Patching initial APIC ID */
-		*ebx &= ~APIC_ID_MASK;
-		*ebx |= (apicid & APIC_ID_MASK);
-
-#ifndef CONFIG_MTRR_ENABLED
-		/* mask mtrr */
-		*edx &= ~CPUID_EDX_MTRR;
-#endif
+		if (leaf == 0x01 && entry != NULL) {
+			uint32_t apicid =
+				vlapic_get_id(vcpu->arch_vcpu.vlapic);
 
-		/* Patching X2APIC, X2APIC mode is disabled by default. */
-		if (x2apic_enabled)
-			*ecx |= CPUID_ECX_x2APIC;
-		else
-			*ecx &= ~CPUID_ECX_x2APIC;
+			/* Patching initial APIC ID */
+			*ebx &= ~APIC_ID_MASK;
+			*ebx |= (apicid & APIC_ID_MASK);
 
-		/* mask pcid */
-		*ecx &= ~CPUID_ECX_PCID;
-
-		/*mask vmx to guest os */
-		*ecx &= ~CPUID_ECX_VMX;
-
-		/*no xsave support for guest if it is not enabled on host*/
-		if (!(*ecx & CPUID_ECX_OSXSAVE))
-			*ecx &= ~CPUID_ECX_XSAVE;
-
-		*ecx &= ~CPUID_ECX_OSXSAVE;
-		if (*ecx & CPUID_ECX_XSAVE) {
-			uint64_t cr4;
-			/*read guest CR4*/
-			cr4 = exec_vmread(VMX_GUEST_CR4);
-			if (cr4 & CR4_OSXSAVE)
+			/* OSXSAVE follows the guest CR4 */
+			if ((*ecx & CPUID_ECX_XSAVE) &&
+				(exec_vmread(VMX_GUEST_CR4) & CR4_OSXSAVE))
 				*ecx |= CPUID_ECX_OSXSAVE;
 		}
-		break;
+
+		return;
 	}
 
+	/* percpu related */
+	switch (leaf) {
 	case 0x0b:
 		/* Patching X2APIC */
 		if (!x2apic_enabled) {
@@ -340,3 +410,49 @@ void guest_cpuid(struct vcpu *vcpu,
 		break;
 	}
 }
+
+int get_cpuid_exit_info(char *str, int str_max, int vmid)
+{
+	int i, len, size = str_max;
+	uint32_t slot, exits;
+	struct vcpu *vcpu;
+	struct vm *vm = get_vm_from_vmid(vmid);
+
+	if (!vm) {
+		len = snprintf(str, size,
+			"\r\nvm is not exist for vmid %d", vmid);
+		size -= len;
+		str += len;
+		goto END;
+	}
+
+	len = snprintf(str, size, "\r\nVCPU\tLEAF\t\tEXITS");
+	size -= len;
+	str += len;
+
+	foreach_vcpu(i, vm, vcpu) {
+		for (slot = 0; slot < VCPUID_STAT_SLOTS; slot++) {
+			exits = vcpu->cpuid_exits[slot];
+			if (exits == 0)
+				continue;
+
+			if (slot == VCPUID_STAT_SLOTS - 1U)
+				len = snprintf(str, size,
+					"\r\n%d\tother\t\t%u",
+					vcpu->vcpu_id, exits);
+			else
+				len = snprintf(str, size,
+					"\r\n%d\t0x%08x\t%u",
+					vcpu->vcpu_id,
+					vcpuid_stat_leaf(slot), exits);
+			if (len >= size)
+				goto END;
+			size -= len;
+			str += len;
+		}
+	}
+
+END:
+	snprintf(str, size, "\r\n");
+	return 0;
+}
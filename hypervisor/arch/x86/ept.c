@@ -203,6 +203,97 @@ static int hv_emulate_mmio(struct vcpu *vcpu, struct mem_io *mmio,
 			mmio_handler->handler_private_data);
 }
 
+/*
+ * Find the HV MMIO handler overlapping [start, end), or NULL if the range
+ * is owned by the DM. The last hit of each vcpu is checked first, accesses
+ * outside all handlers are rejected on the bounds alone, and the rest is a
+ * binary search on the sorted, non-overlapping ranges.
+ */
+static struct mem_io_node *find_mmio_node(struct vcpu *vcpu, uint64_t start,
+	uint64_t end)
+{
+	struct vm *vm = vcpu->vm;
+	struct mem_io_node *node = vcpu->mmio_hint;
+	uint32_t lo, hi, mid;
+
+	if ((node != NULL) && (start < node->range_end) &&
+		(end > node->range_start))
+		return node;
+
+	if ((end <= vm->mmio_lo) || (start >= vm->mmio_hi))
+		return NULL;
+
+	/* first node with range_start >= end */
+	lo = 0;
+	hi = vm->nr_mmio_nodes;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (vm->mmio_nodes[mid]->range_start < end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+
+	node = vm->mmio_nodes[lo - 1];
+	if (node->range_end <= start)
+		return NULL;
+
+	vcpu->mmio_hint = node;
+	return node;
+}
+
+static void update_mmio_bounds(struct vm *vm)
+{
+	uint32_t i;
+
+	vm->mmio_lo = ~0UL;
+	vm->mmio_hi = 0;
+	for (i = 0; i < vm->nr_mmio_nodes; i++) {
+		if (vm->mmio_nodes[i]->range_start < vm->mmio_lo)
+			vm->mmio_lo = vm->mmio_nodes[i]->range_start;
+		if (vm->mmio_nodes[i]->range_end > vm->mmio_hi)
+			vm->mmio_hi = vm->mmio_nodes[i]->range_end;
+	}
+}
+
+static int insert_mmio_node(struct vm *vm, struct mem_io_node *mmio_node)
+{
+	struct mem_io_node **nodes;
+	uint32_t i, max;
+
+	if (vm->nr_mmio_nodes == vm->max_mmio_nodes) {
+		max = (vm->max_mmio_nodes != 0) ? vm->max_mmio_nodes * 2 : 8;
+		nodes = calloc(max, sizeof(struct mem_io_node *));
+		if (nodes == NULL)
+			return -ENOMEM;
+
+		if (vm->mmio_nodes != NULL) {
+			memcpy_s(nodes, max * sizeof(struct mem_io_node *),
+				vm->mmio_nodes,
+				vm->nr_mmio_nodes * sizeof(struct mem_io_node *));
+			free(vm->mmio_nodes);
+		}
+		vm->mmio_nodes = nodes;
+		vm->max_mmio_nodes = max;
+	}
+
+	/* keep the array sorted by range_start */
+	for (i = vm->nr_mmio_nodes; i > 0; i--) {
+		if (vm->mmio_nodes[i - 1]->range_start <=
+				mmio_node->range_start)
+			break;
+		vm->mmio_nodes[i] = vm->mmio_nodes[i - 1];
+	}
+	vm->mmio_nodes[i] = mmio_node;
+	vm->nr_mmio_nodes++;
+
+	update_mmio_bounds(vm);
+
+	return 0;
+}
+
 int register_mmio_emulation_handler(struct vm *vm,
 	hv_mem_io_handler_t read_write, uint64_t start,
 	uint64_t end, void *handler_private_data)
@@ -226,17 +317,17 @@ int register_mmio_emulation_handler(struct vm *vm,
 			/* Fill in information for this node */
 			mmio_node->read_write = read_write;
 			mmio_node->handler_private_data = handler_private_data;
-
-			INIT_LIST_HEAD(&mmio_node->list);
-			list_add(&mmio_node->list, &vm->mmio_list);
-
 			mmio_node->range_start = start;
 			mmio_node->range_end = end;
+
+			status = insert_mmio_node(vm, mmio_node);
+			if (status != 0) {
+				free(mmio_node);
+				return status;
+			}
+
 			ept_mmap(vm, start, start, end - start,
 					MAP_UNMAP, 0);
-
-			/* Return success */
-			status = 0;
 		}
 	}
 
@@ -247,20 +338,153 @@ int register_mmio_emulation_handler(struct vm *vm,
 void unregister_mmio_emulation_handler(struct vm *vm, uint64_t start,
 	uint64_t end)
 {
-	struct list_head *pos, *tmp;
 	struct mem_io_node *mmio_node;
+	struct vcpu *vcpu;
+	uint32_t i, j;
+	int k;
 
-	list_for_each_safe(pos, tmp, &vm->mmio_list) {
-		mmio_node = list_entry(pos, struct mem_io_node, list);
+	for (i = 0; i < vm->nr_mmio_nodes; i++) {
+		mmio_node = vm->mmio_nodes[i];
 
 		if ((mmio_node->range_start == start) &&
 			(mmio_node->range_end == end)) {
-			/* assume only one entry found in mmio_list */
-			list_del_init(&mmio_node->list);
+			/* assume only one entry found in mmio_nodes */
+			vm->nr_mmio_nodes--;
+			for (j = i; j < vm->nr_mmio_nodes; j++)
+				vm->mmio_nodes[j] = vm->mmio_nodes[j + 1];
+
+			for (k = 0; k < vm->hw.num_vcpus; k++) {
+				vcpu = vm->hw.vcpu_array[k];
+				if ((vcpu != NULL) &&
+					(vcpu->mmio_hint == mmio_node))
+					vcpu->mmio_hint = NULL;
+			}
 			free(mmio_node);
 			break;
 		}
 	}
+
+	if (vm->nr_mmio_nodes == 0) {
+		free(vm->mmio_nodes);
+		vm->mmio_nodes = NULL;
+		vm->max_mmio_nodes = 0;
+	}
+	update_mmio_bounds(vm);
+}
+
+int set_coalesced_mmio_zone(struct vm *vm, uint64_t addr, uint32_t size,
+	uint32_t op)
+{
+	struct coalesced_zone *zone;
+	uint32_t i;
+	int ret = 0;
+
+	if ((size == 0) || (addr + size < addr))
+		return -EINVAL;
+
+	spinlock_obtain(&vm->coalesced_lock);
+	for (i = 0; i < vm->nr_coalesced_zones; i++) {
+		zone = &vm->coalesced_zones[i];
+		if ((zone->start == addr) && (zone->end == addr + size))
+			break;
+	}
+
+	if (op == COALESCED_MMIO_ZONE_ADD) {
+		if (i < vm->nr_coalesced_zones)
+			goto out;
+		if (vm->nr_coalesced_zones == MAX_COALESCED_ZONES) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		zone = &vm->coalesced_zones[vm->nr_coalesced_zones];
+		zone->start = addr;
+		zone->end = addr + size;
+		vm->nr_coalesced_zones++;
+	} else if (op == COALESCED_MMIO_ZONE_DEL) {
+		if (i == vm->nr_coalesced_zones) {
+			ret = -ENODEV;
+			goto out;
+		}
+		vm->nr_coalesced_zones--;
+		vm->coalesced_zones[i] =
+			vm->coalesced_zones[vm->nr_coalesced_zones];
+	} else
+		ret = -EINVAL;
+
+out:
+	spinlock_release(&vm->coalesced_lock);
+	return ret;
+}
+
+static bool in_coalesced_zone(struct vm *vm, uint64_t addr, uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < vm->nr_coalesced_zones; i++) {
+		if ((addr >= vm->coalesced_zones[i].start) &&
+			(addr + size <= vm->coalesced_zones[i].end))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Buffer an MMIO write in the coalesced ring instead of sending it to
+ * VHM, without pausing the vcpu. The DM replays the ring before it
+ * handles the next synchronous request, so the writes stay ordered with
+ * respect to everything else the DM emulates.
+ *
+ * On failure nothing has been emulated and the caller falls back to the
+ * normal request path, which also gets a full ring drained.
+ */
+static int coalesce_mmio(struct vcpu *vcpu)
+{
+	struct vm *vm = vcpu->vm;
+	struct mem_io *mmio = &vcpu->mmio;
+	struct coalesced_mmio_ring *ring;
+	struct coalesced_mmio_entry *entry;
+	uint32_t last, next;
+	int ret = -ENODEV;
+
+	if (vm->nr_coalesced_zones == 0)
+		return -ENODEV;
+
+	spinlock_obtain(&vm->coalesced_lock);
+	ring = vm->sw.coalesced_ring;
+	if ((ring == NULL) ||
+		!in_coalesced_zone(vm, mmio->paddr, mmio->access_size))
+		goto out;
+
+	/* The ring lives in SOS memory, don't trust its indexes */
+	last = ring->last;
+	if (last >= COALESCED_MMIO_MAX)
+		goto out;
+	next = (last + 1) % COALESCED_MMIO_MAX;
+	if (next == *(volatile uint32_t *)&ring->first) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	/* Only emulate once there is room, so a fallback to VHM does not
+	 * run the instruction twice.
+	 */
+	ret = emulate_instruction(vcpu);
+	if (ret != 0)
+		goto out;
+
+	entry = &ring->entries[last];
+	entry->addr = mmio->paddr;
+	entry->value = mmio->value;
+	entry->size = mmio->access_size;
+
+	/* Entry must be visible before the new index */
+	CPU_MEMORY_WRITE_BARRIER();
+	ring->last = next;
+
+out:
+	spinlock_release(&vm->coalesced_lock);
+	return ret;
 }
 
 int dm_emulate_mmio_post(struct vcpu *vcpu)
@@ -324,7 +548,6 @@ int ept_violation_vmexit_handler(struct vcpu *vcpu)
 	int status = -EINVAL;
 	uint64_t exit_qual;
 	uint64_t gpa;
-	struct list_head *pos;
 	struct mem_io *mmio = &vcpu->mmio;
 	struct mem_io_node *mmio_handler = NULL;
 
@@ -365,14 +588,10 @@ int ept_violation_vmexit_handler(struct vcpu *vcpu)
 	if (mmio->access_size == 0)
 		goto out;
 
-	list_for_each(pos, &vcpu->vm->mmio_list) {
-		mmio_handler = list_entry(pos, struct mem_io_node, list);
-		if ((mmio->paddr + mmio->access_size <=
-			mmio_handler->range_start) ||
-			(mmio->paddr >= mmio_handler->range_end))
-			continue;
-
-		else if (!((mmio->paddr >= mmio_handler->range_start) &&
+	mmio_handler = find_mmio_node(vcpu, mmio->paddr,
+			mmio->paddr + mmio->access_size);
+	if (mmio_handler != NULL) {
+		if (!((mmio->paddr >= mmio_handler->range_start) &&
 			(mmio->paddr + mmio->access_size <=
 			mmio_handler->range_end))) {
 			pr_fatal("Err MMIO, addr:0x%llx, size:%x",
@@ -398,7 +617,6 @@ int ept_violation_vmexit_handler(struct vcpu *vcpu)
 		}
 
 		status = 0;
-		break;
 	}
 
 	if (status != 0) {
@@ -410,6 +628,11 @@ int ept_violation_vmexit_handler(struct vcpu *vcpu)
 		 * instruction emulation. For MMIO read, ask DM to run MMIO
 		 * emulation at first.
 		 */
+		if ((mmio->read_write == HV_MEM_IO_WRITE) &&
+			((exit_qual & 0x38) != 0x28) &&
+			(coalesce_mmio(vcpu) == 0))
+			return 0;
+
 		memset(&vcpu->req, 0, sizeof(struct vhm_request));
 
 		if (dm_emulate_mmio_pre(vcpu, exit_qual) != 0)
@@ -450,12 +673,10 @@ int ept_misconfig_vmexit_handler(__unused struct vcpu *vcpu)
 	return status;
 }
 
-int ept_mmap(struct vm *vm, uint64_t hpa,
+int ept_mmap_noflush(struct vm *vm, uint64_t hpa,
 	uint64_t gpa, uint64_t size, uint32_t type, uint32_t prot)
 {
 	struct map_params map_params;
-	int i;
-	struct vcpu *vcpu;
 
 	/* Setup memory map parameters */
 	map_params.page_table_type = PTT_EPT;
@@ -473,20 +694,80 @@ int ept_mmap(struct vm *vm, uint64_t hpa,
 		map_mem(&map_params, (void *)hpa,
 			(void *)gpa, size, prot);
 
+		/* Tables are freed by the promotion, only do it while no
+		 * vcpu can be walking them. 1G promotion would free PDs
+		 * the secure world EPT shares. Once a device is assigned
+		 * the IOMMU walks and caches the same tables for DMA
+		 * whatever the VM state, so stop folding from then on.
+		 */
+		if (vm->state != VM_STARTED && vm->iommu_domain == NULL)
+			vm->arch_vm.ept_promotions += promote_mem(&map_params,
+				(void *)hpa, (void *)gpa, size,
+				vm->arch_vm.sworld_eptp == 0);
+
 	} else if (type == MAP_UNMAP) {
 		unmap_mem(&map_params, (void *)hpa, (void *)gpa,
 				size, prot);
 	} else
 		ASSERT(0, "unknown map type");
 
+	dev_dbg(ACRN_DBG_EPT, "ept map: %s hpa: 0x%016llx gpa: 0x%016llx ",
+			type == MAP_UNMAP ? "unmap" : "map", hpa, gpa);
+	dev_dbg(ACRN_DBG_EPT, "size: 0x%016llx prot: 0x%x\n", size, prot);
+
+	return 0;
+}
+
+void ept_flush(struct vm *vm)
+{
+	int i;
+	struct vcpu *vcpu;
+
 	foreach_vcpu(i, vm, vcpu) {
 		vcpu_make_request(vcpu, ACRN_REQUEST_EPT_FLUSH);
 	}
+	vm->arch_vm.ept_flushes++;
+}
 
-	dev_dbg(ACRN_DBG_EPT, "ept map: %s hpa: 0x%016llx gpa: 0x%016llx ",
-			type == MAP_UNMAP ? "unmap" : "map", hpa, gpa);
-	dev_dbg(ACRN_DBG_EPT, "size: 0x%016llx prot: 0x%x\n", size, prot);
+int ept_mmap(struct vm *vm, uint64_t hpa,
+	uint64_t gpa, uint64_t size, uint32_t type, uint32_t prot)
+{
+	int ret;
 
+	ret = ept_mmap_noflush(vm, hpa, gpa, size, type, prot);
+	ept_flush(vm);
+
+	return ret;
+}
+
+int get_ept_info(char *str, int str_max)
+{
+	int len, size = str_max;
+	struct list_head *pos;
+	struct page_size_stats stats;
+	struct vm *vm;
+
+	len = snprintf(str, size,
+		"\r\nVM\t4K\t\t2M\t\t1G\t\tTABLES\t\tPROMOTED\tFLUSHES");
+	size -= len;
+	str += len;
+
+	spinlock_obtain(&vm_list_lock);
+	list_for_each(pos, &vm_list) {
+		vm = list_entry(pos, struct vm, list);
+		get_page_size_stats((vm->arch_vm.nworld_eptp != 0) ?
+				HPA2HVA(vm->arch_vm.nworld_eptp) : NULL,
+				PTT_EPT, &stats);
+		len = snprintf(str, size,
+			"\r\n%d\t%-16lld%-16lld%-16lld%-16lld%-16lld%lld",
+			vm->attr.id, stats.pages_4k, stats.pages_2m,
+			stats.pages_1g, stats.tables,
+			vm->arch_vm.ept_promotions, vm->arch_vm.ept_flushes);
+		size -= len;
+		str += len;
+	}
+	spinlock_release(&vm_list_lock);
+	snprintf(str, size, "\r\n");
 	return 0;
 }
 
@@ -15,6 +15,8 @@ uint32_t e820_entries;
 struct e820_entry e820[E820_MAX_ENTRIES];
 struct e820_mem_params e820_mem;
 
+#define PW_MAX_LEVELS	4
+
 struct page_walk_info {
 	uint64_t top_entry;	/* Top level paging structure entry */
 	int level;
@@ -26,6 +28,46 @@ struct page_walk_info {
 				 * true for PAE/4-level paing */
 	bool wp;		/* CR0.WP */
 	bool nxe;		/* MSR_IA32_EFER_NXE_BIT */
+
+	/* paging entries the walk went through, for the software TLB */
+	int nr_entries;
+	void *entry_ptr[PW_MAX_LEVELS];
+	uint64_t entry_val[PW_MAX_LEVELS];
+	bool all_rw;
+	bool all_us;
+	bool any_xd;
+};
+
+/*
+ * Software TLB for gva2gpa, per vcpu (hence per VPID) and direct mapped
+ * by 4K virtual page number. Each entry is tagged with CR3 and paging
+ * mode and keeps the paging entries it was built from. As neither MOV
+ * CR3 nor INVLPG cause a VM exit, a hit re-reads those entries instead
+ * of trusting them: that costs a few loads but no GPA2HVA/EPT walk, and
+ * picks up any change the guest made to its page tables. Only
+ * translations without protection fault are cached, and a hit that
+ * would fault for the current access takes the slow path to get the
+ * error code right.
+ */
+#define GVA_TLB_SIZE	16
+
+struct gva_tlb_entry {
+	uint64_t vpn;
+	uint64_t cr3;
+	uint64_t gpa;		/* 4K frame the page maps to */
+	uint8_t valid;
+	uint8_t paging_mode;
+	uint8_t width;
+	uint8_t all_rw;
+	uint8_t all_us;
+	uint8_t any_xd;
+	uint8_t nr_entries;
+	void *entry_ptr[PW_MAX_LEVELS];
+	uint64_t entry_val[PW_MAX_LEVELS];
+};
+
+struct gva_tlb {
+	struct gva_tlb_entry entries[GVA_TLB_SIZE];
 };
 
 inline bool
@@ -214,11 +256,20 @@ static int _gva2gpa_common(struct vcpu *vcpu, struct page_walk_info *pw_info,
 		index = (gva >> shift) & ((1UL << pw_info->width) - 1);
 		page_size = 1UL << shift;
 
-		if (pw_info->width == 10)
+		if (pw_info->width == 10) {
 			/* 32bit entry */
 			entry = *((uint32_t *)(base + 4 * index));
-		else
+			pw_info->entry_ptr[pw_info->nr_entries] =
+				base + 4 * index;
+		} else {
 			entry = *((uint64_t *)(base + 8 * index));
+			pw_info->entry_ptr[pw_info->nr_entries] =
+				base + 8 * index;
+		}
+		pw_info->entry_val[pw_info->nr_entries++] = entry;
+		pw_info->all_rw &= !!(entry & MMU_32BIT_PDE_RW);
+		pw_info->all_us &= !!(entry & MMU_32BIT_PDE_US);
+		pw_info->any_xd |= !!(entry & MMU_MEM_ATTR_BIT_EXECUTE_DISABLE);
 
 		/* check if the entry present */
 		if (!(entry & MMU_32BIT_PDE_P)) {
@@ -285,6 +336,10 @@ static int _gva2gpa_pae(struct vcpu *vcpu, struct page_walk_info *pw_info,
 		goto out;
 	}
 
+	/* PDPTEs have no access rights */
+	pw_info->entry_ptr[pw_info->nr_entries] = &base[index];
+	pw_info->entry_val[pw_info->nr_entries++] = entry;
+
 	pw_info->level = 2;
 	pw_info->top_entry = entry;
 	ret = _gva2gpa_common(vcpu, pw_info, gva, gpa, err_code);
@@ -294,6 +349,91 @@ out:
 
 }
 
+static inline uint64_t gva_tlb_read_entry(void *ptr, uint8_t width)
+{
+	return (width == 10) ? *(volatile uint32_t *)ptr :
+		*(volatile uint64_t *)ptr;
+}
+
+static struct gva_tlb_entry *gva_tlb_slot(struct vcpu *vcpu, uint64_t gva)
+{
+	struct gva_tlb *tlb = vcpu->gva_tlb;
+
+	if (tlb == NULL) {
+		tlb = calloc(1, sizeof(struct gva_tlb));
+		if (tlb == NULL)
+			return NULL;
+		vcpu->gva_tlb = tlb;
+	}
+
+	return &tlb->entries[(gva >> 12) & (GVA_TLB_SIZE - 1)];
+}
+
+static bool gva_tlb_lookup(struct gva_tlb_entry *tlb_entry,
+	struct page_walk_info *pw_info, uint64_t gva, uint64_t *gpa)
+{
+	int i;
+
+	if (!tlb_entry->valid || (tlb_entry->vpn != (gva >> 12)) ||
+		(tlb_entry->cr3 != pw_info->top_entry) ||
+		(tlb_entry->paging_mode != pw_info->level) ||
+		(tlb_entry->width != pw_info->width))
+		return false;
+
+	/* would fault: let the page walk build the error code */
+	if (pw_info->is_write_access && !tlb_entry->all_rw &&
+		(pw_info->is_user_mode || pw_info->wp))
+		return false;
+	if (pw_info->is_inst_fetch && pw_info->nxe && tlb_entry->any_xd)
+		return false;
+	if (pw_info->is_user_mode && !tlb_entry->all_us)
+		return false;
+
+	for (i = 0; i < tlb_entry->nr_entries; i++) {
+		if (gva_tlb_read_entry(tlb_entry->entry_ptr[i],
+				tlb_entry->width) != tlb_entry->entry_val[i]) {
+			tlb_entry->valid = 0;
+			return false;
+		}
+	}
+
+	*gpa = tlb_entry->gpa | (gva & (CPU_PAGE_SIZE - 1));
+	return true;
+}
+
+static void gva_tlb_fill(struct gva_tlb_entry *tlb_entry,
+	struct page_walk_info *pw_info, uint64_t cr3, enum vm_paging_mode pm,
+	uint64_t gva, uint64_t gpa)
+{
+	int i;
+
+	tlb_entry->vpn = gva >> 12;
+	tlb_entry->cr3 = cr3;
+	tlb_entry->gpa = gpa & ~(CPU_PAGE_SIZE - 1);
+	tlb_entry->paging_mode = pm;
+	tlb_entry->width = pw_info->width;
+	tlb_entry->all_rw = pw_info->all_rw;
+	tlb_entry->all_us = pw_info->all_us;
+	tlb_entry->any_xd = pw_info->any_xd;
+	tlb_entry->nr_entries = pw_info->nr_entries;
+	for (i = 0; i < pw_info->nr_entries; i++) {
+		tlb_entry->entry_ptr[i] = pw_info->entry_ptr[i];
+		tlb_entry->entry_val[i] = pw_info->entry_val[i];
+	}
+	tlb_entry->valid = 1;
+}
+
+/*
+ * Called on paging mode changes and whenever the hardware TLBs of the vcpu
+ * are flushed (EPT or VPID), as the EPT may no longer map the paging
+ * structures the entries point to.
+ */
+void gva_tlb_flush(struct vcpu *vcpu)
+{
+	if (vcpu->gva_tlb != NULL)
+		memset(vcpu->gva_tlb, 0, sizeof(struct gva_tlb));
+}
+
 /* Refer to SDM Vol.3A 6-39 section 6.15 for the format of paging fault error
  * code.
  *
@@ -319,6 +459,7 @@ int gva2gpa(struct vcpu *vcpu, uint64_t gva, uint64_t *gpa,
 		&vcpu->arch_vcpu.contexts[vcpu->arch_vcpu.cur_context];
 	enum vm_paging_mode pm = get_vcpu_paging_mode(vcpu);
 	struct page_walk_info pw_info;
+	struct gva_tlb_entry *tlb_entry = NULL;
 	int ret = 0;
 
 	if (!gpa || !err_code)
@@ -333,9 +474,21 @@ int gva2gpa(struct vcpu *vcpu, uint64_t gva, uint64_t *gpa,
 	pw_info.pse = true;
 	pw_info.nxe = cur_context->ia32_efer & MSR_IA32_EFER_NXE_BIT;
 	pw_info.wp = !!(cur_context->cr0 & CR0_WP);
+	pw_info.nr_entries = 0;
+	pw_info.all_rw = true;
+	pw_info.all_us = true;
+	pw_info.any_xd = false;
 
 	*err_code &=  ~PAGE_FAULT_P_FLAG;
 
+	if (pm != PAGING_MODE_0_LEVEL) {
+		pw_info.width = (pm == PAGING_MODE_2_LEVEL) ? 10 : 9;
+		tlb_entry = gva_tlb_slot(vcpu, gva);
+		if ((tlb_entry != NULL) &&
+			gva_tlb_lookup(tlb_entry, &pw_info, gva, gpa))
+			return 0;
+	}
+
 	if (pm == PAGING_MODE_4_LEVEL) {
 		pw_info.width = 9;
 		ret = _gva2gpa_common(vcpu, &pw_info, gva, gpa, err_code);
@@ -353,7 +506,10 @@ int gva2gpa(struct vcpu *vcpu, uint64_t gva, uint64_t *gpa,
 	if (ret == -EFAULT) {
 		if (pw_info.is_user_mode)
 			*err_code |= PAGE_FAULT_US_FLAG;
-	}
+	} else if ((ret == 0) && (tlb_entry != NULL) &&
+		(pw_info.nr_entries > 0))
+		gva_tlb_fill(tlb_entry, &pw_info, cur_context->cr3, pm,
+			gva, *gpa);
 
 	return ret;
 }
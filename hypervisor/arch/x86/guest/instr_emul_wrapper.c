@@ -307,11 +307,54 @@ int vm_gva2gpa(struct vcpu *vcpu, uint64_t gva, uint64_t *gpa,
 	return gva2gpa(vcpu, gva, gpa, err_code);
 }
 
+static struct decode_cache_entry *
+decode_cache_lookup(struct vcpu *vcpu, uint64_t rip)
+{
+	struct decode_cache *cache = vcpu->decode_cache;
+	uint64_t cr3;
+
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(struct decode_cache));
+		if (cache == NULL)
+			return NULL;
+		vcpu->decode_cache = cache;
+	}
+
+	cr3 = vcpu->arch_vcpu.contexts[vcpu->arch_vcpu.cur_context].cr3;
+	if (cache->cr3 != cr3) {
+		memset(cache->entries, 0, sizeof(cache->entries));
+		cache->cr3 = cr3;
+	}
+
+	return &cache->entries[(rip * 0x9E3779B97F4A7C15UL) >>
+		(64 - DECODE_CACHE_BITS)];
+}
+
+static bool decode_cache_match(struct decode_cache_entry *entry,
+	struct vie *vie, uint64_t rip, uint8_t cpu_mode, uint8_t cs_d)
+{
+	uint8_t i;
+
+	if (!entry->valid || (entry->rip != rip) ||
+		(entry->cpu_mode != cpu_mode) || (entry->cs_d != cs_d) ||
+		(entry->vie.num_valid != vie->num_valid))
+		return false;
+
+	/* the code may have been rewritten since */
+	for (i = 0; i < vie->num_valid; i++) {
+		if (entry->vie.inst[i] != vie->inst[i])
+			return false;
+	}
+
+	return true;
+}
+
 uint8_t decode_instruction(struct vcpu *vcpu)
 {
 	uint64_t guest_rip_gva, guest_rip_gpa;
 	char *guest_rip_hva;
 	struct emul_cnx *emul_cnx;
+	struct decode_cache_entry *entry;
 	uint32_t csar;
 	int retval = 0;
 	enum vm_cpu_mode cpu_mode;
@@ -341,6 +384,14 @@ uint8_t decode_instruction(struct vcpu *vcpu)
 	csar = exec_vmread(VMX_GUEST_CS_ATTR);
 	cpu_mode = get_vcpu_mode(vcpu);
 
+	entry = decode_cache_lookup(vcpu, guest_rip_gva);
+	if ((entry != NULL) && decode_cache_match(entry, &emul_cnx->vie,
+			guest_rip_gva, cpu_mode, SEG_DESC_DEF32(csar))) {
+		vcpu->decode_cache->hits++;
+		emul_cnx->vie = entry->vie;
+		return emul_cnx->vie.opsize;
+	}
+
 	retval = __decode_instruction(vcpu, guest_rip_gva,
 			cpu_mode, SEG_DESC_DEF32(csar), &emul_cnx->vie);
 
@@ -350,9 +401,48 @@ uint8_t decode_instruction(struct vcpu *vcpu)
 		return 0;
 	}
 
+	if (entry != NULL) {
+		vcpu->decode_cache->misses++;
+		entry->rip = guest_rip_gva;
+		entry->cpu_mode = cpu_mode;
+		entry->cs_d = SEG_DESC_DEF32(csar);
+		entry->vie = emul_cnx->vie;
+		entry->valid = 1;
+	}
+
 	return  emul_cnx->vie.opsize;
 }
 
+int get_decode_cache_info(char *str, int str_max)
+{
+	int i, len, size = str_max;
+	struct list_head *pos;
+	struct decode_cache *cache;
+	struct vcpu *vcpu;
+	struct vm *vm;
+
+	len = snprintf(str, size, "\r\nVM\tVCPU\tHITS\t\tMISSES");
+	size -= len;
+	str += len;
+
+	spinlock_obtain(&vm_list_lock);
+	list_for_each(pos, &vm_list) {
+		vm = list_entry(pos, struct vm, list);
+		foreach_vcpu(i, vm, vcpu) {
+			cache = vcpu->decode_cache;
+			len = snprintf(str, size, "\r\n%d\t%d\t%-16lld%lld",
+				vm->attr.id, vcpu->vcpu_id,
+				(cache != NULL) ? cache->hits : 0,
+				(cache != NULL) ? cache->misses : 0);
+			size -= len;
+			str += len;
+		}
+	}
+	spinlock_release(&vm_list_lock);
+	snprintf(str, size, "\r\n");
+	return 0;
+}
+
 int emulate_instruction(struct vcpu *vcpu)
 {
 	struct emul_cnx *emul_cnx;
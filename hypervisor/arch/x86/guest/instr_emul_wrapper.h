@@ -139,6 +139,29 @@ struct emul_cnx {
 	struct vcpu *vcpu;
 };
 
+/*
+ * Per-vcpu cache of decoded instructions, direct mapped by RIP. An entry
+ * is only used if the instruction bytes at RIP are still the same, and
+ * the whole cache is dropped when the guest switches CR3.
+ */
+#define DECODE_CACHE_BITS	3
+#define DECODE_CACHE_SIZE	(1U << DECODE_CACHE_BITS)
+
+struct decode_cache_entry {
+	uint64_t	rip;
+	uint8_t		cpu_mode;
+	uint8_t		cs_d;
+	uint8_t		valid;
+	struct vie	vie;
+};
+
+struct decode_cache {
+	uint64_t	cr3;
+	uint64_t	hits;
+	uint64_t	misses;
+	struct decode_cache_entry entries[DECODE_CACHE_SIZE];
+};
+
 /*
  * Identifiers for architecturally defined registers.
  */
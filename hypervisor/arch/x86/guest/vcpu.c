@@ -46,7 +46,23 @@ int create_vcpu(int cpu_id, struct vm *vm, struct vcpu **rtn_vcpu_handle)
 
 	/* Initialize the physical CPU ID for this VCPU */
 	vcpu->pcpu_id = cpu_id;
-	per_cpu(ever_run_vcpu, cpu_id) = vcpu;
+
+	/* Extended and debug state of a vcpu switched out from a shared
+	 * pcpu. A zeroed XSAVE header makes the first restore load the
+	 * init state.
+	 */
+	vcpu->xcr0 = 1UL;
+	vcpu->dr6 = 0xFFFF0FF0UL;
+	if (cpu_has_cap(X86_FEATURE_XSAVE)) {
+		uint32_t eax, ebx, ecx, edx, pages;
+
+		/* ECX covers every feature the guest may enable in XCR0 */
+		cpuid_subleaf(0xd, 0, &eax, &ebx, &ecx, &edx);
+		pages = (ecx + CPU_PAGE_SIZE - 1) / CPU_PAGE_SIZE;
+		vcpu->xsave_area = alloc_pages(pages);
+		ASSERT(vcpu->xsave_area != NULL, "");
+		memset(vcpu->xsave_area, 0, pages * CPU_PAGE_SIZE);
+	}
 
 	/* Initialize the parent VM reference */
 	vcpu->vm = vm;
@@ -117,7 +133,8 @@ int create_vcpu(int cpu_id, struct vm *vm, struct vcpu **rtn_vcpu_handle)
 	vcpu->launched = false;
 	vcpu->paused_cnt = 0;
 	vcpu->running = 0;
-	vcpu->ioreq_pending = 0;
+	vcpu->blocked = 0;
+	vcpu->ioreq_pending = IOREQ_NONE;
 	vcpu->arch_vcpu.nr_sipi = 0;
 	vcpu->pending_pre_work = 0;
 	vcpu->state = VCPU_INIT;
@@ -249,9 +266,14 @@ int destroy_vcpu(struct vcpu *vcpu)
 	atomic_dec(&vcpu->vm->hw.created_vcpus);
 
 	vlapic_free(vcpu);
+	free(vcpu->decode_cache);
+	free(vcpu->gva_tlb);
 	free(vcpu->arch_vcpu.vmcs);
 	free(vcpu->guest_msrs);
-	per_cpu(ever_run_vcpu, vcpu->pcpu_id) = NULL;
+	free(vcpu->msr_exits);
+	free(vcpu->xsave_area);
+	if (per_cpu(ever_run_vcpu, vcpu->pcpu_id) == vcpu)
+		per_cpu(ever_run_vcpu, vcpu->pcpu_id) = NULL;
 	free_pcpu(vcpu->pcpu_id);
 	free(vcpu);
 
@@ -277,7 +299,8 @@ void reset_vcpu(struct vcpu *vcpu)
 	vcpu->launched = false;
 	vcpu->paused_cnt = 0;
 	vcpu->running = 0;
-	vcpu->ioreq_pending = 0;
+	vcpu->blocked = 0;
+	vcpu->ioreq_pending = IOREQ_NONE;
 	vcpu->arch_vcpu.nr_sipi = 0;
 	vcpu->pending_pre_work = 0;
 	vlapic = vcpu->arch_vcpu.vlapic;
@@ -335,6 +358,91 @@ void schedule_vcpu(struct vcpu *vcpu)
 	release_schedule_lock(vcpu->pcpu_id);
 }
 
+static void save_vcpu_state(struct vcpu *vcpu)
+{
+	struct run_context *context =
+		&vcpu->arch_vcpu.contexts[vcpu->arch_vcpu.cur_context];
+
+	/* MSRs which not in the VMCS */
+	context->ia32_star = msr_read(MSR_IA32_STAR);
+	context->ia32_lstar = msr_read(MSR_IA32_LSTAR);
+	context->ia32_fmask = msr_read(MSR_IA32_FMASK);
+	context->ia32_kernel_gs_base = msr_read(MSR_IA32_KERNEL_GS_BASE);
+
+	/* DR7 is in the VMCS, the guest accesses the others directly */
+	CPU_DR_READ(dr0, &vcpu->dr[0]);
+	CPU_DR_READ(dr1, &vcpu->dr[1]);
+	CPU_DR_READ(dr2, &vcpu->dr[2]);
+	CPU_DR_READ(dr3, &vcpu->dr[3]);
+	CPU_DR_READ(dr6, &vcpu->dr6);
+
+	if (vcpu->xsave_area != NULL) {
+		vcpu->xcr0 = read_xcr(0);
+		asm volatile("xsave (%0)"
+				: : "r" (vcpu->xsave_area), "a" (~0U), "d" (~0U)
+				: "memory");
+	} else
+		asm volatile("fxsave (%0)"
+				: : "r" (context->fxstore_guest_area)
+				: "memory");
+}
+
+static void restore_vcpu_state(struct vcpu *vcpu)
+{
+	struct run_context *context =
+		&vcpu->arch_vcpu.contexts[vcpu->arch_vcpu.cur_context];
+	uint64_t vmcs_pa;
+
+	/* a vcpu not launched yet gets its VMCS loaded by init_vmcs() */
+	if (vcpu->launched) {
+		vmcs_pa = HVA2HPA(vcpu->arch_vcpu.vmcs);
+		exec_vmptrld(&vmcs_pa);
+	}
+
+	msr_write(MSR_IA32_STAR, context->ia32_star);
+	msr_write(MSR_IA32_LSTAR, context->ia32_lstar);
+	msr_write(MSR_IA32_FMASK, context->ia32_fmask);
+	msr_write(MSR_IA32_KERNEL_GS_BASE, context->ia32_kernel_gs_base);
+
+	CPU_DR_WRITE(dr0, vcpu->dr[0]);
+	CPU_DR_WRITE(dr1, vcpu->dr[1]);
+	CPU_DR_WRITE(dr2, vcpu->dr[2]);
+	CPU_DR_WRITE(dr3, vcpu->dr[3]);
+	CPU_DR_WRITE(dr6, vcpu->dr6);
+
+	if (vcpu->xsave_area != NULL) {
+		write_xcr(0, vcpu->xcr0);
+		asm volatile("xrstor (%0)"
+				: : "r" (vcpu->xsave_area), "a" (~0U), "d" (~0U)
+				: "memory");
+	} else
+		asm volatile("fxrstor (%0)"
+				: : "r" (context->fxstore_guest_area));
+}
+
+/*
+ * Make vcpu the owner of its pcpu's VMCS pointer, MSRs and FPU state.
+ * The hypervisor does not touch this state itself, so it is only moved
+ * when another vcpu ran on the pcpu since, not on every trip through
+ * the idle loop. A vcpu never launched on a pcpu nobody used keeps the
+ * state it finds, as vm0 does when taking over from the boot loader.
+ */
+void load_vcpu_state(struct vcpu *vcpu)
+{
+	struct vcpu *prev = per_cpu(ever_run_vcpu, vcpu->pcpu_id);
+
+	if (prev == vcpu)
+		return;
+
+	if (prev != NULL)
+		save_vcpu_state(prev);
+	if (prev != NULL || vcpu->launched)
+		restore_vcpu_state(vcpu);
+
+	per_cpu(ever_run_vcpu, vcpu->pcpu_id) = vcpu;
+	per_cpu(vcpu, vcpu->pcpu_id) = vcpu;
+}
+
 /* help function for vcpu create */
 int prepare_vcpu(struct vm *vm, int pcpu_id)
 {
@@ -375,8 +483,6 @@ int prepare_vcpu(struct vm *vm, int pcpu_id)
 	/* initialize the vcpu tsc aux */
 	vcpu->msr_tsc_aux_guest = vcpu->vcpu_id;
 
-	set_pcpu_used(pcpu_id);
-
 	INIT_LIST_HEAD(&vcpu->run_list);
 
 	return ret;
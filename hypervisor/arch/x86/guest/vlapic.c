@@ -94,11 +94,25 @@ apicv_set_tmr(struct vlapic *vlapic, int vector, bool level);
 static void
 apicv_batch_set_tmr(struct vlapic *vlapic);
 
+static void
+apicv_post_intr(struct vlapic *vlapic, int hostcpu);
+
 /*
  * Post an interrupt to the vcpu running on 'hostcpu'. This will use a
  * hardware assist if available (e.g. Posted Interrupt) or fall back to
- * sending an 'ipinum' to interrupt the 'hostcpu'.
+ * an event request, which sends an IPI to interrupt the 'hostcpu'.
  */
+static void
+vlapic_post_intr(struct vlapic *vlapic)
+{
+	if (vlapic->ops.apicv_post_intr) {
+		(*vlapic->ops.apicv_post_intr)(vlapic, vlapic->vcpu->pcpu_id);
+		return;
+	}
+
+	vcpu_make_request(vlapic->vcpu, ACRN_REQUEST_EVENT);
+}
+
 static void vlapic_set_error(struct vlapic *vlapic, uint32_t mask);
 
 static int vlapic_timer_expired(void *data);
@@ -594,7 +608,7 @@ vlapic_fire_lvt(struct vlapic *vlapic, uint32_t lvt)
 			return 0;
 		}
 		if (vlapic_set_intr_ready(vlapic, vec, false))
-			vcpu_make_request(vlapic->vcpu, ACRN_REQUEST_EVENT);
+			vlapic_post_intr(vlapic);
 		break;
 	case APIC_LVT_DM_NMI:
 		vcpu_inject_nmi(vlapic->vcpu);
@@ -1679,7 +1693,7 @@ vlapic_set_intr(struct vcpu *vcpu, int vector, bool level)
 
 	vlapic = vcpu->arch_vcpu.vlapic;
 	if (vlapic_set_intr_ready(vlapic, vector, level))
-		vcpu_make_request(vcpu, ACRN_REQUEST_EVENT);
+		vlapic_post_intr(vlapic);
 	else
 		ret = -ENODEV;
 
@@ -1952,7 +1966,23 @@ int vlapic_create(struct vcpu *vcpu)
 			vlapic->ops.apicv_batch_set_tmr =
 					apicv_batch_set_tmr;
 
-			vlapic->pir_desc = (struct pir_desc *)(&(vlapic->pir));
+			ASSERT(vcpu->vm->arch_vm.pir_descs != NULL,
+				"pir_desc allocate failed");
+			vlapic->pir_desc = (struct pir_desc *)
+				vcpu->vm->arch_vm.pir_descs + vcpu->vcpu_id;
+			memset(vlapic->pir_desc, 0, sizeof(struct pir_desc));
+
+			if (is_vapic_posted_intr_supported()) {
+				vlapic->ops.apicv_post_intr = apicv_post_intr;
+
+				/* where VT-d sends the notifications */
+				vlapic->pir_desc->pending =
+					((uint64_t)VECTOR_POSTED_INTR <<
+						PIR_DESC_NV_POS) |
+					((uint64_t)per_cpu(lapic_id,
+						vcpu->pcpu_id) <<
+						(PIR_DESC_NDST_POS + 8));
+			}
 		}
 
 		if (is_vcpu_bsp(vcpu)) {
@@ -2025,28 +2055,65 @@ apicv_set_intr_ready(struct vlapic *vlapic, int vector, __unused bool level)
 	mask = 1UL << (vector % 64);
 
 	atomic_set_long(&pir_desc->pir[idx], mask);
-	notify = (atomic_cmpxchg64((long *)&pir_desc->pending, 0, 1) == 0);
+	notify = !bitmap_test_and_set(PIR_DESC_ON, &pir_desc->pending);
 	return notify;
 }
 
+/*
+ * The interrupt is in the PIR already. A vcpu running in non-root mode
+ * on another pcpu takes it through the posted-interrupt notification
+ * without a VM exit; one in root mode or switched out folds the PIR
+ * into its vIRR before the next VM entry.
+ */
+static void
+apicv_post_intr(struct vlapic *vlapic, int hostcpu)
+{
+	struct vcpu *vcpu = vlapic->vcpu;
+
+	/* pairs with block_vcpu(), see there */
+	if (atomic_load(&vcpu->blocked) != 0) {
+		wake_vcpu(vcpu);
+		return;
+	}
+
+	if (atomic_load(&vcpu->running) == 1 &&
+			hostcpu != (int)get_cpu_id())
+		send_single_ipi(hostcpu, VECTOR_POSTED_INTR);
+}
+
 static int
 apicv_pending_intr(struct vlapic *vlapic, __unused int *vecptr)
 {
 	struct pir_desc *pir_desc;
 	struct lapic *lapic;
-	uint64_t pending, pirval;
-	uint32_t ppr, vpr;
+	uint64_t pirval;
+	uint32_t ppr, vpr, val;
 	int i;
 
 	pir_desc = vlapic->pir_desc;
-
-	pending = atomic_load64((long *)&pir_desc->pending);
-	if (!pending)
-		return 0;
-
 	lapic = vlapic->apic_page;
 	ppr = lapic->ppr & 0xF0;
 
+	/*
+	 * A vector may already sit in vIRR, moved there by
+	 * apicv_inject_pir() or by posted-interrupt processing while the
+	 * guest had interrupts disabled, with ON clear. RVI is the highest
+	 * vIRR bit, read the virtual APIC page as the VMCS of this vcpu
+	 * need not be loaded here.
+	 */
+	for (i = 7; i >= 0; i--) {
+		val = atomic_load((int *)&lapic->irr[i].val);
+		if (val != 0U) {
+			vpr = (i * 32 + fls(val)) & 0xF0;
+			if (vpr > ppr)
+				return 1;
+			break;
+		}
+	}
+
+	if (!bitmap_test(PIR_DESC_ON, &pir_desc->pending))
+		return 0;
+
 	if (ppr == 0)
 		return 1;
 
@@ -2126,6 +2193,70 @@ apicv_get_apic_page_addr(struct vlapic *vlapic)
 	return HVA2HPA(vlapic->apic_page);
 }
 
+/**
+ *APIC-v: Get the HPA to posted-interrupt descriptor
+ * **/
+uint64_t
+apicv_get_pir_desc_addr(struct vlapic *vlapic)
+{
+	return HVA2HPA(vlapic->pir_desc);
+}
+
+/*
+ * VMX and the posted format IRTE both drop the low 6 bits of the
+ * descriptor address. The heap only aligns to CONFIG_MALLOC_ALIGN, so the
+ * 64-byte descriptors of all vcpus of a VM are packed in pages instead.
+ */
+int
+apicv_create_pir_descs(struct vm *vm)
+{
+	uint32_t size;
+
+	if (!is_vapic_supported() || !is_vapic_intr_delivery_supported())
+		return 0;
+
+	size = vm->hw.num_vcpus * sizeof(struct pir_desc);
+	vm->arch_vm.pir_descs = alloc_pages((size + CPU_PAGE_SIZE - 1) >>
+			CPU_PAGE_SHIFT);
+	if (vm->arch_vm.pir_descs == NULL)
+		return -ENOMEM;
+
+	memset(vm->arch_vm.pir_descs, 0, size);
+	return 0;
+}
+
+void
+apicv_destroy_pir_descs(struct vm *vm)
+{
+	free(vm->arch_vm.pir_descs);
+	vm->arch_vm.pir_descs = NULL;
+}
+
+/*
+ * VT-d posts interrupts of passthrough devices to a vcpu whether it runs
+ * or not. While the vcpu is blocked its notifications go to the wakeup
+ * vector, which exits non-root mode to let the scheduler run it again.
+ */
+void
+apicv_set_pi_wakeup(struct vlapic *vlapic, bool wakeup)
+{
+	struct pir_desc *pir_desc = vlapic->pir_desc;
+	uint64_t old, new;
+
+	if (pir_desc == NULL || !is_vapic_posted_intr_supported())
+		return;
+
+	do {
+		old = atomic_load64((long *)&pir_desc->pending);
+		new = (old & ~PIR_DESC_NV_MASK) | ((uint64_t)(wakeup ?
+			VECTOR_POSTED_INTR_WAKEUP : VECTOR_POSTED_INTR) <<
+			PIR_DESC_NV_POS);
+		if (new == old)
+			return;
+	} while (atomic_cmpxchg64((long *)&pir_desc->pending, old, new)
+			!= (long)old);
+}
+
 /*
  * Transfer the pending interrupts in the PIR descriptor to the IRR
  * in the virtual APIC page.
@@ -2142,7 +2273,9 @@ apicv_inject_pir(struct vlapic *vlapic)
 	struct lapic_reg *irr = NULL;
 
 	pir_desc = vlapic->pir_desc;
-	if (atomic_cmpxchg64((long *)&pir_desc->pending, 1, 0) != 1)
+	if (!bitmap_test(PIR_DESC_ON, &pir_desc->pending))
+		return;
+	if (!bitmap_test_and_clear(PIR_DESC_ON, &pir_desc->pending))
 		return;
 
 	pirval = 0;
@@ -91,6 +91,17 @@
 
 struct vlapic;
 
+/*
+ * The processor and VT-d both update 'pending' of the posted-interrupt
+ * descriptor: ON and SN are bits, NV is the notification vector and
+ * NDST the APIC ID (bits 15:8 in xAPIC mode) of the notified pcpu.
+ */
+#define PIR_DESC_ON		0
+#define PIR_DESC_SN		1
+#define PIR_DESC_NV_POS		16
+#define PIR_DESC_NV_MASK	(0xFFUL << PIR_DESC_NV_POS)
+#define PIR_DESC_NDST_POS	32
+
 struct pir_desc {
 	uint64_t pir[4];
 	uint64_t pending;
@@ -146,7 +157,6 @@ struct vlapic {
 	 */
 	uint32_t	svr_last;
 	uint32_t	lvt_last[VLAPIC_MAXLVT_INDEX + 1];
-	struct pir_desc	pir;
 };
 
 #endif	/* _VLAPIC_PRIV_H_ */
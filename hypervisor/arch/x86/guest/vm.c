@@ -84,8 +84,7 @@ int create_vm(struct vm_description *vm_desc, struct vm **rtn_vm)
 	init_vm(vm_desc, vm);
 
 
-	/* Init mmio list */
-	INIT_LIST_HEAD(&vm->mmio_list);
+	INIT_LIST_HEAD(&vm->ptdev_list);
 
 	if (vm->hw.num_vcpus == 0)
 		vm->hw.num_vcpus = phy_cpu_num;
@@ -98,6 +97,12 @@ int create_vm(struct vm_description *vm_desc, struct vm **rtn_vm)
 		goto err1;
 	}
 
+	status = apicv_create_pir_descs(vm);
+	if (status != 0) {
+		pr_err("%s, pir_desc allocation failed\n", __func__);
+		goto err2;
+	}
+
 	for (id = 0; id < sizeof(long) * 8; id++)
 		if (bitmap_test_and_set(id, &vmid_bitmap) == 0)
 			break;
@@ -109,6 +114,7 @@ int create_vm(struct vm_description *vm_desc, struct vm **rtn_vm)
 
 	/* gpa_lowtop are used for system start up */
 	vm->hw.gpa_lowtop = 0;
+	vm->sched_weight = SCHED_DEFAULT_WEIGHT;
 	/* Only for SOS: Configure VM software information */
 	/* For UOS: This VM software information is configure in DM */
 	if (is_vm0(vm)) {
@@ -120,10 +126,16 @@ int create_vm(struct vm_description *vm_desc, struct vm **rtn_vm)
 		if (status != 0)
 			goto err2;
 #endif
+		/* the service OS is not time-shared with UOS vcpus */
+		vm->rt_pinned = true;
 	} else {
 		/* populate UOS vm fields according to vm_desc */
 		vm->sworld_control.sworld_enabled =
 			vm_desc->sworld_enabled;
+		vm->rt_pinned = vm_desc->rt_pinned;
+		vm->hlt_exit = vm_desc->hlt_exit;
+		vm->ioreq_poll_us = min(vm_desc->ioreq_poll_us,
+				CONFIG_IOREQ_POLL_MAX_US);
 		memcpy_s(&vm->GUID[0], sizeof(vm->GUID),
 					&vm_desc->GUID[0],
 					sizeof(vm_desc->GUID));
@@ -143,7 +155,7 @@ int create_vm(struct vm_description *vm_desc, struct vm **rtn_vm)
 
 	/* Create virtual uart */
 	if (is_vm0(vm))
-		vm->vuart = vuart_init(vm);
+		vm->vuart = vuart_console_init(vm);
 
 	vm->vpic = vpic_init(vm);
 
@@ -160,6 +172,8 @@ int create_vm(struct vm_description *vm_desc, struct vm **rtn_vm)
 	/* Populate return VM handle */
 	*rtn_vm = vm;
 	vm->sw.io_shared_page = NULL;
+	vm->sw.coalesced_ring = NULL;
+	spinlock_init(&vm->coalesced_lock);
 
 	status = set_vcpuid_entries(vm);
 	if (status != 0)
@@ -174,6 +188,7 @@ err4:
 err3:
 	vpic_cleanup(vm);
 err2:
+	apicv_destroy_pir_descs(vm);
 	free(vm->hw.vcpu_array);
 err1:
 	free(vm);
@@ -194,6 +209,9 @@ int shutdown_vm(struct vm *vm)
 	if (vm->state != VM_PAUSED)
 		return -EINVAL;
 
+	/* no device may post to the PIR descriptors of the vcpus freed below */
+	ptdev_release_all_entries(vm);
+
 	foreach_vcpu(i, vm, vcpu) {
 		reset_vcpu(vcpu);
 		destroy_vcpu(vcpu);
@@ -203,11 +221,11 @@ int shutdown_vm(struct vm *vm)
 	list_del_init(&vm->list);
 	spinlock_release(&vm_list_lock);
 
-	ptdev_release_all_entries(vm);
-
 	/* cleanup and free vioapic */
 	vioapic_cleanup(vm->arch_vm.virt_ioapic);
 
+	vuart_deinit(vm);
+
 	/* Destroy secure world */
 	if (vm->sworld_control.sworld_enabled)
 		destroy_secure_world(vm);
@@ -229,6 +247,7 @@ int shutdown_vm(struct vm *vm)
 	if (vm->vpic)
 		vpic_cleanup(vm);
 
+	apicv_destroy_pir_descs(vm);
 	free(vm->hw.vcpu_array);
 
 	/* TODO: De-Configure HV-SW */
@@ -298,8 +317,10 @@ int prepare_vm0(void)
 		return ret;
 
 	/* Allocate all cpus to vm0 at the beginning */
-	for (i = 0; i < phy_cpu_num; i++)
+	for (i = 0; i < phy_cpu_num; i++) {
+		set_pcpu_used(i);
 		prepare_vcpu(vm, i);
+	}
 
 	/* start vm0 BSP automatically */
 	start_vm(vm);
@@ -94,6 +94,22 @@ int vmcall_vmexit_handler(struct vcpu *vcpu)
 		ret = hcall_notify_req_finish(param1, param2);
 		break;
 
+	case HC_SET_COALESCED_RING:
+		ret = hcall_set_coalesced_ring(vm, param1, param2);
+		break;
+
+	case HC_SET_COALESCED_ZONE:
+		ret = hcall_set_coalesced_zone(vm, param1, param2);
+		break;
+
+	case HC_SETUP_VUART:
+		ret = hcall_setup_vuart(vm, param1, param2);
+		break;
+
+	case HC_NOTIFY_VUART:
+		ret = hcall_notify_vuart(vm, param1);
+		break;
+
 	case HC_VM_SET_MEMMAP:
 		ret = hcall_set_vm_memmap(vm, param1, param2);
 		break;
@@ -7,23 +7,264 @@
 #include <hypervisor.h>
 #include <ucode.h>
 
-/*MRS need to be emulated, the order in this array better as freq of ops*/
-static const uint32_t emulated_msrs[] = {
-	MSR_IA32_TSC_DEADLINE,  /* Enable TSC_DEADLINE VMEXIT */
-	MSR_IA32_BIOS_UPDT_TRIG, /* Enable MSR_IA32_BIOS_UPDT_TRIG */
-	MSR_IA32_BIOS_SIGN_ID, /* Enable MSR_IA32_BIOS_SIGN_ID */
-	MSR_IA32_TIME_STAMP_COUNTER,
-
-/* following MSR not emulated now */
+/* when guest accesses are trapped through the MSR bitmap */
+enum vmsr_trap {
+	VMSR_PASS,		/* never, the guest owns the MSR */
+	VMSR_TRAP,		/* always */
+	VMSR_TRAP_SHARED,	/* for VMs which may share pcpus */
+};
+
+struct vmsr_entry {
+	uint32_t start;		/* first MSR of the range */
+	uint32_t end;		/* last MSR of the range */
+	int shadow;		/* guest_msrs slot, or -1 */
+	enum vmsr_trap intercept;
+	/* a NULL handler accesses the shadow, or injects #GP without one */
+	int (*rdmsr)(struct vcpu *vcpu, uint32_t msr, uint64_t *val);
+	int (*wrmsr)(struct vcpu *vcpu, uint32_t msr, uint64_t val);
+	const char *name;
+};
+
+static int rdmsr_lapic(struct vcpu *vcpu, uint32_t msr, uint64_t *val)
+{
+	vlapic_rdmsr(vcpu, msr, val);
+	return 0;
+}
+
+static int wrmsr_lapic(struct vcpu *vcpu, uint32_t msr, uint64_t val)
+{
+	vlapic_wrmsr(vcpu, msr, val);
+	return 0;
+}
+
+static int rdmsr_tsc(struct vcpu *vcpu, __unused uint32_t msr,
+		uint64_t *val)
+{
+	int cur_context = vcpu->arch_vcpu.cur_context;
+
+	/* Add the TSC_offset to host TSC to get guest TSC */
+	*val = rdtsc() + vcpu->arch_vcpu.contexts[cur_context].tsc_offset;
+	return 0;
+}
+
+static int wrmsr_tsc(struct vcpu *vcpu, __unused uint32_t msr,
+		uint64_t val)
+{
+	struct run_context *cur_context =
+		&vcpu->arch_vcpu.contexts[vcpu->arch_vcpu.cur_context];
+
+	/*Caculate TSC offset from changed TSC MSR value*/
+	cur_context->tsc_offset = val - rdtsc();
+	exec_vmwrite64(VMX_TSC_OFFSET_FULL, cur_context->tsc_offset);
+	return 0;
+}
+
+static int wrmsr_ucode(struct vcpu *vcpu, __unused uint32_t msr,
+		uint64_t val)
+{
+	/* We only allow SOS to do uCode update */
+	if (is_vm0(vcpu->vm))
+		acrn_update_ucode(vcpu, val);
+	return 0;
+}
+
+static int rdmsr_ucode_rev(__unused struct vcpu *vcpu,
+		__unused uint32_t msr, uint64_t *val)
+{
+	*val = get_microcode_version();
+	return 0;
+}
+
+static int rdmsr_zero(__unused struct vcpu *vcpu,
+		__unused uint32_t msr, uint64_t *val)
+{
+	*val = 0;
+	return 0;
+}
+
+static int wrmsr_ignore(__unused struct vcpu *vcpu,
+		__unused uint32_t msr, __unused uint64_t val)
+{
+	return 0;
+}
+
+static int rdmsr_pstate(__unused struct vcpu *vcpu, uint32_t msr,
+		uint64_t *val)
+{
+	*val = msr_read(msr);
+	return 0;
+}
+
+static int wrmsr_pstate(struct vcpu *vcpu, uint32_t msr, uint64_t val)
+{
+	if (validate_pstate(vcpu->vm, val) == 0)
+		msr_write(msr, val);
+	return 0;
+}
+
+static int rdmsr_mtrr(__unused struct vcpu *vcpu, __unused uint32_t msr,
+		__unused uint64_t *val)
+{
+#ifdef CONFIG_MTRR_ENABLED
+	*val = mtrr_rdmsr(vcpu, msr);
+	return 0;
+#else
+	return -EACCES;
+#endif
+}
+
+static int wrmsr_mtrr(__unused struct vcpu *vcpu, __unused uint32_t msr,
+		__unused uint64_t val)
+{
+#ifdef CONFIG_MTRR_ENABLED
+	mtrr_wrmsr(vcpu, msr, val);
+	return 0;
+#else
+	return -EACCES;
+#endif
+}
+
+static const uint32_t sysenter_fields[] = {
+	VMX_GUEST_IA32_SYSENTER_CS,
+	VMX_GUEST_IA32_SYSENTER_ESP,
+	VMX_GUEST_IA32_SYSENTER_EIP,
+};
+
+static int rdmsr_sysenter(__unused struct vcpu *vcpu, uint32_t msr,
+		uint64_t *val)
+{
+	*val = exec_vmread(sysenter_fields[msr - MSR_IA32_SYSENTER_CS]);
+	return 0;
+}
+
+static int wrmsr_sysenter(__unused struct vcpu *vcpu, uint32_t msr,
+		uint64_t val)
+{
+	exec_vmwrite(sysenter_fields[msr - MSR_IA32_SYSENTER_CS], val);
+	return 0;
+}
+
+static int wrmsr_gs_base(__unused struct vcpu *vcpu,
+		__unused uint32_t msr, uint64_t val)
+{
+	exec_vmwrite(VMX_GUEST_GS_BASE, val);
+	return 0;
+}
+
 /*
- *	MSR_IA32_APIC_BASE,
- *	MSR_IA32_SYSENTER_CS,
- *	MSR_IA32_SYSENTER_ESP,
- *	MSR_IA32_SYSENTER_EIP,
- *	MSR_IA32_TSC_AUX,
+ * MSRs emulated by the hypervisor, the order in this array better as
+ * freq of ops. Intercepted entries are trapped through the MSR bitmap,
+ * the others are only handled when they exit for another reason.
+ *
+ * The PMU is not switched with the vcpu, so VMs which are not pinned
+ * see it as a counter-less stub instead of the counters of whichever
+ * vcpu last ran on the pcpu. CPUID leaf 0xa reports no PMU anyway.
  */
+static const struct vmsr_entry vmsr_table[] = {
+	{ MSR_IA32_TSC_DEADLINE, MSR_IA32_TSC_DEADLINE, IDX_TSC_DEADLINE,
+		VMSR_TRAP, rdmsr_lapic, wrmsr_lapic, "TSC_DEADLINE" },
+	{ MSR_IA32_TIME_STAMP_COUNTER, MSR_IA32_TIME_STAMP_COUNTER, -1,
+		VMSR_TRAP, rdmsr_tsc, wrmsr_tsc, "TSC" },
+	{ MSR_IA32_PERF_CTL, MSR_IA32_PERF_CTL, -1,
+		VMSR_TRAP, rdmsr_pstate, wrmsr_pstate, "PERF_CTL" },
+	{ MSR_IA32_BIOS_UPDT_TRIG, MSR_IA32_BIOS_UPDT_TRIG, -1,
+		VMSR_TRAP, NULL, wrmsr_ucode, "BIOS_UPDT_TRIG" },
+	{ MSR_IA32_BIOS_SIGN_ID, MSR_IA32_BIOS_SIGN_ID, -1,
+		VMSR_TRAP, rdmsr_ucode_rev, wrmsr_ignore, "BIOS_SIGN_ID" },
+
+	/* below MSR protected from guest OS, if access to inject gp*/
+	{ MSR_IA32_MTRR_CAP, MSR_IA32_MTRR_CAP, -1,
+		VMSR_TRAP, rdmsr_mtrr, NULL, "MTRR_CAP" },
+	{ MSR_IA32_MTRR_DEF_TYPE, MSR_IA32_MTRR_DEF_TYPE, -1,
+		VMSR_TRAP, rdmsr_mtrr, wrmsr_mtrr, "MTRR_DEF_TYPE" },
+	{ MSR_IA32_MTRR_FIX64K_00000, MSR_IA32_MTRR_FIX64K_00000, -1,
+		VMSR_TRAP, rdmsr_mtrr, wrmsr_mtrr, "MTRR_FIX64K" },
+	{ MSR_IA32_MTRR_FIX16K_80000, MSR_IA32_MTRR_FIX16K_A0000, -1,
+		VMSR_TRAP, rdmsr_mtrr, wrmsr_mtrr, "MTRR_FIX16K" },
+	{ MSR_IA32_MTRR_FIX4K_C0000, MSR_IA32_MTRR_FIX4K_F8000, -1,
+		VMSR_TRAP, rdmsr_mtrr, wrmsr_mtrr, "MTRR_FIX4K" },
+	{ MSR_IA32_MTRR_PHYSBASE_0, MSR_IA32_MTRR_PHYSMASK_9, -1,
+		VMSR_TRAP, NULL, NULL, "MTRR_PHYS" },
+	{ MSR_IA32_VMX_BASIC, MSR_IA32_VMX_TRUE_ENTRY_CTLS, -1,
+		VMSR_TRAP, NULL, NULL, "VMX_CAPS" },
+
+	{ MSR_IA32_PMC0, MSR_IA32_PMC7, -1,
+		VMSR_TRAP_SHARED, rdmsr_zero, wrmsr_ignore, "PMC" },
+	{ MSR_IA32_PERFEVTSEL0, MSR_IA32_PERFEVTSEL7, -1,
+		VMSR_TRAP_SHARED, rdmsr_zero, wrmsr_ignore, "PERFEVTSEL" },
+	{ MSR_OFFCORE_RSP_0, MSR_OFFCORE_RSP_1, -1,
+		VMSR_TRAP_SHARED, rdmsr_zero, wrmsr_ignore, "OFFCORE_RSP" },
+	{ MSR_IA32_FIXED_CTR0, MSR_IA32_FIXED_CTR2, -1,
+		VMSR_TRAP_SHARED, rdmsr_zero, wrmsr_ignore, "FIXED_CTR" },
+	{ MSR_IA32_FIXED_CTR_CTL, MSR_IA32_PERF_GLOBAL_OVF_CTRL, -1,
+		VMSR_TRAP_SHARED, rdmsr_zero, wrmsr_ignore, "PERF_GLOBAL" },
+	{ MSR_IA32_PEBS_ENABLE, MSR_IA32_PEBS_ENABLE, -1,
+		VMSR_TRAP_SHARED, rdmsr_zero, wrmsr_ignore, "PEBS_ENABLE" },
+	{ MSR_IA32_A_PMC0, MSR_IA32_A_PMC7, -1,
+		VMSR_TRAP_SHARED, rdmsr_zero, wrmsr_ignore, "A_PMC" },
+
+	/* following MSR not emulated now just left for future */
+	{ MSR_IA32_SYSENTER_CS, MSR_IA32_SYSENTER_EIP, -1,
+		VMSR_PASS, rdmsr_sysenter, wrmsr_sysenter, "SYSENTER" },
+	{ MSR_IA32_GS_BASE, MSR_IA32_GS_BASE, -1,
+		VMSR_PASS, NULL, wrmsr_gs_base, "GS_BASE" },
+	/* switched around vmentry through vcpu->msr_tsc_aux_guest */
+	{ MSR_IA32_TSC_AUX, MSR_IA32_TSC_AUX, -1,
+		VMSR_PASS, NULL, NULL, "TSC_AUX" },
+	{ MSR_IA32_APIC_BASE, MSR_IA32_APIC_BASE, -1,
+		VMSR_PASS, rdmsr_lapic, wrmsr_lapic, "APIC_BASE" },
 };
 
+#define VMSR_TABLE_SIZE		ARRAY_SIZE(vmsr_table)
+#define VMSR_INDEX_RANGE	0x2000U
+#define VMSR_HIGH_BASE		0xC0000000U
+
+/*
+ * vmsr_table slot + 1 for each MSR covered by the MSR bitmap, 0 for
+ * MSRs without emulation. Built once by the first VM.
+ */
+static uint8_t vmsr_low_index[VMSR_INDEX_RANGE];
+static uint8_t vmsr_high_index[VMSR_INDEX_RANGE];
+static bool vmsr_index_ready;
+static spinlock_t vmsr_index_lock = { .head = 0, .tail = 0 };
+
+static void init_vmsr_index(void)
+{
+	uint32_t i, msr;
+
+	spinlock_obtain(&vmsr_index_lock);
+	if (vmsr_index_ready) {
+		spinlock_release(&vmsr_index_lock);
+		return;
+	}
+
+	for (i = 0; i < VMSR_TABLE_SIZE; i++) {
+		for (msr = vmsr_table[i].start; msr <= vmsr_table[i].end;
+				msr++) {
+			if (msr < VMSR_INDEX_RANGE)
+				vmsr_low_index[msr] = i + 1;
+			else if (msr - VMSR_HIGH_BASE < VMSR_INDEX_RANGE)
+				vmsr_high_index[msr - VMSR_HIGH_BASE] = i + 1;
+		}
+	}
+
+	vmsr_index_ready = true;
+	spinlock_release(&vmsr_index_lock);
+}
+
+/* Return the vmsr_table slot of msr, VMSR_TABLE_SIZE if not emulated */
+static inline uint32_t find_vmsr(uint32_t msr)
+{
+	uint8_t idx = 0;
+
+	if (msr < VMSR_INDEX_RANGE)
+		idx = vmsr_low_index[msr];
+	else if (msr - VMSR_HIGH_BASE < VMSR_INDEX_RANGE)
+		idx = vmsr_high_index[msr - VMSR_HIGH_BASE];
+
+	return (idx == 0) ? VMSR_TABLE_SIZE : (uint32_t)(idx - 1);
+}
+
 static void enable_msr_interception(uint8_t *bitmap, uint32_t msr)
 {
 	uint8_t *read_map;
@@ -77,16 +318,13 @@ void disable_msr_interception(uint8_t *bitmap, uint32_t msr)
 
 void init_msr_emulation(struct vcpu *vcpu)
 {
-	uint32_t i = 0;
-	uint32_t msrs_count =  ARRAY_SIZE(emulated_msrs);
+	uint32_t i, msr;
 	void *msr_bitmap;
 	uint64_t value64;
 
-	ASSERT(msrs_count == IDX_MAX_MSR,
-		"MSR ID should be matched with emulated_msrs");
-
 	/*msr bitmap, just allocated/init once, and used for all vm's vcpu*/
 	if (is_vcpu_bsp(vcpu)) {
+		init_vmsr_index();
 
 		/* Allocate and initialize memory for MSR bitmap region*/
 		vcpu->vm->arch_vm.msr_bitmap = alloc_page();
@@ -95,32 +333,15 @@ void init_msr_emulation(struct vcpu *vcpu)
 
 		msr_bitmap = vcpu->vm->arch_vm.msr_bitmap;
 
-		for (i = 0; i < msrs_count; i++)
-			enable_msr_interception(msr_bitmap, emulated_msrs[i]);
-
-		enable_msr_interception(msr_bitmap, MSR_IA32_PERF_CTL);
-
-		/* below MSR protected from guest OS, if access to inject gp*/
-		enable_msr_interception(msr_bitmap, MSR_IA32_MTRR_CAP);
-		enable_msr_interception(msr_bitmap, MSR_IA32_MTRR_DEF_TYPE);
-
-		for (i = MSR_IA32_MTRR_PHYSBASE_0;
-			i <= MSR_IA32_MTRR_PHYSMASK_9; i++) {
-			enable_msr_interception(msr_bitmap, i);
-		}
-
-		enable_msr_interception(msr_bitmap, MSR_IA32_MTRR_FIX64K_00000);
-		enable_msr_interception(msr_bitmap, MSR_IA32_MTRR_FIX16K_80000);
-		enable_msr_interception(msr_bitmap, MSR_IA32_MTRR_FIX16K_A0000);
-
-		for (i = MSR_IA32_MTRR_FIX4K_C0000;
-			i <= MSR_IA32_MTRR_FIX4K_F8000; i++) {
-			enable_msr_interception(msr_bitmap, i);
-		}
-
-		for (i = MSR_IA32_VMX_BASIC;
-			i <= MSR_IA32_VMX_TRUE_ENTRY_CTLS; i++) {
-			enable_msr_interception(msr_bitmap, i);
+		for (i = 0; i < VMSR_TABLE_SIZE; i++) {
+			if (vmsr_table[i].intercept == VMSR_PASS)
+				continue;
+			if (vmsr_table[i].intercept == VMSR_TRAP_SHARED &&
+					vcpu->vm->rt_pinned)
+				continue;
+			for (msr = vmsr_table[i].start;
+				msr <= vmsr_table[i].end; msr++)
+				enable_msr_interception(msr_bitmap, msr);
 		}
 	}
 
@@ -129,105 +350,43 @@ void init_msr_emulation(struct vcpu *vcpu)
 	exec_vmwrite64(VMX_MSR_BITMAP_FULL, value64);
 	pr_dbg("VMX_MSR_BITMAP: 0x%016llx ", value64);
 
-	vcpu->guest_msrs = (uint64_t *)calloc(msrs_count, sizeof(uint64_t));
-
+	vcpu->guest_msrs = (uint64_t *)calloc(IDX_MAX_MSR, sizeof(uint64_t));
 	ASSERT(vcpu->guest_msrs != NULL, "");
-	memset(vcpu->guest_msrs, 0, msrs_count * sizeof(uint64_t));
+
+	/* one more slot counts the MSRs missing in vmsr_table */
+	vcpu->msr_exits = (uint32_t *)calloc(VMSR_TABLE_SIZE + 1,
+			sizeof(uint32_t));
+	ASSERT(vcpu->msr_exits != NULL, "");
 }
 
 int rdmsr_vmexit_handler(struct vcpu *vcpu)
 {
-	uint32_t msr;
+	uint32_t msr, i;
 	uint64_t v = 0;
+	int err = -EACCES;
+	const struct vmsr_entry *entry;
 	int cur_context = vcpu->arch_vcpu.cur_context;
 
 	/* Read the msr value */
 	msr = vcpu->arch_vcpu.contexts[cur_context].guest_cpu_regs.regs.rcx;
 
-	/* Do the required processing for each msr case */
-	switch (msr) {
-	case MSR_IA32_TSC_DEADLINE:
-	{
-		vlapic_rdmsr(vcpu, msr, &v);
-		break;
-	}
-	case MSR_IA32_TIME_STAMP_COUNTER:
-	{
-		/* Add the TSC_offset to host TSC to get guest TSC */
-		v = rdtsc() + vcpu->arch_vcpu.contexts[cur_context].tsc_offset;
-		break;
-	}
-	case MSR_IA32_MTRR_CAP:
-	case MSR_IA32_MTRR_DEF_TYPE:
-	case MSR_IA32_MTRR_FIX64K_00000:
-	case MSR_IA32_MTRR_FIX16K_80000:
-	case MSR_IA32_MTRR_FIX16K_A0000:
-	case MSR_IA32_MTRR_FIX4K_C0000:
-	case MSR_IA32_MTRR_FIX4K_C8000:
-	case MSR_IA32_MTRR_FIX4K_D0000:
-	case MSR_IA32_MTRR_FIX4K_D8000:
-	case MSR_IA32_MTRR_FIX4K_E0000:
-	case MSR_IA32_MTRR_FIX4K_E8000:
-	case MSR_IA32_MTRR_FIX4K_F0000:
-	case MSR_IA32_MTRR_FIX4K_F8000:
-	{
-#ifdef CONFIG_MTRR_ENABLED
-		v = mtrr_rdmsr(vcpu, msr);
-#else
-		vcpu_inject_gp(vcpu, 0);
-#endif
-		break;
-	}
-	case MSR_IA32_BIOS_SIGN_ID:
-	{
-		v = get_microcode_version();
-		break;
-	}
-	case MSR_IA32_PERF_CTL:
-	{
-		v = msr_read(msr);
-		break;
-	}
+	i = find_vmsr(msr);
+	vcpu->msr_exits[i]++;
 
-	/* following MSR not emulated now just left for future */
-	case MSR_IA32_SYSENTER_CS:
-	{
-		v = exec_vmread(VMX_GUEST_IA32_SYSENTER_CS);
-		break;
-	}
-	case MSR_IA32_SYSENTER_ESP:
-	{
-		v = exec_vmread(VMX_GUEST_IA32_SYSENTER_ESP);
-		break;
-	}
-	case MSR_IA32_SYSENTER_EIP:
-	{
-		v = exec_vmread(VMX_GUEST_IA32_SYSENTER_EIP);
-		break;
-	}
-	case MSR_IA32_TSC_AUX:
-	{
-		v = vcpu->arch_vcpu.msr_tsc_aux;
-		break;
-	}
-	case MSR_IA32_APIC_BASE:
-	{
-		/* Read APIC base */
-		vlapic_rdmsr(vcpu, msr, &v);
-		break;
-	}
-	default:
-	{
-		if (!((msr >= MSR_IA32_MTRR_PHYSBASE_0 &&
-			msr <= MSR_IA32_MTRR_PHYSMASK_9) ||
-		      (msr >= MSR_IA32_VMX_BASIC &&
-			msr <= MSR_IA32_VMX_TRUE_ENTRY_CTLS))) {
-			pr_warn("rdmsr: %lx should not come here!", msr);
+	if (i < VMSR_TABLE_SIZE) {
+		entry = &vmsr_table[i];
+		if (entry->rdmsr != NULL)
+			err = entry->rdmsr(vcpu, msr, &v);
+		else if (entry->shadow >= 0) {
+			v = vcpu->guest_msrs[entry->shadow];
+			err = 0;
 		}
+	} else
+		pr_warn("rdmsr: %lx should not come here!", msr);
+
+	if (err != 0) {
 		vcpu_inject_gp(vcpu, 0);
 		v = 0;
-		break;
-	}
 	}
 
 	/* Store the MSR contents in RAX and RDX */
@@ -242,8 +401,10 @@ int rdmsr_vmexit_handler(struct vcpu *vcpu)
 
 int wrmsr_vmexit_handler(struct vcpu *vcpu)
 {
-	uint32_t msr;
+	uint32_t msr, i;
 	uint64_t v;
+	int err = -EACCES;
+	const struct vmsr_entry *entry;
 	struct run_context *cur_context =
 		&vcpu->arch_vcpu.contexts[vcpu->arch_vcpu.cur_context];
 
@@ -254,111 +415,73 @@ int wrmsr_vmexit_handler(struct vcpu *vcpu)
 	v = (((uint64_t) cur_context->guest_cpu_regs.regs.rdx) << 32) |
 	    ((uint64_t) cur_context->guest_cpu_regs.regs.rax);
 
-	/* Do the required processing for each msr case */
-	switch (msr) {
-	case MSR_IA32_TSC_DEADLINE:
-	{
-		vlapic_wrmsr(vcpu, msr, v);
-		break;
-	}
-	case MSR_IA32_TIME_STAMP_COUNTER:
-	{
-		/*Caculate TSC offset from changed TSC MSR value*/
-		cur_context->tsc_offset = v - rdtsc();
-		exec_vmwrite64(VMX_TSC_OFFSET_FULL, cur_context->tsc_offset);
-		break;
-	}
+	i = find_vmsr(msr);
+	vcpu->msr_exits[i]++;
 
-	case MSR_IA32_MTRR_DEF_TYPE:
-	case MSR_IA32_MTRR_FIX64K_00000:
-	case MSR_IA32_MTRR_FIX16K_80000:
-	case MSR_IA32_MTRR_FIX16K_A0000:
-	case MSR_IA32_MTRR_FIX4K_C0000:
-	case MSR_IA32_MTRR_FIX4K_C8000:
-	case MSR_IA32_MTRR_FIX4K_D0000:
-	case MSR_IA32_MTRR_FIX4K_D8000:
-	case MSR_IA32_MTRR_FIX4K_E0000:
-	case MSR_IA32_MTRR_FIX4K_E8000:
-	case MSR_IA32_MTRR_FIX4K_F0000:
-	case MSR_IA32_MTRR_FIX4K_F8000:
-	{
-#ifdef CONFIG_MTRR_ENABLED
-		mtrr_wrmsr(vcpu, msr, v);
-#else
-		vcpu_inject_gp(vcpu, 0);
-#endif
-		break;
-	}
-	case MSR_IA32_MTRR_CAP:
-	{
-		vcpu_inject_gp(vcpu, 0);
-		break;
-	}
-	case MSR_IA32_BIOS_SIGN_ID:
-	{
-		break;
-	}
-	case MSR_IA32_BIOS_UPDT_TRIG:
-	{
-		/* We only allow SOS to do uCode update */
-		if (is_vm0(vcpu->vm))
-			acrn_update_ucode(vcpu, v);
-		break;
-	}
-	case MSR_IA32_PERF_CTL:
-	{
-		if (validate_pstate(vcpu->vm, v)) {
-			break;
+	if (i < VMSR_TABLE_SIZE) {
+		entry = &vmsr_table[i];
+		if (entry->wrmsr != NULL)
+			err = entry->wrmsr(vcpu, msr, v);
+		else if (entry->shadow >= 0) {
+			vcpu->guest_msrs[entry->shadow] = v;
+			err = 0;
 		}
-		msr_write(msr, v);
-		break;
-	}
+	} else
+		pr_warn("wrmsr: %lx should not come here!", msr);
 
-	/* following MSR not emulated now just left for future */
-	case MSR_IA32_SYSENTER_CS:
-	{
-		exec_vmwrite(VMX_GUEST_IA32_SYSENTER_CS, v);
-		break;
-	}
-	case MSR_IA32_SYSENTER_ESP:
-	{
-		exec_vmwrite(VMX_GUEST_IA32_SYSENTER_ESP, v);
-		break;
-	}
-	case MSR_IA32_SYSENTER_EIP:
-	{
-		exec_vmwrite(VMX_GUEST_IA32_SYSENTER_EIP, v);
-		break;
-	}
-	case MSR_IA32_GS_BASE:
-	{
-		exec_vmwrite(VMX_GUEST_GS_BASE, v);
-		break;
-	}
-	case MSR_IA32_TSC_AUX:
-	{
-		vcpu->arch_vcpu.msr_tsc_aux = v;
-		break;
-	}
-	case MSR_IA32_APIC_BASE:
-	{
-		vlapic_wrmsr(vcpu, msr, v);
-		break;
-	}
-	default:
-	{
-		if (!((msr >= MSR_IA32_MTRR_PHYSBASE_0 &&
-			msr <= MSR_IA32_MTRR_PHYSMASK_9) ||
-		      (msr >= MSR_IA32_VMX_BASIC &&
-			msr <= MSR_IA32_VMX_TRUE_ENTRY_CTLS))) {
-			pr_warn("rdmsr: %lx should not come here!", msr);
-		}
+	if (err != 0)
 		vcpu_inject_gp(vcpu, 0);
-		break;
-	}
-	}
 
 	TRACE_2L(TRC_VMEXIT_WRMSR, msr, v);
 
 	return 0;
 }
+
+int get_msr_exit_info(char *str, int str_max, int vmid)
+{
+	int i, len, size = str_max;
+	uint32_t slot, exits;
+	struct vcpu *vcpu;
+	struct vm *vm = get_vm_from_vmid(vmid);
+
+	if (!vm) {
+		len = snprintf(str, size,
+			"\r\nvm is not exist for vmid %d", vmid);
+		size -= len;
+		str += len;
+		goto END;
+	}
+
+	len = snprintf(str, size, "\r\nVCPU\tMSR\t\tNAME\t\tEXITS");
+	size -= len;
+	str += len;
+
+	foreach_vcpu(i, vm, vcpu) {
+		if (vcpu->msr_exits == NULL)
+			continue;
+
+		for (slot = 0; slot <= VMSR_TABLE_SIZE; slot++) {
+			exits = vcpu->msr_exits[slot];
+			if (exits == 0)
+				continue;
+
+			if (slot == VMSR_TABLE_SIZE)
+				len = snprintf(str, size,
+					"\r\n%d\t-\t\tother\t\t%u",
+					vcpu->vcpu_id, exits);
+			else
+				len = snprintf(str, size,
+					"\r\n%d\t0x%08x\t%-16s%u",
+					vcpu->vcpu_id, vmsr_table[slot].start,
+					vmsr_table[slot].name, exits);
+			if (len >= size)
+				goto END;
+			size -= len;
+			str += len;
+		}
+	}
+
+END:
+	snprintf(str, size, "\r\n");
+	return 0;
+}
@@ -29,16 +29,15 @@
  */
 
 #include <hypervisor.h>
+#include <uart16550.h>
 
-#include "uart16550.h"
-#include "serial_internal.h"
-
-#define COM1_BASE	0x3F8
-#define COM1_IRQ	4
 #define DEFAULT_RCLK	1843200
 #define DEFAULT_BAUD	9600
 #define RX_SIZE		256
-#define TX_SIZE		65536
+/* FIFO size of a UART backed by the shared ring */
+#define VUART_TX_SIZE	256
+/* the 8250 driver writes up to this many bytes per THRE interrupt */
+#define VUART_TX_BURST	16
 
 #define vuart_lock_init(vu)	spinlock_init(&((vu)->lock))
 #define vuart_lock(vu)		spinlock_obtain(&((vu)->lock))
@@ -92,6 +91,99 @@ static int fifo_numchars(struct fifo *fifo)
 	return fifo->num;
 }
 
+/*
+ * Without a ring the transmitter is always ready, the HV console keeps
+ * the latest TX_SIZE bytes. With a ring THRE is only reported while a
+ * whole burst fits, so the guest never overruns the FIFO while the
+ * device model is slow to drain the ring.
+ */
+static bool vuart_tx_ready(struct vuart *vu)
+{
+	if (vu->ring == NULL)
+		return true;
+
+	return fifo_numchars(&vu->txfifo) <=
+		vu->txfifo.size - VUART_TX_BURST;
+}
+
+/* Wake the device model up unless it has not seen the last wakeup yet */
+static void vuart_kick_dm(struct vuart *vu)
+{
+	if (atomic_swap((int *)&vu->ring->notify, 1) == 0)
+		fire_vhm_interrupt();
+}
+
+/* Move buffered guest output to the shared ring, as much as fits */
+static void vuart_flush_tx(struct vuart *vu)
+{
+	struct vuart_ring *ring;
+	uint32_t head, tail, next, start;
+
+	if (vu->ring == NULL || fifo_numchars(&vu->txfifo) == 0)
+		return;
+
+	ring = &vu->ring->tx;
+
+	/* The ring lives in SOS memory, don't trust its indexes */
+	head = ring->head;
+	tail = *(volatile uint32_t *)&ring->tail;
+	if (head >= VUART_RING_SIZE || tail >= VUART_RING_SIZE)
+		return;
+
+	start = head;
+	while (fifo_numchars(&vu->txfifo) > 0) {
+		next = (head + 1) % VUART_RING_SIZE;
+		if (next == tail)
+			break;
+		ring->buf[head] = fifo_getchar(&vu->txfifo);
+		head = next;
+	}
+
+	if (head == start)
+		return;
+
+	/* Data must be visible before the new index */
+	CPU_MEMORY_WRITE_BARRIER();
+	ring->head = head;
+	vuart_kick_dm(vu);
+}
+
+/* Move guest input from the shared ring to the RX FIFO, as much as fits */
+static void vuart_fill_rx(struct vuart *vu)
+{
+	struct vuart_ring *ring;
+	uint32_t head, tail, start;
+	bool full;
+
+	if (vu->ring == NULL)
+		return;
+
+	ring = &vu->ring->rx;
+
+	tail = ring->tail;
+	head = *(volatile uint32_t *)&ring->head;
+	if (head >= VUART_RING_SIZE || tail >= VUART_RING_SIZE)
+		return;
+
+	/* the device model stops reading its backend while rx is full */
+	full = (head + 1) % VUART_RING_SIZE == tail;
+	start = tail;
+
+	/* pairs with the barrier before the device model advances head */
+	CPU_MEMORY_READ_BARRIER();
+	while (tail != head &&
+		fifo_numchars(&vu->rxfifo) < vu->rxfifo.size) {
+		fifo_putchar(&vu->rxfifo, ring->buf[tail]);
+		tail = (tail + 1) % VUART_RING_SIZE;
+	}
+
+	CPU_MEMORY_BARRIER();
+	ring->tail = tail;
+
+	if (full && tail != start)
+		vuart_kick_dm(vu);
+}
+
 /*
  * The IIR returns a prioritized interrupt reason:
  * - receive data available
@@ -111,7 +203,8 @@ static int uart_intr_reason(struct vuart *vu)
 		return IIR_NOPEND;
 }
 
-static void uart_init(struct vuart *vu)
+/* Put the registers and FIFOs back to their power-on state */
+static void uart_reset(struct vuart *vu)
 {
 	uint16_t divisor;
 
@@ -119,10 +212,27 @@ static void uart_init(struct vuart *vu)
 	vu->dll = divisor;
 	vu->dlh = divisor >> 16;
 
+	vu->data = 0;
+	vu->ier = 0;
+	vu->lcr = 0;
+	vu->mcr = 0;
+	vu->lsr = 0;
+	vu->msr = 0;
+	vu->fcr = 0;
+	vu->scr = 0;
+	vu->thre_int_pending = false;
+	fifo_reset(&vu->rxfifo);
+	fifo_reset(&vu->txfifo);
+}
+
+static void uart_init(struct vuart *vu, int base, int irq, int tx_size)
+{
 	vu->active = false;
-	vu->base = COM1_BASE;
+	vu->base = base;
+	vu->irq = irq;
 	fifo_init(&vu->rxfifo, RX_SIZE);
-	fifo_init(&vu->txfifo, TX_SIZE);
+	fifo_init(&vu->txfifo, tx_size);
+	uart_reset(vu);
 	vuart_lock_init(vu);
 }
 
@@ -138,13 +248,13 @@ static void uart_toggle_intr(struct vuart *vu)
 
 	if (intr_reason != IIR_NOPEND) {
 		if (vu->vm->vpic)
-			vpic_assert_irq(vu->vm, COM1_IRQ);
+			vpic_assert_irq(vu->vm, vu->irq);
 
-		vioapic_assert_irq(vu->vm, COM1_IRQ);
+		vioapic_assert_irq(vu->vm, vu->irq);
 		if (vu->vm->vpic)
-			vpic_deassert_irq(vu->vm, COM1_IRQ);
+			vpic_deassert_irq(vu->vm, vu->irq);
 
-		vioapic_deassert_irq(vu->vm, COM1_IRQ);
+		vioapic_deassert_irq(vu->vm, vu->irq);
 	}
 }
 
@@ -173,7 +283,8 @@ static void uart_write(__unused struct vm_io_handler *hdlr,
 	switch (offset) {
 	case UART16550_THR:
 		fifo_putchar(&vu->txfifo, value);
-		vu->thre_int_pending = true;
+		vuart_flush_tx(vu);
+		vu->thre_int_pending = vuart_tx_ready(vu);
 		break;
 	case UART16550_IER:
 		/*
@@ -192,6 +303,8 @@ static void uart_write(__unused struct vm_io_handler *hdlr,
 		} else {
 			if ((value & FCR_RFR) != 0)
 				fifo_reset(&vu->rxfifo);
+			if ((value & FCR_TFR) != 0 && vu->ring != NULL)
+				fifo_reset(&vu->txfifo);
 
 			vu->fcr = value &
 				(FCR_FIFOE | FCR_DMA | FCR_RX_MASK);
@@ -234,6 +347,7 @@ static uint32_t uart_read(__unused struct vm_io_handler *hdlr,
 	struct vuart *vu = vm_vuart(vm);
 	offset -= vu->base;
 	vuart_lock(vu);
+	vuart_fill_rx(vu);
 	/*
 	 * Take care of the special case DLAB accesses first
 	 */
@@ -274,8 +388,12 @@ static uint32_t uart_read(__unused struct vm_io_handler *hdlr,
 		reg = vu->mcr;
 		break;
 	case UART16550_LSR:
-		/* Transmitter is always ready for more data */
-		vu->lsr |= LSR_TEMT | LSR_THRE;
+		/* Retry output the ring had no room for before */
+		vuart_flush_tx(vu);
+		if (vuart_tx_ready(vu))
+			vu->lsr |= LSR_TEMT | LSR_THRE;
+		else
+			vu->lsr &= ~(LSR_TEMT | LSR_THRE);
 		/* Check for new receive data */
 		if (fifo_numchars(&vu->rxfifo) > 0)
 			vu->lsr |= LSR_DR;
@@ -302,93 +420,117 @@ done:
 	return reg;
 }
 
-void vuart_register_io_handler(struct vm *vm)
+static void vuart_register_io_handler(struct vm *vm, int base)
 {
 	struct vm_io_range range = {
 		.flags = IO_ATTR_RW,
-		.base = 0x3f8,
+		.base = base,
 		.len = 8
 	};
 
 	register_io_emulation_handler(vm, &range, uart_read, uart_write);
 }
 
-void vuart_console_tx_chars(void)
+/*
+ * Called by the device model after it consumed output from or produced
+ * input to the shared ring.
+ */
+void vuart_notify(struct vuart *vu)
 {
-	struct vuart *vu;
-
-	vu = vuart_console_active();
-	if (vu == NULL)
-		return;
+	bool was_ready;
 
 	vuart_lock(vu);
-	while (fifo_numchars(&vu->txfifo) > 0)
-		printf("%c", fifo_getchar(&vu->txfifo));
+	was_ready = vuart_tx_ready(vu);
+	vuart_flush_tx(vu);
+	vuart_fill_rx(vu);
+	/* raise the THRE interrupt the guest waits for to send more */
+	if (!was_ready && vuart_tx_ready(vu))
+		vu->thre_int_pending = true;
+	uart_toggle_intr(vu);
 	vuart_unlock(vu);
 }
 
-void vuart_console_rx_chars(uint32_t serial_handle)
+void vuart_rx_chars(struct vuart *vu, const char *buf, uint32_t len)
 {
-	struct vuart *vu;
-	uint32_t vbuf_len;
-	char buffer[100];
-	uint32_t buf_idx = 0;
-
-	if (serial_handle == SERIAL_INVALID_HANDLE) {
-		pr_err("%s: invalid serial handle 0x%llx\n",
-				__func__, serial_handle);
-		return;
-	}
-
-	vu = vuart_console_active();
-	if (vu == NULL)
-		return;
+	uint32_t i;
 
 	vuart_lock(vu);
-	/* Get data from serial */
-	vbuf_len = serial_gets(serial_handle, buffer, 100);
-	if (vbuf_len) {
-		while (buf_idx < vbuf_len) {
-			if (buffer[buf_idx] == GUEST_CONSOLE_TO_HV_SWITCH_KEY) {
-				/* Switch the console */
-				shell_switch_console();
-				break;
-			}
-			buf_idx++;
-		}
-		if (vu->active != false) {
-			buf_idx = 0;
-			while (buf_idx < vbuf_len)
-				fifo_putchar(&vu->rxfifo, buffer[buf_idx++]);
-
-			uart_toggle_intr(vu);
-		}
-	}
+	for (i = 0; i < len; i++)
+		fifo_putchar(&vu->rxfifo, buf[i]);
+	uart_toggle_intr(vu);
 	vuart_unlock(vu);
 }
 
-struct vuart *vuart_console_active(void)
+uint32_t vuart_tx_chars(struct vuart *vu, char *buf, uint32_t len)
 {
-	struct vm *vm = get_vm_from_vmid(0);
+	uint32_t i = 0;
 
-	if (vm && vm->vuart) {
-		struct vuart *vu = vm->vuart;
+	vuart_lock(vu);
+	while (i < len && fifo_numchars(&vu->txfifo) > 0)
+		buf[i++] = fifo_getchar(&vu->txfifo);
+	vuart_unlock(vu);
 
-		if (vu->active)
-			return vm->vuart;
-	}
-	return NULL;
+	return i;
 }
 
-void *vuart_init(struct vm *vm)
+struct vuart *vuart_init(struct vm *vm, int base, int irq, int tx_size)
 {
 	struct vuart *vu;
 
 	vu = calloc(1, sizeof(struct vuart));
 	ASSERT(vu != NULL, "");
-	uart_init(vu);
+	uart_init(vu, base, irq, tx_size);
 	vu->vm = vm;
-	vuart_register_io_handler(vm);
+	vuart_register_io_handler(vm, base);
 
 	return vu;
 }
+
+/*
+ * Attach a UART backed by the shared ring to a VM which is not running
+ * yet, so the device model no longer sees the register accesses. The
+ * I/O handler can not be installed under running vcpus, and VM0 keeps
+ * its own ports.
+ */
+int vuart_setup(struct vm *vm, int base, int irq,
+		struct vuart_ring_page *ring)
+{
+	struct vuart *vu = vm->vuart;
+
+	if (is_vm0(vm) || irq < 0 || irq >= NR_LEGACY_PIN)
+		return -EINVAL;
+
+	if (vm->state != VM_CREATED)
+		return -EBUSY;
+
+	/* The device model sets the UART up again after a VM reset */
+	if (vu != NULL) {
+		if (vu->ring == NULL || vu->base != base || vu->irq != irq)
+			return -EBUSY;
+
+		vuart_lock(vu);
+		vu->ring = ring;
+		uart_reset(vu);
+		vuart_unlock(vu);
+		return 0;
+	}
+
+	vu = vuart_init(vm, base, irq, VUART_TX_SIZE);
+	vu->ring = ring;
+	vm->vuart = vu;
+
+	return 0;
+}
+
+void vuart_deinit(struct vm *vm)
+{
+	struct vuart *vu = vm->vuart;
+
+	if (vu == NULL)
+		return;
+
+	vm->vuart = NULL;
+	free(vu->rxfifo.buf);
+	free(vu->txfifo.buf);
+	free(vu);
+}
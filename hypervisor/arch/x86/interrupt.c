@@ -97,14 +97,18 @@ static bool vcpu_pending_request(struct vcpu *vcpu)
 int vcpu_make_request(struct vcpu *vcpu, int eventid)
 {
 	bitmap_set(eventid, &vcpu->arch_vcpu.pending_req);
+
+	/* pairs with block_vcpu(), see there */
+	if (atomic_load(&vcpu->blocked) != 0) {
+		wake_vcpu(vcpu);
+		return 0;
+	}
+
 	/*
 	 * if current hostcpu is not the target vcpu's hostcpu, we need
-	 * to invoke IPI to wake up target vcpu
-	 *
-	 * TODO: Here we just compare with cpuid, since cpuid currently is
-	 *  global under pCPU / vCPU 1:1 mapping. If later we enabled vcpu
-	 *  scheduling, we need change here to determine it target vcpu is
-	 *  VMX non-root or root mode
+	 * to invoke IPI to wake up target vcpu. A vcpu which shares its
+	 * pcpu and is not running picks the request up when it is
+	 * switched in, the IPI is harmless then.
 	 */
 	if ((int)get_cpu_id() != vcpu->pcpu_id)
 		send_single_ipi(vcpu->pcpu_id, VECTOR_NOTIFY_VCPU);
@@ -372,15 +376,25 @@ int acrn_handle_pending_request(struct vcpu *vcpu)
 		return -EFAULT;
 	}
 
-	if (bitmap_test_and_clear(ACRN_REQUEST_EPT_FLUSH, pending_req_bits))
+	if (bitmap_test_and_clear(ACRN_REQUEST_EPT_FLUSH, pending_req_bits)) {
 		invept(vcpu);
+		gva_tlb_flush(vcpu);
+	}
 
-	if (bitmap_test_and_clear(ACRN_REQUEST_VPID_FLUSH, pending_req_bits))
+	if (bitmap_test_and_clear(ACRN_REQUEST_VPID_FLUSH, pending_req_bits)) {
 		flush_vpid_single(vcpu->arch_vcpu.vpid);
+		gva_tlb_flush(vcpu);
+	}
 
 	if (bitmap_test_and_clear(ACRN_REQUEST_TMR_UPDATE, pending_req_bits))
 		vioapic_update_tmr(vcpu);
 
+	/* interrupts posted while the vcpu was out of non-root mode */
+	if (is_vapic_posted_intr_supported()) {
+		apicv_set_pi_wakeup(vcpu->arch_vcpu.vlapic, false);
+		apicv_inject_pir(vcpu->arch_vcpu.vlapic);
+	}
+
 	/* handling cancelled event injection when vcpu is switched out */
 	if (vcpu->arch_vcpu.inject_event_pending) {
 		exec_vmwrite(VMX_ENTRY_EXCEPTION_ERROR_CODE,
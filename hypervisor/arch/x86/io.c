@@ -49,6 +49,41 @@ static void dm_emulate_pio_pre(struct vcpu *vcpu, uint64_t exit_qual,
 	vcpu->req.reqs.pio_request.value = req_value;
 }
 
+#define IO_HANDLER_SPANNED	((struct vm_io_handler *)-1)
+
+static inline struct vm_io_handler *
+io_port_map_lookup(struct vm *vm, uint32_t port)
+{
+	struct vm_io_handler **map;
+
+	map = vm->arch_vm.io_port_map[(port >> IO_PORT_MAP_SHIFT) &
+					IO_PORT_MAP_MASK];
+	if (map == NULL)
+		return NULL;
+
+	return map[port & IO_PORT_MAP_MASK];
+}
+
+/*
+ * Return the handler covering all of [port, port + sz), NULL if no handler
+ * claims any of these ports (the access goes to VHM), or IO_HANDLER_SPANNED
+ * if the access is only partially covered by one handler.
+ */
+static struct vm_io_handler *
+find_io_handler(struct vm *vm, uint32_t port, uint32_t sz)
+{
+	struct vm_io_handler *handler;
+	uint32_t i;
+
+	handler = io_port_map_lookup(vm, port);
+	for (i = 1; i < sz; i++) {
+		if (io_port_map_lookup(vm, port + i) != handler)
+			return IO_HANDLER_SPANNED;
+	}
+
+	return handler;
+}
+
 int io_instr_vmexit_handler(struct vcpu *vcpu)
 {
 	uint32_t sz;
@@ -73,28 +108,20 @@ int io_instr_vmexit_handler(struct vcpu *vcpu)
 	TRACE_4I(TRC_VMEXIT_IO_INSTRUCTION, port, direction, sz,
 		cur_context_idx);
 
-	for (handler = vm->arch_vm.io_handler;
-			handler; handler = handler->next) {
-
-		if ((port >= handler->desc.addr + handler->desc.len) ||
-				(port + sz <= handler->desc.addr))
-			continue;
-		else if (!((port >= handler->desc.addr) && ((port + sz)
-				<= (handler->desc.addr + handler->desc.len)))) {
-			pr_fatal("Err:IO, port 0x%04x, size=%u spans devices",
-					port, sz);
-			return -EIO;
-		}
+	handler = find_io_handler(vm, port, sz);
+	if (handler == IO_HANDLER_SPANNED) {
+		pr_fatal("Err:IO, port 0x%04x, size=%u spans devices",
+				port, sz);
+		return -EIO;
+	}
 
+	if (handler != NULL) {
 		if (direction == 0) {
 			handler->desc.io_write(handler, vm, port, sz,
 				cur_context->guest_cpu_regs.regs.rax);
 
 			pr_dbg("IO write on port %04x, data %08x", port,
 				cur_context->guest_cpu_regs.regs.rax & mask);
-
-			status = 0;
-			break;
 		} else {
 			uint32_t data = handler->desc.io_read(handler, vm,
 							 port, sz);
@@ -103,10 +130,8 @@ int io_instr_vmexit_handler(struct vcpu *vcpu)
 			cur_context->guest_cpu_regs.regs.rax |= data & mask;
 
 			pr_dbg("IO read on port %04x, data %08x", port, data);
-
-			status = 0;
-			break;
 		}
+		status = 0;
 	}
 
 	/* Go for VHM */
@@ -127,18 +152,57 @@ int io_instr_vmexit_handler(struct vcpu *vcpu)
 	return status;
 }
 
+static int io_port_map_insert(struct vm *vm, struct vm_io_handler *hdlr)
+{
+	struct vm_io_handler **map;
+	uint32_t port, end, idx;
+
+	end = hdlr->desc.addr + hdlr->desc.len;
+	if (end > 0x10000)
+		end = 0x10000;
+
+	for (port = hdlr->desc.addr; port < end; port++) {
+		idx = port >> IO_PORT_MAP_SHIFT;
+		map = vm->arch_vm.io_port_map[idx];
+		if (map == NULL) {
+			map = calloc(IO_PORT_MAP_ENTRIES,
+					sizeof(struct vm_io_handler *));
+			if (map == NULL) {
+				pr_err("Error: out of memory");
+				return -ENOMEM;
+			}
+			vm->arch_vm.io_port_map[idx] = map;
+		}
+
+		/* Keep the list semantics: the latest registration wins */
+		map[port & IO_PORT_MAP_MASK] = hdlr;
+	}
+
+	return 0;
+}
+
 static void register_io_handler(struct vm *vm, struct vm_io_handler *hdlr)
 {
 	if (vm->arch_vm.io_handler)
 		hdlr->next = vm->arch_vm.io_handler;
 
 	vm->arch_vm.io_handler = hdlr;
+
+	if (io_port_map_insert(vm, hdlr) != 0)
+		pr_err("IO handler 0x%x lookup not fully set up",
+				hdlr->desc.addr);
 }
 
 static void empty_io_handler_list(struct vm *vm)
 {
 	struct vm_io_handler *handler = vm->arch_vm.io_handler;
 	struct vm_io_handler *tmp;
+	int i;
+
+	for (i = 0; i < IO_PORT_MAP_ENTRIES; i++) {
+		free(vm->arch_vm.io_port_map[i]);
+		vm->arch_vm.io_port_map[i] = NULL;
+	}
 
 	while (handler) {
 		tmp = handler;
@@ -244,6 +308,8 @@ void register_io_emulation_handler(struct vm *vm, struct vm_io_range *range,
 
 	handler = create_io_handler(range->base,
 			range->len, io_read_fn_ptr, io_write_fn_ptr);
+	if (handler == NULL)
+		return;
 
 	register_io_handler(vm, handler);
 }
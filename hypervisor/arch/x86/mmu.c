@@ -1167,3 +1167,161 @@ int modify_mem_mt(struct map_params *map_params, void *paddr, void *vaddr,
 	return ret;
 }
 
+
+/* Return the entry at target_level mapping addr, or NULL if the walk
+ * ends earlier in a non-present entry or a large page.
+ */
+static void *lookup_table_entry(void *table_base, void *addr,
+		uint32_t target_level, int table_type)
+{
+	uint32_t level;
+	uint64_t entry;
+	void *entry_addr;
+
+	for (level = IA32E_PML4; level < target_level; level++) {
+		entry_addr = table_base + fetch_page_table_offset(addr, level);
+		entry = MEM_READ64(entry_addr);
+		if ((check_page_table_present(table_type, entry) != PT_PRESENT)
+			|| ((level != IA32E_PML4)
+			&& ((entry & IA32E_PDE_PS_BIT) != 0)))
+			return NULL;
+		table_base = HPA2HVA(entry & IA32E_REF_MASK);
+	}
+
+	return table_base + fetch_page_table_offset(addr, target_level);
+}
+
+/* If the table referenced by entry_addr maps one naturally aligned,
+ * contiguous range of page_size with identical attributes, replace it
+ * with a single large page entry and free the table.
+ */
+static bool promote_table(void *entry_addr, uint64_t page_size,
+		int table_type)
+{
+	uint64_t entry = MEM_READ64(entry_addr);
+	uint64_t next_size = (page_size == PAGE_SIZE_1G) ?
+			PAGE_SIZE_2M : PAGE_SIZE_4K;
+	uint64_t first, attr, base;
+	void *sub_tab_addr;
+	uint32_t i;
+
+	if ((check_page_table_present(table_type, entry) != PT_PRESENT)
+			|| ((entry & IA32E_PDE_PS_BIT) != 0))
+		return false;
+
+	sub_tab_addr = HPA2HVA(entry & IA32E_REF_MASK);
+	first = MEM_READ64(sub_tab_addr);
+	if (check_page_table_present(table_type, first) != PT_PRESENT)
+		return false;
+
+	/* a PD can only be folded if all of it are 2M leaves already */
+	if ((page_size == PAGE_SIZE_1G) && ((first & IA32E_PDE_PS_BIT) == 0))
+		return false;
+
+	base = first & IA32E_REF_MASK;
+	attr = first & ~IA32E_REF_MASK;
+	if (!MEM_ALIGNED_CHECK(base, page_size))
+		return false;
+
+	for (i = 1; i < IA32E_NUM_ENTRIES; i++) {
+		if (MEM_READ64(sub_tab_addr + (i * IA32E_COMM_ENTRY_SIZE))
+				!= (attr | (base + (i * next_size))))
+			return false;
+	}
+
+	MEM_WRITE64(entry_addr, attr | IA32E_PDE_PS_BIT | base);
+	free_paging_struct(sub_tab_addr);
+
+	return true;
+}
+
+static uint32_t promote_paging(struct map_params *map_params, void *vaddr,
+		uint64_t size, bool allow_1g, bool direct)
+{
+	int table_type = map_params->page_table_type;
+	void *table_base = direct ? (map_params->pml4_base)
+				: (map_params->pml4_inverted);
+	uint64_t start = (uint64_t)vaddr;
+	uint64_t end = start + size;
+	uint64_t addr;
+	uint32_t promoted = 0;
+	void *entry_addr;
+
+	for (addr = start & ~(PAGE_SIZE_2M - 1); addr < end;
+			addr += PAGE_SIZE_2M) {
+		entry_addr = lookup_table_entry(table_base, (void *)addr,
+				IA32E_PD, table_type);
+		if ((entry_addr != NULL) && promote_table(entry_addr,
+				PAGE_SIZE_2M, table_type))
+			promoted++;
+	}
+
+	if (!allow_1g || !check_mmu_1gb_support(table_type))
+		return promoted;
+
+	for (addr = start & ~(PAGE_SIZE_1G - 1); addr < end;
+			addr += PAGE_SIZE_1G) {
+		entry_addr = lookup_table_entry(table_base, (void *)addr,
+				IA32E_PDPT, table_type);
+		if ((entry_addr != NULL) && promote_table(entry_addr,
+				PAGE_SIZE_1G, table_type))
+			promoted++;
+	}
+
+	return promoted;
+}
+
+/*
+ * Fold page tables covering [vaddr, vaddr + size) back into 2M/1G pages
+ * where the mapping allows it, e.g. after a range was remapped in one go
+ * or built up by several smaller requests. EPT only; the caller has to
+ * invalidate the EPT afterwards. 1G folding frees the PD, so it must not
+ * be used while the PD may also be referenced from another hierarchy.
+ * Returns the number of tables freed.
+ */
+uint32_t promote_mem(struct map_params *map_params, void *paddr, void *vaddr,
+		uint64_t size, bool allow_1g)
+{
+	uint32_t promoted;
+
+	if (map_params->page_table_type != PTT_EPT)
+		return 0;
+
+	promoted = promote_paging(map_params, vaddr, size, allow_1g, true);
+	promoted += promote_paging(map_params, paddr, size, allow_1g, false);
+
+	return promoted;
+}
+
+static void count_page_sizes(void *table_base, uint32_t level,
+		int table_type, struct page_size_stats *stats)
+{
+	uint64_t entry;
+	uint32_t i;
+
+	stats->tables++;
+	for (i = 0; i < IA32E_NUM_ENTRIES; i++) {
+		entry = MEM_READ64(table_base + (i * IA32E_COMM_ENTRY_SIZE));
+		if (check_page_table_present(table_type, entry) != PT_PRESENT)
+			continue;
+
+		if (level == IA32E_PT)
+			stats->pages_4k++;
+		else if ((level == IA32E_PD) && (entry & IA32E_PDE_PS_BIT))
+			stats->pages_2m++;
+		else if ((level == IA32E_PDPT) &&
+				(entry & IA32E_PDPTE_PS_BIT))
+			stats->pages_1g++;
+		else
+			count_page_sizes(HPA2HVA(entry & IA32E_REF_MASK),
+					level + 1, table_type, stats);
+	}
+}
+
+void get_page_size_stats(void *pml4_base, int table_type,
+		struct page_size_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (pml4_base != NULL)
+		count_page_sizes(pml4_base, IA32E_PML4, table_type, stats);
+}
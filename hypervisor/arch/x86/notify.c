@@ -7,6 +7,8 @@
 #include <hypervisor.h>
 
 static struct dev_handler_node *notification_node;
+static struct dev_handler_node *posted_intr_node;
+static struct dev_handler_node *posted_wakeup_node;
 
 /* run in interrupt context */
 static int kick_notification(__unused int irq, __unused void *data)
@@ -17,26 +19,37 @@ static int kick_notification(__unused int irq, __unused void *data)
 	return 0;
 }
 
-static int request_notification_irq(dev_handler_t func, void *data,
-				const char *name)
+/* run in interrupt context */
+static int posted_intr_wakeup(__unused int irq, __unused void *data)
+{
+	/* VT-d posted an interrupt to a blocked vcpu of this pcpu, the
+	 * scheduler finds it by its pending PIR
+	 */
+	bitmap_set(NEED_RESCHEDULE, &get_cpu_var(sched_ctx).flags);
+	return 0;
+}
+
+static int request_notification_irq(struct dev_handler_node **pnode,
+			int vector, dev_handler_t func, void *data,
+			const char *name)
 {
 	int irq = -1; /* system allocate */
 	struct dev_handler_node *node = NULL;
 
-	if (notification_node != NULL) {
+	if (*pnode != NULL) {
 		pr_info("%s, Notification vector already allocated on this CPU",
 				__func__);
 		return -EBUSY;
 	}
 
 	/* all cpu register the same notification vector */
-	node = pri_register_handler(irq, VECTOR_NOTIFY_VCPU, func, data, name);
+	node = pri_register_handler(irq, vector, func, data, name);
 	if (node == NULL) {
 		pr_err("Failed to add notify isr");
 		return -1;
 	}
 	update_irq_handler(dev_to_irq(node), quick_handler_nolock);
-	notification_node = node;
+	*pnode = node;
 	return 0;
 }
 
@@ -51,7 +64,8 @@ void setup_notification(void)
 
 	/* support IPI notification, VM0 will register all CPU */
 	snprintf(name, 32, "NOTIFY_ISR%d", cpu);
-	if (request_notification_irq(kick_notification, NULL, name) < 0) {
+	if (request_notification_irq(&notification_node, VECTOR_NOTIFY_VCPU,
+			kick_notification, NULL, name) < 0) {
 		pr_err("Failed to setup notification");
 		return;
 	}
@@ -59,6 +73,23 @@ void setup_notification(void)
 	dev_dbg(ACRN_DBG_PTIRQ, "NOTIFY: irq[%d] setup vector %x",
 		dev_to_irq(notification_node),
 		dev_to_vector(notification_node));
+
+	if (!is_vapic_posted_intr_supported())
+		return;
+
+	/* A posted-interrupt notification which arrives in root mode only
+	 * needs the EOI, the PIR is folded before the next VM entry.
+	 */
+	snprintf(name, 32, "POSTED_INTR_ISR%d", cpu);
+	if (request_notification_irq(&posted_intr_node, VECTOR_POSTED_INTR,
+			kick_notification, NULL, name) < 0)
+		pr_err("Failed to setup posted interrupt notification");
+
+	snprintf(name, 32, "POSTED_WAKEUP_ISR%d", cpu);
+	if (request_notification_irq(&posted_wakeup_node,
+			VECTOR_POSTED_INTR_WAKEUP,
+			posted_intr_wakeup, NULL, name) < 0)
+		pr_err("Failed to setup posted interrupt wakeup");
 }
 
 void cleanup_notification(void)
@@ -66,4 +97,12 @@ void cleanup_notification(void)
 	if (notification_node)
 		unregister_handler_common(notification_node);
 	notification_node = NULL;
+
+	if (posted_intr_node)
+		unregister_handler_common(posted_intr_node);
+	posted_intr_node = NULL;
+
+	if (posted_wakeup_node)
+		unregister_handler_common(posted_wakeup_node);
+	posted_wakeup_node = NULL;
 }
@@ -31,40 +31,102 @@ static int tsc_deadline_handler(__unused int irq, __unused void *data)
 
 static inline void update_physical_timer(struct per_cpu_timers *cpu_timer)
 {
-	struct timer *timer = NULL;
+	uint64_t fire_tsc;
 
 	/* find the next event timer */
-	if (!list_empty(&cpu_timer->timer_list)) {
-		timer = list_entry((&cpu_timer->timer_list)->next,
-			struct timer, node);
+	if (cpu_timer->nr_timers > 0) {
+		fire_tsc = cpu_timer->heap[0]->fire_tsc;
+
+		/* skip the msr write if the deadline is already armed */
+		if (fire_tsc == cpu_timer->programmed_tsc)
+			return;
 
 		/* it is okay to program a expired time */
-		msr_write(MSR_IA32_TSC_DEADLINE, timer->fire_tsc);
+		msr_write(MSR_IA32_TSC_DEADLINE, fire_tsc);
+		cpu_timer->programmed_tsc = fire_tsc;
+		cpu_timer->msr_writes++;
 	}
 }
 
-static void __add_timer(struct per_cpu_timers *cpu_timer,
-			struct timer *timer,
-			bool *need_update)
+static inline void heap_set(struct per_cpu_timers *cpu_timer, int idx,
+			struct timer *timer)
+{
+	cpu_timer->heap[idx] = timer;
+	timer->heap_idx = idx;
+}
+
+static void heap_sift_up(struct per_cpu_timers *cpu_timer, int idx)
+{
+	struct timer *timer = cpu_timer->heap[idx];
+	int parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (cpu_timer->heap[parent]->fire_tsc <= timer->fire_tsc)
+			break;
+		heap_set(cpu_timer, idx, cpu_timer->heap[parent]);
+		idx = parent;
+	}
+	heap_set(cpu_timer, idx, timer);
+}
+
+static void heap_sift_down(struct per_cpu_timers *cpu_timer, int idx)
 {
-	struct list_head *pos, *prev;
-	struct timer *tmp;
-	uint64_t tsc = timer->fire_tsc;
-
-	prev = &cpu_timer->timer_list;
-	list_for_each(pos, &cpu_timer->timer_list) {
-		tmp = list_entry(pos, struct timer, node);
-		if (tmp->fire_tsc < tsc)
-			prev = &tmp->node;
-		else
+	struct timer *timer = cpu_timer->heap[idx];
+	int child;
+
+	while ((child = 2 * idx + 1) < cpu_timer->nr_timers) {
+		if (child + 1 < cpu_timer->nr_timers &&
+			cpu_timer->heap[child + 1]->fire_tsc <
+			cpu_timer->heap[child]->fire_tsc)
+			child++;
+		if (timer->fire_tsc <= cpu_timer->heap[child]->fire_tsc)
 			break;
+		heap_set(cpu_timer, idx, cpu_timer->heap[child]);
+		idx = child;
 	}
+	heap_set(cpu_timer, idx, timer);
+}
 
-	list_add(&timer->node, prev);
+static int __add_timer(struct per_cpu_timers *cpu_timer,
+			struct timer *timer,
+			bool *need_update)
+{
+	/* sized in timer.h to hold every timer of the pcpu */
+	ASSERT(cpu_timer->nr_timers < MAX_TIMERS_PER_CPU,
+		"timer heap overflow");
+	if (cpu_timer->nr_timers >= MAX_TIMERS_PER_CPU)
+		return -ENOSPC;
+
+	heap_set(cpu_timer, cpu_timer->nr_timers++, timer);
+	heap_sift_up(cpu_timer, timer->heap_idx);
 
 	if (need_update)
-		/* update the physical timer if we're on the timer_list head */
-		*need_update = (prev == &cpu_timer->timer_list);
+		/* update the physical timer if we're on the heap top */
+		*need_update = (timer->heap_idx == 0);
+
+	return 0;
+}
+
+static void __del_timer(struct per_cpu_timers *cpu_timer,
+			struct timer *timer)
+{
+	int idx = timer->heap_idx;
+	struct timer *last;
+
+	last = cpu_timer->heap[--cpu_timer->nr_timers];
+	cpu_timer->heap[cpu_timer->nr_timers] = NULL;
+	timer->heap_idx = -1;
+
+	if (last == timer)
+		return;
+
+	heap_set(cpu_timer, idx, last);
+	if (idx > 0 && cpu_timer->heap[(idx - 1) / 2]->fire_tsc >
+			last->fire_tsc)
+		heap_sift_up(cpu_timer, idx);
+	else
+		heap_sift_down(cpu_timer, idx);
 }
 
 int add_timer(struct timer *timer)
@@ -83,7 +145,11 @@ int add_timer(struct timer *timer)
 
 	pcpu_id  = get_cpu_id();
 	cpu_timer = &per_cpu(cpu_timers, pcpu_id);
-	__add_timer(cpu_timer, timer, &need_update);
+	if (__add_timer(cpu_timer, timer, &need_update) != 0) {
+		pr_err("CPU%d timer heap is full", pcpu_id);
+		return -ENOSPC;
+	}
+	timer->pcpu_id = pcpu_id;
 
 	if (need_update)
 		update_physical_timer(cpu_timer);
@@ -95,8 +161,8 @@ int add_timer(struct timer *timer)
 
 void del_timer(struct timer *timer)
 {
-	if (timer && !list_empty(&timer->node))
-		list_del(&timer->node);
+	if (timer && timer->heap_idx >= 0)
+		__del_timer(&per_cpu(cpu_timers, timer->pcpu_id), timer);
 }
 
 static int request_timer_irq(int pcpu_id,
@@ -130,7 +196,7 @@ static void init_percpu_timer(int pcpu_id)
 	struct per_cpu_timers *cpu_timer;
 
 	cpu_timer = &per_cpu(cpu_timers, pcpu_id);
-	INIT_LIST_HEAD(&cpu_timer->timer_list);
+	memset(cpu_timer, 0, sizeof(struct per_cpu_timers));
 }
 
 static void init_tsc_deadline_timer(void)
@@ -175,24 +241,26 @@ int timer_softirq(int pcpu_id)
 {
 	struct per_cpu_timers *cpu_timer;
 	struct timer *timer;
-	struct list_head *pos, *n;
 	int tries = MAX_TIMER_ACTIONS;
 	uint64_t current_tsc = rdtsc();
 
 	/* handle passed timer */
 	cpu_timer = &per_cpu(cpu_timers, pcpu_id);
 
+	/* the armed deadline has fired and been disarmed by hardware */
+	cpu_timer->programmed_tsc = 0UL;
+
 	/* This is to make sure we are not blocked due to delay inside func()
 	 * force to exit irq handler after we serviced >31 timers
 	 * caller used to __add_timer() for periodic timer, if there is a delay
 	 * inside func(), it will infinitely loop here, because new added timer
 	 * already passed due to previously func()'s delay.
 	 */
-	list_for_each_safe(pos, n, &cpu_timer->timer_list) {
-		timer = list_entry(pos, struct timer, node);
+	while (cpu_timer->nr_timers > 0) {
+		timer = cpu_timer->heap[0];
 		/* timer expried */
 		if (timer->fire_tsc <= current_tsc && --tries > 0) {
-			del_timer(timer);
+			__del_timer(cpu_timer, timer);
 
 			run_timer(timer);
 
@@ -210,6 +278,28 @@ int timer_softirq(int pcpu_id)
 	return 0;
 }
 
+int get_timer_info(char *str, int str_max)
+{
+	int pcpu_id, len, size = str_max;
+	struct per_cpu_timers *cpu_timer;
+
+	len = snprintf(str, size, "\r\nCPU\tTIMERS\tDEADLINE\t\tMSR_WRITES");
+	size -= len;
+	str += len;
+
+	for (pcpu_id = 0; pcpu_id < phy_cpu_num; pcpu_id++) {
+		cpu_timer = &per_cpu(cpu_timers, pcpu_id);
+		len = snprintf(str, size, "\r\n%d\t%d\t0x%016llx\t%lld",
+				pcpu_id, cpu_timer->nr_timers,
+				cpu_timer->programmed_tsc,
+				cpu_timer->msr_writes);
+		size -= len;
+		str += len;
+	}
+	snprintf(str, size, "\r\n");
+	return 0;
+}
+
 void check_tsc(void)
 {
 	uint64_t temp64;
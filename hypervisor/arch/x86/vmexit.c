@@ -8,6 +8,7 @@
 
 static int unhandled_vmexit_handler(struct vcpu *vcpu);
 static int xsetbv_vmexit_handler(struct vcpu *vcpu);
+static int hlt_vmexit_handler(struct vcpu *vcpu);
 /* VM Dispatch table for Exit condition handling */
 static const struct vm_exit_dispatch dispatch_table[] = {
 	[VMX_EXIT_REASON_EXCEPTION_OR_NMI] = {
@@ -35,7 +36,7 @@ static const struct vm_exit_dispatch dispatch_table[] = {
 	[VMX_EXIT_REASON_GETSEC] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_HLT] = {
-		.handler = unhandled_vmexit_handler},
+		.handler = hlt_vmexit_handler},
 	[VMX_EXIT_REASON_INVD] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_INVLPG] = {
@@ -218,6 +219,18 @@ static int unhandled_vmexit_handler(__unused struct vcpu *vcpu)
 	return 0;
 }
 
+/*
+ * HLT only exits for vcpus of VMs which are not pinned, see
+ * init_exec_ctrl(). The vcpu leaves its pcpu to the other vcpus
+ * there until vcpu_make_request() wakes it up again.
+ */
+static int hlt_vmexit_handler(struct vcpu *vcpu)
+{
+	block_vcpu(vcpu);
+
+	return 0;
+}
+
 int cpuid_vmexit_handler(struct vcpu *vcpu)
 {
 	struct run_context *cur_context =
@@ -130,17 +130,30 @@ int exec_vmxon_instr(uint32_t pcpu_id)
 
 int vmx_off(int pcpu_id)
 {
-	int ret = 0;
-
-	struct vcpu *vcpu = get_ever_run_vcpu(pcpu_id);
+	int ret = 0, i;
+	struct list_head *pos;
+	struct vm *vm;
+	struct vcpu *vcpu;
 	uint64_t vmcs_pa;
 
-	if (vcpu) {
-		vmcs_pa = HVA2HPA(vcpu->arch_vcpu.vmcs);
-		ret = exec_vmclear((void *)&vmcs_pa);
+	/* all VMCSs of vcpus sharing the pcpu may be active on it */
+	spinlock_obtain(&vm_list_lock);
+	list_for_each(pos, &vm_list) {
+		vm = list_entry(pos, struct vm, list);
+		foreach_vcpu(i, vm, vcpu) {
+			if (vcpu->pcpu_id != pcpu_id)
+				continue;
+			vmcs_pa = HVA2HPA(vcpu->arch_vcpu.vmcs);
+			ret = exec_vmclear((void *)&vmcs_pa);
+			if (ret)
+				break;
+		}
 		if (ret)
-			return ret;
+			break;
 	}
+	spinlock_release(&vm_list_lock);
+	if (ret)
+		return ret;
 
 	asm volatile ("vmxoff" : : : "memory");
 
@@ -374,6 +387,7 @@ int vmx_write_cr0(struct vcpu *vcpu, uint64_t cr0)
 	exec_vmwrite(VMX_GUEST_CR0, cr0_vmx & 0xFFFFFFFFUL);
 	exec_vmwrite(VMX_CR0_READ_SHADOW, cr0 & 0xFFFFFFFFUL);
 	context->cr0 = cr0;
+	gva_tlb_flush(vcpu);
 
 	pr_dbg("VMM: Try to write %08x, allow to write 0x%08x to CR0",
 		cr0, cr0_vmx);
@@ -387,6 +401,7 @@ int vmx_write_cr3(struct vcpu *vcpu, uint64_t cr3)
 		&vcpu->arch_vcpu.contexts[vcpu->arch_vcpu.cur_context];
 	/* Write to guest's CR3 */
 	context->cr3 = cr3;
+	gva_tlb_flush(vcpu);
 
 	/* Commit new value to VMCS */
 	exec_vmwrite(VMX_GUEST_CR3, cr3);
@@ -454,6 +469,7 @@ int vmx_write_cr4(struct vcpu *vcpu, uint64_t cr4)
 	exec_vmwrite(VMX_GUEST_CR4, cr4_vmx & 0xFFFFFFFFUL);
 	exec_vmwrite(VMX_CR4_READ_SHADOW, cr4 & 0xFFFFFFFFUL);
 	context->cr4 = cr4;
+	gva_tlb_flush(vcpu);
 
 	pr_dbg("VMM: Try to write %08x, allow to write 0x%08x to CR4",
 		cr4, cr4_vmx);
@@ -1093,6 +1109,12 @@ static void init_exec_ctrl(struct vcpu *vcpu)
 	/* enable external interrupt VM Exit */
 	value32 |= VMX_PINBASED_CTLS_IRQ_EXIT;
 
+	/* Interrupts for a running vcpu are posted to its PIR descriptor
+	 * and delivered by the notification vector without a VM Exit
+	 */
+	if (is_vapic_posted_intr_supported())
+		value32 |= VMX_PINBASED_CTLS_POST_IRQ;
+
 	exec_vmwrite(VMX_PIN_VM_EXEC_CONTROLS, value32);
 	pr_dbg("VMX_PIN_VM_EXEC_CONTROLS: 0x%x ", value32);
 
@@ -1123,6 +1145,13 @@ static void init_exec_ctrl(struct vcpu *vcpu)
 	 */
 	value32 &= ~VMX_PROCBASED_CTLS_INVLPG;
 
+	/* A halted vcpu of a VM which asked for it gives its pcpu to
+	 * the other vcpus sharing it, or lets the pcpu idle. Otherwise it
+	 * halts in the guest and runs out its slice.
+	 */
+	if (vcpu->vm->hlt_exit)
+		value32 |= VMX_PROCBASED_CTLS_HLT;
+
 	if (is_vapic_supported()) {
 		value32 |= VMX_PROCBASED_CTLS_TPR_SHADOW;
 	} else {
@@ -1198,6 +1227,14 @@ static void init_exec_ctrl(struct vcpu *vcpu)
 			exec_vmwrite64(VMX_EOI_EXIT2_FULL, -1UL);
 			exec_vmwrite64(VMX_EOI_EXIT3_FULL, -1UL);
 		}
+
+		if (is_vapic_posted_intr_supported()) {
+			exec_vmwrite(VMX_POSTED_INTR_VECTOR,
+						VECTOR_POSTED_INTR);
+			value64 = apicv_get_pir_desc_addr(
+						vcpu->arch_vcpu.vlapic);
+			exec_vmwrite64(VMX_PIR_DESC_ADDR_FULL, value64);
+		}
 	}
 
 	/* Check for EPT support */
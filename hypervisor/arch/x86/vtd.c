@@ -56,6 +56,36 @@
 	((var &	\
 	  ~bitname ## _MASK) | ((val << bitname ## _POS) & bitname ## _MASK))
 
+/* invalidation queue descriptors */
+#define DMAR_QI_ENTRIES             (CPU_PAGE_SIZE / 16)
+#define DMAR_QI_CC_DESC             0x1UL
+#define DMAR_QI_IOTLB_DESC          0x2UL
+#define DMAR_QI_IEC_DESC            0x4UL
+#define DMAR_QI_WAIT_DESC           0x5UL
+#define DMAR_QI_GRAN(g)             ((uint64_t)(g) << 4)
+#define DMAR_QI_DID(d)              ((uint64_t)((d) & 0xffff) << 16)
+#define DMAR_QI_SID(s)              ((uint64_t)((s) & 0xffff) << 32)
+#define DMAR_QI_FM(m)               ((uint64_t)((m) & 0x3) << 48)
+#define DMAR_QI_IOTLB_DW            (1UL << 6)
+#define DMAR_QI_IOTLB_DR            (1UL << 7)
+#define DMAR_QI_IEC_INDEX           (1UL << 4)
+#define DMAR_QI_IEC_IIDX(i)         ((uint64_t)((i) & 0xffff) << 32)
+#define DMAR_QI_WAIT_SW             (1UL << 5)
+#define DMAR_QI_WAIT_DATA(d)        ((uint64_t)(d) << 32)
+
+/* interrupt remapping table, 2^(S+1) entries */
+#define DMAR_IR_ENTRIES             (CPU_PAGE_SIZE / 16)
+#define DMAR_IRTA_S                 7
+
+/* posted format IRTE */
+#define IRTE_LOWER_P                (1UL << 0)
+#define IRTE_LOWER_IM_POSTED        (1UL << 15)
+#define IRTE_LOWER_VECTOR(v)        ((uint64_t)((v) & 0xff) << 16)
+#define IRTE_LOWER_PDA(a)           (((uint64_t)(a) << 32) & ~0x3fffffffffUL)
+#define IRTE_UPPER_SID(s)           ((uint64_t)((s) & 0xffff))
+#define IRTE_UPPER_SVT_SID          (1UL << 18)
+#define IRTE_UPPER_PDA(a)           ((uint64_t)(a) & ~0xffffffffUL)
+
 /* translation type */
 #define DMAR_CTX_TT_UNTRANSLATED    0x0
 #define DMAR_CTX_TT_ALL             0x1
@@ -129,8 +159,31 @@ struct dmar_drhd_rt {
 	uint16_t cap_num_fault_regs;
 	uint16_t cap_fault_reg_offset;
 	uint16_t ecap_iotlb_offset;
+
+	/* queued invalidation and interrupt remapping, only enabled
+	 * to post passthrough MSIs to vcpus
+	 */
+	bool ir_enabled;
+	struct dmar_qi_desc *qi_queue;
+	uint32_t qi_tail;
+	uint32_t qi_seq;    /* wait data of the last submission */
+	uint32_t qi_status;
+	bool qi_failed;     /* a wait timed out, the queue is not used */
+	struct dmar_irte *ir_table;
+	uint64_t ir_bitmap[DMAR_IR_ENTRIES / 64];
+};
+
+struct dmar_qi_desc {
+	uint64_t lower;
+	uint64_t upper;
 };
 
+/* aligned for cmpxchg16b */
+struct dmar_irte {
+	uint64_t lower;
+	uint64_t upper;
+} __aligned(16);
+
 struct dmar_root_entry {
 	uint64_t lower;
 	uint64_t upper;
@@ -166,6 +219,7 @@ static struct iommu_domain *host_domain;
 static struct list_head iommu_domains;
 
 static void dmar_register_hrhd(struct dmar_drhd_rt *drhd_rt);
+static void dmar_disable_intr_remapping(struct dmar_drhd_rt *dmar_uint);
 static struct dmar_drhd_rt *device_to_dmaru(uint16_t segment, uint8_t bus,
 					   uint8_t devfun);
 static int register_hrhd_units(void)
@@ -530,13 +584,73 @@ static void dmar_write_buffer_flush(struct dmar_drhd_rt *dmar_uint)
 	IOMMU_UNLOCK(dmar_uint);
 }
 
+/*
+ * Queue an invalidation descriptor followed by a wait descriptor and
+ * spin until the hardware writes the wait status back. Once queued
+ * invalidation is enabled the register-based invalidation must not be
+ * used any more.
+ *
+ * Each wait descriptor carries its own sequence number, so a late write
+ * from an earlier wait can't complete a later submission. If the wait
+ * does not complete within DMAR_OP_TIMEOUT the unit is marked failed
+ * and -ETIMEDOUT is returned; later submissions fail with -EIO without
+ * touching the queue.
+ */
+static int dmar_qi_submit(struct dmar_drhd_rt *dmar_uint,
+		uint64_t lower, uint64_t upper)
+{
+	struct dmar_qi_desc *desc;
+	uint64_t start;
+	uint32_t seq;
+
+	IOMMU_LOCK(dmar_uint);
+	if (dmar_uint->qi_failed) {
+		IOMMU_UNLOCK(dmar_uint);
+		return -EIO;
+	}
+
+	/* 0 is the value written before the wait, never use it */
+	seq = ++dmar_uint->qi_seq;
+	if (seq == 0)
+		seq = ++dmar_uint->qi_seq;
+
+	desc = &dmar_uint->qi_queue[dmar_uint->qi_tail];
+	desc->lower = lower;
+	desc->upper = upper;
+
+	desc = &dmar_uint->qi_queue[dmar_uint->qi_tail + 1];
+	desc->lower = DMAR_QI_WAIT_DESC | DMAR_QI_WAIT_SW |
+		DMAR_QI_WAIT_DATA(seq);
+	desc->upper = HVA2HPA(&dmar_uint->qi_status);
+	dmar_uint->qi_status = 0;
+
+	/* the queue is drained after each submission, it never fills */
+	dmar_uint->qi_tail = (dmar_uint->qi_tail + 2) % DMAR_QI_ENTRIES;
+	iommu_write64(dmar_uint, DMAR_IQT_REG,
+		(uint64_t)dmar_uint->qi_tail << DMAR_IQ_SHIFT);
+
+	start = rdtsc();
+	while (atomic_load((int *)&dmar_uint->qi_status) != (int)seq) {
+		if (rdtsc() - start > DMAR_OP_TIMEOUT) {
+			dmar_uint->qi_failed = true;
+			IOMMU_UNLOCK(dmar_uint);
+			pr_err("%s: timeout on descriptor 0x%llx",
+				__func__, lower);
+			return -ETIMEDOUT;
+		}
+		asm volatile ("pause" ::: "memory");
+	}
+	IOMMU_UNLOCK(dmar_uint);
+	return 0;
+}
+
 /*
  * did: domain id
  * sid: source id
  * fm: function mask
  * cirg: cache-invalidation request granularity
  */
-static void dmar_invalid_context_cache(struct dmar_drhd_rt *dmar_uint,
+static int dmar_invalid_context_cache(struct dmar_drhd_rt *dmar_uint,
 	uint16_t did, uint16_t sid, uint8_t fm, enum dmar_cirg_type cirg)
 {
 	uint64_t cmd = DMA_CCMD_ICC;
@@ -555,9 +669,14 @@ static void dmar_invalid_context_cache(struct dmar_drhd_rt *dmar_uint,
 		break;
 	default:
 		pr_err("unknown CIRG type");
-		return;
+		return -EINVAL;
 	}
 
+	if (dmar_uint->gcmd & DMA_GCMD_QIE)
+		return dmar_qi_submit(dmar_uint, DMAR_QI_CC_DESC |
+			DMAR_QI_GRAN(cirg) | DMAR_QI_DID(did) |
+			DMAR_QI_SID(sid) | DMAR_QI_FM(fm), 0);
+
 	IOMMU_LOCK(dmar_uint);
 	iommu_write64(dmar_uint, DMAR_CCMD_REG, cmd);
 	/* read upper 32bits to check */
@@ -568,14 +687,16 @@ static void dmar_invalid_context_cache(struct dmar_drhd_rt *dmar_uint,
 
 	dev_dbg(ACRN_DBG_IOMMU, "cc invalidation granularity %d",
 		DMA_CCMD_GET_CAIG_32(status));
+	return 0;
 }
 
-static void dmar_invalid_context_cache_global(struct dmar_drhd_rt *dmar_uint)
+static int dmar_invalid_context_cache_global(struct dmar_drhd_rt *dmar_uint)
 {
-	dmar_invalid_context_cache(dmar_uint, 0, 0, 0, DMAR_CIRG_GLOBAL);
+	return dmar_invalid_context_cache(dmar_uint, 0, 0, 0,
+			DMAR_CIRG_GLOBAL);
 }
 
-static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_uint,
+static int dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_uint,
 				   uint16_t did, uint64_t address, uint8_t am,
 				   bool hint, enum dmar_iirg_type iirg)
 {
@@ -601,8 +722,14 @@ static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_uint,
 		break;
 	default:
 		pr_err("unknown IIRG type");
-		return;
+		return -EINVAL;
 	}
+
+	if (dmar_uint->gcmd & DMA_GCMD_QIE)
+		return dmar_qi_submit(dmar_uint, DMAR_QI_IOTLB_DESC |
+			DMAR_QI_GRAN(iirg) | DMAR_QI_DID(did) |
+			DMAR_QI_IOTLB_DR | DMAR_QI_IOTLB_DW, addr);
+
 	IOMMU_LOCK(dmar_uint);
 	if (addr)
 		iommu_write64(dmar_uint, dmar_uint->ecap_iotlb_offset, addr);
@@ -616,7 +743,9 @@ static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_uint,
 	if (!DMA_IOTLB_GET_IAIG_32(status)) {
 		pr_err("fail to invalidate IOTLB!, 0x%x, 0x%x",
 			status, iommu_read32(dmar_uint, DMAR_FSTS_REG));
+		return -EIO;
 	}
+	return 0;
 }
 
 /* Invalidate IOTLB globally,
@@ -624,9 +753,9 @@ static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_uint,
  * all PASID-cache entries are invalidated,
  * all paging-structure-cache entries are invalidated.
  */
-static void dmar_invalid_iotlb_global(struct dmar_drhd_rt *dmar_uint)
+static int dmar_invalid_iotlb_global(struct dmar_drhd_rt *dmar_uint)
 {
-	dmar_invalid_iotlb(dmar_uint, 0, 0, 0, 0, DMAR_IIRG_GLOBAL);
+	return dmar_invalid_iotlb(dmar_uint, 0, 0, 0, 0, DMAR_IIRG_GLOBAL);
 }
 
 static void dmar_set_root_table(struct dmar_drhd_rt *dmar_uint)
@@ -649,6 +778,143 @@ static void dmar_set_root_table(struct dmar_drhd_rt *dmar_uint)
 	IOMMU_UNLOCK(dmar_uint);
 }
 
+/*
+ * Interrupt remapping is only used to post passthrough MSIs to vcpus,
+ * so it is enabled when both the unit and the processor support posted
+ * interrupts. Compatibility format interrupts stay allowed: only the
+ * MSIs programmed in remappable format by ptdev go through the table.
+ */
+static bool dmar_unit_support_posted_intr(struct dmar_drhd_rt *dmar_uint)
+{
+	return iommu_ecap_qi(dmar_uint->ecap) &&
+		iommu_ecap_ir(dmar_uint->ecap) &&
+		iommu_cap_pi(dmar_uint->cap) &&
+		is_vapic_posted_intr_supported();
+}
+
+/*
+ * Wait for the global status bits in 'mask' to become set (or clear).
+ * Unlike DMAR_WAIT_COMPLETION this is bounded in release builds too,
+ * it returns -ETIMEDOUT after DMAR_OP_TIMEOUT. Called with the unit
+ * lock held.
+ */
+static int dmar_wait_gsts(struct dmar_drhd_rt *dmar_uint, uint32_t mask,
+		bool set)
+{
+	uint64_t start = rdtsc();
+	uint32_t status;
+
+	while (1) {
+		status = iommu_read32(dmar_uint, DMAR_GSTS_REG);
+		if (((status & mask) != 0) == set)
+			return 0;
+		if (rdtsc() - start > DMAR_OP_TIMEOUT) {
+			pr_err("%s: timeout on status 0x%x, gsts 0x%x",
+				__func__, mask, status);
+			return -ETIMEDOUT;
+		}
+		asm volatile ("pause" ::: "memory");
+	}
+}
+
+static void dmar_enable_intr_remapping(struct dmar_drhd_rt *dmar_uint)
+{
+	int ret;
+
+	if (!dmar_unit_support_posted_intr(dmar_uint))
+		return;
+
+	if (dmar_uint->qi_queue == NULL) {
+		dmar_uint->qi_queue = alloc_page();
+		dmar_uint->ir_table = alloc_page();
+		ASSERT(dmar_uint->qi_queue != NULL &&
+			dmar_uint->ir_table != NULL,
+			"failed to allocate invalidation queue!");
+		memset(dmar_uint->qi_queue, 0, CPU_PAGE_SIZE);
+		memset(dmar_uint->ir_table, 0, CPU_PAGE_SIZE);
+		iommu_flush_cache(dmar_uint, dmar_uint->ir_table,
+				CPU_PAGE_SIZE);
+	}
+
+	IOMMU_LOCK(dmar_uint);
+	/* 256 descriptors, queue size field 0 */
+	dmar_uint->qi_tail = 0;
+	dmar_uint->qi_failed = false;
+	iommu_write64(dmar_uint, DMAR_IQT_REG, 0);
+	iommu_write64(dmar_uint, DMAR_IQA_REG, HVA2HPA(dmar_uint->qi_queue));
+	dmar_uint->gcmd |= DMA_GCMD_QIE;
+	iommu_write32(dmar_uint, DMAR_GCMD_REG, dmar_uint->gcmd);
+	ret = dmar_wait_gsts(dmar_uint, DMA_GSTS_QIES, true);
+
+	if (ret == 0) {
+		iommu_write64(dmar_uint, DMAR_IRTA_REG,
+			HVA2HPA(dmar_uint->ir_table) | DMAR_IRTA_S);
+		iommu_write32(dmar_uint, DMAR_GCMD_REG,
+			dmar_uint->gcmd | DMA_GCMD_SIRTP);
+		ret = dmar_wait_gsts(dmar_uint, DMA_GSTS_IRTPS, true);
+	}
+	IOMMU_UNLOCK(dmar_uint);
+
+	/* global interrupt entry cache invalidation */
+	if (ret == 0)
+		ret = dmar_qi_submit(dmar_uint, DMAR_QI_IEC_DESC, 0);
+
+	if (ret == 0) {
+		IOMMU_LOCK(dmar_uint);
+		dmar_uint->gcmd |= DMA_GCMD_CFI;
+		iommu_write32(dmar_uint, DMAR_GCMD_REG, dmar_uint->gcmd);
+		ret = dmar_wait_gsts(dmar_uint, DMA_GSTS_CFIS, true);
+
+		if (ret == 0) {
+			dmar_uint->gcmd |= DMA_GCMD_IRE;
+			iommu_write32(dmar_uint, DMAR_GCMD_REG,
+				dmar_uint->gcmd);
+			ret = dmar_wait_gsts(dmar_uint, DMA_GSTS_IRES, true);
+		}
+		IOMMU_UNLOCK(dmar_uint);
+	}
+
+	if (ret != 0) {
+		pr_err("%s: failed to enable posted interrupts", __func__);
+		dmar_disable_intr_remapping(dmar_uint);
+		return;
+	}
+
+	dmar_uint->ir_enabled = true;
+	dev_dbg(ACRN_DBG_IOMMU, "%s: posted interrupts enabled", __func__);
+}
+
+/*
+ * Turn interrupt remapping and queued invalidation off. If the unit does
+ * not acknowledge, QIE is kept in the command cache and the queue marked
+ * failed, so neither queued nor register invalidation is used on it.
+ */
+static void dmar_disable_intr_remapping(struct dmar_drhd_rt *dmar_uint)
+{
+	int ret;
+
+	if (!(dmar_uint->gcmd & DMA_GCMD_QIE))
+		return;
+
+	IOMMU_LOCK(dmar_uint);
+	dmar_uint->ir_enabled = false;
+	dmar_uint->gcmd &= ~(DMA_GCMD_IRE | DMA_GCMD_CFI);
+	iommu_write32(dmar_uint, DMAR_GCMD_REG, dmar_uint->gcmd);
+	ret = dmar_wait_gsts(dmar_uint, DMA_GSTS_IRES, false);
+
+	if (ret == 0) {
+		dmar_uint->gcmd &= ~DMA_GCMD_QIE;
+		iommu_write32(dmar_uint, DMAR_GCMD_REG, dmar_uint->gcmd);
+		ret = dmar_wait_gsts(dmar_uint, DMA_GSTS_QIES, false);
+	}
+
+	if (ret != 0) {
+		dmar_uint->gcmd |= DMA_GCMD_QIE;
+		dmar_uint->qi_failed = true;
+	}
+	IOMMU_UNLOCK(dmar_uint);
+}
+
 static int dmar_fault_event_mask(struct dmar_drhd_rt *dmar_uint)
 {
 	IOMMU_LOCK(dmar_uint);
@@ -826,6 +1092,7 @@ static void dmar_enable(struct dmar_drhd_rt *dmar_uint)
 	dmar_setup_interrupt(dmar_uint);
 	dmar_write_buffer_flush(dmar_uint);
 	dmar_set_root_table(dmar_uint);
+	dmar_enable_intr_remapping(dmar_uint);
 	dmar_invalid_context_cache_global(dmar_uint);
 	dmar_invalid_iotlb_global(dmar_uint);
 	dmar_enable_translation(dmar_uint);
@@ -836,6 +1103,8 @@ static void dmar_disable(struct dmar_drhd_rt *dmar_uint)
 	if (dmar_uint->gcmd & DMA_GCMD_TE)
 		dmar_disable_translation(dmar_uint);
 
+	dmar_disable_intr_remapping(dmar_uint);
+
 	dmar_fault_event_mask(dmar_uint);
 }
 
@@ -1077,8 +1346,12 @@ remove_iommu_device(struct iommu_domain *domain, uint16_t segment,
 
 	/* if caching mode is present, need to invalidate translation cache */
 	/* if(cap_caching_mode(dmar_uint->cap)) { */
-	dmar_invalid_context_cache_global(dmar_uint);
-	dmar_invalid_iotlb_global(dmar_uint);
+	if (dmar_invalid_context_cache_global(dmar_uint) != 0 ||
+			dmar_invalid_iotlb_global(dmar_uint) != 0) {
+		pr_err("%s: failed to invalidate caches for %x:%x.%x",
+			__func__, bus, devfun >> 3, devfun & 0x7);
+		return 1;
+	}
 	/* } */
 	return 0;
 }
@@ -1091,7 +1364,8 @@ int assign_iommu_device(struct iommu_domain *domain, uint8_t bus,
 
 	/* TODO: check if the device assigned */
 
-	remove_iommu_device(host_domain, 0, bus, devfun);
+	if (remove_iommu_device(host_domain, 0, bus, devfun) != 0)
+		return 1;
 	add_iommu_device(domain, 0, bus, devfun);
 	return 0;
 }
@@ -1104,11 +1378,125 @@ int unassign_iommu_device(struct iommu_domain *domain, uint8_t bus,
 
 	/* TODO: check if the device assigned */
 
-	remove_iommu_device(domain, 0, bus, devfun);
+	if (remove_iommu_device(domain, 0, bus, devfun) != 0)
+		return 1;
 	add_iommu_device(host_domain, 0, bus, devfun);
 	return 0;
 }
 
+/* Replace all 128 bits of an IRTE with a single locked store */
+static void irte_write_atomic(struct dmar_irte *irte, uint64_t lower,
+		uint64_t upper)
+{
+	uint64_t old_lower = irte->lower;
+	uint64_t old_upper = irte->upper;
+	uint8_t done;
+
+	do {
+		asm volatile(BUS_LOCK "cmpxchg16b %1; setz %0"
+			: "=q" (done), "+m" (*irte),
+			  "+a" (old_lower), "+d" (old_upper)
+			: "b" (lower), "c" (upper)
+			: "cc", "memory");
+	} while (!done);
+}
+
+/*
+ * Program a posted format IRTE which makes the device write 'vector'
+ * straight into the posted-interrupt descriptor at 'pi_desc'. An entry
+ * is allocated when *index is negative, otherwise it is rewritten.
+ */
+int iommu_set_posted_irte(uint8_t bus, uint8_t devfun, int *index,
+		uint64_t pi_desc, uint8_t vector)
+{
+	struct dmar_drhd_rt *dmar_uint;
+	struct dmar_irte *irte;
+	uint64_t lower, upper;
+	int i = *index;
+	int ret;
+
+	dmar_uint = device_to_dmaru(0, bus, devfun);
+	if (dmar_uint == NULL || dmar_uint->drhd->ignore ||
+			!dmar_uint->ir_enabled || dmar_uint->qi_failed)
+		return -ENODEV;
+
+	if (i < 0) {
+		IOMMU_LOCK(dmar_uint);
+		for (i = 0; i < DMAR_IR_ENTRIES; i++) {
+			if (!bitmap_test_and_set(i % 64,
+					&dmar_uint->ir_bitmap[i / 64]))
+				break;
+		}
+		IOMMU_UNLOCK(dmar_uint);
+		if (i == DMAR_IR_ENTRIES)
+			return -ENOMEM;
+	}
+
+	upper = IRTE_UPPER_SID((bus << 8) | devfun) |
+		IRTE_UPPER_SVT_SID | IRTE_UPPER_PDA(pi_desc);
+	lower = IRTE_LOWER_P | IRTE_LOWER_IM_POSTED |
+		IRTE_LOWER_VECTOR(vector) | IRTE_LOWER_PDA(pi_desc);
+
+	/*
+	 * An entry in use is retargeted while the device may be sending
+	 * interrupts, so it must never look non-present or half written
+	 * to the unit: an interrupt hitting it would be dropped.
+	 */
+	irte = &dmar_uint->ir_table[i];
+	if (!(irte->lower & IRTE_LOWER_P)) {
+		irte->upper = upper;
+		irte->lower = lower;
+	} else if (irte->upper == upper)
+		irte->lower = lower;
+	else
+		irte_write_atomic(irte, lower, upper);
+	iommu_flush_cache(dmar_uint, irte, sizeof(*irte));
+	ret = dmar_qi_submit(dmar_uint, DMAR_QI_IEC_DESC |
+		DMAR_QI_IEC_INDEX | DMAR_QI_IEC_IIDX(i), 0);
+	if (ret != 0)
+		goto fail;
+
+	*index = i;
+	return 0;
+
+fail:
+	/*
+	 * The unit may still hold the entry in its cache, so the index is
+	 * never handed out again. A fresh entry is leaked, a caller owned
+	 * one stays allocated until iommu_free_irte() leaks it.
+	 */
+	irte->lower = 0;
+	iommu_flush_cache(dmar_uint, irte, sizeof(*irte));
+	return ret;
+}
+
+void iommu_free_irte(uint8_t bus, uint8_t devfun, int index)
+{
+	struct dmar_drhd_rt *dmar_uint;
+	struct dmar_irte *irte;
+
+	dmar_uint = device_to_dmaru(0, bus, devfun);
+	if (dmar_uint == NULL || !dmar_uint->ir_enabled ||
+			index < 0 || index >= DMAR_IR_ENTRIES)
+		return;
+
+	irte = &dmar_uint->ir_table[index];
+	irte->lower = 0;
+	irte->upper = 0;
+	iommu_flush_cache(dmar_uint, irte, sizeof(*irte));
+
+	/* without the flush the unit may still post through the cached
+	 * entry, keep the index allocated rather than reuse it
+	 */
+	if (dmar_qi_submit(dmar_uint, DMAR_QI_IEC_DESC |
+			DMAR_QI_IEC_INDEX | DMAR_QI_IEC_IIDX(index), 0) != 0) {
+		pr_err("%s: leaking IRTE %d", __func__, index);
+		return;
+	}
+
+	bitmap_clear(index % 64, &dmar_uint->ir_bitmap[index / 64]);
+}
+
 void enable_iommu(void)
 {
 	struct dmar_drhd_rt *dmar_uint;
@@ -144,6 +144,9 @@ int64_t hcall_create_vm(struct vm *vm, uint64_t param)
 	memset(&vm_desc, 0, sizeof(vm_desc));
 	vm_desc.sworld_enabled =
 		(!!(cv.vm_flag & (SECURE_WORLD_ENABLED)));
+	vm_desc.rt_pinned = (!!(cv.vm_flag & (RT_PINNED_ENABLED)));
+	vm_desc.hlt_exit = (!!(cv.vm_flag & (HLT_EXIT_ENABLED)));
+	vm_desc.ioreq_poll_us = cv.ioreq_poll_us;
 	memcpy_s(&vm_desc.GUID[0], 16, &cv.GUID[0], 16);
 	ret = create_vm(&vm_desc, &target_vm);
 
@@ -218,7 +221,7 @@ int64_t hcall_create_vcpu(struct vm *vm, uint64_t vmid, uint64_t param)
 		return -1;
 	}
 
-	pcpu_id = allocate_pcpu();
+	pcpu_id = allocate_pcpu(target_vm->rt_pinned);
 	if (-1 == pcpu_id) {
 		pr_err("%s: No physical available\n", __func__);
 		return -1;
@@ -322,6 +325,130 @@ int64_t hcall_set_ioreq_buffer(struct vm *vm, uint64_t vmid, uint64_t param)
 	return ret;
 }
 
+int64_t hcall_set_coalesced_ring(struct vm *vm, uint64_t vmid,
+	uint64_t param)
+{
+	uint64_t hpa = 0;
+	struct acrn_set_coalesced_ring ring;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (!is_vm0(vm)) {
+		pr_err("%s: ERROR! Not coming from service vm", __func__);
+		return -1;
+	}
+
+	if ((target_vm == NULL) || is_vm0(target_vm))
+		return -1;
+
+	memset((void *)&ring, 0, sizeof(ring));
+
+	if (copy_from_vm(vm, &ring, param, sizeof(ring))) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -1;
+	}
+
+	dev_dbg(ACRN_DBG_HYCALL, "[%d] SET COALESCED RING=0x%p",
+			vmid, ring.ring_buf);
+
+	spinlock_obtain(&target_vm->coalesced_lock);
+	if (ring.ring_buf == 0) {
+		target_vm->sw.coalesced_ring = NULL;
+		spinlock_release(&target_vm->coalesced_lock);
+		return 0;
+	}
+
+	hpa = gpa2hpa(vm, ring.ring_buf);
+	if ((hpa == 0) || ((hpa & (CPU_PAGE_SIZE - 1)) != 0)) {
+		pr_err("%s: invalid GPA.\n", __func__);
+		target_vm->sw.coalesced_ring = NULL;
+		spinlock_release(&target_vm->coalesced_lock);
+		return -EINVAL;
+	}
+
+	target_vm->sw.coalesced_ring = HPA2HVA(hpa);
+	spinlock_release(&target_vm->coalesced_lock);
+
+	return 0;
+}
+
+int64_t hcall_set_coalesced_zone(struct vm *vm, uint64_t vmid,
+	uint64_t param)
+{
+	struct acrn_coalesced_mmio_zone zone;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (!is_vm0(vm)) {
+		pr_err("%s: ERROR! Not coming from service vm", __func__);
+		return -1;
+	}
+
+	if ((target_vm == NULL) || is_vm0(target_vm))
+		return -1;
+
+	memset((void *)&zone, 0, sizeof(zone));
+
+	if (copy_from_vm(vm, &zone, param, sizeof(zone))) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -1;
+	}
+
+	dev_dbg(ACRN_DBG_HYCALL, "[%d] COALESCED ZONE 0x%llx+0x%x op %d",
+			vmid, zone.addr, zone.size, zone.op);
+
+	return set_coalesced_mmio_zone(target_vm, zone.addr, zone.size,
+			zone.op);
+}
+
+int64_t hcall_setup_vuart(struct vm *vm, uint64_t vmid, uint64_t param)
+{
+	uint64_t hpa = 0;
+	struct acrn_vuart_setup setup;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (!is_vm0(vm)) {
+		pr_err("%s: ERROR! Not coming from service vm", __func__);
+		return -1;
+	}
+
+	if ((target_vm == NULL) || is_vm0(target_vm))
+		return -1;
+
+	memset((void *)&setup, 0, sizeof(setup));
+
+	if (copy_from_vm(vm, &setup, param, sizeof(setup))) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -1;
+	}
+
+	dev_dbg(ACRN_DBG_HYCALL, "[%d] SETUP VUART port 0x%x irq %d ring=0x%p",
+			vmid, setup.base, setup.irq, setup.ring_buf);
+
+	hpa = gpa2hpa(vm, setup.ring_buf);
+	if ((hpa == 0) || ((hpa & (CPU_PAGE_SIZE - 1)) != 0)) {
+		pr_err("%s: invalid GPA.\n", __func__);
+		return -EINVAL;
+	}
+
+	return vuart_setup(target_vm, setup.base, setup.irq, HPA2HVA(hpa));
+}
+
+int64_t hcall_notify_vuart(struct vm *vm, uint64_t vmid)
+{
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (!is_vm0(vm)) {
+		pr_err("%s: ERROR! Not coming from service vm", __func__);
+		return -1;
+	}
+
+	if (target_vm == NULL || target_vm->vuart == NULL)
+		return -1;
+
+	vuart_notify(target_vm->vuart);
+
+	return 0;
+}
+
 static void complete_request(struct vcpu *vcpu)
 {
 	/*
@@ -334,11 +461,15 @@ static void complete_request(struct vcpu *vcpu)
 		req_buf = (union vhm_request_buffer *)
 				vcpu->vm->sw.io_shared_page;
 		req_buf->req_queue[vcpu->vcpu_id].valid = false;
-		atomic_store(&vcpu->ioreq_pending, 0);
+		atomic_store(&vcpu->ioreq_pending, IOREQ_NONE);
 
 		return;
 	}
 
+	/* the vcpu may be polling and complete the request by itself */
+	if (!acrn_claim_request(vcpu, IOREQ_WAIT))
+		return;
+
 	switch (vcpu->req.type) {
 	case REQ_MMIO:
 		request_vcpu_pre_work(vcpu, ACRN_VCPU_MMIO_COMPLETE);
@@ -389,7 +520,7 @@ int64_t hcall_notify_req_finish(uint64_t vmid, uint64_t vcpu_id)
 	return 0;
 }
 
-int64_t _set_vm_memmap(struct vm *vm, struct vm *target_vm,
+static int64_t _set_vm_memmap(struct vm *vm, struct vm *target_vm,
 	struct vm_set_memmap *memmap)
 {
 	uint64_t hpa;
@@ -437,13 +568,14 @@ int64_t _set_vm_memmap(struct vm *vm, struct vm *target_vm,
 			attr |= MMU_MEM_ATTR_UNCACHED;
 	}
 
-	/* create gpa to hpa EPT mapping */
-	return ept_mmap(target_vm, hpa,
+	/* create gpa to hpa EPT mapping, callers flush the EPT */
+	return ept_mmap_noflush(target_vm, hpa,
 		memmap->remote_gpa, memmap->length, memmap->type, attr);
 }
 
 int64_t hcall_set_vm_memmap(struct vm *vm, uint64_t vmid, uint64_t param)
 {
+	int64_t ret;
 	struct vm_set_memmap memmap;
 	struct vm *target_vm = get_vm_from_vmid(vmid);
 
@@ -467,7 +599,10 @@ int64_t hcall_set_vm_memmap(struct vm *vm, uint64_t vmid, uint64_t param)
 		return -1;
 	}
 
-	return _set_vm_memmap(vm, target_vm, &memmap);
+	ret = _set_vm_memmap(vm, target_vm, &memmap);
+	ept_flush(target_vm);
+
+	return ret;
 }
 
 int64_t hcall_set_vm_memmaps(struct vm *vm, uint64_t param)
@@ -476,6 +611,7 @@ int64_t hcall_set_vm_memmaps(struct vm *vm, uint64_t param)
 	struct memory_map *regions;
 	struct vm *target_vm;
 	unsigned int idx;
+	int64_t ret = 0;
 
 	if (!is_vm0(vm)) {
 		pr_err("%s: ERROR! Not coming from service vm",
@@ -505,11 +641,18 @@ int64_t hcall_set_vm_memmaps(struct vm *vm, uint64_t param)
 		 * to struct vm_set_memmap, it will be removed in the future
 		 */
 		if (_set_vm_memmap(vm, target_vm,
-			(struct vm_set_memmap *)&regions[idx]) < 0)
-			return -1;
+			(struct vm_set_memmap *)&regions[idx]) < 0) {
+			ret = -1;
+			break;
+		}
 		idx++;
 	}
-	return 0;
+
+	/* one invalidation for the whole batch */
+	if (idx != 0)
+		ept_flush(target_vm);
+
+	return ret;
 }
 
 int64_t hcall_remap_pci_msix(struct vm *vm, uint64_t vmid, uint64_t param)
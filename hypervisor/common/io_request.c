@@ -7,7 +7,7 @@
 
 #define ACRN_DBG_IOREQUEST	6
 
-static void fire_vhm_interrupt(void)
+void fire_vhm_interrupt(void)
 {
 	/*
 	 * use vLAPIC to inject vector to SOS vcpu 0 if vlapic is enabled
@@ -55,6 +55,63 @@ static void acrn_print_request(int vcpu_id, struct vhm_request *req)
 	}
 }
 
+static inline bool request_done(struct vhm_request *req)
+{
+	int32_t processed = *(volatile int32_t *)&req->processed;
+
+	return (processed == REQ_STATE_SUCCESS) ||
+		(processed == REQ_STATE_FAILED);
+}
+
+/*
+ * Both the vcpu itself (polling) and hcall_notify_req_finish may see a
+ * request finished; only the one which moves ioreq_pending from @state
+ * to IOREQ_NONE completes it.
+ */
+bool acrn_claim_request(struct vcpu *vcpu, int state)
+{
+	union vhm_request_buffer *req_buf;
+	struct vhm_request *req;
+
+	req_buf = (union vhm_request_buffer *)(vcpu->vm->sw.io_shared_page);
+	req = &req_buf->req_queue[vcpu->vcpu_id];
+
+	if (!request_done(req) ||
+		atomic_cmpxchg(&vcpu->ioreq_pending, state, IOREQ_NONE) != state)
+		return false;
+
+	if (request_done(req))
+		return true;
+
+	/* a stale notification raced with a new request, hand it back */
+	atomic_store(&vcpu->ioreq_pending, state);
+
+	return request_done(req) &&
+		(atomic_cmpxchg(&vcpu->ioreq_pending, state, IOREQ_NONE) == state);
+}
+
+static void complete_request_inline(struct vcpu *vcpu)
+{
+	if (vcpu->req.type == REQ_MMIO)
+		dm_emulate_mmio_post(vcpu);
+	else if (vcpu->req.type == REQ_PORTIO)
+		dm_emulate_pio_post(vcpu);
+}
+
+/* spin up to the VM's ioreq_poll_us for VHM to process the request */
+static bool poll_request(struct vcpu *vcpu, struct vhm_request *req)
+{
+	uint64_t deadline = rdtsc() + US_TO_TICKS(vcpu->vm->ioreq_poll_us);
+
+	do {
+		if (request_done(req))
+			return acrn_claim_request(vcpu, IOREQ_POLL);
+		asm volatile ("pause" ::: "memory");
+	} while (rdtsc() < deadline);
+
+	return false;
+}
+
 int acrn_insert_request_wait(struct vcpu *vcpu, struct vhm_request *req)
 {
 	union vhm_request_buffer *req_buf = NULL;
@@ -74,11 +131,41 @@ int acrn_insert_request_wait(struct vcpu *vcpu, struct vhm_request *req)
 	memcpy_s(&req_buf->req_queue[cur], sizeof(struct vhm_request),
 		 req, sizeof(struct vhm_request));
 
+	if (vcpu->vm->ioreq_poll_us != 0) {
+		/* While polling, notifications from VHM are ignored and the
+		 * vcpu completes the request itself.
+		 */
+		atomic_store(&vcpu->ioreq_pending, IOREQ_POLL);
+		req_buf->req_queue[cur].valid = true;
+
+		acrn_print_request(vcpu->vcpu_id, req_buf->req_queue + cur);
+
+		fire_vhm_interrupt();
+
+		if (poll_request(vcpu, req_buf->req_queue + cur)) {
+			complete_request_inline(vcpu);
+			return 0;
+		}
+
+		/* Budget exhausted: pause first, then let VHM complete it.
+		 * A notification which came in while we were still polling
+		 * has been dropped, so check once more afterwards.
+		 */
+		pause_vcpu(vcpu, VCPU_PAUSED);
+		atomic_store(&vcpu->ioreq_pending, IOREQ_WAIT);
+		if (acrn_claim_request(vcpu, IOREQ_WAIT)) {
+			complete_request_inline(vcpu);
+			resume_vcpu(vcpu);
+		}
+
+		return 0;
+	}
+
 	/* pause vcpu, wait for VHM to handle the MMIO request.
 	 * TODO: when pause_vcpu changed to switch vcpu out directlly, we
 	 * should fix the race issue between req.valid = true and vcpu pause
 	 */
-	atomic_store(&vcpu->ioreq_pending, 1);
+	atomic_store(&vcpu->ioreq_pending, IOREQ_WAIT);
 	pause_vcpu(vcpu, VCPU_PAUSED);
 
 	/* Must clear the signal before we mark req valid
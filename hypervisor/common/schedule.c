@@ -7,7 +7,23 @@
 #include <hypervisor.h>
 #include <schedule.h>
 
-static unsigned long pcpu_used_bitmap;
+static spinlock_t pcpu_alloc_lock = {
+	.head = 0,
+	.tail = 0
+};
+
+/* TICKS_TO_US() rounds to 256us, too coarse for wake latency */
+#define TICKS_TO_NS(x)	((x) * 1000UL / (tsc_hz / 1000000UL))
+
+static int slice_timer_fn(void *data)
+{
+	struct sched_context *ctx = (struct sched_context *)data;
+
+	/* runs on the owning pcpu, vcpu_thread() or the idle loop acts on it */
+	ctx->slice_expired = true;
+	bitmap_set(NEED_RESCHEDULE, &ctx->flags);
+	return 0;
+}
 
 void init_scheduler(void)
 {
@@ -19,6 +35,14 @@ void init_scheduler(void)
 		INIT_LIST_HEAD(&per_cpu(sched_ctx, i).runqueue);
 		per_cpu(sched_ctx, i).flags= 0;
 		per_cpu(sched_ctx, i).curr_vcpu = NULL;
+		per_cpu(sched_ctx, i).nr_vcpus = 0;
+		per_cpu(sched_ctx, i).pinned = false;
+		initialize_timer(&per_cpu(sched_ctx, i).slice_timer,
+				slice_timer_fn, &per_cpu(sched_ctx, i),
+				0, TICK_MODE_ONESHOT, 0);
+		per_cpu(sched_ctx, i).idle_mode = get_monitor_cap() ?
+			IDLE_MODE_MWAIT : IDLE_MODE_HLT;
+		per_cpu(sched_ctx, i).idle_state = IDLE_MODE_NONE;
 	}
 }
 
@@ -32,26 +56,61 @@ void release_schedule_lock(int pcpu_id)
 	spinlock_release(&per_cpu(sched_ctx, pcpu_id).scheduler_lock);
 }
 
-int allocate_pcpu(void)
+/*
+ * A vcpu gets a pcpu of its own while one is free. After that, vcpus of
+ * VMs which are not pinned share the least loaded pcpu which is not
+ * pinned either, up to CONFIG_MAX_VCPUS_PER_PCPU each.
+ */
+int allocate_pcpu(bool pinned)
 {
-	int i;
+	int i, pcpu_id = -1;
+	struct sched_context *ctx;
 
+	spinlock_obtain(&pcpu_alloc_lock);
 	for (i = 0; i < phy_cpu_num; i++) {
-		if (bitmap_test_and_set(i, &pcpu_used_bitmap) == 0)
-			return i;
+		if (per_cpu(sched_ctx, i).nr_vcpus == 0) {
+			pcpu_id = i;
+			break;
+		}
+	}
+
+	if (pcpu_id < 0 && !pinned) {
+		for (i = 0; i < phy_cpu_num; i++) {
+			ctx = &per_cpu(sched_ctx, i);
+			if (ctx->pinned ||
+				ctx->nr_vcpus >= CONFIG_MAX_VCPUS_PER_PCPU)
+				continue;
+			if (pcpu_id < 0 || ctx->nr_vcpus <
+					per_cpu(sched_ctx, pcpu_id).nr_vcpus)
+				pcpu_id = i;
+		}
+	}
+
+	if (pcpu_id >= 0) {
+		ctx = &per_cpu(sched_ctx, pcpu_id);
+		if (ctx->nr_vcpus++ == 0)
+			ctx->pinned = pinned;
 	}
+	spinlock_release(&pcpu_alloc_lock);
 
-	return -1;
+	return pcpu_id;
 }
 
+/* claim a pcpu statically assigned to a VM, such as those of vm0 */
 void set_pcpu_used(int pcpu_id)
 {
-	bitmap_set(pcpu_id, &pcpu_used_bitmap);
+	spinlock_obtain(&pcpu_alloc_lock);
+	per_cpu(sched_ctx, pcpu_id).nr_vcpus++;
+	per_cpu(sched_ctx, pcpu_id).pinned = true;
+	spinlock_release(&pcpu_alloc_lock);
 }
 
 void free_pcpu(int pcpu_id)
 {
-	bitmap_clear(pcpu_id, &pcpu_used_bitmap);
+	spinlock_obtain(&pcpu_alloc_lock);
+	if (--per_cpu(sched_ctx, pcpu_id).nr_vcpus == 0)
+		per_cpu(sched_ctx, pcpu_id).pinned = false;
+	spinlock_release(&pcpu_alloc_lock);
 }
 
 void add_vcpu_to_runqueue(struct vcpu *vcpu)
@@ -74,25 +133,129 @@ void remove_vcpu_from_runqueue(struct vcpu *vcpu)
 	spinlock_release(&per_cpu(sched_ctx, pcpu_id).runqueue_lock);
 }
 
-static struct vcpu *select_next_vcpu(int pcpu_id)
+/*
+ * Weighted round robin: the first vcpu on the runqueue which is not
+ * blocked in guest HLT runs. A vcpu whose slice expired goes behind
+ * its peers first. *nr_runnable tells whether a slice is needed at all.
+ * A blocked vcpu with an interrupt which VT-d posted to it is runnable
+ * again, the posted-interrupt wakeup vector got us here.
+ */
+static struct vcpu *select_next_vcpu(int pcpu_id, int *nr_runnable)
 {
-	struct vcpu *vcpu = NULL;
+	struct sched_context *ctx = &per_cpu(sched_ctx, pcpu_id);
+	struct vcpu *vcpu = NULL, *tmp;
+	struct list_head *pos;
+
+	*nr_runnable = 0;
+
+	spinlock_obtain(&ctx->runqueue_lock);
+	if (ctx->slice_expired) {
+		ctx->slice_expired = false;
+		if (ctx->curr_vcpu != NULL &&
+				!list_empty(&ctx->curr_vcpu->run_list)) {
+			list_del(&ctx->curr_vcpu->run_list);
+			list_add_tail(&ctx->curr_vcpu->run_list,
+					&ctx->runqueue);
+		}
+	}
 
-	spinlock_obtain(&per_cpu(sched_ctx, pcpu_id).runqueue_lock);
-	if (!list_empty(&per_cpu(sched_ctx, pcpu_id).runqueue)) {
-		vcpu = get_first_item(&per_cpu(sched_ctx, pcpu_id).runqueue,
-				struct vcpu, run_list);
+	list_for_each(pos, &ctx->runqueue) {
+		tmp = list_entry(pos, struct vcpu, run_list);
+		if (atomic_load(&tmp->blocked) != 0) {
+			if (vlapic_pending_intr(tmp->arch_vcpu.vlapic,
+					NULL) == 0)
+				continue;
+			atomic_store(&tmp->blocked, 0);
+		}
+		if (vcpu == NULL)
+			vcpu = tmp;
+		(*nr_runnable)++;
 	}
-	spinlock_release(&per_cpu(sched_ctx, pcpu_id).runqueue_lock);
+	spinlock_release(&ctx->runqueue_lock);
 
 	return vcpu;
 }
 
+static void update_slice_timer(struct sched_context *ctx,
+		struct vcpu *prev, struct vcpu *next, int nr_runnable)
+{
+	uint64_t slice;
+
+	/* a vcpu alone on its pcpu runs until it blocks or a peer shows up */
+	if (next == NULL || nr_runnable < 2) {
+		del_timer(&ctx->slice_timer);
+		return;
+	}
+
+	/* keep the running slice */
+	if (next == prev && ctx->slice_timer.heap_idx >= 0)
+		return;
+
+	del_timer(&ctx->slice_timer);
+	slice = US_TO_TICKS(CONFIG_SCHED_TIMESLICE_MS * 1000UL) *
+		next->vm->sched_weight / SCHED_DEFAULT_WEIGHT;
+	ctx->slice_timer.fire_tsc = rdtsc() + slice;
+	add_timer(&ctx->slice_timer);
+}
+
+/*
+ * Take a vcpu which executed HLT off its pcpu until an event is pending
+ * for it. The xchg orders the blocked store before the pending_req,
+ * vIRR and PIR loads and pairs with vcpu_make_request() and the
+ * posted-interrupt path of the vlapic, so a racing event is not lost.
+ */
+void block_vcpu(struct vcpu *vcpu)
+{
+	struct vlapic *vlapic = vcpu->arch_vcpu.vlapic;
+
+	atomic_swap(&vcpu->blocked, 1);
+	/* VT-d posts to the wakeup vector from now on */
+	apicv_set_pi_wakeup(vlapic, true);
+	if (vcpu->arch_vcpu.pending_req != 0UL ||
+		vlapic_pending_intr(vlapic, NULL) != 0) {
+		apicv_set_pi_wakeup(vlapic, false);
+		atomic_store(&vcpu->blocked, 0);
+		return;
+	}
+
+	bitmap_set(NEED_RESCHEDULE,
+		&per_cpu(sched_ctx, vcpu->pcpu_id).flags);
+}
+
+void wake_vcpu(struct vcpu *vcpu)
+{
+	if (atomic_cmpxchg(&vcpu->blocked, 1, 0) == 1)
+		make_reschedule_request(vcpu);
+}
+
+int set_sched_weight(struct vm *vm, uint32_t weight)
+{
+	if (weight == 0U || weight > SCHED_MAX_WEIGHT)
+		return -EINVAL;
+
+	/* takes effect with the next slice of each vcpu */
+	vm->sched_weight = weight;
+	return 0;
+}
+
+static void kick_pcpu(int pcpu_id)
+{
+	/*
+	 * A pcpu sleeping in mwait monitors its flags word, so the
+	 * bitmap_set done by the caller already woke it up. The locked
+	 * bitmap_set orders the flags write before this load.
+	 */
+	if (atomic_load(&per_cpu(sched_ctx, pcpu_id).idle_state)
+			!= IDLE_MODE_MWAIT)
+		send_single_ipi(pcpu_id, VECTOR_NOTIFY_VCPU);
+}
+
 void make_reschedule_request(struct vcpu *vcpu)
 {
+	per_cpu(sched_ctx, vcpu->pcpu_id).wake_tsc = rdtsc();
 	bitmap_set(NEED_RESCHEDULE,
 		&per_cpu(sched_ctx, vcpu->pcpu_id).flags);
-	send_single_ipi(vcpu->pcpu_id, VECTOR_NOTIFY_VCPU);
+	kick_pcpu(vcpu->pcpu_id);
 }
 
 int need_reschedule(int pcpu_id)
@@ -111,10 +274,9 @@ static void context_switch_out(struct vcpu *vcpu)
 	cancel_event_injection(vcpu);
 
 	atomic_store(&vcpu->running, 0);
-	/* do prev vcpu context switch out */
-	/* For now, we don't need to invalid ept.
-	 * But if we have more than one vcpu on one pcpu,
-	 * we need add ept invalid operation here.
+	/* The guest state which is not in the VMCS stays loaded until
+	 * another vcpu is switched in, see load_vcpu_state(). EPT and
+	 * VPID tagged TLB entries need no flush across the switch.
 	 */
 }
 
@@ -128,19 +290,15 @@ static void context_switch_in(struct vcpu *vcpu)
 		return;
 
 	atomic_store(&vcpu->running, 1);
-	/* FIXME:
-	 * Now, we don't need to load new vcpu VMCS because
-	 * we only do switch between vcpu loop and idle loop.
-	 * If we have more than one vcpu on on pcpu, need to
-	 * add VMCS load operation here.
-	 */
+	/* VMCS and register state of the previous vcpu on this pcpu */
+	load_vcpu_state(vcpu);
 }
 
 void make_pcpu_offline(int pcpu_id)
 {
 	bitmap_set(NEED_OFFLINE,
 		&per_cpu(sched_ctx, pcpu_id).flags);
-	send_single_ipi(pcpu_id, VECTOR_NOTIFY_VCPU);
+	kick_pcpu(pcpu_id);
 }
 
 int need_offline(int pcpu_id)
@@ -149,20 +307,131 @@ int need_offline(int pcpu_id)
 		&per_cpu(sched_ctx, pcpu_id).flags);
 }
 
+int set_idle_mode(int pcpu_id, int mode)
+{
+	if (pcpu_id < 0 || pcpu_id >= phy_cpu_num)
+		return -EINVAL;
+
+	if (mode != IDLE_MODE_PAUSE && mode != IDLE_MODE_HLT &&
+			mode != IDLE_MODE_MWAIT)
+		return -EINVAL;
+
+	if (mode == IDLE_MODE_MWAIT && !get_monitor_cap())
+		return -ENODEV;
+
+	per_cpu(sched_ctx, pcpu_id).idle_mode = mode;
+	/* let a sleeping pcpu pick up the new mode */
+	send_single_ipi(pcpu_id, VECTOR_NOTIFY_VCPU);
+	return 0;
+}
+
+static void idle_wait(struct sched_context *ctx, int pcpu_id)
+{
+	int mode = ctx->idle_mode;
+	uint64_t start, end;
+
+	if (mode == IDLE_MODE_PAUSE) {
+		asm volatile ("pause" ::: "memory");
+		return;
+	}
+
+	/* publish the idle state before looking at flags a last time */
+	atomic_swap(&ctx->idle_state, mode);
+	if (mode == IDLE_MODE_MWAIT)
+		asm volatile ("monitor"
+				:
+				: "a"(&ctx->flags), "c"(0), "d"(0)
+				: "memory");
+
+	if (ctx->flags != 0UL ||
+		(per_cpu(softirq_pending, pcpu_id) & SOFTIRQ_MASK) != 0UL) {
+		atomic_store(&ctx->idle_state, IDLE_MODE_NONE);
+		return;
+	}
+
+	/*
+	 * sti only takes effect after the next instruction, so an
+	 * interrupt which is already pending wakes us from hlt/mwait
+	 * rather than being taken before we go to sleep. The timer
+	 * interrupt for the next expiring timer is the only periodic
+	 * wake source, the TSC deadline is armed for heap[0] alone.
+	 */
+	start = rdtsc();
+	if (mode == IDLE_MODE_MWAIT)
+		asm volatile ("sti\n"
+				"mwait\n"
+				:
+				: "a"(0), "c"(0)
+				: "memory");
+	else
+		asm volatile ("sti\n"
+				"hlt\n"
+				::: "memory");
+	CPU_IRQ_DISABLE();
+	end = rdtsc();
+
+	atomic_store(&ctx->idle_state, IDLE_MODE_NONE);
+	ctx->idle_entries++;
+	ctx->idle_ticks += end - start;
+
+	/* only count requests which actually arrived while we slept */
+	if ((ctx->flags & (1UL << NEED_RESCHEDULE)) != 0UL &&
+			ctx->wake_tsc >= start && end > ctx->wake_tsc) {
+		ctx->wakeups++;
+		ctx->wake_lat_total += end - ctx->wake_tsc;
+		if (end - ctx->wake_tsc > ctx->wake_lat_max)
+			ctx->wake_lat_max = end - ctx->wake_tsc;
+	}
+}
+
 void default_idle(void)
 {
 	int pcpu_id = get_cpu_id();
+	struct sched_context *ctx = &per_cpu(sched_ctx, pcpu_id);
 
 	while (1) {
 		if (need_reschedule(pcpu_id))
 			schedule();
 		else if (need_offline(pcpu_id))
 			cpu_dead(pcpu_id);
-		else
-			__asm __volatile("pause" ::: "memory");
+		else {
+			/* timers still have to expire on an idle pcpu */
+			CPU_IRQ_ENABLE();
+			exec_softirq();
+			CPU_IRQ_DISABLE();
+
+			idle_wait(ctx, pcpu_id);
+		}
 	}
 }
 
+int get_idle_info(char *str, int str_max)
+{
+	int i, len, size = str_max;
+	struct sched_context *ctx;
+	static const char *const mode_str[] = { "pause", "hlt", "mwait" };
+
+	len = snprintf(str, size,
+		"\r\nCPU\tMODE\tENTRIES\t\tIDLE(ms)\tWAKEUPS\t\tAVG LAT(ns)\tMAX LAT(ns)");
+	size -= len;
+	str += len;
+
+	for (i = 0; i < phy_cpu_num; i++) {
+		ctx = &per_cpu(sched_ctx, i);
+		len = snprintf(str, size,
+			"\r\n%d\t%s\t%-16lld%-16lld%-16lld%-16lld%lld",
+			i, mode_str[ctx->idle_mode], ctx->idle_entries,
+			ctx->idle_ticks / CYCLES_PER_MS, ctx->wakeups,
+			(ctx->wakeups != 0UL) ?
+			TICKS_TO_NS(ctx->wake_lat_total / ctx->wakeups) : 0UL,
+			TICKS_TO_NS(ctx->wake_lat_max));
+		size -= len;
+		str += len;
+	}
+	snprintf(str, size, "\r\n");
+	return 0;
+}
+
 static void switch_to(struct vcpu *curr)
 {
 	/*
@@ -203,17 +472,25 @@ static void switch_to(struct vcpu *curr)
 void schedule(void)
 {
 	int pcpu_id = get_cpu_id();
+	struct sched_context *ctx = &per_cpu(sched_ctx, pcpu_id);
 	struct vcpu *next = NULL;
-	struct vcpu *prev = per_cpu(sched_ctx, pcpu_id).curr_vcpu;
+	struct vcpu *prev = ctx->curr_vcpu;
+	bool expired = ctx->slice_expired;
+	int nr_runnable;
 
 	get_schedule_lock(pcpu_id);
-	next = select_next_vcpu(pcpu_id);
+	next = select_next_vcpu(pcpu_id, &nr_runnable);
+	update_slice_timer(ctx, prev, next, nr_runnable);
 
 	if (prev == next) {
 		release_schedule_lock(pcpu_id);
 		return;
 	}
 
+	ctx->nr_switches++;
+	if (expired && prev != NULL)
+		ctx->nr_preemptions++;
+
 	context_switch_out(prev);
 	context_switch_in(next);
 	release_schedule_lock(pcpu_id);
@@ -222,3 +499,35 @@ void schedule(void)
 
 	ASSERT(false, "Shouldn't go here");
 }
+
+int get_sched_info(char *str, int str_max)
+{
+	int i, len, size = str_max;
+	struct sched_context *ctx;
+	struct vcpu *vcpu;
+
+	len = snprintf(str, size,
+		"\r\nCPU\tVCPUS\tPINNED\tCURRENT\t\tSWITCHES\tPREEMPTIONS");
+	size -= len;
+	str += len;
+
+	for (i = 0; i < phy_cpu_num; i++) {
+		ctx = &per_cpu(sched_ctx, i);
+		vcpu = ctx->curr_vcpu;
+		if (vcpu != NULL)
+			len = snprintf(str, size,
+				"\r\n%d\t%d\t%s\tvm%d:vcpu%d\t%-16lld%lld",
+				i, ctx->nr_vcpus, ctx->pinned ? "yes" : "no",
+				vcpu->vm->attr.id, vcpu->vcpu_id,
+				ctx->nr_switches, ctx->nr_preemptions);
+		else
+			len = snprintf(str, size,
+				"\r\n%d\t%d\t%s\tidle\t\t%-16lld%lld",
+				i, ctx->nr_vcpus, ctx->pinned ? "yes" : "no",
+				ctx->nr_switches, ctx->nr_preemptions);
+		size -= len;
+		str += len;
+	}
+	snprintf(str, size, "\r\n");
+	return 0;
+}
@@ -977,6 +977,193 @@ int shell_show_vmexit_profile(struct shell *p_shell,
 	return 0;
 }
 
+int shell_show_timer_info(struct shell *p_shell,
+		__unused int argc, __unused char **argv)
+{
+	char *temp_str = alloc_page();
+
+	if (temp_str == NULL)
+		return -ENOMEM;
+
+	get_timer_info(temp_str, CPU_PAGE_SIZE);
+	shell_puts(p_shell, temp_str);
+
+	free(temp_str);
+
+	return 0;
+}
+
+int shell_show_malloc_info(struct shell *p_shell,
+		__unused int argc, __unused char **argv)
+{
+	char *temp_str = alloc_page();
+
+	if (temp_str == NULL)
+		return -ENOMEM;
+
+	get_malloc_info(temp_str, CPU_PAGE_SIZE);
+	shell_puts(p_shell, temp_str);
+
+	free(temp_str);
+
+	return 0;
+}
+
+int shell_show_decode_cache(struct shell *p_shell,
+		__unused int argc, __unused char **argv)
+{
+	char *temp_str = alloc_page();
+
+	if (temp_str == NULL)
+		return -ENOMEM;
+
+	get_decode_cache_info(temp_str, CPU_PAGE_SIZE);
+	shell_puts(p_shell, temp_str);
+
+	free(temp_str);
+
+	return 0;
+}
+
+int shell_show_cpuid_exit(struct shell *p_shell, int argc, char **argv)
+{
+	char *temp_str = alloc_page();
+	uint32_t vmid;
+
+	if (temp_str == NULL)
+		return -ENOMEM;
+
+	/* User input invalidation */
+	if (argc != 2) {
+		snprintf(temp_str, CPU_PAGE_SIZE, "\r\nvmid param needed\r\n");
+		goto END;
+	} else
+		vmid = atoi(argv[1]);
+
+	get_cpuid_exit_info(temp_str, CPU_PAGE_SIZE, vmid);
+END:
+	shell_puts(p_shell, temp_str);
+	free(temp_str);
+
+	return 0;
+}
+
+int shell_show_msr_exit(struct shell *p_shell, int argc, char **argv)
+{
+	char *temp_str = alloc_page();
+	uint32_t vmid;
+
+	if (temp_str == NULL)
+		return -ENOMEM;
+
+	/* User input invalidation */
+	if (argc != 2) {
+		snprintf(temp_str, CPU_PAGE_SIZE, "\r\nvmid param needed\r\n");
+		goto END;
+	} else
+		vmid = atoi(argv[1]);
+
+	get_msr_exit_info(temp_str, CPU_PAGE_SIZE, vmid);
+END:
+	shell_puts(p_shell, temp_str);
+	free(temp_str);
+
+	return 0;
+}
+
+int shell_show_ept(struct shell *p_shell,
+		__unused int argc, __unused char **argv)
+{
+	char *temp_str = alloc_page();
+
+	if (temp_str == NULL)
+		return -ENOMEM;
+
+	get_ept_info(temp_str, CPU_PAGE_SIZE);
+	shell_puts(p_shell, temp_str);
+
+	free(temp_str);
+
+	return 0;
+}
+
+int shell_show_idle(struct shell *p_shell,
+		__unused int argc, __unused char **argv)
+{
+	char *temp_str = alloc_page();
+
+	if (temp_str == NULL)
+		return -ENOMEM;
+
+	get_idle_info(temp_str, CPU_PAGE_SIZE);
+	shell_puts(p_shell, temp_str);
+
+	free(temp_str);
+
+	return 0;
+}
+
+int shell_set_idle_mode(struct shell *p_shell, int argc, char **argv)
+{
+	int mode;
+
+	if (argc != 3)
+		return -EINVAL;
+
+	if (strcmp(argv[2], "pause") == 0)
+		mode = IDLE_MODE_PAUSE;
+	else if (strcmp(argv[2], "hlt") == 0)
+		mode = IDLE_MODE_HLT;
+	else if (strcmp(argv[2], "mwait") == 0)
+		mode = IDLE_MODE_MWAIT;
+	else
+		return -EINVAL;
+
+	if (set_idle_mode(atoi(argv[1]), mode) != 0) {
+		shell_puts(p_shell, "failed to set idle mode\r\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int shell_show_sched(struct shell *p_shell,
+		__unused int argc, __unused char **argv)
+{
+	char *temp_str = alloc_page();
+
+	if (temp_str == NULL)
+		return -ENOMEM;
+
+	get_sched_info(temp_str, CPU_PAGE_SIZE);
+	shell_puts(p_shell, temp_str);
+
+	free(temp_str);
+
+	return 0;
+}
+
+int shell_set_sched_weight(struct shell *p_shell, int argc, char **argv)
+{
+	struct vm *vm;
+
+	if (argc != 3)
+		return -EINVAL;
+
+	vm = get_vm_from_vmid(atoi(argv[1]));
+	if (vm == NULL) {
+		shell_puts(p_shell, "No vm found in the input <vm_id>\r\n");
+		return -EINVAL;
+	}
+
+	if (set_sched_weight(vm, atoi(argv[2])) != 0) {
+		shell_puts(p_shell, "weight must be 1 to 4096\r\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 int shell_dump_logbuf(__unused struct shell *p_shell,
 		int argc, char **argv)
 {
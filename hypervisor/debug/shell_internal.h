@@ -113,6 +113,46 @@ struct shell_cmd {
 #define SHELL_CMD_VMEXIT_PARAM		NULL
 #define SHELL_CMD_VMEXIT_HELP		"show vmexit profiling"
 
+#define SHELL_CMD_TIMER			"timer"
+#define SHELL_CMD_TIMER_PARAM		NULL
+#define SHELL_CMD_TIMER_HELP		"show timer info per CPU"
+
+#define SHELL_CMD_MALLOC		"malloc"
+#define SHELL_CMD_MALLOC_PARAM		NULL
+#define SHELL_CMD_MALLOC_HELP		"show heap and slab allocator stats"
+
+#define SHELL_CMD_DECODE_CACHE		"decode_cache"
+#define SHELL_CMD_DECODE_CACHE_PARAM	NULL
+#define SHELL_CMD_DECODE_CACHE_HELP	"show instruction decode cache hits per VCPU"
+
+#define SHELL_CMD_CPUID_EXIT		"cpuid_exit"
+#define SHELL_CMD_CPUID_EXIT_PARAM	"<vm id>"
+#define SHELL_CMD_CPUID_EXIT_HELP	"show CPUID exits per leaf and VCPU"
+
+#define SHELL_CMD_MSR_EXIT		"msr_exit"
+#define SHELL_CMD_MSR_EXIT_PARAM	"<vm id>"
+#define SHELL_CMD_MSR_EXIT_HELP		"show RDMSR/WRMSR exits per MSR and VCPU"
+
+#define SHELL_CMD_EPT			"ept"
+#define SHELL_CMD_EPT_PARAM		NULL
+#define SHELL_CMD_EPT_HELP		"show EPT page size distribution per VM"
+
+#define SHELL_CMD_IDLE			"idle"
+#define SHELL_CMD_IDLE_PARAM		NULL
+#define SHELL_CMD_IDLE_HELP		"show idle mode and wake latency per PCPU"
+
+#define SHELL_CMD_IDLE_MODE		"idle_mode"
+#define SHELL_CMD_IDLE_MODE_PARAM	"<pcpu id> <pause|hlt|mwait>"
+#define SHELL_CMD_IDLE_MODE_HELP	"set how an idle PCPU waits for work"
+
+#define SHELL_CMD_SCHED			"sched"
+#define SHELL_CMD_SCHED_PARAM		NULL
+#define SHELL_CMD_SCHED_HELP		"show VCPU sharing and switches per PCPU"
+
+#define SHELL_CMD_SCHED_WEIGHT		"sched_weight"
+#define SHELL_CMD_SCHED_WEIGHT_PARAM	"<vm id> <weight>"
+#define SHELL_CMD_SCHED_WEIGHT_HELP	"set the time slice weight of a VM, default 256"
+
 #define SHELL_CMD_LOGDUMP		"logdump"
 #define SHELL_CMD_LOGDUMP_PARAM		"<pcpu id>"
 #define SHELL_CMD_LOGDUMP_HELP		"log buffer dump"
@@ -154,6 +194,16 @@ int shell_reboot(struct shell *p_shell, int argc, char **argv);
 int shell_show_vioapic_info(struct shell *p_shell, int argc, char **argv);
 int shell_show_ioapic_info(struct shell *p_shell, int argc, char **argv);
 int shell_show_vmexit_profile(struct shell *p_shell, int argc, char **argv);
+int shell_show_timer_info(struct shell *p_shell, int argc, char **argv);
+int shell_show_malloc_info(struct shell *p_shell, int argc, char **argv);
+int shell_show_decode_cache(struct shell *p_shell, int argc, char **argv);
+int shell_show_cpuid_exit(struct shell *p_shell, int argc, char **argv);
+int shell_show_msr_exit(struct shell *p_shell, int argc, char **argv);
+int shell_show_ept(struct shell *p_shell, int argc, char **argv);
+int shell_show_idle(struct shell *p_shell, int argc, char **argv);
+int shell_set_idle_mode(struct shell *p_shell, int argc, char **argv);
+int shell_show_sched(struct shell *p_shell, int argc, char **argv);
+int shell_set_sched_weight(struct shell *p_shell, int argc, char **argv);
 int shell_dump_logbuf(struct shell *p_shell, int argc, char **argv);
 int shell_get_loglevel(struct shell *p_shell, int argc, char **argv);
 int shell_set_loglevel(struct shell *p_shell, int argc, char **argv);
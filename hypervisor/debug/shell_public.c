@@ -95,6 +95,66 @@ static struct shell_cmd acrn_cmd[] = {
 		.help_str	= SHELL_CMD_VMEXIT_HELP,
 		.fcn		= shell_show_vmexit_profile,
 	},
+	{
+		.str		= SHELL_CMD_TIMER,
+		.cmd_param	= SHELL_CMD_TIMER_PARAM,
+		.help_str	= SHELL_CMD_TIMER_HELP,
+		.fcn		= shell_show_timer_info,
+	},
+	{
+		.str		= SHELL_CMD_MALLOC,
+		.cmd_param	= SHELL_CMD_MALLOC_PARAM,
+		.help_str	= SHELL_CMD_MALLOC_HELP,
+		.fcn		= shell_show_malloc_info,
+	},
+	{
+		.str		= SHELL_CMD_DECODE_CACHE,
+		.cmd_param	= SHELL_CMD_DECODE_CACHE_PARAM,
+		.help_str	= SHELL_CMD_DECODE_CACHE_HELP,
+		.fcn		= shell_show_decode_cache,
+	},
+	{
+		.str		= SHELL_CMD_CPUID_EXIT,
+		.cmd_param	= SHELL_CMD_CPUID_EXIT_PARAM,
+		.help_str	= SHELL_CMD_CPUID_EXIT_HELP,
+		.fcn		= shell_show_cpuid_exit,
+	},
+	{
+		.str		= SHELL_CMD_MSR_EXIT,
+		.cmd_param	= SHELL_CMD_MSR_EXIT_PARAM,
+		.help_str	= SHELL_CMD_MSR_EXIT_HELP,
+		.fcn		= shell_show_msr_exit,
+	},
+	{
+		.str		= SHELL_CMD_EPT,
+		.cmd_param	= SHELL_CMD_EPT_PARAM,
+		.help_str	= SHELL_CMD_EPT_HELP,
+		.fcn		= shell_show_ept,
+	},
+	{
+		.str		= SHELL_CMD_IDLE,
+		.cmd_param	= SHELL_CMD_IDLE_PARAM,
+		.help_str	= SHELL_CMD_IDLE_HELP,
+		.fcn		= shell_show_idle,
+	},
+	{
+		.str		= SHELL_CMD_IDLE_MODE,
+		.cmd_param	= SHELL_CMD_IDLE_MODE_PARAM,
+		.help_str	= SHELL_CMD_IDLE_MODE_HELP,
+		.fcn		= shell_set_idle_mode,
+	},
+	{
+		.str		= SHELL_CMD_SCHED,
+		.cmd_param	= SHELL_CMD_SCHED_PARAM,
+		.help_str	= SHELL_CMD_SCHED_HELP,
+		.fcn		= shell_show_sched,
+	},
+	{
+		.str		= SHELL_CMD_SCHED_WEIGHT,
+		.cmd_param	= SHELL_CMD_SCHED_WEIGHT_PARAM,
+		.help_str	= SHELL_CMD_SCHED_WEIGHT_HELP,
+		.fcn		= shell_set_sched_weight,
+	},
 	{
 		.str		= SHELL_CMD_LOGDUMP,
 		.cmd_param	= SHELL_CMD_LOGDUMP_PARAM,
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <hypervisor.h>
+
+#include "serial_internal.h"
+
+/* The HV console keeps the latest TX_SIZE bytes of SOS output */
+#define TX_SIZE		65536
+
+void vuart_console_tx_chars(void)
+{
+	struct vuart *vu;
+	char buffer[100];
+	uint32_t i, len;
+
+	vu = vuart_console_active();
+	if (vu == NULL)
+		return;
+
+	while ((len = vuart_tx_chars(vu, buffer, 100)) > 0) {
+		for (i = 0; i < len; i++)
+			printf("%c", buffer[i]);
+	}
+}
+
+void vuart_console_rx_chars(uint32_t serial_handle)
+{
+	struct vuart *vu;
+	uint32_t vbuf_len;
+	char buffer[100];
+	uint32_t buf_idx = 0;
+
+	if (serial_handle == SERIAL_INVALID_HANDLE) {
+		pr_err("%s: invalid serial handle 0x%llx\n",
+				__func__, serial_handle);
+		return;
+	}
+
+	vu = vuart_console_active();
+	if (vu == NULL)
+		return;
+
+	/* Get data from serial */
+	vbuf_len = serial_gets(serial_handle, buffer, 100);
+	if (vbuf_len) {
+		while (buf_idx < vbuf_len) {
+			if (buffer[buf_idx] == GUEST_CONSOLE_TO_HV_SWITCH_KEY) {
+				/* Switch the console */
+				shell_switch_console();
+				break;
+			}
+			buf_idx++;
+		}
+		if (vu->active != false)
+			vuart_rx_chars(vu, buffer, vbuf_len);
+	}
+}
+
+struct vuart *vuart_console_active(void)
+{
+	struct vm *vm = get_vm_from_vmid(0);
+
+	if (vm && vm->vuart) {
+		struct vuart *vu = vm->vuart;
+
+		if (vu->active)
+			return vm->vuart;
+	}
+	return NULL;
+}
+
+void *vuart_console_init(struct vm *vm)
+{
+	return vuart_init(vm, COM1_BASE, COM1_IRQ, TX_SIZE);
+}
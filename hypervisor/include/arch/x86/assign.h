@@ -52,6 +52,10 @@ struct ptdev_remapping_info {
 	struct dev_handler_node *node;
 	struct list_head softirq_node;
 	struct list_head entry_node;
+	struct list_head phys_hash_node;	/* hashed by entry_id */
+	struct list_head virt_hash_node;	/* hashed by vm + virt info */
+	struct list_head vm_node;		/* link in vm->ptdev_list */
+	int irte_index;		/* VT-d posted IRTE of a MSI, -1 if none */
 
 	union {
 		struct ptdev_msi_info msi;
@@ -244,7 +244,9 @@ int hv_main(int cpu_id);
 bool is_vapic_supported(void);
 bool is_vapic_intr_delivery_supported(void);
 bool is_vapic_virt_reg_supported(void);
+bool is_vapic_posted_intr_supported(void);
 bool cpu_has_cap(uint32_t bit);
+bool get_monitor_cap(void);
 void load_cpu_state_data(void);
 void start_cpus();
 
@@ -263,6 +265,21 @@ void start_cpus();
 			: "r"(value));                      \
 }
 
+/* Read debug register */
+#define CPU_DR_READ(dr, result_ptr)                         \
+{                                                           \
+	asm volatile ("mov %%" __CPP_STRING(dr) ", %0"      \
+			: "=r"(*result_ptr));               \
+}
+
+/* Write debug register */
+#define CPU_DR_WRITE(dr, value)                             \
+{                                                           \
+	asm volatile ("mov %0, %%" __CPP_STRING(dr)         \
+			: /* No output */                   \
+			: "r"(value));                      \
+}
+
 /* Read MSR */
 #define CPU_MSR_READ(reg, msr_val_ptr)                      \
 {                                                           \
@@ -437,6 +454,15 @@ write_xcr(int reg, uint64_t val)
 	high = val >> 32;
 	asm volatile("xsetbv" : : "c" (reg), "a" (low), "d" (high));
 }
+
+static inline uint64_t
+read_xcr(int reg)
+{
+	uint32_t low, high;
+
+	asm volatile("xgetbv" : "=a" (low), "=d" (high) : "c" (reg));
+	return ((uint64_t)high << 32) | low;
+}
 #else /* ASSEMBLER defined */
 
 #endif /* ASSEMBLER defined */
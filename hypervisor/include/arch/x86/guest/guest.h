@@ -22,7 +22,7 @@
 		idx++, vcpu = vm->hw.vcpu_array[idx])
 
 
-/* the index is matched with emulated msrs array*/
+/* per vcpu shadow MSR slots, referenced by the vmsr registry */
 enum {
 	IDX_TSC_DEADLINE,
 	IDX_BIOS_UPDT_TRIG,
@@ -34,8 +34,13 @@ enum {
 
 struct vhm_request;
 
+void fire_vhm_interrupt(void);
 int acrn_insert_request_wait(struct vcpu *vcpu, struct vhm_request *req);
+bool acrn_claim_request(struct vcpu *vcpu, int state);
 int get_req_info(char *str, int str_max);
+int get_decode_cache_info(char *str, int str_max);
+int get_cpuid_exit_info(char *str, int str_max, int vmid);
+int get_msr_exit_info(char *str, int str_max, int vmid);
 
 /*
  * VCPU related APIs
@@ -92,6 +97,7 @@ bool is_vm0(struct vm *vm);
 bool vm_lapic_disabled(struct vm *vm);
 uint64_t vcpumask2pcpumask(struct vm *vm, uint64_t vdmask);
 
+void gva_tlb_flush(struct vcpu *vcpu);
 int gva2gpa(struct vcpu *vcpu, uint64_t gva, uint64_t *gpa, uint32_t *err_code);
 int vm_gva2gpa(struct vcpu *vcpu, uint64_t gla, uint64_t *gpa,
 	uint32_t *err_code);
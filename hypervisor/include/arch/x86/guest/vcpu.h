@@ -9,6 +9,11 @@
 
 #define	ACRN_VCPU_MMIO_COMPLETE		(0)
 
+/* states of vcpu->ioreq_pending */
+#define	IOREQ_NONE			(0)
+#define	IOREQ_WAIT			(1)	/* vcpu paused, DM completes */
+#define	IOREQ_POLL			(2)	/* vcpu polls for completion */
+
 /* Size of various elements within the VCPU structure */
 #define REG_SIZE                            8
 
@@ -187,9 +192,6 @@ struct vcpu_arch {
 	uint32_t irq_window_enabled;
 	uint32_t nrexits;
 
-	/* Auxiliary TSC value */
-	uint64_t msr_tsc_aux;
-
 	/* VCPU context state information */
 	uint32_t exit_reason;
 	uint32_t idt_vectoring_info;
@@ -211,6 +213,17 @@ struct vcpu_arch {
 };
 
 struct vm;
+
+/* Direct lookup ranges for the basic, hypervisor and extended leaves */
+#define VCPUID_BASIC_LEAVES	0x20U
+#define VCPUID_HV_BASE		0x40000000U
+#define VCPUID_HV_LEAVES	0x11U
+#define VCPUID_EXT_BASE		0x80000000U
+#define VCPUID_EXT_LEAVES	0x20U
+/* per leaf exit counters, the last slot counts all other leaves */
+#define VCPUID_STAT_SLOTS	\
+	(VCPUID_BASIC_LEAVES + VCPUID_HV_LEAVES + VCPUID_EXT_LEAVES + 1U)
+
 struct vcpu {
 	int pcpu_id;	/* Physical CPU ID of this VCPU */
 	int vcpu_id;	/* virtual identifier for VCPU */
@@ -232,10 +245,14 @@ struct vcpu {
 	bool launched; /* Whether the vcpu is launched on target pcpu */
 	unsigned int paused_cnt; /* how many times vcpu is paused */
 	int running; /* vcpu is picked up and run? */
+	int blocked; /* halted in guest HLT, skipped by the scheduler */
 	int ioreq_pending; /* ioreq is ongoing or not? */
 
 	struct vhm_request req; /* used by io/ept emulation */
 	struct mem_io mmio; /* used by io/ept emulation */
+	struct mem_io_node *mmio_hint; /* last hit HV MMIO handler */
+	struct decode_cache *decode_cache; /* decoded MMIO instructions */
+	struct gva_tlb *gva_tlb; /* software TLB of gva2gpa */
 
 	/* save guest msr tsc aux register.
 	 * Before VMENTRY, save guest MSR_TSC_AUX to this fields.
@@ -245,7 +262,16 @@ struct vcpu {
 	 * code.
 	 */
 	uint64_t msr_tsc_aux_guest;
-	uint64_t *guest_msrs;
+	uint64_t *guest_msrs;	/* shadow MSR values, indexed by IDX_xxx */
+	uint32_t *msr_exits;	/* exits per vmsr registry entry */
+	uint32_t cpuid_exits[VCPUID_STAT_SLOTS];
+
+	/* XCR0 and XSAVE image while another vcpu owns the pcpu */
+	uint64_t xcr0;
+	void *xsave_area;
+	/* DR0-3 and DR6, which the VMCS does not hold */
+	uint64_t dr[4];
+	uint64_t dr6;
 #ifdef CONFIG_MTRR_ENABLED
 	struct mtrr_state mtrr;
 #endif
@@ -266,6 +292,7 @@ void reset_vcpu(struct vcpu *vcpu);
 void pause_vcpu(struct vcpu *vcpu, enum vcpu_state new_state);
 void resume_vcpu(struct vcpu *vcpu);
 void schedule_vcpu(struct vcpu *vcpu);
+void load_vcpu_state(struct vcpu *vcpu);
 int prepare_vcpu(struct vm *vm, int pcpu_id);
 
 void request_vcpu_pre_work(struct vcpu *vcpu, int pre_work_id);
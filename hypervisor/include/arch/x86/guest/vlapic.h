@@ -123,6 +123,10 @@ void vlapic_restore(struct vlapic *vlapic, struct lapic_regs *regs);
 bool vlapic_enabled(struct vlapic *vlapic);
 uint64_t apicv_get_apic_access_addr(struct vm *vm);
 uint64_t apicv_get_apic_page_addr(struct vlapic *vlapic);
+uint64_t apicv_get_pir_desc_addr(struct vlapic *vlapic);
+int apicv_create_pir_descs(struct vm *vm);
+void apicv_destroy_pir_descs(struct vm *vm);
+void apicv_set_pi_wakeup(struct vlapic *vlapic, bool wakeup);
 bool vlapic_apicv_enabled(struct vcpu *vcpu);
 void apicv_inject_pir(struct vlapic *vlapic);
 int apic_access_vmexit_handler(struct vcpu *vcpu);
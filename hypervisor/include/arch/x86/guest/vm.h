@@ -56,6 +56,8 @@ struct vm_sw_info {
 	struct sw_linux linux_info;
 	/* HVA to IO shared page */
 	void *io_shared_page;
+	/* HVA to coalesced MMIO ring page */
+	struct coalesced_mmio_ring *coalesced_ring;
 };
 
 struct vm_pm_info {
@@ -94,23 +96,36 @@ struct vm_arch {
 	 */
 	uint64_t sworld_eptp;
 	uint64_t m2p;		/* machine address to guest physical address */
+	uint64_t ept_promotions;	/* tables folded into large pages */
+	uint64_t ept_flushes;	/* EPT flush requests to all vcpus */
 	void *tmp_pg_array;	/* Page array for tmp guest paging struct */
 	void *iobitmap[2];/* IO bitmap page array base address for this VM */
 	void *msr_bitmap;	/* MSR bitmap page base address for this VM */
+	void *pir_descs;	/* posted-interrupt descriptors of the vcpus */
 	void *virt_ioapic;	/* Virtual IOAPIC base address */
 	/**
 	 * A link to the IO handler of this VM.
 	 * We only register io handle to this link
 	 * when create VM on sequences and ungister it when
 	 * destory VM. So there no need lock to prevent preempt.
-	 * Besides, there only a few io handlers now, we don't
-	 * need binary search temporary.
 	 */
 	struct vm_io_handler *io_handler;
+	/**
+	 * Port indexed lookup of io_handler, built at registration:
+	 * io_port_map[port >> 8][port & 0xff] is the handler owning port.
+	 * A NULL second level table or entry means the port goes to VHM.
+	 */
+	struct vm_io_handler **io_port_map[IO_PORT_MAP_ENTRIES];
 
 	/* reference to virtual platform to come here (as needed) */
 };
 
+#define MAX_COALESCED_ZONES	16
+struct coalesced_zone {
+	uint64_t start;
+	uint64_t end;		/* exclusive */
+};
+
 #define CPUID_CHECK_SUBLEAF	(1 << 0)
 #define MAX_VM_VCPUID_ENTRIES	64
 struct vcpuid_entry {
@@ -124,6 +139,12 @@ struct vcpuid_entry {
 	uint32_t padding;
 };
 
+/* first vcpuid_entries[] slot of a leaf and its number of subleaves */
+struct vcpuid_index {
+	uint8_t first;
+	uint8_t nr;
+};
+
 struct vpic;
 struct vm {
 	struct vm_attr attr;	/* Reference to this VM's attributes */
@@ -139,9 +160,26 @@ struct vm {
 	struct list_head list; /* list of VM */
 	spinlock_t spinlock;	/* Spin-lock used to protect VM modifications */
 
-	struct list_head mmio_list; /* list for mmio. This list is not updated
-				     * when vm is active. So no lock needed
-				     */
+	/* HV emulated MMIO ranges sorted by range_start, plus the lowest
+	 * start and highest end among them. Not updated when vm is active,
+	 * so no lock needed.
+	 */
+	struct mem_io_node **mmio_nodes;
+	uint32_t nr_mmio_nodes;
+	uint32_t max_mmio_nodes;
+	uint64_t mmio_lo;
+	uint64_t mmio_hi;
+
+	/* Ranges whose writes are appended to sw.coalesced_ring instead
+	 * of being sent to VHM one at a time, protected by coalesced_lock
+	 */
+	struct coalesced_zone coalesced_zones[MAX_COALESCED_ZONES];
+	uint32_t nr_coalesced_zones;
+	spinlock_t coalesced_lock;
+
+	struct list_head ptdev_list; /* ptdev remapping entries of this VM,
+				      * protected by ptdev_lock
+				      */
 
 	struct _vm_shared_memory *shared_memory_area;
 
@@ -153,8 +191,20 @@ struct vm {
 	unsigned char GUID[16];
 	struct secure_world_control sworld_control;
 
+	/* vcpus keep dedicated pcpus and are never time-shared */
+	bool rt_pinned;
+	/* halted vcpus exit and give up their pcpu */
+	bool hlt_exit;
+	/* time in us a vcpu spins on a forwarded I/O request */
+	uint32_t ioreq_poll_us;
+	/* share of a time-shared pcpu relative to SCHED_DEFAULT_WEIGHT */
+	uint32_t sched_weight;
+
 	uint32_t vcpuid_entry_nr, vcpuid_level, vcpuid_xlevel;
 	struct vcpuid_entry vcpuid_entries[MAX_VM_VCPUID_ENTRIES];
+	struct vcpuid_index vcpuid_basic[VCPUID_BASIC_LEAVES];
+	struct vcpuid_index vcpuid_hv[VCPUID_HV_LEAVES];
+	struct vcpuid_index vcpuid_ext[VCPUID_EXT_LEAVES];
 };
 
 struct vm_description {
@@ -166,6 +216,12 @@ struct vm_description {
 	int                    vm_hw_num_cores;   /* Number of virtual cores */
 	/* Whether secure world is enabled for current VM. */
 	bool                   sworld_enabled;
+	/* Whether the VM needs pcpus of its own, e.g. for real-time */
+	bool                   rt_pinned;
+	/* Whether vcpus exit on HLT instead of halting in the guest */
+	bool                   hlt_exit;
+	/* Time in us vcpus spin on a forwarded I/O request */
+	uint32_t               ioreq_poll_us;
 };
 
 int shutdown_vm(struct vm *vm);
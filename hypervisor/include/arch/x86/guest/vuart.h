@@ -38,6 +38,11 @@ struct fifo {
 	int size;	/* size of the fifo */
 };
 
+#define COM1_BASE	0x3F8
+#define COM1_IRQ	4
+
+struct vuart_ring_page;
+
 struct vuart {
 	char data;		/* Data register (R/W) */
 	char ier;		/* Interrupt enable register (R/W) */
@@ -53,6 +58,10 @@ struct vuart {
 	struct fifo rxfifo;
 	struct fifo txfifo;
 	int base;
+	int irq;
+
+	/* data shared with the device model, NULL for the HV console */
+	struct vuart_ring_page *ring;
 
 	bool thre_int_pending;	/* THRE interrupt pending */
 	bool active;
@@ -60,13 +69,21 @@ struct vuart {
 	spinlock_t lock;	/* protects all softc elements */
 };
 
+struct vuart *vuart_init(struct vm *vm, int base, int irq, int tx_size);
+void vuart_deinit(struct vm *vm);
+int vuart_setup(struct vm *vm, int base, int irq,
+		struct vuart_ring_page *ring);
+void vuart_notify(struct vuart *vu);
+void vuart_rx_chars(struct vuart *vu, const char *buf, uint32_t len);
+uint32_t vuart_tx_chars(struct vuart *vu, char *buf, uint32_t len);
+
 #ifdef HV_DEBUG
-void *vuart_init(struct vm *vm);
+void *vuart_console_init(struct vm *vm);
 struct vuart *vuart_console_active(void);
 void vuart_console_tx_chars(void);
 void vuart_console_rx_chars(uint32_t serial_handle);
 #else
-static inline void *vuart_init(__unused struct vm *vm)
+static inline void *vuart_console_init(__unused struct vm *vm)
 {
 	return NULL;
 }
@@ -138,6 +138,11 @@ struct vm_io_handler {
 	struct vm_io_handler_desc desc;
 };
 
+/* Two level port lookup table covering the 64K I/O port space */
+#define IO_PORT_MAP_SHIFT       8
+#define IO_PORT_MAP_ENTRIES     (1 << IO_PORT_MAP_SHIFT)
+#define IO_PORT_MAP_MASK        (IO_PORT_MAP_ENTRIES - 1)
+
 #define IO_ATTR_R               0
 #define IO_ATTR_RW              1
 #define IO_ATTR_NO_ACCESS       2
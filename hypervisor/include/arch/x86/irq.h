@@ -21,6 +21,8 @@
 #define VECTOR_FOR_PRI_END	0xFF
 #define VECTOR_TIMER		0xEF
 #define VECTOR_NOTIFY_VCPU	0xF0
+#define VECTOR_POSTED_INTR	0xF2
+#define VECTOR_POSTED_INTR_WAKEUP	0xF3
 #define VECTOR_VIRT_IRQ_VHM	0xF7
 #define VECTOR_SPURIOUS		0xFF
 
@@ -149,6 +151,9 @@ extern spurious_handler_t spurious_handler;
 #define	MSI_ADDR_BASE	0xfee00000
 #define	MSI_ADDR_RH	0x00000008	/* Redirection Hint */
 #define	MSI_ADDR_LOG	0x00000004	/* Destination Mode */
+#define	MSI_ADDR_IR_FORMAT	0x00000010	/* Remappable Format */
+#define	MSI_ADDR_IR_HANDLE(h)	\
+	((((h) & 0x7fff) << 5) | ((((h) >> 15) & 0x1) << 2))
 
 /* RFLAGS */
 #define HV_ARCH_VCPU_RFLAGS_IF              (1<<9)
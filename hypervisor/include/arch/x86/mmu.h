@@ -232,6 +232,12 @@ struct map_params {
 	/* used HPA->HVA for HOST, used HPA->GPA for EPT */
 	void *pml4_inverted;
 };
+struct page_size_stats {
+	uint64_t pages_4k;
+	uint64_t pages_2m;
+	uint64_t pages_1g;
+	uint64_t tables;	/* paging structures, incl. the PML4 */
+};
 struct entry_params {
 	uint32_t entry_level;
 	uint32_t entry_present;
@@ -289,7 +295,6 @@ typedef int(*hv_mem_io_handler_t)(struct vcpu *, struct mem_io *, void *);
 struct mem_io_node {
 	hv_mem_io_handler_t read_write;
 	void *handler_private_data;
-	struct list_head list;
 	uint64_t range_start;
 	uint64_t range_end;
 };
@@ -308,6 +313,10 @@ int modify_mem(struct map_params *map_params, void *paddr, void *vaddr,
 		       uint64_t size, uint32_t flags);
 int modify_mem_mt(struct map_params *map_params, void *paddr, void *vaddr,
 		       uint64_t size, uint32_t flags);
+uint32_t promote_mem(struct map_params *map_params, void *paddr,
+		void *vaddr, uint64_t size, bool allow_1g);
+void get_page_size_stats(void *pml4_base, int table_type,
+		struct page_size_stats *stats);
 int check_vmx_mmu_cap(void);
 int allocate_vpid(void);
 void flush_vpid_single(int vpid);
@@ -324,6 +333,9 @@ int register_mmio_emulation_handler(struct vm *vm,
 void unregister_mmio_emulation_handler(struct vm *vm, uint64_t start,
         uint64_t end);
 
+int set_coalesced_mmio_zone(struct vm *vm, uint64_t addr, uint32_t size,
+	uint32_t op);
+
 #pragma pack(1)
 
 /** Defines a single entry in an E820 memory map. */
@@ -381,6 +393,10 @@ uint64_t _gpa2hpa(struct vm *vm, uint64_t gpa, uint32_t *size);
 uint64_t  hpa2gpa(struct vm *vm, uint64_t hpa);
 int ept_mmap(struct vm *vm, uint64_t hpa,
 	uint64_t gpa, uint64_t size, uint32_t type, uint32_t prot);
+int ept_mmap_noflush(struct vm *vm, uint64_t hpa,
+	uint64_t gpa, uint64_t size, uint32_t type, uint32_t prot);
+void ept_flush(struct vm *vm);
+int get_ept_info(char *str, int str_max);
 int ept_update_mt(struct vm *vm, uint64_t hpa,
 	uint64_t gpa, uint64_t size, uint32_t prot);
 
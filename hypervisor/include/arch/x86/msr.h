@@ -39,6 +39,8 @@
 /* General performance counter 2 */
 #define MSR_IA32_PMC3                       0x000000C4
 /* General performance counter 3 */
+#define MSR_IA32_PMC7                       0x000000C8
+/* General performance counter 7 */
 #define MSR_IA32_MPERF                      0x000000E7
 /* Max. qualified performance clock counter */
 #define MSR_IA32_APERF                      0x000000E8
@@ -61,6 +63,8 @@
 /* Performance Event Select Register 2 */
 #define MSR_IA32_PERFEVTSEL3                0x00000189
 /* Performance Event Select Register 3 */
+#define MSR_IA32_PERFEVTSEL7                0x0000018D
+/* Performance Event Select Register 7 */
 #define MSR_IA32_PERF_STATUS                0x00000198
 /* Current performance state */
 #define MSR_IA32_PERF_CTL                   0x00000199
@@ -73,6 +77,10 @@
 /* Thermal status information */
 #define MSR_IA32_MISC_ENABLE                0x000001A0
 /* Enable misc. processor features */
+#define MSR_OFFCORE_RSP_0                   0x000001A6
+/* Offcore response event select 0 */
+#define MSR_OFFCORE_RSP_1                   0x000001A7
+/* Offcore response event select 1 */
 #define MSR_IA32_ENERGY_PERF_BIAS           0x000001B0
 /* Performance energy bias hint */
 #define MSR_IA32_DEBUGCTL                   0x000001D9
@@ -210,6 +218,10 @@
 #define MSR_IA32_PERF_GLOBAL_OVF_CTRL       0x00000390
 /* Global performance counter overflow control */
 #define MSR_IA32_PEBS_ENABLE                0x000003F1	/* PEBS control */
+#define MSR_IA32_A_PMC0                     0x000004C1
+/* Full width general performance counter 0 */
+#define MSR_IA32_A_PMC7                     0x000004C8
+/* Full width general performance counter 7 */
 #define MSR_IA32_MC0_CTL                    0x00000400	/* MC 0 control */
 #define MSR_IA32_MC0_STATUS                 0x00000401	/* MC 0 status */
 #define MSR_IA32_MC0_ADDR                   0x00000402	/* MC 0 address */
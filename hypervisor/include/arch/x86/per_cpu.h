@@ -27,6 +27,7 @@ struct per_cpu_region {
 	struct stack_canary stack_canary;
 #endif
 	struct per_cpu_timers cpu_timers;
+	struct slab_magazine slab_mag[SLAB_NUM_CLASSES];
 	struct sched_context sched_ctx;
 	struct emul_cnx g_inst_ctxt;
 	struct host_gdt gdt;
@@ -14,12 +14,32 @@ enum tick_mode {
 	TICK_MODE_PERIODIC,
 };
 
+/*
+ * Size the heap for everything that can be armed on one pcpu: the vlapic
+ * timer of each vcpu sharing it, plus the scheduler slice timer and the
+ * console timer. add_timer() then never finds the heap full.
+ */
+#define TIMERS_PER_VCPU		1
+#define TIMERS_PER_PCPU		2
+#define MAX_TIMERS_PER_CPU	(CONFIG_MAX_VCPUS_PER_PCPU * TIMERS_PER_VCPU \
+					+ TIMERS_PER_PCPU)
+
+#if CONFIG_MAX_VCPUS_PER_PCPU < 1
+#error "CONFIG_MAX_VCPUS_PER_PCPU must be at least 1"
+#endif
+
+struct timer;
 struct per_cpu_timers {
-	struct list_head timer_list;	/* it's for runtime active timer list */
+	/* runtime active timers, min-heap ordered by fire_tsc */
+	struct timer *heap[MAX_TIMERS_PER_CPU];
+	int nr_timers;
+	uint64_t programmed_tsc;	/* deadline armed in the TSC_DEADLINE msr */
+	uint64_t msr_writes;		/* number of TSC_DEADLINE msr writes */
 };
 
 struct timer {
-	struct list_head node;		/* link all timers */
+	int heap_idx;			/* index in heap, -1 if not active */
+	int pcpu_id;			/* pcpu whose heap the timer is on */
 	int mode;			/* timer mode: one-shot or periodic */
 	uint64_t fire_tsc;		/* tsc deadline to interrupt */
 	uint64_t period_in_cycle;	/* period of the periodic timer in unit of TSC cycles */
@@ -44,7 +64,7 @@ static inline void initialize_timer(struct timer *timer,
 		timer->fire_tsc = fire_tsc;
 		timer->mode = mode;
 		timer->period_in_cycle = period_in_cycle;
-		INIT_LIST_HEAD(&timer->node);
+		timer->heap_idx = -1;
 	}
 }
 
@@ -59,5 +79,6 @@ void timer_init(void);
 void timer_cleanup(void);
 void check_tsc(void);
 void calibrate_tsc(void);
+int get_timer_info(char *str, int str_max);
 
 #endif /* TIMER_H */
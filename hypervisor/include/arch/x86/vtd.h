@@ -223,6 +223,13 @@ struct iommu_domain *create_iommu_domain(int vm_id,
 /* Destroy the iommu domain */
 int destroy_iommu_domain(struct iommu_domain *domain);
 
+/* Post a MSI of the device to a vcpu through a posted format IRTE */
+int iommu_set_posted_irte(uint8_t bus, uint8_t devfun, int *index,
+	uint64_t pi_desc, uint8_t vector);
+
+/* Release the IRTE allocated by iommu_set_posted_irte() */
+void iommu_free_irte(uint8_t bus, uint8_t devfun, int index);
+
 /* Enable translation of iommu*/
 void enable_iommu(void);
 
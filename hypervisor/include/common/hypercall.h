@@ -195,6 +195,85 @@ int64_t hcall_set_ioreq_buffer(struct vm *vm, uint64_t vmid, uint64_t param);
  */
 int64_t hcall_notify_req_finish(uint64_t vmid, uint64_t param);
 
+/**
+ * @brief set coalesced MMIO ring
+ *
+ * Set the shared page the hypervisor appends coalesced MMIO writes to.
+ * The page is written until the VM is destroyed or the ring is set
+ * again, so the SOS must keep it pinned that long. Only VM0 may set it.
+ * The function will return -1 if the target VM does not exist or is VM0.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_set_coalesced_ring
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_set_coalesced_ring(struct vm *vm, uint64_t vmid,
+	uint64_t param);
+
+/**
+ * @brief add or remove a coalesced MMIO zone
+ *
+ * Writes to a coalesced zone are buffered in the coalesced MMIO ring
+ * instead of being forwarded to the device model one by one. Only VM0
+ * may set zones.
+ * The function will return -1 if the target VM does not exist or is VM0.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_coalesced_mmio_zone
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_set_coalesced_zone(struct vm *vm, uint64_t vmid,
+	uint64_t param);
+
+/**
+ * @brief attach a hypervisor emulated UART to a VM
+ *
+ * The hypervisor emulates the 16550 registers of the UART itself and
+ * exchanges the data bytes with the device model through a shared ring
+ * page instead of forwarding every register access.
+ *
+ * The vUART needs the SOS kernel (VHM) to do two things beyond
+ * forwarding the hypercall:
+ *  - pin the ring page until the VM is destroyed or set up again, as
+ *    the hypervisor writes it that long;
+ *  - on every upcall, signal the notify_fd eventfd of each vUART whose
+ *    ring page has notify set. The hypervisor raises the upcall without
+ *    a vhm_request for this, only when it sets notify from 0, so a VHM
+ *    which only dispatches requests leaves guest output stuck.
+ *
+ * The function will return -1 if the caller is not VM0, or if the
+ * target VM does not exist or is VM0, and an error if the target has
+ * been started already.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_vuart_setup
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_setup_vuart(struct vm *vm, uint64_t vmid, uint64_t param);
+
+/**
+ * @brief notify the vUART of a VM about ring updates
+ *
+ * Pull new input from the shared ring and push buffered output to it.
+ * The function will return -1 if the caller is not VM0, or if the
+ * target VM does not exist or has no vUART.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_notify_vuart(struct vm *vm, uint64_t vmid);
+
 /**
  * @brief setup ept memory mapping
  *
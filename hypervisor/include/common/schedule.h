@@ -10,12 +10,43 @@
 #define	NEED_RESCHEDULE		(1)
 #define	NEED_OFFLINE		(2)
 
+/* how an idle pcpu waits for work, see default_idle() */
+#define	IDLE_MODE_NONE		(-1)
+#define	IDLE_MODE_PAUSE		(0)
+#define	IDLE_MODE_HLT		(1)
+#define	IDLE_MODE_MWAIT		(2)
+
+/* vcpus time-sharing a pcpu get slices in proportion to their VM weight */
+#define	SCHED_DEFAULT_WEIGHT	256U
+#define	SCHED_MAX_WEIGHT	4096U
+
 struct sched_context {
 	spinlock_t runqueue_lock;
 	struct list_head runqueue;
 	unsigned long flags;
 	struct vcpu *curr_vcpu;
 	spinlock_t scheduler_lock;
+
+	/* vcpus assigned to this pcpu, protected by pcpu_alloc_lock */
+	int nr_vcpus;
+	/* owned by a single vcpu of a pinned VM, never time-shared */
+	bool pinned;
+	/* preempts the running vcpu once its slice is used up */
+	struct timer slice_timer;
+	bool slice_expired;
+	uint64_t nr_switches;
+	uint64_t nr_preemptions;
+
+	int idle_mode;
+	/* mode the pcpu is sleeping in right now, IDLE_MODE_NONE if awake */
+	int idle_state;
+	/* TSC of the last reschedule request, for wake latency */
+	uint64_t wake_tsc;
+	uint64_t idle_entries;
+	uint64_t idle_ticks;
+	uint64_t wakeups;
+	uint64_t wake_lat_total;
+	uint64_t wake_lat_max;
 };
 
 void init_scheduler(void);
@@ -23,13 +54,19 @@ void get_schedule_lock(int pcpu_id);
 void release_schedule_lock(int pcpu_id);
 
 void set_pcpu_used(int pcpu_id);
-int allocate_pcpu(void);
+int allocate_pcpu(bool pinned);
 void free_pcpu(int pcpu_id);
 
 void add_vcpu_to_runqueue(struct vcpu *vcpu);
 void remove_vcpu_from_runqueue(struct vcpu *vcpu);
+void block_vcpu(struct vcpu *vcpu);
+void wake_vcpu(struct vcpu *vcpu);
+int set_sched_weight(struct vm *vm, uint32_t weight);
+int get_sched_info(char *str, int str_max);
 
 void default_idle(void);
+int set_idle_mode(int pcpu_id, int mode);
+int get_idle_info(char *str, int str_max);
 
 void make_reschedule_request(struct vcpu *vcpu);
 int need_reschedule(int pcpu_id);
@@ -23,5 +23,9 @@
 #define ENODEV		19
 /** Indicates that argument is not valid. */
 #define EINVAL		22
+/** Indicates that no space is left. */
+#define ENOSPC		28
+/** Indicates that the operation timed out. */
+#define ETIMEDOUT	110
 
 #endif /* ERRNO_H */
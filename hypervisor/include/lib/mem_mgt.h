@@ -21,11 +21,34 @@ struct mem_pool {
 	uint32_t *contiguity_bitmap;	/* Pointer to contiguity bitmap */
 };
 
+/* Size classes served by the slab allocator: 16, 32, ... 256 bytes */
+#define SLAB_MIN_SHIFT		4
+#define SLAB_NUM_CLASSES	5
+#define SLAB_MAX_SIZE		(1U << (SLAB_MIN_SHIFT + SLAB_NUM_CLASSES - 1))
+#define SLAB_MAGAZINE_SIZE	16
+
+struct slab_cache {
+	spinlock_t lock;	/* To protect the depot free list */
+	uint32_t obj_size;	/* Size of one object in Bytes */
+	void *free_list;	/* Depot of free objects, linked via 1st word */
+	uint32_t nr_free;	/* Objects in the depot */
+	uint32_t nr_pages;	/* Pages carved into objects */
+};
+
+/* Per-cpu cache of free objects for one size class */
+struct slab_magazine {
+	uint32_t count;
+	void *objs[SLAB_MAGAZINE_SIZE];
+	uint64_t allocs;
+	uint64_t frees;
+};
+
 /* APIs exposing memory allocation/deallocation abstractions */
 void *malloc(unsigned int num_bytes);
 void *calloc(unsigned int num_elements, unsigned int element_size);
 void *alloc_page(void);
 void *alloc_pages(unsigned int page_num);
 void free(void *ptr);
+int get_malloc_info(char *str, int str_max);
 
 #endif /* MEM_MGT_H_ */
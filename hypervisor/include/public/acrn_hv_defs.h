@@ -46,6 +46,10 @@
 #define HC_ID_IOREQ_BASE            0x30UL
 #define HC_SET_IOREQ_BUFFER         _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x00)
 #define HC_NOTIFY_REQUEST_FINISH    _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x01)
+#define HC_SET_COALESCED_RING       _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x02)
+#define HC_SET_COALESCED_ZONE       _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x03)
+#define HC_SETUP_VUART              _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x04)
+#define HC_NOTIFY_VUART             _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x05)
 
 /* Guest memory management */
 #define HC_ID_MEM_BASE              0x40UL
@@ -55,6 +55,171 @@ struct mem_pool Paging_Memory_Pool = {
         .contiguity_bitmap = Paging_Heap_Contiguity_Bitmap
 };
 
+/************************************************************************/
+/*   Slab caches for small objects, carved from Paging_Memory_Pool      */
+/************************************************************************/
+static struct slab_cache Slab_Caches[SLAB_NUM_CLASSES] = {
+        { .obj_size = 16 },
+        { .obj_size = 32 },
+        { .obj_size = 64 },
+        { .obj_size = 128 },
+        { .obj_size = 256 },
+};
+
+/* Size class + 1 of each Paging_Heap page owned by a slab cache */
+static uint8_t Slab_Page_Class[CONFIG_NUM_ALLOC_PAGES];
+
+static void *allocate_mem(struct mem_pool *pool, unsigned int num_bytes);
+
+static inline bool mem_pool_contains(struct mem_pool *pool, void *ptr)
+{
+        return (pool->start_addr <= ptr) &&
+                (ptr < (pool->start_addr +
+                        (pool->total_buffs * pool->buff_size)));
+}
+
+static int slab_class(unsigned int num_bytes)
+{
+        int cls = 0;
+
+        while ((1U << (SLAB_MIN_SHIFT + cls)) < num_bytes)
+                cls++;
+
+        return cls;
+}
+
+/*
+ * The magazine of the current pcpu, or NULL while per-cpu data is not
+ * set up yet (early boot) or this pcpu is not running.
+ */
+static struct slab_magazine *get_slab_magazine(int cls)
+{
+        uint32_t pcpu_id;
+        int state;
+
+        if (per_cpu_data_base_ptr == NULL)
+                return NULL;
+
+        pcpu_id = get_cpu_id();
+        if (pcpu_id >= (uint32_t)phy_cpu_num)
+                return NULL;
+
+        state = per_cpu(state, pcpu_id);
+        if (state != CPU_STATE_INITIALIZING && state != CPU_STATE_RUNNING)
+                return NULL;
+
+        return &per_cpu(slab_mag, pcpu_id)[cls];
+}
+
+/* Carve a new page into objects of the cache. Depot lock held. */
+static int slab_grow(struct slab_cache *cache, int cls)
+{
+        char *page;
+        uint32_t offset;
+
+        page = allocate_mem(&Paging_Memory_Pool, CPU_PAGE_SIZE);
+        if (page == NULL)
+                return -ENOMEM;
+
+        Slab_Page_Class[(page - (char *)Paging_Heap) / CPU_PAGE_SIZE] =
+                cls + 1;
+
+        for (offset = 0; offset < CPU_PAGE_SIZE; offset += cache->obj_size) {
+                *(void **)(page + offset) = cache->free_list;
+                cache->free_list = page + offset;
+        }
+        cache->nr_free += CPU_PAGE_SIZE / cache->obj_size;
+        cache->nr_pages++;
+
+        return 0;
+}
+
+/* Take one object from the depot, growing it if empty. Depot lock held. */
+static void *slab_depot_get(struct slab_cache *cache, int cls)
+{
+        void *obj;
+
+        if (cache->free_list == NULL && slab_grow(cache, cls) != 0)
+                return NULL;
+
+        obj = cache->free_list;
+        cache->free_list = *(void **)obj;
+        cache->nr_free--;
+
+        return obj;
+}
+
+/* Put one object back to the depot. Depot lock held. */
+static void slab_depot_put(struct slab_cache *cache, void *obj)
+{
+        *(void **)obj = cache->free_list;
+        cache->free_list = obj;
+        cache->nr_free++;
+}
+
+static void *slab_alloc(int cls)
+{
+        struct slab_cache *cache = &Slab_Caches[cls];
+        struct slab_magazine *mag;
+        void *obj;
+        spinlock_rflags;
+
+        /* The magazine is only touched by its pcpu, with irq disabled */
+        CPU_INT_ALL_DISABLE();
+
+        mag = get_slab_magazine(cls);
+        if (mag != NULL && mag->count > 0) {
+                obj = mag->objs[--mag->count];
+        } else {
+                spinlock_obtain(&cache->lock);
+                obj = slab_depot_get(cache, cls);
+
+                /* Refill half of the magazine from what the depot has */
+                while (mag != NULL && obj != NULL &&
+                        cache->free_list != NULL &&
+                        mag->count < SLAB_MAGAZINE_SIZE / 2)
+                        mag->objs[mag->count++] =
+                                slab_depot_get(cache, cls);
+
+                spinlock_release(&cache->lock);
+        }
+
+        if (mag != NULL && obj != NULL)
+                mag->allocs++;
+
+        CPU_INT_ALL_RESTORE();
+
+        return obj;
+}
+
+static void slab_free(int cls, void *obj)
+{
+        struct slab_cache *cache = &Slab_Caches[cls];
+        struct slab_magazine *mag;
+        spinlock_rflags;
+
+        CPU_INT_ALL_DISABLE();
+
+        mag = get_slab_magazine(cls);
+        if (mag != NULL && mag->count < SLAB_MAGAZINE_SIZE) {
+                mag->objs[mag->count++] = obj;
+        } else {
+                spinlock_obtain(&cache->lock);
+                slab_depot_put(cache, obj);
+
+                /* Flush half of a full magazine back to the depot */
+                while (mag != NULL && mag->count > SLAB_MAGAZINE_SIZE / 2)
+                        slab_depot_put(cache, mag->objs[--mag->count]);
+
+                spinlock_release(&cache->lock);
+        }
+
+        if (mag != NULL)
+                mag->frees++;
+
+        CPU_INT_ALL_RESTORE();
+}
+
 static void *allocate_mem(struct mem_pool *pool, unsigned int num_bytes)
 {
 
@@ -227,9 +392,14 @@ void *malloc(unsigned int num_bytes)
 
         /* Check if bytes requested extend page-size */
         if (num_bytes < CPU_PAGE_SIZE) {
+                /* Small objects come from the slab caches first */
+                if (num_bytes != 0 && num_bytes <= SLAB_MAX_SIZE)
+                        memory = slab_alloc(slab_class(num_bytes));
+
                 /* Request memory allocation from smaller segmented memory pool
                  */
-                memory = allocate_mem(&Memory_Pool, num_bytes);
+                if (memory == NULL)
+                        memory = allocate_mem(&Memory_Pool, num_bytes);
         } else {
                 int page_num =
                         (num_bytes + CPU_PAGE_SIZE - 1) >> CPU_PAGE_SHIFT;
@@ -280,21 +450,88 @@ void *calloc(unsigned int num_elements, unsigned int element_size)
 
 void free(void *ptr)
 {
+        uint32_t page_idx;
+
+        if (ptr == NULL)
+                return;
+
         /* Check if ptr belongs to 16-Bytes aligned Memory Pool */
-        if ((Memory_Pool.start_addr < ptr) &&
-            (ptr < (Memory_Pool.start_addr +
-                    (Memory_Pool.total_buffs * Memory_Pool.buff_size)))) {
+        if (mem_pool_contains(&Memory_Pool, ptr)) {
                 /* Free buffer in 16-Bytes aligned Memory Pool */
                 deallocate_mem(&Memory_Pool, ptr);
         }
         /* Check if ptr belongs to page aligned Memory Pool */
-        else if ((Paging_Memory_Pool.start_addr < ptr) &&
-                 (ptr < (Paging_Memory_Pool.start_addr +
-                         (Paging_Memory_Pool.total_buffs *
-                          Paging_Memory_Pool.buff_size)))) {
-                /* Free buffer in page aligned Memory Pool */
-                deallocate_mem(&Paging_Memory_Pool, ptr);
+        else if (mem_pool_contains(&Paging_Memory_Pool, ptr)) {
+                page_idx = ((char *)ptr - (char *)Paging_Heap) /
+                        CPU_PAGE_SIZE;
+
+                /* Objects in slab pages go back to their size class */
+                if (Slab_Page_Class[page_idx] != 0)
+                        slab_free(Slab_Page_Class[page_idx] - 1, ptr);
+                else
+                        /* Free buffer in page aligned Memory Pool */
+                        deallocate_mem(&Paging_Memory_Pool, ptr);
+        }
+}
+
+static uint32_t mem_pool_used_buffs(struct mem_pool *pool)
+{
+        uint32_t idx, bits, used = 0;
+
+        for (idx = 0; idx < pool->bmp_size; idx++) {
+                for (bits = pool->bitmap[idx]; bits != 0; bits &= bits - 1)
+                        used++;
         }
+
+        return used;
+}
+
+int get_malloc_info(char *str, int str_max)
+{
+        int cls, pcpu_id, len, size = str_max;
+        struct slab_cache *cache;
+        struct slab_magazine *mag;
+        uint64_t allocs, frees;
+        uint32_t cached;
+
+        len = snprintf(str, size,
+                "\r\nSIZE\tPAGES\tDEPOT\tCACHED\tALLOCS\t\tFREES");
+        size -= len;
+        str += len;
+
+        for (cls = 0; cls < SLAB_NUM_CLASSES; cls++) {
+                cache = &Slab_Caches[cls];
+                allocs = 0;
+                frees = 0;
+                cached = 0;
+                for (pcpu_id = 0; pcpu_id < phy_cpu_num; pcpu_id++) {
+                        mag = &per_cpu(slab_mag, pcpu_id)[cls];
+                        allocs += mag->allocs;
+                        frees += mag->frees;
+                        cached += mag->count;
+                }
+
+                len = snprintf(str, size, "\r\n%d\t%d\t%d\t%d\t%lld\t\t%lld",
+                        cache->obj_size, cache->nr_pages, cache->nr_free,
+                        cached, allocs, frees);
+                size -= len;
+                str += len;
+        }
+
+        len = snprintf(str, size, "\r\n\r\nheap: %d/%d buffers of %d bytes",
+                mem_pool_used_buffs(&Memory_Pool), Memory_Pool.total_buffs,
+                Memory_Pool.buff_size);
+        size -= len;
+        str += len;
+
+        len = snprintf(str, size, "\r\npages: %d/%d",
+                mem_pool_used_buffs(&Paging_Memory_Pool),
+                Paging_Memory_Pool.total_buffs);
+        size -= len;
+        str += len;
+
+        snprintf(str, size, "\r\n");
+        return 0;
 }
 
 void *memchr(const void *void_s, int c, size_t n)